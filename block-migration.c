@@ -33,6 +33,9 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Longest run of zero chunks that is queued as a single BlkMigBlock */
+#define MAX_ZERO_RUN_SECTORS    (BDRV_SECTORS_PER_DIRTY_CHUNK * 1024)
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -61,7 +64,7 @@ typedef struct BlkMigDevState {
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
-    /* Only used by migration thread.  */
+    /* Only used by migration thread.  NULL if the block reads as zero.  */
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
@@ -82,6 +85,7 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    uint8_t *zero_buf;
 
     /* Protected by lock.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
@@ -109,28 +113,66 @@ static void blk_mig_unlock(void)
     qemu_mutex_unlock(&block_mig_state.lock);
 }
 
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
+{
+    int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
+                     | flags);
+
+    /* device name */
+    len = strlen(bmds->bs->device_name);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
+
+/* Send a run of chunks that read as zero without having read them.  With
+ * the zero-blocks capability each chunk is a bare header, otherwise the
+ * data is taken from a preallocated zero buffer; runs are then a single
+ * chunk long, see mig_save_device_bulk.
+ */
+static void blk_send_zero(QEMUFile *f, BlkMigBlock *blk)
+{
+    int64_t sector = blk->sector;
+    int64_t end = blk->sector + blk->nr_sectors;
+
+    for (; sector < end; sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        if (block_mig_state.zero_blocks) {
+            blk_send_header(f, blk->bmds, sector,
+                            BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+        } else {
+            blk_send_header(f, blk->bmds, sector, BLK_MIG_FLAG_DEVICE_BLOCK);
+            qemu_put_buffer(f, block_mig_state.zero_buf, BLOCK_SIZE);
+        }
+    }
+
+    /* See blk_send for why zero blocks are flushed immediately.  */
+    if (block_mig_state.zero_blocks) {
+        qemu_fflush(f);
+    }
+}
+
 /* Must run outside of the iothread lock during the bulk phase,
  * or the VM will stall.
  */
 
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
-    int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
+    if (!blk->buf) {
+        blk_send_zero(f, blk);
+        return;
+    }
+
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        buffer_is_zero(blk->buf, blk->nr_sectors * BDRV_SECTOR_SIZE)) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(blk->bmds->bs->device_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -228,6 +270,67 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
 
+/* Called with iothread lock taken.
+ *
+ * Return the number of sectors starting at the chunk-aligned @sector, up
+ * to @max_sectors, that the block layer reports as reading zero.  The
+ * result is a multiple of the chunk size unless the run reaches the end
+ * of the device.  This lets the caller skip reading unallocated or zeroed
+ * parts of thin-provisioned images.
+ */
+static int64_t bmds_zero_sectors(BlkMigDevState *bmds, int64_t sector,
+                                 int max_sectors)
+{
+    int64_t end = MIN(bmds->total_sectors, sector + max_sectors);
+    int64_t cur = sector;
+    int64_t ret;
+    int n;
+
+    while (cur < end) {
+        ret = bdrv_get_block_status(bmds->bs, cur, end - cur, &n);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || n == 0) {
+            break;
+        }
+        cur += n;
+    }
+
+    if (cur < bmds->total_sectors) {
+        cur &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    }
+    return MAX(cur - sector, 0);
+}
+
+static BlkMigBlock *blk_create(BlkMigDevState *bmds, int64_t sector,
+                               int nr_sectors, bool zero)
+{
+    BlkMigBlock *blk;
+
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->buf = zero ? NULL : g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->ret = 0;
+
+    if (!zero) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    }
+    return blk;
+}
+
+/* Called without the migration lock.  Queue a zero block behind the reads
+ * that were submitted before it, so that chunks are sent in order.
+ */
+static void blk_queue_zero(BlkMigBlock *blk)
+{
+    blk_mig_lock();
+    QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+    block_mig_state.read_done++;
+    blk_mig_unlock();
+}
+
 /* Never hold migration lock when yielding to the main loop!  */
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -254,7 +357,8 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
-    int nr_sectors;
+    int64_t nr_zero;
+    int nr_sectors, max_zero;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -282,15 +386,29 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+    /* Do not read chunks that are known to be zero.  With the zero-blocks
+     * capability a chunk is only a header on the wire, so a whole run of
+     * them is queued at once.  Otherwise each chunk carries a full payload
+     * and is queued on its own, so that flush_blks and the iterate budget
+     * account for it and rate limit it like a chunk that was read.
+     */
+    max_zero = block_mig_state.zero_blocks ? MAX_ZERO_RUN_SECTORS
+                                           : BDRV_SECTORS_PER_DIRTY_CHUNK;
+    qemu_mutex_lock_iothread();
+    nr_zero = bmds_zero_sectors(bmds, cur_sector, max_zero);
+    if (nr_zero > 0) {
+        bdrv_reset_dirty(bs, cur_sector, nr_zero);
+        qemu_mutex_unlock_iothread();
+
+        blk = blk_create(bmds, cur_sector, nr_zero, true);
+        blk_queue_zero(blk);
+
+        bmds->cur_sector = cur_sector + nr_zero;
+        return (bmds->cur_sector >= total_sectors);
+    }
+    qemu_mutex_unlock_iothread();
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    blk = blk_create(bmds, cur_sector, nr_sectors, false);
 
     blk_mig_lock();
     block_mig_state.submitted++;
@@ -361,6 +479,9 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    if (!block_mig_state.zero_blocks) {
+        block_mig_state.zero_buf = g_malloc0(BLOCK_SIZE);
+    }
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -425,6 +546,17 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int ret = -EIO;
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+        /* Skip clean chunks using the dirty bitmap instead of testing
+         * them one by one.
+         */
+        sector = bdrv_get_next_dirty(bmds->bs, sector);
+        if (sector < 0) {
+            bmds->cur_dirty = bmds->total_sectors;
+            break;
+        }
+        sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        bmds->cur_dirty = sector;
+
         blk_mig_lock();
         if (bmds_aio_inflight(bmds, sector)) {
             blk_mig_unlock();
@@ -433,23 +565,24 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             blk_mig_unlock();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
+            bool zero;
 
             if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
                 nr_sectors = total_sectors - sector;
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
+            zero = bmds_zero_sectors(bmds, sector, nr_sectors) == nr_sectors;
+            blk = blk_create(bmds, sector, nr_sectors, zero);
+
+            if (zero) {
+                if (is_async) {
+                    blk_queue_zero(blk);
+                } else {
+                    blk_send(f, blk);
+                    g_free(blk);
+                }
+            } else if (is_async) {
                 blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
                                             nr_sectors, blk_mig_read_cb, blk);
 
@@ -580,6 +713,9 @@ static void blk_mig_cleanup(void)
         g_free(bmds);
     }
 
+    g_free(block_mig_state.zero_buf);
+    block_mig_state.zero_buf = NULL;
+
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
         g_free(blk->buf);
@@ -79,6 +79,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write);
@@ -174,6 +175,7 @@ void bdrv_io_limits_enable(BlockDriverState *bs)
 {
     assert(!bs->io_limits_enabled);
     throttle_init(&bs->throttle_state,
+                  bdrv_get_aio_context(bs),
                   QEMU_CLOCK_VIRTUAL,
                   bdrv_throttle_read_timer_cb,
                   bdrv_throttle_write_timer_cb,
@@ -327,6 +329,8 @@ BlockDriverState *bdrv_new(const char *device_name)
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
+    bs->aio_context = qemu_get_aio_context();
+    QLIST_INIT(&bs->aio_notifiers);
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
@@ -1487,7 +1491,11 @@ void bdrv_close_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         bdrv_close(bs);
+        aio_context_release(aio_context);
     }
 }
 
@@ -1512,17 +1520,6 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
-static bool bdrv_requests_pending_all(void)
-{
-    BlockDriverState *bs;
-    QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        if (bdrv_requests_pending(bs)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1542,17 +1539,20 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
 
     while (busy) {
-        /* FIXME: We do not have timer support here, so this is effectively
-         * a busy wait.
-         */
+        busy = false;
+
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (bdrv_start_throttled_reqs(bs)) {
-                busy = true;
-            }
-        }
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+            bool bs_busy;
+
+            aio_context_acquire(aio_context);
+            bdrv_start_throttled_reqs(bs);
+            bs_busy = bdrv_requests_pending(bs);
+            bs_busy |= aio_poll(aio_context, bs_busy);
+            aio_context_release(aio_context);
 
-        busy = bdrv_requests_pending_all();
-        busy |= aio_poll(qemu_get_aio_context(), busy);
+            busy |= bs_busy;
+        }
     }
 }
 
@@ -1607,6 +1607,9 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
 
+    /* latency accounting is configured per device */
+    bs_dest->latency_stats      = bs_src->latency_stats;
+
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
 
@@ -1695,16 +1698,24 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
     assert(!bs->refcnt);
+    assert(QLIST_EMPTY(&bs->aio_notifiers));
 
     bdrv_close(bs);
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, NULL, 0);
+    }
+    bdrv_set_slow_request_log(bs, 0, 0);
+
     g_free(bs);
 }
 
@@ -1942,12 +1953,17 @@ int bdrv_commit_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         if (bs->drv && bs->backing_hd) {
             int ret = bdrv_commit(bs);
             if (ret < 0) {
+                aio_context_release(aio_context);
                 return ret;
             }
         }
+        aio_context_release(aio_context);
     }
     return 0;
 }
@@ -2317,10 +2333,12 @@ static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return rwco.ret;
@@ -3053,10 +3071,15 @@ int bdrv_flush_all(void)
     int result = 0;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        int ret = bdrv_flush(bs);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_flush(bs);
         if (ret < 0 && !result) {
             result = ret;
         }
+        aio_context_release(aio_context);
     }
 
     return result;
@@ -3109,9 +3132,9 @@ typedef struct BdrvCoGetBlockStatusData {
  * 'nb_sectors' is the max value 'pnum' should be set to.  If nb_sectors goes
  * beyond the end of the disk image it will be clamped.
  */
-static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
-                                                     int64_t sector_num,
-                                                     int nb_sectors, int *pnum)
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
 {
     int64_t length;
     int64_t n;
@@ -3207,10 +3230,12 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_get_block_status_co_entry(&data);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
         qemu_coroutine_enter(co, &data);
         while (!data.done) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return data.ret;
@@ -3521,7 +3546,7 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, false);
 }
 
@@ -3531,10 +3556,20 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, true);
 }
 
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, opaque);
+
+    return bdrv_co_aio_rw_vector(bs, sector_num, NULL, nb_sectors,
+                                 BDRV_REQ_ZERO_WRITE, cb, opaque, true);
+}
+
 
 typedef struct MultiwriteCB {
     int error;
@@ -3770,7 +3805,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3802,7 +3837,10 @@ static BlockDriverAIOCB *bdrv_aio_writev_em(BlockDriverState *bs,
 typedef struct BlockDriverAIOCBCoroutine {
     BlockDriverAIOCB common;
     BlockRequest req;
+    BdrvRequestFlags flags;
     bool is_write;
+    BlockDriverState *copy_src;
+    int64_t copy_src_sector;
     bool *done;
     QEMUBH* bh;
 } BlockDriverAIOCBCoroutine;
@@ -3815,7 +3853,7 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -3846,13 +3884,13 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3860,6 +3898,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write)
@@ -3871,6 +3910,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
+    acb->flags = flags;
     acb->is_write = is_write;
     acb->done = NULL;
 
@@ -3886,7 +3926,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3913,7 +3953,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4104,7 +4144,11 @@ void bdrv_invalidate_cache_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         bdrv_invalidate_cache(bs);
+        aio_context_release(aio_context);
     }
 }
 
@@ -4129,10 +4173,12 @@ int bdrv_flush(BlockDriverState *bs)
         /* Fast-path if already in coroutine context */
         bdrv_flush_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
@@ -4201,16 +4247,225 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         /* Fast-path if already in coroutine context */
         bdrv_discard_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
     return rwco.ret;
 }
 
+/**************************************************************/
+/* copy offloading */
+
+static int coroutine_fn bdrv_co_copy_range_internal(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_check_request(src, src_sector, nb_sectors) ||
+        bdrv_check_request(dst, dst_sector, nb_sectors)) {
+        return -EIO;
+    }
+
+    /* Throttled requests must be accounted for like normal I/O */
+    if (src->io_limits_enabled || dst->io_limits_enabled) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        if (!src->drv->bdrv_co_copy_range_from) {
+            return -ENOTSUP;
+        }
+        if (src->copy_on_read_in_flight) {
+            wait_for_overlapping_requests(src, src_sector, nb_sectors);
+        }
+
+        tracked_request_begin(&req, src, src_sector, nb_sectors, false);
+        ret = src->drv->bdrv_co_copy_range_from(src, src_sector,
+                                                dst, dst_sector, nb_sectors);
+        tracked_request_end(&req);
+        return ret;
+    }
+
+    if (!dst->drv->bdrv_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    if (dst->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(dst, dst_sector, nb_sectors);
+    }
+
+    tracked_request_begin(&req, dst, dst_sector, nb_sectors, true);
+
+    ret = notifier_with_return_list_notify(&dst->before_write_notifiers, &req);
+    if (ret >= 0) {
+        ret = dst->drv->bdrv_co_copy_range_to(src, src_sector,
+                                              dst, dst_sector, nb_sectors);
+    }
+
+    /* Nothing was written, the caller falls back to normal I/O */
+    if (ret == -ENOTSUP) {
+        goto out;
+    }
+
+    if (ret == 0 && !dst->enable_write_cache) {
+        ret = bdrv_co_flush(dst);
+    }
+
+    if (dst->dirty_bitmap) {
+        bdrv_set_dirty(dst, dst_sector, nb_sectors);
+    }
+
+    if (dst->wr_highest_sector < dst_sector + nb_sectors - 1) {
+        dst->wr_highest_sector = dst_sector + nb_sectors - 1;
+    }
+    if (dst->growable && ret >= 0) {
+        dst->total_sectors = MAX(dst->total_sectors, dst_sector + nb_sectors);
+    }
+
+out:
+    tracked_request_end(&req);
+    return ret;
+}
+
+/*
+ * Let the driver of src copy the data. Drivers implement this by calling
+ * bdrv_co_copy_range_from() on a child node or bdrv_co_copy_range_to() on
+ * dst once they have found the node that contains the data.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors)
+{
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, true);
+}
+
+/*
+ * Let the driver of dst copy the data. Drivers implement this by calling
+ * bdrv_co_copy_range_to() with a child node as dst, or by copying the data
+ * if both src and dst are nodes they know how to copy between.
+ */
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors)
+{
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, false);
+}
+
+/*
+ * Copy nb_sectors sectors from src to dst without passing the data through
+ * QEMU, e.g. by using copy_file_range() or reflinks in the host filesystem.
+ *
+ * Returns -ENOTSUP if the copy can't be offloaded. Nothing has been written
+ * to dst in this case and the caller must fall back to reading and writing
+ * the data.
+ */
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors)
+{
+    trace_bdrv_co_copy_range(src, src_sector, dst, dst_sector, nb_sectors);
+
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors);
+}
+
+typedef struct CopyRangeCo {
+    BlockDriverState *src;
+    int64_t src_sector;
+    BlockDriverState *dst;
+    int64_t dst_sector;
+    int nb_sectors;
+    int ret;
+} CopyRangeCo;
+
+static void coroutine_fn bdrv_copy_range_co_entry(void *opaque)
+{
+    CopyRangeCo *crco = opaque;
+
+    crco->ret = bdrv_co_copy_range(crco->src, crco->src_sector,
+                                   crco->dst, crco->dst_sector,
+                                   crco->nb_sectors);
+}
+
+/* Synchronous version of bdrv_co_copy_range() */
+int bdrv_copy_range(BlockDriverState *src, int64_t src_sector,
+                    BlockDriverState *dst, int64_t dst_sector, int nb_sectors)
+{
+    Coroutine *co;
+    CopyRangeCo crco = {
+        .src = src,
+        .src_sector = src_sector,
+        .dst = dst,
+        .dst_sector = dst_sector,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_copy_range_co_entry(&crco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(dst);
+
+        co = qemu_coroutine_create(bdrv_copy_range_co_entry);
+        qemu_coroutine_enter(co, &crco);
+        while (crco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+
+    return crco.ret;
+}
+
+static void coroutine_fn bdrv_aio_copy_range_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bdrv_co_copy_range(acb->copy_src, acb->copy_src_sector,
+                                        bs, acb->req.sector,
+                                        acb->req.nb_sectors);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/* Asynchronous version of bdrv_co_copy_range(), bs is the destination */
+BlockDriverAIOCB *bdrv_aio_copy_range(BlockDriverState *src,
+        int64_t src_sector, BlockDriverState *bs, int64_t sector_num,
+        int nb_sectors, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    trace_bdrv_aio_copy_range(src, src_sector, bs, sector_num, nb_sectors,
+                              opaque);
+
+    acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
+    acb->copy_src = src;
+    acb->copy_src_sector = src_sector;
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->done = NULL;
+    co = qemu_coroutine_create(bdrv_aio_copy_range_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
 /**************************************************************/
 /* removable device support */
 
@@ -4354,6 +4609,18 @@ void bdrv_dirty_iter_init(BlockDriverState *bs, HBitmapIter *hbi)
     hbitmap_iter_init(hbi, bs->dirty_bitmap, 0);
 }
 
+/* Return the first dirty sector at or after @sector, or -1 if there is none.  */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
+{
+    HBitmapIter hbi;
+
+    if (!bs->dirty_bitmap || sector >= bs->total_sectors) {
+        return -1;
+    }
+    hbitmap_iter_init(&hbi, bs->dirty_bitmap, sector);
+    return hbitmap_iter_next(&hbi);
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
@@ -4447,21 +4714,153 @@ void
 bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
         enum BlockAcctType type)
 {
+    BlockLatencyStats *stats = &bs->latency_stats;
+    unsigned int depth;
+
     assert(type < BDRV_MAX_IOTYPE);
 
     cookie->bytes = bytes;
     cookie->start_time_ns = get_clock();
     cookie->type = type;
+    cookie->in_flight = true;
+
+    depth = ++stats->in_flight;
+    if (depth > stats->max_in_flight) {
+        stats->max_in_flight = depth;
+    }
+    stats->queue_depth_bins[MIN(BDRV_QUEUE_DEPTH_BINS - 1,
+                                31 - clz32(depth))]++;
+}
+
+static void bdrv_acct_log_slow_request(BlockLatencyStats *stats,
+                                       BlockAcctCookie *cookie,
+                                       int64_t latency_ns)
+{
+    stats->slow[stats->slow_next] = (BlockSlowRequestEntry) {
+        .type           = cookie->type,
+        .bytes          = cookie->bytes,
+        .start_time_ns  = cookie->start_time_ns,
+        .latency_ns     = latency_ns,
+    };
+    stats->slow_next = (stats->slow_next + 1) % stats->slow_size;
+    if (stats->slow_count < stats->slow_size) {
+        stats->slow_count++;
+    }
+    stats->nr_slow++;
 }
 
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    BlockLatencyStats *stats = &bs->latency_stats;
+    BlockAcctHistogram *hist;
+    int64_t latency_ns;
+    int lo, hi, mid;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
+    latency_ns = get_clock() - cookie->start_time_ns;
+    trace_bdrv_acct_done(bs, cookie->type, cookie->bytes, latency_ns);
+
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    bdrv_acct_cancel(bs, cookie);
+
+    hist = &stats->histogram[cookie->type];
+    if (hist->bins) {
+        /* Find the first boundary that is greater than the latency */
+        lo = 0;
+        hi = hist->nb_boundaries;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        hist->bins[lo]++;
+    }
+
+    if (stats->slow_threshold_ns && latency_ns >= stats->slow_threshold_ns) {
+        trace_bdrv_acct_slow_request(bs, cookie->type, cookie->bytes,
+                                     latency_ns);
+        bdrv_acct_log_slow_request(stats, cookie, latency_ns);
+    }
+}
+
+/*
+ * Drops a request from the in-flight count without recording it, for device
+ * models that cancel a request whose completion callback may never run.  It
+ * is a no-op if bdrv_acct_done() already accounted for the cookie.
+ */
+void
+bdrv_acct_cancel(BlockDriverState *bs, BlockAcctCookie *cookie)
+{
+    BlockLatencyStats *stats = &bs->latency_stats;
+
+    if (!cookie->in_flight) {
+        return;
+    }
+    cookie->in_flight = false;
+
+    /* A swap in bdrv_append() may have moved the request to another device */
+    if (stats->in_flight > 0) {
+        stats->in_flight--;
+    }
+}
+
+/*
+ * Sets the bin boundaries of the latency histogram for one request type, in
+ * nanoseconds and strictly ascending.  nb_boundaries == 0 disables the
+ * histogram.  The counters start from zero again in any case.
+ */
+void bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nb_boundaries)
+{
+    BlockAcctHistogram *hist;
+
+    assert(type < BDRV_MAX_IOTYPE);
+    hist = &bs->latency_stats.histogram[type];
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nb_boundaries = 0;
+
+    if (nb_boundaries > 0) {
+        hist->nb_boundaries = nb_boundaries;
+        hist->boundaries = g_memdup(boundaries,
+                                    nb_boundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, nb_boundaries + 1);
+    }
+}
+
+/*
+ * Keeps the last 'size' requests that took threshold_ns or longer.  A zero
+ * threshold disables the log.  Previously logged requests are dropped.
+ */
+void bdrv_set_slow_request_log(BlockDriverState *bs, int64_t threshold_ns,
+                               unsigned int size)
+{
+    BlockLatencyStats *stats = &bs->latency_stats;
+
+    g_free(stats->slow);
+    stats->slow = NULL;
+    stats->slow_size = 0;
+    stats->slow_count = 0;
+    stats->slow_next = 0;
+    stats->nr_slow = 0;
+    stats->slow_threshold_ns = 0;
+
+    if (threshold_ns > 0 && size > 0) {
+        stats->slow_threshold_ns = threshold_ns;
+        stats->slow = g_new0(BlockSlowRequestEntry, size);
+        stats->slow_size = size;
+    }
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
@@ -4615,8 +5014,114 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    BdrvAioNotifier *ban;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
+        ban->detach_aio_context(ban->opaque);
+    }
+
+    if (bs->io_limits_enabled) {
+        throttle_detach_aio_context(&bs->throttle_state);
+    }
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+void bdrv_attach_aio_context(BlockDriverState *bs,
+                             AioContext *new_context)
+{
+    BdrvAioNotifier *ban;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    bs->aio_context = new_context;
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+    if (bs->io_limits_enabled) {
+        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    }
+
+    QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
+        ban->attached_aio_context(new_context, ban->opaque);
+    }
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
+}
+
+void bdrv_add_aio_context_notifier(BlockDriverState *bs,
+        void (*attached_aio_context)(AioContext *new_context, void *opaque),
+        void (*detach_aio_context)(void *opaque), void *opaque)
+{
+    BdrvAioNotifier *ban = g_new(BdrvAioNotifier, 1);
+    *ban = (BdrvAioNotifier){
+        .attached_aio_context = attached_aio_context,
+        .detach_aio_context   = detach_aio_context,
+        .opaque               = opaque
+    };
+
+    QLIST_INSERT_HEAD(&bs->aio_notifiers, ban, list);
+}
+
+void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
+                                      void (*attached_aio_context)(AioContext *,
+                                                                   void *),
+                                      void (*detach_aio_context)(void *),
+                                      void *opaque)
+{
+    BdrvAioNotifier *ban, *ban_next;
+
+    QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
+        if (ban->attached_aio_context == attached_aio_context &&
+            ban->detach_aio_context   == detach_aio_context   &&
+            ban->opaque               == opaque) {
+            QLIST_REMOVE(ban, list);
+            g_free(ban);
+
+            return;
+        }
+    }
+
+    abort();
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
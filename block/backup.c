@@ -44,6 +44,7 @@ typedef struct BackupBlockJob {
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
     HBitmap *bitmap;
+    bool copy_offload;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
 
@@ -119,6 +120,21 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * BACKUP_SECTORS_PER_CLUSTER);
 
+        /* Let the host copy the cluster if it can.  On failure, retry
+         * through the bounce buffer; this also tells source and target
+         * errors apart.
+         */
+        if (job->copy_offload) {
+            ret = bdrv_co_copy_range(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                     job->target,
+                                     start * BACKUP_SECTORS_PER_CLUSTER, n);
+            if (ret == 0) {
+                goto copied;
+            }
+            trace_backup_do_cow_copy_offload_fail(job, start, ret);
+            job->copy_offload = false;
+        }
+
         if (!bounce_buffer) {
             bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
         }
@@ -152,6 +168,7 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
+copied:
         hbitmap_set(job->bitmap, start, 1);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
@@ -378,6 +395,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
+    job->copy_offload = true;
     job->target = target;
     job->sync_mode = sync_mode;
     job->common.len = len;
@@ -39,9 +39,28 @@
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 64
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
+
+/* Persistent cache file layout: header, presence bitmap (one bit per
+ * chunk), then the cached data at the same offsets as in the image.  */
+#define CURL_CACHE_MAGIC        0x5145435552434143ULL /* "QECURCAC" */
+#define CURL_CACHE_VERSION      1
+#define CURL_CACHE_DIRTY        1
+#define CURL_CACHE_CHUNK_SIZE   (64 * 1024)
+#define CURL_CACHE_BITMAP_OFFSET 4096
+
+typedef struct CURLCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t length;
+    int64_t  filetime;
+    uint32_t chunk_size;
+} QEMU_PACKED CURLCacheHeader;
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -77,32 +96,49 @@ typedef struct CURLState
 
 typedef struct BDRVCURLState {
     CURLM *multi;
+    AioContext *aio_context;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
-    size_t readahead_size;
     bool accept_range;
+    long filetime;
+
+    /* Read-ahead grows from readahead_size up to readahead_max while
+     * the guest reads sequentially.  */
+    size_t readahead_size;
+    size_t readahead_max;
+    size_t cur_readahead;
+    size_t next_offset;
+
+    int cache_fd;
+    uint8_t *cache_bitmap;
+    uint64_t cache_nb_chunks;
+    uint64_t cache_data_offset;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
-                        void *s, void *sp)
+                        void *userp, void *sp)
 {
+    BDRVCURLState *s = userp;
+
     DPRINTF("CURL (AIO): Sock action %d on fd %d\n", action, fd);
     switch (action) {
         case CURL_POLL_IN:
-            qemu_aio_set_fd_handler(fd, curl_multi_do, NULL, s);
+            aio_set_fd_handler(s->aio_context, fd, curl_multi_do, NULL, s);
             break;
         case CURL_POLL_OUT:
-            qemu_aio_set_fd_handler(fd, NULL, curl_multi_do, s);
+            aio_set_fd_handler(s->aio_context, fd, NULL, curl_multi_do, s);
             break;
         case CURL_POLL_INOUT:
-            qemu_aio_set_fd_handler(fd, curl_multi_do, curl_multi_do, s);
+            aio_set_fd_handler(s->aio_context, fd, curl_multi_do,
+                               curl_multi_do, s);
             break;
         case CURL_POLL_REMOVE:
-            qemu_aio_set_fd_handler(fd, NULL, NULL, NULL);
+            aio_set_fd_handler(s->aio_context, fd, NULL, NULL, NULL);
             break;
     }
 
@@ -162,7 +198,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -209,6 +245,208 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+/* Returns true if some buffer holds or will receive the byte at start */
+static bool curl_range_pending(BDRVCURLState *s, size_t start)
+{
+    int i;
+
+    for (i = 0; i < s->num_states; i++) {
+        CURLState *state = &s->states[i];
+
+        if (state->orig_buf && start >= state->buf_start &&
+            start < state->buf_start + state->buf_len) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool curl_cache_chunk_present(BDRVCURLState *s, uint64_t chunk)
+{
+    return s->cache_bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+static bool curl_cache_contains(BDRVCURLState *s, size_t start, size_t len)
+{
+    uint64_t chunk;
+
+    for (chunk = start / CURL_CACHE_CHUNK_SIZE;
+         chunk <= (start + len - 1) / CURL_CACHE_CHUNK_SIZE; chunk++) {
+        if (!curl_cache_chunk_present(s, chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int curl_cache_write_header(BDRVCURLState *s, uint32_t flags)
+{
+    CURLCacheHeader header = {
+        .magic      = cpu_to_be64(CURL_CACHE_MAGIC),
+        .version    = cpu_to_be32(CURL_CACHE_VERSION),
+        .flags      = cpu_to_be32(flags),
+        .length     = cpu_to_be64(s->len),
+        .filetime   = cpu_to_be64(s->filetime),
+        .chunk_size = cpu_to_be32(CURL_CACHE_CHUNK_SIZE),
+    };
+
+    if (pwrite(s->cache_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -errno;
+    }
+    if (qemu_fdatasync(s->cache_fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void curl_cache_disable(BDRVCURLState *s)
+{
+    DPRINTF("CURL: Disabling cache file: %s\n", strerror(errno));
+    qemu_close(s->cache_fd);
+    s->cache_fd = -1;
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+}
+
+static int curl_cache_open(BDRVCURLState *s, const char *filename)
+{
+    CURLCacheHeader header = { 0 };
+    size_t bitmap_size;
+    bool valid;
+    int ret;
+
+    s->cache_fd = qemu_open(filename, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (s->cache_fd < 0) {
+        return -errno;
+    }
+
+    s->cache_nb_chunks = DIV_ROUND_UP(s->len, CURL_CACHE_CHUNK_SIZE);
+    bitmap_size = DIV_ROUND_UP(s->cache_nb_chunks, 8);
+    s->cache_bitmap = g_malloc0(bitmap_size);
+    s->cache_data_offset = ROUND_UP(CURL_CACHE_BITMAP_OFFSET + bitmap_size,
+                                    CURL_CACHE_CHUNK_SIZE);
+
+    /* Never throw away a file that is not ours; the user may have passed
+     * the wrong path.  */
+    if (pread(s->cache_fd, &header, sizeof(header), 0) != sizeof(header)
+        || be64_to_cpu(header.magic) != CURL_CACHE_MAGIC) {
+        off_t size = lseek(s->cache_fd, 0, SEEK_END);
+        if (size < 0) {
+            ret = -errno;
+            goto fail;
+        } else if (size > 0) {
+            ret = -EEXIST;
+            goto fail;
+        }
+    }
+
+    /* A cache that was not closed cleanly, or that belongs to a different
+     * version of the remote file, is thrown away.  */
+    valid = be64_to_cpu(header.magic) == CURL_CACHE_MAGIC
+        && be32_to_cpu(header.version) == CURL_CACHE_VERSION
+        && !(be32_to_cpu(header.flags) & CURL_CACHE_DIRTY)
+        && be64_to_cpu(header.length) == s->len
+        && be64_to_cpu(header.filetime) == s->filetime
+        && be32_to_cpu(header.chunk_size) == CURL_CACHE_CHUNK_SIZE
+        && pread(s->cache_fd, s->cache_bitmap, bitmap_size,
+                 CURL_CACHE_BITMAP_OFFSET) == bitmap_size;
+
+    if (!valid) {
+        memset(s->cache_bitmap, 0, bitmap_size);
+        if (ftruncate(s->cache_fd, 0) < 0) {
+            ret = -errno;
+            goto fail;
+        }
+    }
+
+    /* Keep the dirty flag set while the file is in use */
+    ret = curl_cache_write_header(s, CURL_CACHE_DIRTY);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    DPRINTF("CURL: Using cache file %s (%s)\n", filename,
+            valid ? "valid" : "new");
+    return 0;
+
+fail:
+    qemu_close(s->cache_fd);
+    s->cache_fd = -1;
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+    return ret;
+}
+
+static void curl_cache_close(BDRVCURLState *s)
+{
+    size_t bitmap_size = DIV_ROUND_UP(s->cache_nb_chunks, 8);
+
+    if (pwrite(s->cache_fd, s->cache_bitmap, bitmap_size,
+               CURL_CACHE_BITMAP_OFFSET) == bitmap_size
+        && qemu_fdatasync(s->cache_fd) == 0) {
+        curl_cache_write_header(s, 0);
+    }
+
+    qemu_close(s->cache_fd);
+    s->cache_fd = -1;
+    g_free(s->cache_bitmap);
+    s->cache_bitmap = NULL;
+}
+
+static int curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                           QEMUIOVector *qiov)
+{
+    char *buf;
+    int ret = 0;
+
+    if (!curl_cache_contains(s, start, len)) {
+        return -ENOENT;
+    }
+
+    buf = g_malloc(len);
+    if (pread(s->cache_fd, buf, len, s->cache_data_offset + start) != len) {
+        ret = -EIO;
+    } else {
+        qemu_iovec_from_buf(qiov, 0, buf, len);
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* Save the complete chunks of a finished transfer in the cache file */
+static void curl_cache_store(BDRVCURLState *s, CURLState *state)
+{
+    size_t buf_end = state->buf_start + state->buf_off;
+    uint64_t first, chunk;
+    size_t start, end;
+
+    first = DIV_ROUND_UP(state->buf_start, CURL_CACHE_CHUNK_SIZE);
+    for (chunk = first; chunk < s->cache_nb_chunks; chunk++) {
+        start = chunk * CURL_CACHE_CHUNK_SIZE;
+        end = MIN(start + CURL_CACHE_CHUNK_SIZE, s->len);
+        if (end > buf_end) {
+            break;
+        }
+        if (curl_cache_chunk_present(s, chunk)) {
+            continue;
+        }
+
+        if (pwrite(s->cache_fd, state->orig_buf + (start - state->buf_start),
+                   end - start, s->cache_data_offset + start) != end - start) {
+            curl_cache_disable(s);
+            return;
+        }
+        s->cache_bitmap[chunk / 8] |= 1 << (chunk % 8);
+    }
+
+    if (chunk > first &&
+        pwrite(s->cache_fd, s->cache_bitmap + first / 8,
+               (chunk - 1) / 8 - first / 8 + 1,
+               CURL_CACHE_BITMAP_OFFSET + first / 8) < 0) {
+        curl_cache_disable(s);
+    }
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -241,7 +479,11 @@ static void curl_multi_do(void *arg)
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
                 /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
+                if (msg->data.result == CURLE_OK) {
+                    if (s->cache_fd >= 0) {
+                        curl_cache_store(s, state);
+                    }
+                } else {
                     int i;
                     for (i = 0; i < CURL_NUM_ACB; i++) {
                         CURLAIOCB *acb = state->acb[i];
@@ -266,29 +508,21 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+static CURLState *curl_find_state(BDRVCURLState *s)
 {
-    CURLState *state = NULL;
-    int i, j;
+    int i;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+    for (i = 0; i < s->num_states; i++) {
+        if (!s->states[i].in_use) {
+            s->states[i].in_use = 1;
+            return &s->states[i];
         }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
-        }
-    } while(!state);
+    }
+    return NULL;
+}
 
+static CURLState *curl_setup_state(BDRVCURLState *s, CURLState *state)
+{
     if (state->curl)
         goto has_curl;
 
@@ -328,6 +562,18 @@ has_curl:
     return state;
 }
 
+static CURLState *curl_init_state(BDRVCURLState *s)
+{
+    CURLState *state;
+
+    while (!(state = curl_find_state(s))) {
+        g_usleep(100);
+        curl_multi_do(s);
+    }
+
+    return curl_setup_state(s, state);
+}
+
 static void curl_clean_state(CURLState *s)
 {
     if (s->s->multi)
@@ -391,10 +637,55 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = "readahead-max",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum readahead size for sequential reads",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of parallel range requests",
+        },
+        {
+            .name = "cache-file",
+            .type = QEMU_OPT_STRING,
+            .help = "Local file that keeps the downloaded data",
+        },
         { /* end of list */ }
     },
 };
 
+static void curl_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVCURLState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->num_states; i++) {
+        if (s->states[i].in_use) {
+            curl_clean_state(&s->states[i]);
+        }
+    }
+
+    /* Removes the remaining sockets from the old AioContext */
+    if (s->multi) {
+        curl_multi_cleanup(s->multi);
+        s->multi = NULL;
+    }
+}
+
+static void curl_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BDRVCURLState *s = bs->opaque;
+
+    assert(!s->multi);
+    s->aio_context = new_context;
+    s->multi = curl_multi_init();
+    curl_multi_setopt(s->multi, CURLMOPT_SOCKETDATA, s);
+    curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+}
+
 static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -403,7 +694,9 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *file;
+    const char *cache_file;
     double d;
+    int ret;
 
     static int inited = 0;
 
@@ -421,6 +714,8 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->cache_fd = -1;
+
     s->readahead_size = qemu_opt_get_size(opts, "readahead", READ_AHEAD_SIZE);
     if ((s->readahead_size & 0x1ff) != 0) {
         fprintf(stderr, "HTTP_READAHEAD_SIZE %zd is not a multiple of 512\n",
@@ -428,6 +723,25 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->readahead_max = qemu_opt_get_size(opts, "readahead-max",
+                                         MAX(READ_AHEAD_MAX,
+                                             s->readahead_size));
+    if ((s->readahead_max & 0x1ff) != 0 ||
+        s->readahead_max < s->readahead_size) {
+        fprintf(stderr, "readahead-max %zd must be a multiple of 512 and "
+                "at least readahead\n", s->readahead_max);
+        goto out_noclean;
+    }
+    s->cur_readahead = s->readahead_size;
+
+    s->num_states = qemu_opt_get_number(opts, "connections", CURL_NUM_STATES);
+    if (s->num_states < 1 || s->num_states > CURL_MAX_STATES) {
+        fprintf(stderr, "connections must be between 1 and %d\n",
+                CURL_MAX_STATES);
+        goto out_noclean;
+    }
+    s->states = g_new0(CURLState, s->num_states);
+
     file = qemu_opt_get(opts, "url");
     if (file == NULL) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "curl block driver requires "
@@ -453,8 +767,10 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     curl_easy_setopt(state->curl, CURLOPT_HEADERFUNCTION,
                      curl_header_cb);
     curl_easy_setopt(state->curl, CURLOPT_HEADERDATA, s);
+    curl_easy_setopt(state->curl, CURLOPT_FILETIME, 1);
     if (curl_easy_perform(state->curl))
         goto out;
+    curl_easy_getinfo(state->curl, CURLINFO_FILETIME, &s->filetime);
     curl_easy_getinfo(state->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
     if (d)
         s->len = (size_t)d;
@@ -473,12 +789,24 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    cache_file = qemu_opt_get(opts, "cache-file");
+    if (cache_file) {
+        ret = curl_cache_open(s, cache_file);
+        if (ret == -EEXIST) {
+            qerror_report(ERROR_CLASS_GENERIC_ERROR, "'%s' is not a curl "
+                          "cache file", cache_file);
+            goto out_noclean;
+        } else if (ret < 0) {
+            qerror_report(ERROR_CLASS_GENERIC_ERROR, "Could not open cache "
+                          "file '%s': %s", cache_file, strerror(-ret));
+            goto out_noclean;
+        }
+    }
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
-    s->multi = curl_multi_init();
-    curl_multi_setopt(s->multi, CURLMOPT_SOCKETDATA, s);
-    curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+    curl_attach_aio_context(bs, bdrv_get_aio_context(bs));
     curl_multi_do(s);
 
     qemu_opts_del(opts);
@@ -490,6 +818,7 @@ out:
     state->curl = NULL;
 out_noclean:
     g_free(s->url);
+    g_free(s->states);
     qemu_opts_del(opts);
     return -EINVAL;
 }
@@ -505,6 +834,52 @@ static const AIOCBInfo curl_aiocb_info = {
 };
 
 
+static void curl_start_request(BDRVCURLState *s, CURLState *state,
+                               size_t start, size_t len)
+{
+    size_t end;
+
+    state->buf_off = 0;
+    if (state->orig_buf)
+        g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    end = MIN(start + state->buf_len, s->len) - 1;
+    state->orig_buf = g_malloc(state->buf_len);
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/* While streaming at full read-ahead, fetch the next window on another
+ * connection so that it is in flight when the guest gets there.  */
+static void curl_prefetch(BDRVCURLState *s, size_t start)
+{
+    CURLState *state;
+
+    if (start >= s->len || curl_range_pending(s, start)) {
+        return;
+    }
+    if (s->cache_fd >= 0 &&
+        curl_cache_contains(s, start, MIN(s->cur_readahead, s->len - start))) {
+        return;
+    }
+
+    state = curl_find_state(s);
+    if (!state) {
+        return;
+    }
+    if (!curl_setup_state(s, state)) {
+        state->in_use = 0;
+        return;
+    }
+
+    DPRINTF("CURL (AIO): Prefetching %zd at %zd\n", s->cur_readahead, start);
+    curl_start_request(s, state, start, s->cur_readahead);
+}
+
 static void curl_readv_bh_cb(void *p)
 {
     CURLState *state;
@@ -516,11 +891,26 @@ static void curl_readv_bh_cb(void *p)
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t buf_start, buf_len;
+
+    // Grow the read-ahead window while the guest reads sequentially
+    if (start == s->next_offset) {
+        s->cur_readahead = MIN(s->cur_readahead * 2, s->readahead_max);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
+    s->next_offset = start + len;
+
+    if (s->cache_fd >= 0 && curl_cache_read(s, start, len, acb->qiov) == 0) {
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+        return;
+    }
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
@@ -538,26 +928,27 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    // With a cache file, download whole chunks so they can be stored
+    buf_start = start;
+    buf_len = len + s->cur_readahead;
+    if (s->cache_fd >= 0) {
+        buf_start = start & ~((size_t)CURL_CACHE_CHUNK_SIZE - 1);
+        buf_len = ROUND_UP(start + buf_len, CURL_CACHE_CHUNK_SIZE) - buf_start;
+    }
 
-    state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
+    acb->start = start - buf_start;
+    acb->end = acb->start + len;
     state->acb[0] = acb;
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (readahead %zd)\n",
+            len, start, s->cur_readahead);
+    curl_start_request(s, state, buf_start, buf_len);
 
-    curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
+    if (s->cur_readahead == s->readahead_max) {
+        curl_prefetch(s, buf_start + buf_len);
+    }
 
+    curl_multi_do(s);
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -572,7 +963,7 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
     acb->sector_num = sector_num;
     acb->nb_sectors = nb_sectors;
 
-    acb->bh = qemu_bh_new(curl_readv_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), curl_readv_bh_cb, acb);
     qemu_bh_schedule(acb->bh);
     return &acb->common;
 }
@@ -583,9 +974,8 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
-        if (s->states[i].in_use)
-            curl_clean_state(&s->states[i]);
+    curl_detach_aio_context(bs);
+    for (i=0; i<s->num_states; i++) {
         if (s->states[i].curl) {
             curl_easy_cleanup(s->states[i].curl);
             s->states[i].curl = NULL;
@@ -595,8 +985,10 @@ static void curl_close(BlockDriverState *bs)
             s->states[i].orig_buf = NULL;
         }
     }
-    if (s->multi)
-        curl_multi_cleanup(s->multi);
+    if (s->cache_fd >= 0) {
+        curl_cache_close(s);
+    }
+    g_free(s->states);
     g_free(s->url);
 }
 
@@ -617,6 +1009,9 @@ static BlockDriver bdrv_http = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+
+    .bdrv_detach_aio_context = curl_detach_aio_context,
+    .bdrv_attach_aio_context = curl_attach_aio_context,
 };
 
 static BlockDriver bdrv_https = {
@@ -630,6 +1025,9 @@ static BlockDriver bdrv_https = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+
+    .bdrv_detach_aio_context = curl_detach_aio_context,
+    .bdrv_attach_aio_context = curl_attach_aio_context,
 };
 
 static BlockDriver bdrv_ftp = {
@@ -643,6 +1041,9 @@ static BlockDriver bdrv_ftp = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+
+    .bdrv_detach_aio_context = curl_detach_aio_context,
+    .bdrv_attach_aio_context = curl_attach_aio_context,
 };
 
 static BlockDriver bdrv_ftps = {
@@ -656,6 +1057,9 @@ static BlockDriver bdrv_ftps = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+
+    .bdrv_detach_aio_context = curl_detach_aio_context,
+    .bdrv_attach_aio_context = curl_attach_aio_context,
 };
 
 static BlockDriver bdrv_tftp = {
@@ -669,6 +1073,9 @@ static BlockDriver bdrv_tftp = {
     .bdrv_getlength         = curl_getlength,
 
     .bdrv_aio_readv         = curl_aio_readv,
+
+    .bdrv_detach_aio_context = curl_detach_aio_context,
+    .bdrv_attach_aio_context = curl_attach_aio_context,
 };
 
 static void curl_block_init(void)
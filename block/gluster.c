@@ -338,8 +338,8 @@ static int qemu_gluster_open(BlockDriverState *bs,  QDict *options,
         goto out;
     }
     fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, s);
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->fds[GLUSTER_FD_READ],
+                       qemu_gluster_aio_event_reader, NULL, s);
 
 out:
     qemu_opts_del(opts);
@@ -405,7 +405,7 @@ static void qemu_gluster_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->finished = &finished;
     while (!finished) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -577,13 +577,30 @@ static int64_t qemu_gluster_allocated_file_size(BlockDriverState *bs)
     }
 }
 
+static void qemu_gluster_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->fds[GLUSTER_FD_READ],
+                       NULL, NULL, NULL);
+}
+
+static void qemu_gluster_attach_aio_context(BlockDriverState *bs,
+                                            AioContext *new_context)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    aio_set_fd_handler(new_context, s->fds[GLUSTER_FD_READ],
+                       qemu_gluster_aio_event_reader, NULL, s);
+}
+
 static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
+    qemu_gluster_detach_aio_context(bs);
     close(s->fds[GLUSTER_FD_READ]);
     close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL);
 
     if (s->fd) {
         glfs_close(s->fd);
@@ -622,6 +639,8 @@ static BlockDriver bdrv_gluster = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -643,6 +662,8 @@ static BlockDriver bdrv_gluster_tcp = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -664,6 +685,8 @@ static BlockDriver bdrv_gluster_unix = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -685,6 +708,8 @@ static BlockDriver bdrv_gluster_rdma = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -19,6 +19,7 @@
 
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
+#define RATE_SAMPLE_TIME 1000000000LL /* ns */
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -46,7 +47,21 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
+    int max_chunk_sectors;
+    bool waiting_for_io;
+    bool copy_offload;
     int ret;
+
+    /* Throughput and convergence statistics for query-block-jobs */
+    int64_t bytes_done;
+    int64_t sample_time_ns;
+    int64_t sample_bytes;
+    int64_t sample_dirty;
+    bool stats_valid;
+    int64_t throughput;
+    int64_t drain_rate;
+    int64_t eta;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -85,6 +100,10 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
         QSIMPLEQ_INSERT_TAIL(&s->buf_free, buf, next);
         s->buf_free_count++;
     }
+    qemu_iovec_destroy(&op->qiov);
+    if (ret >= 0) {
+        s->bytes_done += (int64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
 
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     chunk_num = op->sector_num / sectors_per_chunk;
@@ -95,7 +114,14 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+
+    /* The job coroutine can also be waiting for the source's metadata
+     * in bdrv_co_get_block_status; only wake it up if it is waiting
+     * for one of our requests.
+     */
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -136,11 +162,36 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+static void mirror_copy_complete(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    if (ret == -ENOTSUP) {
+        /* Copy again through the buffer */
+        trace_mirror_copy_offload_disabled(s);
+        s->copy_offload = false;
+        bdrv_set_dirty(s->common.bs, op->sector_num, op->nb_sectors);
+        mirror_iteration_done(op, ret);
+        return;
+    }
+    mirror_write_complete(op, ret);
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, max_sectors;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    bool zero = false, use_buf;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -155,6 +206,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     end = s->common.len >> BDRV_SECTOR_BITS;
+    max_sectors = s->max_chunk_sectors;
 
     /* Extend the QEMUIOVector to include all adjacent blocks that will
      * be copied in this operation.
@@ -167,7 +219,9 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
      *
      * We also want to extend the QEMUIOVector to include more adjacent
      * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * run efficiently even with a small granularity.  A single request is
+     * capped at max_chunk_sectors so that several of them can be in flight
+     * at the same time.
      */
     nb_chunks = 0;
     nb_sectors = 0;
@@ -177,9 +231,40 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 
+    /* Ranges that read as zeroes in the source need not go through the
+     * buffer; a write_zeroes request on the target is enough, and it lets
+     * sparse formats keep the range unallocated.  This cannot be done if
+     * we are doing COW ourselves, because the target would fill the rest
+     * of the cluster with zeroes too.
+     *
+     * Zero writes are capped at the size of the buffer, because drivers
+     * without efficient zero writes emulate them with a bounce buffer.
+     */
+    if (!s->cow_bitmap) {
+        int64_t ret;
+        int pnum;
+
+        ret = bdrv_co_get_block_status(source, sector_num,
+                                       s->buf_size >> BDRV_SECTOR_BITS, &pnum);
+        if (ret >= 0 && (ret & BDRV_BLOCK_ZERO)) {
+            if (sector_num + pnum < end) {
+                pnum -= pnum % sectors_per_chunk;
+            }
+            if (pnum > 0) {
+                zero = true;
+                max_sectors = pnum;
+            }
+        }
+    }
+
+    /* Data is copied through the buffer, unless the source and target can
+     * copy it on their own.
+     */
+    use_buf = !zero && !s->copy_offload;
+
     do {
         int added_sectors, added_chunks;
 
@@ -208,18 +293,24 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
-        /* When doing COW, it may happen that there is not enough space for
-         * a full cluster.  Wait if that is the case.
-         */
-        while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
-            trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
-        }
-        if (s->buf_free_count < nb_chunks + added_chunks) {
-            trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
+        if (nb_sectors > 0 && nb_sectors + added_sectors > max_sectors) {
             break;
         }
 
+        if (use_buf) {
+            /* When doing COW, it may happen that there is not enough space
+             * for a full cluster.  Wait if that is the case.
+             */
+            while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
+                trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
+                mirror_wait_for_io(s);
+            }
+            if (s->buf_free_count < nb_chunks + added_chunks) {
+                trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
+                break;
+            }
+        }
+
         /* We have enough free space to copy these sectors.  */
         bitmap_set(s->in_flight_bitmap, next_chunk, added_chunks);
 
@@ -236,15 +327,18 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->nb_sectors = nb_sectors;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
-     * from s->buf_free.
+     * from s->buf_free.  Zero writes and offloaded copies do not need any
+     * buffer.
      */
-    qemu_iovec_init(&op->qiov, nb_chunks);
+    qemu_iovec_init(&op->qiov, use_buf ? nb_chunks : 0);
     next_sector = sector_num;
     while (nb_chunks-- > 0) {
-        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
-        s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, s->granularity);
+        if (use_buf) {
+            MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+            QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+            s->buf_free_count--;
+            qemu_iovec_add(&op->qiov, buf, s->granularity);
+        }
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
@@ -258,8 +352,44 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     bdrv_reset_dirty(source, sector_num, nb_sectors);
 
-    /* Copy the dirty cluster.  */
+    /* A guest write during the bdrv_co_get_block_status call above had its
+     * dirty bit cleared just now.  Check again with the bits reset: a write
+     * from here on dirties the range again and is copied by a later
+     * iteration.  If the range is not all zeroes anymore, hand it back to
+     * the dirty bitmap.
+     */
+    if (zero) {
+        int64_t ret;
+        int pnum;
+
+        ret = bdrv_co_get_block_status(source, sector_num, nb_sectors, &pnum);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || pnum < nb_sectors) {
+            trace_mirror_zero_changed(s, sector_num, nb_sectors);
+            bdrv_set_dirty(source, sector_num, nb_sectors);
+            bitmap_clear(s->in_flight_bitmap, sector_num / sectors_per_chunk,
+                         DIV_ROUND_UP(nb_sectors, sectors_per_chunk));
+            qemu_iovec_destroy(&op->qiov);
+            g_slice_free(MirrorOp, op);
+            return;
+        }
+    }
+
     s->in_flight++;
+    if (zero) {
+        trace_mirror_one_iteration_zero(s, sector_num, nb_sectors);
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              mirror_write_complete, op);
+        return;
+    }
+
+    if (!use_buf) {
+        trace_mirror_one_iteration_copy(s, sector_num, nb_sectors);
+        bdrv_aio_copy_range(source, sector_num, s->target, sector_num,
+                            nb_sectors, mirror_copy_complete, op);
+        return;
+    }
+
+    /* Copy the dirty cluster.  */
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
@@ -282,10 +412,52 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Sample the amount of data copied and the size of the dirty bitmap about
+ * once a second.  The difference between two samples of the dirty count
+ * is the rate at which the job converges, which can be negative if the
+ * guest dirties data faster than we can copy it.
+ */
+static void mirror_update_stats(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->sample_time_ns;
+    int64_t throughput, drain_rate;
+
+    if (elapsed < RATE_SAMPLE_TIME) {
+        return;
+    }
+
+    elapsed /= SCALE_MS;
+    throughput = (s->bytes_done - s->sample_bytes) * 1000 / elapsed;
+    drain_rate = (s->sample_dirty - cnt) * BDRV_SECTOR_SIZE * 1000 / elapsed;
+
+    /* Smooth out the samples with an exponential moving average.  */
+    if (s->stats_valid) {
+        throughput = (s->throughput + throughput) / 2;
+        drain_rate = (s->drain_rate + drain_rate) / 2;
+    }
+    s->throughput = throughput;
+    s->drain_rate = drain_rate;
+    s->stats_valid = true;
+
+    if (cnt == 0) {
+        s->eta = 0;
+    } else if (drain_rate > 0) {
+        s->eta = cnt * BDRV_SECTOR_SIZE / drain_rate;
+    } else {
+        s->eta = -1;
+    }
+
+    trace_mirror_update_stats(s, s->throughput, s->drain_rate, s->eta);
+    s->sample_time_ns = now;
+    s->sample_bytes = s->bytes_done;
+    s->sample_dirty = cnt;
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -293,7 +465,7 @@ static void coroutine_fn mirror_run(void *opaque)
 {
     MirrorBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
-    int64_t sector_num, end, sectors_per_chunk, length;
+    int64_t sector_num, end, sectors_per_chunk, length, max_chunk;
     uint64_t last_pause_ns;
     BlockDriverInfo bdi;
     char backing_filename[1024];
@@ -332,6 +504,14 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
+    /* Split the buffer evenly among the requests that can be in flight,
+     * so that long runs of dirty chunks are copied with a few large
+     * requests without starving the others.
+     */
+    max_chunk = s->buf_size / s->max_in_flight;
+    max_chunk = MAX(max_chunk & ~(s->granularity - 1), s->granularity);
+    s->max_chunk_sectors = max_chunk >> BDRV_SECTOR_BITS;
+
     if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base;
@@ -357,6 +537,8 @@ static void coroutine_fn mirror_run(void *opaque)
 
     bdrv_dirty_iter_init(bs, &s->hbi);
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->sample_time_ns = last_pause_ns;
+    s->sample_dirty = bdrv_get_dirty_count(bs);
     for (;;) {
         uint64_t delay_ns;
         int64_t cnt;
@@ -368,6 +550,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
 
         cnt = bdrv_get_dirty_count(bs);
+        mirror_update_stats(s, cnt);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
@@ -376,10 +559,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 mirror_iteration(s);
@@ -502,6 +685,21 @@ static void mirror_iostatus_reset(BlockJob *job)
     bdrv_iostatus_reset(s->target);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (!s->stats_valid) {
+        return;
+    }
+    info->has_throughput = true;
+    info->throughput = s->throughput;
+    if (s->eta >= 0) {
+        info->has_eta = true;
+        info->eta = s->eta;
+    }
+}
+
 static void mirror_complete(BlockJob *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -530,11 +728,13 @@ static const BlockJobType mirror_job_type = {
     .job_type      = "mirror",
     .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
+    .query         = mirror_query,
     .complete      = mirror_complete,
 };
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
@@ -556,6 +756,14 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
 
     assert ((granularity & (granularity - 1)) == 0);
 
+    if (max_in_flight == 0) {
+        max_in_flight = MAX_IN_FLIGHT;
+    }
+    if (max_in_flight < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -574,6 +782,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->mode = mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = max_in_flight;
+    s->copy_offload = true;
 
     bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
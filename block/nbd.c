@@ -49,29 +49,63 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define DEFAULT_NBD_REQUESTS    64
+#define MAX_NBD_REQUESTS        1024
+#define MAX_NBD_CONNECTIONS     16
 
-typedef struct BDRVNBDState {
+#define HANDLE_TO_INDEX(c, handle) ((handle) ^ ((uint64_t)(intptr_t)c))
+#define INDEX_TO_HANDLE(c, index)  ((index)  ^ ((uint64_t)(intptr_t)c))
+
+typedef struct BDRVNBDState BDRVNBDState;
+
+/* One socket to the server.  Requests are spread across all connections
+ * to the same export; each connection has its own request queue.  */
+typedef struct NBDConnection {
+    BDRVNBDState *s;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
 
     CoMutex send_mutex;
     CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;
     struct nbd_reply reply;
+} NBDConnection;
+
+struct BDRVNBDState {
+    BlockDriverState *bs;
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+
+    NBDConnection *conns;
+    int nb_conns;
+    int max_requests;    /* per connection */
 
     bool is_unix;
     QemuOpts *socket_opts;
 
     char *export_name; /* An NBD server may export several devices */
-} BDRVNBDState;
+};
+
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight on each connection",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server",
+        },
+        { /* end of list */ }
+    },
+};
 
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
@@ -220,6 +254,8 @@ out:
 static int nbd_config(BDRVNBDState *s, QDict *options)
 {
     Error *local_err = NULL;
+    QemuOpts *opts;
+    uint64_t queue_depth, connections;
 
     if (qdict_haskey(options, "path")) {
         if (qdict_haskey(options, "host")) {
@@ -234,6 +270,33 @@ static int nbd_config(BDRVNBDState *s, QDict *options)
         return -EINVAL;
     }
 
+    opts = qemu_opts_create_nofail(&nbd_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                      DEFAULT_NBD_REQUESTS);
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+
+    if (queue_depth < 2 || queue_depth > MAX_NBD_REQUESTS) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "queue-depth must be "
+                      "between 2 and %d", MAX_NBD_REQUESTS);
+        return -EINVAL;
+    }
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "connections must be "
+                      "between 1 and %d", MAX_NBD_CONNECTIONS);
+        return -EINVAL;
+    }
+    s->max_requests = queue_depth;
+    s->nb_conns = connections;
+
     s->socket_opts = qemu_opts_create_nofail(&socket_optslist);
 
     qemu_opts_absorb_qdict(s->socket_opts, options, &local_err);
@@ -256,46 +319,62 @@ static int nbd_config(BDRVNBDState *s, QDict *options)
 }
 
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Pick the connection with the fewest requests in flight.  */
+static NBDConnection *nbd_get_connection(BDRVNBDState *s)
+{
+    NBDConnection *c = &s->conns[0];
+    int i;
+
+    for (i = 1; i < s->nb_conns; i++) {
+        if (s->conns[i].in_flight < c->in_flight) {
+            c = &s->conns[i];
+        }
+    }
+    return c;
+}
+
+static void nbd_coroutine_start(NBDConnection *c, struct nbd_request *request)
 {
+    BDRVNBDState *s = c->s;
     int i;
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight >= s->max_requests - 1) {
+        qemu_co_mutex_lock(&c->free_sema);
+        assert(c->in_flight < s->max_requests);
     }
-    s->in_flight++;
+    c->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+    for (i = 0; i < s->max_requests; i++) {
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    assert(i < s->max_requests);
+    request->handle = INDEX_TO_HANDLE(c, i);
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *c = opaque;
+    BDRVNBDState *s = c->s;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (c->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(c->sock, &c->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            c->reply.handle = 0;
             goto fail;
         }
     }
@@ -303,63 +382,107 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
+    if (i >= s->max_requests) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (c->recv_coroutine[i]) {
+        qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    for (i = 0; i < s->max_requests; i++) {
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *c = opaque;
+    qemu_coroutine_enter(c->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *c, struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
+    BDRVNBDState *s = c->s;
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write, s);
+    qemu_co_mutex_lock(&c->send_mutex);
+    c->send_coroutine = qemu_coroutine_self();
+    aio_set_fd_handler(aio_context, c->sock,
+                       nbd_reply_ready, nbd_restart_write, c);
     if (qiov) {
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 1);
+            socket_set_cork(c->sock, 1);
         }
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
         if (rc >= 0) {
-            ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_sendv(c->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 0);
+            socket_set_cork(c->sock, 0);
         }
     } else {
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    aio_set_fd_handler(aio_context, c->sock, nbd_reply_ready, NULL, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+/* Receive the payload of a READ_SPARSE reply into qiov.  */
+static int nbd_co_receive_sparse(NBDConnection *c, struct nbd_request *request,
+                                 QEMUIOVector *qiov, int offset)
+{
+    uint8_t buf[NBD_SPARSE_CHUNK_SIZE];
+    uint32_t type, length;
+    uint32_t pos = 0;
+    ssize_t ret;
+
+    while (pos < request->len) {
+        ret = qemu_co_recv(c->sock, buf, sizeof(buf));
+        if (ret != sizeof(buf)) {
+            return -EIO;
+        }
+
+        type = be32_to_cpup((uint32_t *)buf);
+        length = be32_to_cpup((uint32_t *)(buf + 4));
+        if (length == 0 || length > request->len - pos) {
+            return -EIO;
+        }
+
+        switch (type) {
+        case NBD_SPARSE_DATA:
+            ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
+                                offset + pos, length);
+            if (ret != length) {
+                return -EIO;
+            }
+            break;
+        case NBD_SPARSE_ZERO:
+            qemu_iovec_memset(qiov, offset + pos, 0, length);
+            break;
+        default:
+            return -EIO;
+        }
+        pos += length;
+    }
+
+    return 0;
+}
+
+static void nbd_co_receive_reply(NBDConnection *c, struct nbd_request *request,
                                  struct nbd_reply *reply,
                                  QEMUIOVector *qiov, int offset)
 {
@@ -368,37 +491,64 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
     qemu_coroutine_yield();
-    *reply = s->reply;
+    *reply = c->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
     } else {
         if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+            if (request->type == NBD_CMD_READ_SPARSE) {
+                ret = nbd_co_receive_sparse(c, request, qiov, offset);
+                if (ret < 0) {
+                    reply->error = -ret;
+                }
+            } else {
+                ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *c, struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == c->s->max_requests) {
+        qemu_co_mutex_unlock(&c->free_sema);
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+/* Send a request on connection c and wait for its reply.  */
+static int nbd_co_request(NBDConnection *c, struct nbd_request *request,
+                          QEMUIOVector *qiov, int offset)
+{
+    struct nbd_reply reply;
+    bool is_write = (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
+    ssize_t ret;
+
+    nbd_coroutine_start(c, request);
+    ret = nbd_co_send_request(c, request, is_write ? qiov : NULL, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(c, request, &reply,
+                             is_write ? NULL : qiov, offset);
+    }
+    nbd_coroutine_end(c, request);
+    return -reply.error;
+}
+
+static int nbd_connect(BDRVNBDState *s, NBDConnection *c)
 {
-    BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -418,7 +568,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -426,31 +576,82 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
+    if (c == &s->conns[0]) {
+        s->nbdflags = nbdflags;
+        s->size = size;
+        s->blocksize = blocksize;
+    } else if (nbdflags != s->nbdflags || size != s->size) {
+        logout("NBD server changed the export between connections\n");
+        closesocket(sock);
+        return -EIO;
+    }
+
+    c->s = s;
+    c->sock = sock;
+    c->recv_coroutine = g_new0(Coroutine *, s->max_requests);
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_mutex_init(&c->free_sema);
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, s);
+    aio_set_fd_handler(bdrv_get_aio_context(s->bs), sock,
+                       nbd_reply_ready, NULL, c);
 
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
-
-    logout("Established connection with NBD server\n");
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_close_connection(NBDConnection *c)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(c->sock, &request);
+
+    aio_set_fd_handler(bdrv_get_aio_context(c->s->bs), c->sock,
+                       NULL, NULL, NULL);
+    closesocket(c->sock);
+    g_free(c->recv_coroutine);
+}
+
+static void nbd_teardown_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    int i;
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL);
-    closesocket(s->sock);
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_close_connection(&s->conns[i]);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
+}
+
+static int nbd_establish_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    int nb_conns = s->nb_conns;
+    int ret;
+
+    s->conns = g_new0(NBDConnection, nb_conns);
+    for (s->nb_conns = 0; s->nb_conns < nb_conns; s->nb_conns++) {
+        ret = nbd_connect(s, &s->conns[s->nb_conns]);
+        if (ret < 0 && s->nb_conns > 0) {
+            /* The server may limit the number of clients; make do with
+             * the connections we already have.  */
+            logout("Failed to open connection %d, using %d of %d\n",
+                   s->nb_conns + 1, s->nb_conns, nb_conns);
+            break;
+        } else if (ret < 0) {
+            nbd_teardown_connection(bs);
+            return ret;
+        }
+    }
+
+    logout("Established %d connection(s) with NBD server\n", s->nb_conns);
+    return 0;
 }
 
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
@@ -459,8 +660,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     BDRVNBDState *s = bs->opaque;
     int result;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    s->bs = bs;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, options);
@@ -482,23 +682,16 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
-    request.type = NBD_CMD_READ;
-    request.from = sector_num * 512;
-    request.len = nb_sectors * 512;
-
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
+    if (s->nbdflags & NBD_FLAG_SEND_READ_SPARSE) {
+        request.type = NBD_CMD_READ_SPARSE;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        request.type = NBD_CMD_READ;
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
 
+    return nbd_co_request(nbd_get_connection(s), &request, qiov, offset);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -507,8 +700,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -518,15 +709,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(nbd_get_connection(s), &request, qiov, offset);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -571,30 +754,29 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int i, ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.type = NBD_CMD_FLUSH;
-    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
-        request.type |= NBD_CMD_FLAG_FUA;
-    }
+    /* The server only guarantees that writes completed on the same
+     * connection are stable, so flush all of them.  */
+    for (i = 0; i < s->nb_conns; i++) {
+        request.type = NBD_CMD_FLUSH;
+        if (s->nbdflags & NBD_FLAG_SEND_FUA) {
+            request.type |= NBD_CMD_FLAG_FUA;
+        }
 
-    request.from = 0;
-    request.len = 0;
+        request.from = 0;
+        request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        ret = nbd_co_request(&s->conns[i], &request, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return 0;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -602,8 +784,6 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -612,15 +792,7 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(nbd_get_connection(s), &request, NULL, 0);
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -632,6 +804,29 @@ static void nbd_close(BlockDriverState *bs)
     nbd_teardown_connection(bs);
 }
 
+static void nbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        aio_set_fd_handler(bdrv_get_aio_context(bs), s->conns[i].sock,
+                           NULL, NULL, NULL);
+    }
+}
+
+static void nbd_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    BDRVNBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        aio_set_fd_handler(new_context, s->conns[i].sock,
+                           nbd_reply_ready, NULL, &s->conns[i]);
+    }
+}
+
 static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -648,6 +843,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_readv       = nbd_co_readv,
     .bdrv_co_writev      = nbd_co_writev,
     .bdrv_close          = nbd_close,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
@@ -662,6 +859,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_readv       = nbd_co_readv,
     .bdrv_co_writev      = nbd_co_writev,
     .bdrv_close          = nbd_close,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
@@ -676,6 +875,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_readv       = nbd_co_readv,
     .bdrv_co_writev      = nbd_co_writev,
     .bdrv_close          = nbd_close,
+    .bdrv_detach_aio_context = nbd_detach_aio_context,
+    .bdrv_attach_aio_context = nbd_attach_aio_context,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
@@ -25,6 +25,7 @@
 #include "block/qapi.h"
 #include "block/block_int.h"
 #include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
 
 /*
  * Returns 0 on success, with *p_list either set to describe snapshot
@@ -288,6 +289,75 @@ void bdrv_query_info(BlockDriverState *bs,
     qapi_free_BlockInfo(info);
 }
 
+static intList *uint64_array_to_list(const uint64_t *array, int n)
+{
+    intList *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        intList *entry = g_malloc0(sizeof(*entry));
+        entry->value = array[i];
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockLatencyHistogram *
+bdrv_query_latency_histogram(const BlockDriverState *bs,
+                             enum BlockAcctType type)
+{
+    const BlockAcctHistogram *hist;
+    BlockLatencyHistogram *info;
+
+    hist = &bs->latency_stats.histogram[type];
+    info = g_malloc0(sizeof(*info));
+    info->boundaries = uint64_array_to_list(hist->boundaries,
+                                            hist->nb_boundaries);
+    info->bins = uint64_array_to_list(hist->bins, hist->nb_boundaries + 1);
+
+    return info;
+}
+
+static void bdrv_query_latency_stats(const BlockDriverState *bs,
+                                     BlockDeviceStats *ds)
+{
+    const BlockLatencyStats *stats = &bs->latency_stats;
+
+    if (stats->histogram[BDRV_ACCT_READ].bins) {
+        ds->has_rd_latency_histogram = true;
+        ds->rd_latency_histogram =
+            bdrv_query_latency_histogram(bs, BDRV_ACCT_READ);
+    }
+    if (stats->histogram[BDRV_ACCT_WRITE].bins) {
+        ds->has_wr_latency_histogram = true;
+        ds->wr_latency_histogram =
+            bdrv_query_latency_histogram(bs, BDRV_ACCT_WRITE);
+    }
+    if (stats->histogram[BDRV_ACCT_FLUSH].bins) {
+        ds->has_flush_latency_histogram = true;
+        ds->flush_latency_histogram =
+            bdrv_query_latency_histogram(bs, BDRV_ACCT_FLUSH);
+    }
+
+    /* Only device models do I/O accounting, protocol layers have no queue */
+    if (bs->device_name[0]) {
+        ds->has_queue_depth = true;
+        ds->queue_depth = g_malloc0(sizeof(*ds->queue_depth));
+        ds->queue_depth->current = stats->in_flight;
+        ds->queue_depth->max = stats->max_in_flight;
+        ds->queue_depth->histogram =
+            uint64_array_to_list(stats->queue_depth_bins,
+                                 BDRV_QUEUE_DEPTH_BINS);
+    }
+
+    if (stats->slow_threshold_ns) {
+        ds->has_slow_requests = true;
+        ds->slow_requests = stats->nr_slow;
+    }
+}
+
 BlockStats *bdrv_query_stats(const BlockDriverState *bs)
 {
     BlockStats *s;
@@ -310,6 +380,12 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_query_stats) {
+        bs->drv->bdrv_query_stats(bs, s->stats);
+    }
+
+    bdrv_query_latency_stats(bs, s->stats);
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -343,6 +419,48 @@ BlockInfoList *qmp_query_block(Error **errp)
     return NULL;
 }
 
+BlockSlowRequestList *qmp_query_block_slow_requests(const char *device,
+                                                   bool has_clear, bool clear,
+                                                   Error **errp)
+{
+    BlockSlowRequestList *head = NULL, **p_next = &head;
+    BlockDriverState *bs;
+    BlockLatencyStats *stats;
+    unsigned int i, idx;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    stats = &bs->latency_stats;
+    for (i = 0; i < stats->slow_count; i++) {
+        BlockSlowRequestList *entry = g_malloc0(sizeof(*entry));
+        BlockSlowRequestEntry *req;
+
+        idx = (stats->slow_next + stats->slow_size - stats->slow_count + i)
+              % stats->slow_size;
+        req = &stats->slow[idx];
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->type = (BlockIOType) req->type;
+        entry->value->bytes = req->bytes;
+        entry->value->start_time_ns = req->start_time_ns;
+        entry->value->latency_ns = req->latency_ns;
+
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    if (has_clear && clear) {
+        stats->slow_count = 0;
+        stats->slow_next = 0;
+    }
+
+    return head;
+}
+
 BlockStatsList *qmp_query_blockstats(Error **errp)
 {
     BlockStatsList *head = NULL, **p_next = &head;
@@ -198,7 +198,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -221,7 +221,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -280,12 +280,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW2_CLUSTER_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = qcow2_get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -294,8 +294,9 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, l2_index + i)
+                          & mask;
+        if (offset + ((uint64_t) i << s->cluster_bits) != l2_entry) {
             break;
         }
     }
@@ -303,12 +304,14 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -318,6 +321,48 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * For images with extended L2 entries: Counts the sectors, starting at the
+ * beginning of the cluster at l2_index, up to the first subcluster (at or
+ * after subcluster sc of that first cluster) whose type differs from the
+ * type of subcluster sc, or which isn't contiguous in the image file. The
+ * type of subcluster sc is returned in *type.
+ */
+static int count_contiguous_subclusters(BDRVQcowState *s, int nb_clusters,
+        uint64_t *l2_table, int l2_index, int sc, int *type)
+{
+    uint64_t first_entry = qcow2_get_l2_entry(s, l2_table, l2_index);
+    uint64_t expected_offset = first_entry & L2E_OFFSET_MASK;
+    int i;
+
+    *type = qcow2_get_subcluster_type(s, first_entry,
+                qcow2_get_l2_bitmap(s, l2_table, l2_index), sc);
+    assert(*type != QCOW2_CLUSTER_COMPRESSED);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, l2_index + i);
+
+        if (*type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+            break;
+        }
+
+        for (; sc < QCOW_EXTL2_SUBCLUSTERS; sc++) {
+            if (qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc)
+                != *type) {
+                goto out;
+            }
+        }
+
+        sc = 0;
+        expected_offset += s->cluster_size;
+    }
+
+out:
+    return i * s->cluster_sectors + sc * s->subcluster_sectors;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -478,10 +523,31 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = qcow2_get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
+    if (s->extended_l2 && ret == QCOW2_CLUSTER_ZERO) {
+        /* The whole-cluster zero flag is reserved with extended L2 entries */
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        return -EIO;
+    }
+    if (s->extended_l2 && ret != QCOW2_CLUSTER_COMPRESSED) {
+        /* Subclusters of different types can't be processed at once */
+        int sc = index_in_cluster >> (s->subcluster_bits - BDRV_SECTOR_BITS);
+
+        nb_available = count_contiguous_subclusters(s, nb_clusters, l2_table,
+                                                    l2_index, sc, &ret);
+        if (ret == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+        } else {
+            *cluster_offset = 0;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        goto out;
+    }
+
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
@@ -492,19 +558,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         if (s->qcow_version < 3) {
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table, l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
     default:
@@ -575,7 +641,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -620,7 +686,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = qcow2_get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -644,7 +710,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    qcow2_set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    qcow2_set_l2_bitmap(s, l2_table, l2_index, 0);
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -682,6 +749,20 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the "allocated" bits for the i-th cluster of an allocation, i.e. of
+ * all subclusters that are touched by either the guest write or COW.
+ */
+static uint64_t l2meta_subcluster_mask(BDRVQcowState *s, QCowL2Meta *m, int i)
+{
+    uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+    uint64_t start = MAX(m->cow_start.offset, cluster_start);
+    uint64_t end = MIN(l2meta_cow_end(m) - m->offset,
+                       cluster_start + s->cluster_size);
+
+    return qcow2_subcluster_mask(s, start - cluster_start, end - cluster_start);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -709,7 +790,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
     }
-    if (qcow2_need_accurate_refcounts(s)) {
+    if (qcow2_need_accurate_refcounts(s) && !m->refcounts_stable) {
         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                    s->refcount_block_cache);
     }
@@ -722,17 +803,37 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     assert(l2_index + m->nb_clusters <= s->l2_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = qcow2_get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (m->keep_old_cluster) {
+            assert((old_entry & L2E_OFFSET_MASK) == cluster_offset);
+        } else if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
+        qcow2_set_l2_entry(s, l2_table, l2_index + i, (cluster_offset +
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+
+        if (s->extended_l2) {
+            uint64_t alloc = l2meta_subcluster_mask(s, m, i);
+
+            /* A new cluster only contains what was just written or copied;
+             * untouched subclusters keep reading as zero or from the
+             * backing file */
+            if (!m->keep_old_cluster) {
+                l2_bitmap &= ~QCOW_EXTL2_ALLOC_MASK;
+            }
+            l2_bitmap |= alloc;
+            l2_bitmap &= ~(alloc << QCOW_EXTL2_ZERO_SHIFT);
+            qcow2_set_l2_bitmap(s, l2_table, l2_index + i, l2_bitmap);
+        }
      }
 
 
@@ -750,7 +851,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -772,7 +873,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -823,6 +924,13 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        if (s->extended_l2) {
+            /* Allocations in different subclusters of a cluster still update
+             * the same L2 entry, so serialise them per cluster */
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -860,6 +968,69 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * For images with extended L2 entries: Returns how many of the nb_clusters
+ * clusters starting at l2_index have all subclusters that are touched by a
+ * write of bytes at guest_offset allocated, so that the write needs no COW
+ * and no update of the subcluster bitmap.
+ */
+static int count_writable_clusters(BDRVQcowState *s, int nb_clusters,
+    uint64_t *l2_table, int l2_index, uint64_t guest_offset, uint64_t bytes)
+{
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, l2_index + i);
+        uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+        uint64_t mask = qcow2_subcluster_mask(s,
+            MAX(start, cluster_start) - cluster_start,
+            MIN(end, cluster_start + s->cluster_size) - cluster_start);
+
+        if ((l2_bitmap & mask) != mask ||
+            (l2_bitmap & (mask << QCOW_EXTL2_ZERO_SHIFT))) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Calculates the COW regions for a write to the sectors [n_start, n_end),
+ * counted from the start of the first cluster, that only needs to copy the
+ * partially written subclusters at the head and the tail of the request.
+ * Subclusters that are marked allocated (and not zero) in l2_bitmap already
+ * contain valid data and don't need COW; l2_bitmap is only consulted for the
+ * first cluster.
+ */
+static void calculate_subcluster_cow(BDRVQcowState *s, uint64_t l2_bitmap,
+    int n_start, int n_end, Qcow2COWRegion *cow_start, Qcow2COWRegion *cow_end)
+{
+    int sc_sectors = s->subcluster_sectors;
+    int head = n_start & ~(sc_sectors - 1);
+    int tail = align_offset(n_end, sc_sectors);
+    int last_sc = (n_end - 1) / sc_sectors;
+    uint64_t valid = l2_bitmap & ~(l2_bitmap >> QCOW_EXTL2_ZERO_SHIFT);
+
+    if (valid & (1ULL << (head / sc_sectors))) {
+        head = n_start;
+    }
+    if (last_sc < QCOW_EXTL2_SUBCLUSTERS && (valid & (1ULL << last_sc))) {
+        tail = n_end;
+    }
+
+    *cow_start = (Qcow2COWRegion) {
+        .offset     = head * BDRV_SECTOR_SIZE,
+        .nb_sectors = n_start - head,
+    };
+    *cow_end = (Qcow2COWRegion) {
+        .offset     = n_end * BDRV_SECTOR_SIZE,
+        .nb_sectors = tail - n_end,
+    };
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -880,6 +1051,11 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  *          the requested offset. *bytes may have decreased and describes
  *          the length of the area that can be written to.
  *
+ *          With extended L2 entries, this includes a single cluster in which
+ *          the write touches unallocated subclusters. A QCowL2Meta is added
+ *          to *m in this case that performs COW on the partially written
+ *          subclusters and updates the subcluster bitmap.
+ *
  *  -errno: in error cases
  */
 static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
@@ -888,9 +1064,11 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t cluster_offset;
+    uint64_t l2_bitmap = 0;
     uint64_t *l2_table;
     unsigned int nb_clusters;
     unsigned int keep_clusters;
+    bool alloc_subclusters = false;
     int ret, pret;
 
     trace_qcow2_handle_copied(qemu_coroutine_self(), guest_offset, *host_offset,
@@ -915,7 +1093,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = qcow2_get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -933,11 +1111,22 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
+        if (s->extended_l2) {
+            keep_clusters = count_writable_clusters(s, keep_clusters,
+                                                    l2_table, l2_index,
+                                                    guest_offset, *bytes);
+            if (keep_clusters == 0) {
+                /* Allocate the subclusters in place */
+                l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, l2_index);
+                alloc_subclusters = true;
+                keep_clusters = 1;
+            }
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -961,6 +1150,29 @@ out:
                      + offset_into_cluster(s, guest_offset);
     }
 
+    if (alloc_subclusters) {
+        int n_start = offset_into_cluster(s, guest_offset) >> BDRV_SECTOR_BITS;
+        int n_end = n_start + (*bytes >> BDRV_SECTOR_BITS);
+        QCowL2Meta *old_m = *m;
+
+        *m = g_malloc0(sizeof(**m));
+
+        **m = (QCowL2Meta) {
+            .next               = old_m,
+
+            .alloc_offset       = cluster_offset & L2E_OFFSET_MASK,
+            .offset             = start_of_cluster(s, guest_offset),
+            .nb_clusters        = 1,
+            .nb_available       = n_end,
+            .refcounts_stable   = true,
+            .keep_old_cluster   = true,
+        };
+        calculate_subcluster_cow(s, l2_bitmap, n_start, n_end,
+                                 &(*m)->cow_start, &(*m)->cow_end);
+        qemu_co_queue_init(&(*m)->dependent_requests);
+        QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+    }
+
     return ret;
 }
 
@@ -984,13 +1196,25 @@ out:
  * restarted, but the whole request should not be failed.
  */
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *host_offset, unsigned int *nb_clusters)
+    uint64_t *host_offset, unsigned int *nb_clusters, bool *from_pool)
 {
     BDRVQcowState *s = bs->opaque;
+    int64_t pool_offset;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
+    /* Try the reservation pool first, its refcounts are already on disk */
+    pool_offset = qcow2_alloc_clusters_from_pool(bs, *host_offset, nb_clusters);
+    if (pool_offset < 0) {
+        return pool_offset;
+    } else if (pool_offset > 0) {
+        *host_offset = pool_offset;
+        *from_pool = true;
+        return 0;
+    }
+    *from_pool = false;
+
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == 0) {
@@ -1042,6 +1266,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int ret;
 
     uint64_t alloc_cluster_offset;
+    bool from_pool;
 
     trace_qcow2_handle_alloc(qemu_coroutine_self(), guest_offset, *host_offset,
                              *bytes);
@@ -1063,7 +1288,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = qcow2_get_l2_entry(s, l2_table, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
@@ -1085,7 +1310,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
     ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
+                                  &nb_clusters, &from_pool);
     if (ret < 0) {
         goto fail;
     }
@@ -1118,8 +1343,51 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    Qcow2COWRegion cow_start = {
+        .offset     = 0,
+        .nb_sectors = alloc_n_start,
+    };
+    Qcow2COWRegion cow_end = {
+        .offset     = nb_sectors * BDRV_SECTOR_SIZE,
+        .nb_sectors = avail_sectors - nb_sectors,
+    };
     QCowL2Meta *old_m = *m;
 
+    /*
+     * With extended L2 entries, subclusters that the write doesn't touch can
+     * stay unallocated, so only the partially written subclusters need COW.
+     * This requires that the old cluster didn't contain any data; otherwise
+     * the whole cluster is copied as usual.
+     */
+    if (s->extended_l2) {
+        Qcow2COWRegion sc_cow_start, sc_cow_end;
+        uint64_t first_entry, last_entry;
+
+        ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+        if (ret < 0) {
+            qcow2_free_clusters(bs, alloc_cluster_offset,
+                                nb_clusters << s->cluster_bits,
+                                QCOW2_DISCARD_NEVER);
+            goto fail;
+        }
+        first_entry = qcow2_get_l2_entry(s, l2_table, l2_index);
+        last_entry = qcow2_get_l2_entry(s, l2_table,
+                                        l2_index + nb_clusters - 1);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        calculate_subcluster_cow(s, 0, alloc_n_start, nb_sectors,
+                                 &sc_cow_start, &sc_cow_end);
+        if (qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_UNALLOCATED) {
+            cow_start = sc_cow_start;
+        }
+        if (qcow2_get_cluster_type(last_entry) == QCOW2_CLUSTER_UNALLOCATED) {
+            cow_end = sc_cow_end;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1129,15 +1397,10 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .offset         = start_of_cluster(s, guest_offset),
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
+        .refcounts_stable = from_pool,
 
-        .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
-        },
-        .cow_end = {
-            .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
-        },
+        .cow_start      = cow_start,
+        .cow_end        = cow_end,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
@@ -1362,14 +1625,15 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = qcow2_get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        qcow2_set_l2_entry(s, l2_table, l2_index + i, 0);
+        qcow2_set_l2_bitmap(s, l2_table, l2_index + i, 0);
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1, type);
@@ -1449,15 +1713,16 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = qcow2_get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            qcow2_set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            qcow2_set_l2_entry(s, l2_table, l2_index + i,
+                               old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1469,6 +1734,80 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+/*
+ * With extended L2 entries, zeroing sets the "reads as zero" bits of the
+ * affected subclusters instead of using QCOW_OFLAG_ZERO, so the request only
+ * needs to be subcluster aligned. The host cluster stays referenced, so that
+ * a later partial write can reuse it without copying the whole cluster.
+ *
+ * This zeroes as much of the given range as possible at once (i.e. up to the
+ * end of the L2 table) and returns the number of zeroed bytes.
+ */
+static int64_t zero_subclusters_single_l2(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t end = offset + bytes;
+    uint64_t cluster_start = start_of_cluster(s, offset);
+    unsigned int nb_clusters;
+    int l2_index;
+    int ret;
+    int i;
+
+    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Limit nb_clusters to one L2 table */
+    nb_clusters = size_to_clusters(s, end - cluster_start);
+    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+
+    for (i = 0; i < nb_clusters; i++, cluster_start += s->cluster_size) {
+        uint64_t old_offset = qcow2_get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, l2_index + i);
+        uint64_t mask = qcow2_subcluster_mask(s,
+            MAX(offset, cluster_start) - cluster_start,
+            MIN(end, cluster_start + s->cluster_size) - cluster_start);
+        uint64_t new_offset = old_offset & ~QCOW_OFLAG_ZERO;
+
+        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            /* Compressed clusters can't be partially zeroed */
+            if (mask != QCOW_EXTL2_ALLOC_MASK) {
+                ret = -ENOTSUP;
+                break;
+            }
+            new_offset = 0;
+            l2_bitmap = 0;
+        }
+
+        l2_bitmap &= ~mask;
+        l2_bitmap |= mask << QCOW_EXTL2_ZERO_SHIFT;
+
+        /* Update L2 entries */
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        qcow2_set_l2_entry(s, l2_table, l2_index + i, new_offset);
+        qcow2_set_l2_bitmap(s, l2_table, l2_index + i, l2_bitmap);
+
+        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
+        }
+    }
+
+    if (ret < 0) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        return ret;
+    }
+
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return MIN(end, cluster_start) - offset;
+}
+
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1480,19 +1819,34 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
+    s->cache_discards = true;
+
     /* Each L2 table is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
+    if (s->extended_l2) {
+        uint64_t bytes = (uint64_t) nb_sectors << BDRV_SECTOR_BITS;
 
-    s->cache_discards = true;
+        while (bytes > 0) {
+            int64_t zeroed = zero_subclusters_single_l2(bs, offset, bytes);
+            if (zeroed < 0) {
+                ret = zeroed;
+                goto fail;
+            }
 
-    while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
-        if (ret < 0) {
-            goto fail;
+            bytes -= zeroed;
+            offset += zeroed;
         }
+    } else {
+        nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
-        nb_clusters -= ret;
-        offset += (ret * s->cluster_size);
+        while (nb_clusters > 0) {
+            ret = zero_single_l2(bs, offset, nb_clusters);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            nb_clusters -= ret;
+            offset += (ret * s->cluster_size);
+        }
     }
 
     ret = 0;
@@ -1552,7 +1906,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, j);
             int64_t offset = l2_entry & L2E_OFFSET_MASK, cluster_index;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
             bool preallocated = offset != 0;
@@ -1572,7 +1926,8 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                     }
                     /* Since we just increased the refcount, the COPIED flag may
                      * no longer be set. */
-                    l2_table[j] = cpu_to_be64(l2_entry & ~QCOW_OFLAG_COPIED);
+                    qcow2_set_l2_entry(s, l2_table, j,
+                                       l2_entry & ~QCOW_OFLAG_COPIED);
                     l2_dirty = true;
                 }
                 continue;
@@ -1585,7 +1940,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 if (!bs->backing_hd) {
                     /* not backed; therefore we can simply deallocate the
                      * cluster */
-                    l2_table[j] = 0;
+                    qcow2_set_l2_entry(s, l2_table, j, 0);
                     l2_dirty = true;
                     continue;
                 }
@@ -1617,7 +1972,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 goto fail;
             }
 
-            l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+            qcow2_set_l2_entry(s, l2_table, j, offset | QCOW_OFLAG_COPIED);
             l2_dirty = true;
 
             cluster_index = offset >> s->cluster_bits;
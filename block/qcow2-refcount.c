@@ -27,6 +27,7 @@
 #include "block/qcow2.h"
 #include "qemu/range.h"
 #include "qapi/qmp/types.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -705,6 +706,84 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Takes up to *nb_clusters clusters from the reservation pool. If offset is
+ * non-zero, the clusters must start at offset.
+ *
+ * The pool is refilled with a single refcount update whenever it runs empty,
+ * and the refcount blocks are flushed right away. Clusters taken from the pool
+ * can therefore be linked into L2 tables without ordering the L2 table writes
+ * after another refcount block flush. The caller holds s->lock, so a refill
+ * stalls other allocating requests, but only once per pool.
+ *
+ * Returns the offset of the first cluster and updates *nb_clusters to the
+ * number of clusters that were taken. Returns 0 if the pool is disabled or
+ * can't serve the request, and -errno on failure.
+ */
+int64_t qcow2_alloc_clusters_from_pool(BlockDriverState *bs, uint64_t offset,
+    unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_offset;
+    int n, ret;
+
+    if (s->alloc_pool_clusters == 0) {
+        return 0;
+    }
+
+    if (s->alloc_pool_count == 0) {
+        if (offset != 0) {
+            return 0;
+        }
+
+        cluster_offset = qcow2_alloc_clusters(bs,
+            (int64_t) s->alloc_pool_clusters << s->cluster_bits);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+
+        if (qcow2_need_accurate_refcounts(s)) {
+            ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+            if (ret < 0) {
+                qcow2_free_clusters(bs, cluster_offset,
+                    (int64_t) s->alloc_pool_clusters << s->cluster_bits,
+                    QCOW2_DISCARD_NEVER);
+                return ret;
+            }
+        }
+
+        trace_qcow2_alloc_pool_refill(bs, cluster_offset,
+                                      s->alloc_pool_clusters);
+        s->alloc_pool_offset = cluster_offset;
+        s->alloc_pool_count = s->alloc_pool_clusters;
+    } else if (offset != 0 && offset != s->alloc_pool_offset) {
+        return 0;
+    }
+
+    n = MIN(*nb_clusters, s->alloc_pool_count);
+    cluster_offset = s->alloc_pool_offset;
+
+    s->alloc_pool_offset += (uint64_t) n << s->cluster_bits;
+    s->alloc_pool_count -= n;
+    *nb_clusters = n;
+
+    return cluster_offset;
+}
+
+/* Returns the clusters left in the reservation pool to the free space */
+void qcow2_free_alloc_pool(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->alloc_pool_count > 0) {
+        qcow2_free_clusters(bs, s->alloc_pool_offset,
+            (int64_t) s->alloc_pool_count << s->cluster_bits,
+            QCOW2_DISCARD_NEVER);
+    }
+    s->alloc_pool_offset = 0;
+    s->alloc_pool_count = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -865,7 +944,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = qcow2_get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -924,7 +1003,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    qcow2_set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
             }
@@ -1038,6 +1117,51 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * Checks the subcluster bitmap of an extended L2 entry. Compressed clusters
+ * have no subclusters, subclusters of clusters without a host offset can't be
+ * allocated, a subcluster can't be both allocated and zero and the
+ * whole-cluster zero flag isn't used with extended L2 entries.
+ */
+static void check_subcluster_bitmap(BlockDriverState *bs,
+    BdrvCheckResult *res, int64_t l2_offset, int l2_index, uint64_t l2_entry,
+    uint64_t l2_bitmap)
+{
+    uint64_t alloc = l2_bitmap & QCOW_EXTL2_ALLOC_MASK;
+    uint64_t zero = l2_bitmap >> QCOW_EXTL2_ZERO_SHIFT;
+    const char *reason = NULL;
+
+    switch (qcow2_get_cluster_type(l2_entry)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        if (l2_bitmap) {
+            reason = "compressed cluster has a subcluster bitmap";
+        }
+        break;
+    case QCOW2_CLUSTER_ZERO:
+        reason = "zero flag is set";
+        break;
+    case QCOW2_CLUSTER_UNALLOCATED:
+        if (alloc) {
+            reason = "subclusters of an unallocated cluster are allocated";
+        }
+        break;
+    case QCOW2_CLUSTER_NORMAL:
+        if (alloc & zero) {
+            reason = "subclusters are both allocated and zero";
+        }
+        break;
+    default:
+        abort();
+    }
+
+    if (reason) {
+        fprintf(stderr, "ERROR l2_offset=%" PRIx64 " l2_index=%d: Invalid "
+                "extended L2 entry (%s); L2 entry corrupted.\n",
+                l2_offset, l2_index, reason);
+        res->corruptions++;
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -1051,20 +1175,26 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors;
+    int i, nb_csectors;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
+    l2_table = g_malloc(s->cluster_size);
 
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
+    if (bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size)
+        != s->cluster_size)
         goto fail;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = qcow2_get_l2_entry(s, l2_table, i);
+        l2_bitmap = qcow2_get_l2_bitmap(s, l2_table, i);
+
+        if (s->extended_l2) {
+            check_subcluster_bitmap(bs, res, l2_offset, i, l2_entry,
+                                    l2_bitmap);
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1269,8 +1399,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1279,7 +1408,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = qcow2_get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1297,7 +1426,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
+                        qcow2_set_l2_entry(s, l2_table, j, refcount == 1
                                     ? l2_entry |  QCOW_OFLAG_COPIED
                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
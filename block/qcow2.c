@@ -30,6 +30,7 @@
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
 #include "trace.h"
 
 /*
@@ -354,6 +355,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Number of bytes to reserve at once for cluster "
+                    "allocations (0 = disabled)",
+        },
         { /* end of list */ }
     },
 };
@@ -368,6 +375,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t alloc_pool_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -489,7 +497,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (s->incompatible_features & QCOW2_INCOMPAT_EXTL2) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->extended_l2 = true;
+        s->subcluster_bits = s->cluster_bits - QCOW_EXTL2_SUBCLUSTER_BITS;
+    } else {
+        s->extended_l2 = false;
+        s->subcluster_bits = s->cluster_bits;
+    }
+    s->subcluster_size = 1 << s->subcluster_bits;
+    s->subcluster_sectors = 1 << (s->subcluster_bits - BDRV_SECTOR_BITS);
+    /* L2 is always one cluster, extended entries take 16 bytes */
+    s->l2_bits = s->cluster_bits - 3 - s->extended_l2;
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -631,8 +655,19 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    alloc_pool_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_POOL_SIZE, 0);
+
     qemu_opts_del(opts);
 
+    if (alloc_pool_size > INT_MAX) {
+        error_setg(errp, "alloc-pool-size must be less than 2 GB");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->alloc_pool_clusters = size_to_clusters(s, alloc_pool_size);
+    s->alloc_pool_offset = 0;
+    s->alloc_pool_count = 0;
+
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         error_setg(errp, "Lazy refcounts require a qcow2 image with at least "
                    "qemu 1.1 compatibility level");
@@ -1037,6 +1072,9 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_free_alloc_pool(bs);
+
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1083,6 +1121,9 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
     options = qdict_new();
     qdict_put(options, QCOW2_OPT_LAZY_REFCOUNTS,
               qbool_from_int(s->use_lazy_refcounts));
+    qdict_put(options, QCOW2_OPT_ALLOC_POOL_SIZE,
+              qint_from_int((int64_t) s->alloc_pool_clusters <<
+                            s->cluster_bits));
 
     memset(s, 0, sizeof(BDRVQcowState));
     qcow2_open(bs, options, flags, NULL);
@@ -1227,6 +1268,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -1371,6 +1417,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                    "%dk", 1 << MIN_CLUSTER_BITS, 1 << (MAX_CLUSTER_BITS - 10));
         return -EINVAL;
     }
+    if ((flags & BLOCK_FLAG_EXTL2) && cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries require a cluster size of at "
+                   "least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+        return -EINVAL;
+    }
 
     /*
      * Open the image file and write a minimal qcow2 header.
@@ -1426,6 +1477,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header.incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not write qcow2 header");
@@ -1555,6 +1610,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTL2 : 0;
         }
         options++;
     }
@@ -1571,6 +1628,13 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
         return -EINVAL;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_EXTL2)) {
+        error_setg(errp, "Extended L2 entries only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        return -EINVAL;
+    }
+
     ret = qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, options, version, &local_err);
     if (error_is_set(&local_err)) {
@@ -1605,8 +1669,10 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcowState *s = bs->opaque;
 
-    /* Emulate misaligned zero writes */
-    if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
+    /* Emulate misaligned zero writes. With extended L2 entries, single
+     * subclusters can be zeroed. */
+    if (sector_num % s->subcluster_sectors ||
+        nb_sectors % s->subcluster_sectors) {
         return -ENOTSUP;
     }
 
@@ -1984,6 +2050,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
             }
         } else if (!strcmp(options[i].name, "lazy_refcounts")) {
             lazy_refcounts = options[i].value.n;
+        } else if (!strcmp(options[i].name, "extended_l2")) {
+            if (options[i].value.n != s->extended_l2) {
+                fprintf(stderr, "Changing the extended L2 entries flag is not "
+                        "supported.\n");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2001,6 +2073,11 @@ static int qcow2_amend_options(BlockDriverState *bs,
                 return ret;
             }
         } else {
+            if (s->extended_l2) {
+                fprintf(stderr, "Images with extended L2 entries cannot be "
+                        "downgraded to compat=0.10.\n");
+                return -ENOTSUP;
+            }
             ret = qcow2_downgrade(bs, new_version);
             if (ret < 0) {
                 return ret;
@@ -2099,6 +2176,12 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTL2,
+        .type = OPT_FLAG,
+        .help = "Split clusters into 32 subclusters with their own "
+                "allocation status",
+    },
     { NULL }
 };
 
@@ -46,6 +46,16 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Extended L2 entries carry a second 64-bit word with one "allocated" bit
+ * (bits 0-31) and one "reads as zero" bit (bits 32-63) per subcluster */
+#define QCOW_EXTL2_SUBCLUSTERS 32
+#define QCOW_EXTL2_SUBCLUSTER_BITS 5
+#define QCOW_EXTL2_ALLOC_MASK 0x00000000ffffffffULL
+#define QCOW_EXTL2_ZERO_SHIFT 32
+
+/* Subclusters must not be smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS (BDRV_SECTOR_BITS + QCOW_EXTL2_SUBCLUSTER_BITS)
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
@@ -63,6 +73,7 @@
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
+#define QCOW2_OPT_ALLOC_POOL_SIZE "alloc-pool-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -120,11 +131,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 2,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -164,6 +178,10 @@ typedef struct BDRVQcowState {
     int l2_bits;
     int l2_size;
     int l1_size;
+    bool extended_l2;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
     int l1_vm_state_index;
     int csize_shift;
     int csize_mask;
@@ -203,6 +221,13 @@ typedef struct BDRVQcowState {
 
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
+    /* Clusters that are reserved for data allocations. Their refcount is
+     * already 1 on disk, so linking them into an L2 table doesn't need to
+     * wait for a refcount block flush. */
+    int alloc_pool_clusters;
+    uint64_t alloc_pool_offset;
+    int alloc_pool_count;
+
     uint64_t incompatible_features;
     uint64_t compatible_features;
     uint64_t autoclear_features;
@@ -277,6 +302,19 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The clusters were taken from the reservation pool, so their refcounts
+     * are already stable on disk.
+     */
+    bool refcounts_stable;
+
+    /**
+     * The write goes to subclusters of an existing cluster that is already
+     * referenced by its L2 entry. Only the subcluster bitmap is updated when
+     * linking, and the cluster is not freed on failure.
+     */
+    bool keep_old_cluster;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -380,6 +418,80 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * L2 table accessors. With extended L2 entries, every entry takes two 64-bit
+ * words: the cluster descriptor followed by the subcluster bitmap. Without
+ * them, the bitmap is implicitly 0.
+ */
+static inline uint64_t qcow2_get_l2_entry(BDRVQcowState *s,
+                                          uint64_t *l2_table, int idx)
+{
+    return be64_to_cpu(l2_table[idx << s->extended_l2]);
+}
+
+static inline void qcow2_set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                      int idx, uint64_t entry)
+{
+    l2_table[idx << s->extended_l2] = cpu_to_be64(entry);
+}
+
+static inline uint64_t qcow2_get_l2_bitmap(BDRVQcowState *s,
+                                           uint64_t *l2_table, int idx)
+{
+    return s->extended_l2 ? be64_to_cpu(l2_table[(idx << 1) + 1]) : 0;
+}
+
+static inline void qcow2_set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                       int idx, uint64_t bitmap)
+{
+    if (s->extended_l2) {
+        l2_table[(idx << 1) + 1] = cpu_to_be64(bitmap);
+    }
+}
+
+/*
+ * Returns the "allocated" bits of all subclusters that intersect the byte
+ * range [start, end) inside of a single cluster. Shift the result by
+ * QCOW_EXTL2_ZERO_SHIFT to get the corresponding "reads as zero" bits.
+ */
+static inline uint64_t qcow2_subcluster_mask(BDRVQcowState *s,
+                                             uint64_t start, uint64_t end)
+{
+    int first = start >> s->subcluster_bits;
+    int last = (end - 1) >> s->subcluster_bits;
+
+    assert(start < end && end <= s->cluster_size);
+    return (QCOW_EXTL2_ALLOC_MASK >> (QCOW_EXTL2_SUBCLUSTERS - 1 - last))
+           & ~((1ULL << first) - 1);
+}
+
+/*
+ * Returns the type (QCOW2_CLUSTER_*) of subcluster sc in a cluster described
+ * by l2_entry and l2_bitmap. Compressed clusters don't have meaningful
+ * subcluster bits. The whole-cluster zero flag is reserved with extended L2
+ * entries; qcow2_get_cluster_offset() rejects entries that have it set, and
+ * they are reported as QCOW2_CLUSTER_ZERO here.
+ */
+static inline int qcow2_get_subcluster_type(BDRVQcowState *s,
+                                            uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc)
+{
+    int type = qcow2_get_cluster_type(l2_entry);
+
+    if (!s->extended_l2 || type == QCOW2_CLUSTER_COMPRESSED ||
+        type == QCOW2_CLUSTER_ZERO) {
+        return type;
+    }
+
+    if (l2_bitmap & (1ULL << (sc + QCOW_EXTL2_ZERO_SHIFT))) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if (type == QCOW2_CLUSTER_NORMAL && (l2_bitmap & (1ULL << sc))) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -418,6 +530,9 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
+int64_t qcow2_alloc_clusters_from_pool(BlockDriverState *bs, uint64_t offset,
+    unsigned int *nb_clusters);
+void qcow2_free_alloc_pool(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
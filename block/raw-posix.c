@@ -55,6 +55,7 @@
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
+#include <sys/syscall.h>
 #endif
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
@@ -142,6 +143,7 @@ typedef struct BDRVRawState {
     bool is_xfs : 1;
 #endif
     bool has_discard : 1;
+    bool has_copy_range : 1;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -167,6 +169,8 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    int aio_fildes2;    /* for QEMU_AIO_COPY_RANGE */
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -231,7 +235,8 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags,
+                       AioContext *aio_context)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -249,6 +254,7 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
             if (!*aio_ctx) {
                 goto error;
             }
+            laio_attach_aio_context(*aio_ctx, aio_context);
         }
         *use_aio = 1;
     } else {
@@ -315,7 +321,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags,
+                    bdrv_get_aio_context(bs))) {
         qemu_close(fd);
         ret = -errno;
         goto fail;
@@ -323,6 +330,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif
 
     s->has_discard = 1;
+    s->has_copy_range = 1;
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
         s->is_xfs = 1;
@@ -335,6 +343,29 @@ fail:
     return ret;
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+}
+
 static int raw_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -365,7 +396,8 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags,
+                    bdrv_get_aio_context(state->bs))) {
         return -1;
     }
 #endif
@@ -731,6 +763,107 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifdef __NR_copy_file_range
+/* Fills @bytes bytes at @offset of @fd with zeroes */
+static ssize_t copy_range_zero_fill(int fd, off_t offset, uint64_t bytes)
+{
+    size_t buf_len = MIN(bytes, 65536);
+    uint8_t *buf = g_malloc0(buf_len);
+    ssize_t ret = 0;
+
+    while (bytes > 0) {
+        ret = pwrite(fd, buf, MIN(bytes, buf_len), offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            break;
+        }
+        offset += ret;
+        bytes -= ret;
+        ret = 0;
+    }
+
+    g_free(buf);
+    return ret;
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+#ifdef __NR_copy_file_range
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+    ssize_t ret;
+
+    if (s->has_copy_range == 0) {
+        return -ENOTSUP;
+    }
+
+#ifdef FICLONERANGE
+    /* Share the extents if the filesystem supports reflinks */
+    {
+        struct file_clone_range range = {
+            .src_fd         = aiocb->aio_fildes,
+            .src_offset     = in_off,
+            .src_length     = bytes,
+            .dest_offset    = out_off,
+        };
+
+        if (ioctl(aiocb->aio_fildes2, FICLONERANGE, &range) == 0) {
+            return 0;
+        }
+    }
+#endif
+
+    /* -ENOTSUP promises the caller that nothing was written, so that it
+     * can fall back to reading and writing the data.  Once part of the
+     * range has been copied, failures are real I/O errors.
+     */
+    while (bytes > 0) {
+        ret = syscall(__NR_copy_file_range, aiocb->aio_fildes, &in_off,
+                      aiocb->aio_fildes2, &out_off, bytes, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            if (ret == -ENOSYS) {
+                s->has_copy_range = 0;
+            }
+            if (bytes < aiocb->aio_nbytes) {
+                return ret == -ENOTSUP || ret == -EOPNOTSUPP ? -EIO : ret;
+            }
+            if (ret == -ENOSYS || ret == -EXDEV || ret == -EINVAL ||
+                ret == -EOPNOTSUPP || ret == -EBADF) {
+                return -ENOTSUP;
+            }
+            return ret;
+        } else if (ret == 0) {
+            /* The rest of the range is beyond the end of the source, which
+             * reads as zeroes.  Anything else that copies nothing is left
+             * to the caller's fallback, or is an error once data was copied.
+             */
+            off_t in_len = lseek(aiocb->aio_fildes, 0, SEEK_END);
+
+            if (in_len >= 0 && in_off >= in_len) {
+                return copy_range_zero_fill(aiocb->aio_fildes2, out_off,
+                                            bytes);
+            }
+            return bytes < aiocb->aio_nbytes ? -EIO : -ENOTSUP;
+        }
+        bytes -= ret;
+    }
+    return 0;
+#else
+    s->has_copy_range = 0;
+    return -ENOTSUP;
+#endif
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -768,6 +901,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_DISCARD:
         ret = handle_aiocb_discard(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -860,6 +996,14 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        raw_detach_aio_context(bs);
+        laio_cleanup(s->aio_ctx);
+        s->aio_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1187,6 +1331,51 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_to(bs, sector_num, dst, dst_sector, nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *src,
+                                             int64_t src_sector,
+                                             BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+    int ret;
+
+    if (src->drv != bs->drv || !s->has_copy_range) {
+        return -ENOTSUP;
+    }
+    src_s = src->opaque;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    acb = g_slice_new(RawPosixAIOData);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_fildes2 = s->fd;
+    acb->aio_offset2 = sector_num * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = (uint64_t) nb_sectors * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_copy_range(acb, src_sector, sector_num, nb_sectors);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1207,9 +1396,13 @@ static BlockDriver bdrv_file = {
     .bdrv_reopen_commit = raw_reopen_commit,
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_create = raw_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1547,6 +1740,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1673,6 +1868,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1776,6 +1973,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1898,6 +2097,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -402,7 +402,8 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     }
     /* Note that acb->bh can be NULL in case where the aio was cancelled */
-    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         rbd_aio_bh_cb, acb);
     qemu_bh_schedule(acb->bh);
     g_free(rcb);
 }
@@ -546,8 +547,8 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
     fcntl(s->fds[0], F_SETFL, O_NONBLOCK);
     fcntl(s->fds[1], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], qemu_rbd_aio_event_reader,
-                            NULL, s);
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->fds[RBD_FD_READ],
+                       qemu_rbd_aio_event_reader, NULL, s);
 
 
     qemu_opts_del(opts);
@@ -565,13 +566,30 @@ failed_opts:
     return r;
 }
 
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_fd_handler(bdrv_get_aio_context(bs), s->fds[RBD_FD_READ],
+                       NULL, NULL, NULL);
+}
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_fd_handler(new_context, s->fds[RBD_FD_READ],
+                       qemu_rbd_aio_event_reader, NULL, s);
+}
+
 static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
+    qemu_rbd_detach_aio_context(bs);
     close(s->fds[0]);
     close(s->fds[1]);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL, NULL, NULL);
 
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
@@ -589,7 +607,7 @@ static void qemu_rbd_aio_cancel(BlockDriverAIOCB *blockacb)
     acb->cancelled = 1;
 
     while (acb->status == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 
     qemu_aio_release(acb);
@@ -1031,6 +1049,9 @@ static BlockDriver bdrv_rbd = {
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
     .bdrv_snapshot_list     = qemu_rbd_snap_list,
     .bdrv_snapshot_goto     = qemu_rbd_snap_rollback,
+
+    .bdrv_detach_aio_context = qemu_rbd_detach_aio_context,
+    .bdrv_attach_aio_context = qemu_rbd_attach_aio_context,
 };
 
 static void bdrv_rbd_init(void)
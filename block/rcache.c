@@ -0,0 +1,486 @@
+/*
+ * Block filter driver that keeps recently read data in memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Usage: rcache:<image>
+ *
+ * Reads are served in units of RCACHE_BLOCK_SIZE bytes.  Blocks are kept
+ * in a hash table and evicted in LRU order once "size" bytes are cached.
+ * Writes and discards go straight to the image and drop the blocks they
+ * touch.  When the guest reads sequentially, up to "readahead" bytes past
+ * the current position are fetched in the background.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/module.h"
+#include "trace.h"
+
+#define RCACHE_BLOCK_SIZE           (64 * 1024)
+#define RCACHE_BLOCK_SECTORS        (RCACHE_BLOCK_SIZE / BDRV_SECTOR_SIZE)
+#define RCACHE_DEFAULT_SIZE         (32 * 1024 * 1024)
+#define RCACHE_DEFAULT_READAHEAD    (256 * 1024)
+
+typedef struct RCacheEntry {
+    int64_t index;
+    uint8_t *data;
+    QTAILQ_ENTRY(RCacheEntry) lru;
+} RCacheEntry;
+
+typedef struct BDRVRCacheState {
+    GHashTable *entries;                /* block index -> RCacheEntry */
+    QTAILQ_HEAD(RCacheLRU, RCacheEntry) lru; /* most recently used first */
+    int nb_entries;
+    int max_entries;
+
+    int readahead_blocks;
+    int64_t next_sector;                /* sequential stream detection */
+    int64_t prefetch_end;               /* first block not prefetched yet */
+    int prefetch_in_flight;             /* running prefetch coroutines */
+
+    /* Incremented whenever the image is modified.  A read that started
+     * before a modification must not populate the cache.  */
+    uint64_t generation;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched;
+} BDRVRCacheState;
+
+/* Valid rcache filenames look like rcache:path/to/image */
+static void rcache_parse_filename(const char *filename, QDict *options,
+                                  Error **errp)
+{
+    if (!strstart(filename, "rcache:", &filename)) {
+        error_setg(errp, "File name string must start with 'rcache:'");
+        return;
+    }
+
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "rcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data",
+        },
+        {
+            .name = "readahead",
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of data to prefetch for sequential reads",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void rcache_free_entry(gpointer p)
+{
+    RCacheEntry *entry = p;
+
+    qemu_vfree(entry->data);
+    g_free(entry);
+}
+
+static int rcache_open(BlockDriverState *bs, QDict *options, int flags,
+                       Error **errp)
+{
+    BDRVRCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    uint64_t size, readahead;
+    int ret;
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, "size", RCACHE_DEFAULT_SIZE);
+    readahead = qemu_opt_get_size(opts, "readahead", RCACHE_DEFAULT_READAHEAD);
+    if (size < RCACHE_BLOCK_SIZE || size / RCACHE_BLOCK_SIZE > INT_MAX) {
+        error_setg(errp, "rcache size must be between %d and %" PRIu64,
+                   RCACHE_BLOCK_SIZE, (uint64_t)INT_MAX * RCACHE_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (readahead > size / 2) {
+        error_setg(errp, "rcache readahead must not exceed half the "
+                   "cache size");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->max_entries = size / RCACHE_BLOCK_SIZE;
+    s->readahead_blocks = DIV_ROUND_UP(readahead, RCACHE_BLOCK_SIZE);
+    s->next_sector = -1;
+
+    /* Open the image file */
+    filename = qemu_opt_get(opts, "x-image");
+    if (filename == NULL) {
+        error_setg(errp, "Could not retrieve image file name");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = bdrv_file_open(&bs->file, filename, NULL, flags, &local_err);
+    if (ret < 0) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        goto fail;
+    }
+
+    /* Only allocated once nothing can fail any more */
+    s->entries = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                       NULL, rcache_free_entry);
+    QTAILQ_INIT(&s->lru);
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void rcache_close(BlockDriverState *bs)
+{
+    BDRVRCacheState *s = bs->opaque;
+
+    /* Prefetch coroutines still use the cache and bs->file */
+    while (s->prefetch_in_flight > 0) {
+        qemu_aio_wait();
+    }
+
+    g_hash_table_destroy(s->entries);
+}
+
+static int64_t rcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static RCacheEntry *rcache_lookup(BDRVRCacheState *s, int64_t index)
+{
+    return g_hash_table_lookup(s->entries, &index);
+}
+
+static void rcache_remove(BDRVRCacheState *s, RCacheEntry *entry)
+{
+    QTAILQ_REMOVE(&s->lru, entry, lru);
+    s->nb_entries--;
+    g_hash_table_remove(s->entries, &entry->index);
+}
+
+static void rcache_insert(BlockDriverState *bs, int64_t index,
+                          const uint8_t *data)
+{
+    BDRVRCacheState *s = bs->opaque;
+    RCacheEntry *entry;
+
+    if (rcache_lookup(s, index)) {
+        return;
+    }
+
+    if (s->nb_entries >= s->max_entries) {
+        rcache_remove(s, QTAILQ_LAST(&s->lru, RCacheLRU));
+    }
+
+    entry = g_new(RCacheEntry, 1);
+    entry->index = index;
+    entry->data = qemu_blockalign(bs, RCACHE_BLOCK_SIZE);
+    memcpy(entry->data, data, RCACHE_BLOCK_SIZE);
+
+    g_hash_table_insert(s->entries, &entry->index, entry);
+    QTAILQ_INSERT_HEAD(&s->lru, entry, lru);
+    s->nb_entries++;
+}
+
+static void rcache_invalidate(BDRVRCacheState *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    int64_t first = sector_num / RCACHE_BLOCK_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / RCACHE_BLOCK_SECTORS;
+    RCacheEntry *entry, *next;
+    int64_t i;
+
+    s->generation++;
+    if (nb_sectors <= 0) {
+        return;
+    }
+
+    trace_rcache_invalidate(s, sector_num, nb_sectors);
+
+    /* Large discards are cheaper to handle by walking the cache */
+    if (last - first >= s->nb_entries) {
+        QTAILQ_FOREACH_SAFE(entry, &s->lru, lru, next) {
+            if (entry->index >= first && entry->index <= last) {
+                rcache_remove(s, entry);
+            }
+        }
+        return;
+    }
+
+    for (i = first; i <= last; i++) {
+        entry = rcache_lookup(s, i);
+        if (entry) {
+            rcache_remove(s, entry);
+        }
+    }
+}
+
+/* Read whole blocks [first, first + nb_blocks) from the image into buf.
+ * The part past the end of the image reads as zeroes.  */
+static int coroutine_fn rcache_read_blocks(BlockDriverState *bs,
+                                           int64_t first, int nb_blocks,
+                                           uint8_t *buf)
+{
+    int64_t sector_num = first * RCACHE_BLOCK_SECTORS;
+    int64_t end = MIN((first + nb_blocks) * RCACHE_BLOCK_SECTORS,
+                      bs->total_sectors);
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    memset(buf + (end - sector_num) * BDRV_SECTOR_SIZE, 0,
+           (size_t)nb_blocks * RCACHE_BLOCK_SIZE -
+           (end - sector_num) * BDRV_SECTOR_SIZE);
+
+    iov.iov_base = buf;
+    iov.iov_len = (end - sector_num) * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    return bdrv_co_readv(bs->file, sector_num, end - sector_num, &qiov);
+}
+
+typedef struct RCachePrefetch {
+    BlockDriverState *bs;
+    int64_t first;
+    int nb_blocks;
+} RCachePrefetch;
+
+static void coroutine_fn rcache_prefetch_entry(void *opaque)
+{
+    RCachePrefetch *pf = opaque;
+    BlockDriverState *bs = pf->bs;
+    BDRVRCacheState *s = bs->opaque;
+    uint64_t generation = s->generation;
+    uint8_t *buf;
+    int i, ret;
+
+    buf = qemu_blockalign(bs, (size_t)pf->nb_blocks * RCACHE_BLOCK_SIZE);
+    ret = rcache_read_blocks(bs, pf->first, pf->nb_blocks, buf);
+    if (ret == 0 && generation == s->generation) {
+        for (i = 0; i < pf->nb_blocks; i++) {
+            rcache_insert(bs, pf->first + i, buf + i * RCACHE_BLOCK_SIZE);
+        }
+        s->prefetched += pf->nb_blocks;
+    }
+
+    qemu_vfree(buf);
+    g_free(pf);
+    s->prefetch_in_flight--;
+}
+
+/* Keep up to readahead_blocks blocks past index in the cache.  Prefetch
+ * is issued in batches of half the read-ahead window.  */
+static void rcache_prefetch(BlockDriverState *bs, int64_t index)
+{
+    BDRVRCacheState *s = bs->opaque;
+    int64_t nb_blocks = DIV_ROUND_UP(bs->total_sectors, RCACHE_BLOCK_SECTORS);
+    int64_t end = MIN(index + s->readahead_blocks, nb_blocks);
+    RCachePrefetch *pf;
+    Coroutine *co;
+
+    if (s->prefetch_end < index ||
+        s->prefetch_end > index + s->readahead_blocks) {
+        s->prefetch_end = index;
+    }
+    if (s->prefetch_end - index >= s->readahead_blocks / 2 ||
+        s->prefetch_end >= end) {
+        return;
+    }
+
+    pf = g_new(RCachePrefetch, 1);
+    pf->bs = bs;
+    pf->first = s->prefetch_end;
+    pf->nb_blocks = end - s->prefetch_end;
+    s->prefetch_end = end;
+
+    trace_rcache_prefetch(s, pf->first, pf->nb_blocks);
+    s->prefetch_in_flight++;
+    co = qemu_coroutine_create(rcache_prefetch_entry);
+    qemu_coroutine_enter(co, pf);
+}
+
+static int coroutine_fn rcache_co_readv(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov)
+{
+    BDRVRCacheState *s = bs->opaque;
+    int64_t first = sector_num / RCACHE_BLOCK_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / RCACHE_BLOCK_SECTORS;
+    uint64_t generation = s->generation;
+    bool sequential = (sector_num == s->next_sector);
+    RCacheEntry *entry;
+    uint8_t *buf;
+    size_t offset, len;
+    int64_t i;
+    int ret;
+
+    s->next_sector = sector_num + nb_sectors;
+
+    for (i = first; i <= last; i++) {
+        if (!rcache_lookup(s, i)) {
+            break;
+        }
+    }
+
+    if (i > last) {
+        /* Every block is cached */
+        trace_rcache_read_hit(s, sector_num, nb_sectors);
+        s->hits++;
+        offset = 0;
+        for (i = first; i <= last; i++) {
+            int64_t start = MAX(sector_num, i * RCACHE_BLOCK_SECTORS);
+            int64_t end = MIN(sector_num + nb_sectors,
+                              (i + 1) * RCACHE_BLOCK_SECTORS);
+
+            entry = rcache_lookup(s, i);
+            len = (end - start) * BDRV_SECTOR_SIZE;
+            qemu_iovec_from_buf(qiov, offset,
+                                entry->data + (start - i * RCACHE_BLOCK_SECTORS)
+                                * BDRV_SECTOR_SIZE, len);
+            offset += len;
+
+            QTAILQ_REMOVE(&s->lru, entry, lru);
+            QTAILQ_INSERT_HEAD(&s->lru, entry, lru);
+        }
+        ret = 0;
+    } else {
+        trace_rcache_read_miss(s, sector_num, nb_sectors);
+        s->misses++;
+        buf = qemu_blockalign(bs, (last - first + 1) * RCACHE_BLOCK_SIZE);
+        ret = rcache_read_blocks(bs, first, last - first + 1, buf);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, 0,
+                                buf + (sector_num - first * RCACHE_BLOCK_SECTORS)
+                                * BDRV_SECTOR_SIZE,
+                                nb_sectors * BDRV_SECTOR_SIZE);
+            if (generation == s->generation) {
+                for (i = first; i <= last; i++) {
+                    rcache_insert(bs, i, buf + (i - first) * RCACHE_BLOCK_SIZE);
+                }
+            }
+        }
+        qemu_vfree(buf);
+    }
+
+    if (ret == 0 && sequential && s->readahead_blocks) {
+        rcache_prefetch(bs, last + 1);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn rcache_co_writev(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *qiov)
+{
+    BDRVRCacheState *s = bs->opaque;
+    int ret;
+
+    /* Invalidate before and after the write, so that reads that run in
+     * parallel with it cannot leave stale data behind.  */
+    rcache_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    rcache_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn rcache_co_write_zeroes(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    BDRVRCacheState *s = bs->opaque;
+    int ret;
+
+    rcache_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors);
+    rcache_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int coroutine_fn rcache_co_discard(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors)
+{
+    BDRVRCacheState *s = bs->opaque;
+    int ret;
+
+    rcache_invalidate(s, sector_num, nb_sectors);
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+    rcache_invalidate(s, sector_num, nb_sectors);
+
+    return ret;
+}
+
+static int64_t coroutine_fn rcache_co_get_block_status(BlockDriverState *bs,
+                                                       int64_t sector_num,
+                                                       int nb_sectors,
+                                                       int *pnum)
+{
+    return bdrv_get_block_status(bs->file, sector_num, nb_sectors, pnum);
+}
+
+static void rcache_query_stats(const BlockDriverState *bs,
+                               BlockDeviceStats *stats)
+{
+    BDRVRCacheState *s = bs->opaque;
+
+    stats->has_cache_hits = true;
+    stats->cache_hits = s->hits;
+    stats->has_cache_misses = true;
+    stats->cache_misses = s->misses;
+    stats->has_cache_prefetched_bytes = true;
+    stats->cache_prefetched_bytes = s->prefetched * RCACHE_BLOCK_SIZE;
+}
+
+static BlockDriver bdrv_rcache = {
+    .format_name            = "rcache",
+    .protocol_name          = "rcache",
+    .instance_size          = sizeof(BDRVRCacheState),
+
+    .bdrv_parse_filename    = rcache_parse_filename,
+    .bdrv_file_open         = rcache_open,
+    .bdrv_close             = rcache_close,
+    .bdrv_getlength         = rcache_getlength,
+
+    .bdrv_co_readv          = rcache_co_readv,
+    .bdrv_co_writev         = rcache_co_writev,
+    .bdrv_co_write_zeroes   = rcache_co_write_zeroes,
+    .bdrv_co_discard        = rcache_co_discard,
+    .bdrv_co_get_block_status = rcache_co_get_block_status,
+
+    .bdrv_query_stats       = rcache_query_stats,
+};
+
+static void bdrv_rcache_init(void)
+{
+    bdrv_register(&bdrv_rcache);
+}
+
+block_init(bdrv_rcache_init);
@@ -81,7 +81,25 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Enough for 16 GB of an extent with 512-entry grain tables and
+ * 64 KB grains.  The cache never grows beyond the number of tables in
+ * the extent.  */
+#define DEFAULT_L2_CACHE_SIZE (1024 * 1024)
+
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
+
+typedef struct VmdkL2CacheEntry {
+    uint32_t l2_offset;
+    uint32_t *table;
+    QTAILQ_ENTRY(VmdkL2CacheEntry) next;
+} VmdkL2CacheEntry;
+
+typedef struct VmdkL2Cache {
+    GHashTable *tables;         /* l2_offset -> VmdkL2CacheEntry */
+    QTAILQ_HEAD(VmdkL2CacheLRU, VmdkL2CacheEntry) lru; /* most recent first */
+    int nb_entries;
+    int max_entries;
+} VmdkL2Cache;
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -101,15 +119,15 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
-    uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    VmdkL2Cache *l2_cache;
 
     int64_t cluster_sectors;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
-    CoMutex lock;
+    /* Reads take the lock shared, writes exclusive */
+    CoRwlock lock;
+    uint64_t l2_cache_size;     /* in bytes, per extent */
     uint64_t desc_offset;
     bool cid_updated;
     uint32_t parent_cid;
@@ -213,7 +231,10 @@ static void vmdk_free_extents(BlockDriverState *bs)
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
         g_free(e->l1_table);
-        g_free(e->l2_cache);
+        if (e->l2_cache) {
+            g_hash_table_destroy(e->l2_cache->tables);
+            g_free(e->l2_cache);
+        }
         g_free(e->l1_backup_table);
         if (e->file != bs->file) {
             bdrv_unref(e->file);
@@ -438,10 +459,21 @@ static int vmdk_add_extent(BlockDriverState *bs,
     return 0;
 }
 
+static void vmdk_free_l2_cache_entry(gpointer p)
+{
+    VmdkL2CacheEntry *entry = p;
+
+    g_free(entry->table);
+    g_free(entry);
+}
+
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
 {
+    BDRVVmdkState *s = bs->opaque;
+    VmdkL2Cache *cache;
     int ret;
     int l1_size, i;
+    uint64_t max_entries;
 
     /* read the L1 table */
     l1_size = extent->l1_size * sizeof(uint32_t);
@@ -471,8 +503,16 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    /* There is no point in caching more tables than the extent has */
+    max_entries = s->l2_cache_size / (extent->l2_size * sizeof(uint32_t));
+    max_entries = MIN(MAX(max_entries, 1), extent->l1_size);
+
+    cache = g_new0(VmdkL2Cache, 1);
+    cache->tables = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, vmdk_free_l2_cache_entry);
+    QTAILQ_INIT(&cache->lru);
+    cache->max_entries = max_entries;
+    extent->l2_cache = cache;
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -810,11 +850,39 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the grain table cache of each extent",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create_nofail(&vmdk_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    s->l2_cache_size = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE,
+                                         DEFAULT_L2_CACHE_SIZE);
+    qemu_opts_del(opts);
 
     if (vmdk_open_sparse(bs, bs->file, flags) == 0) {
         s->desc_offset = 0x200;
@@ -830,7 +898,7 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
     s->parent_cid = vmdk_read_cid(bs, 1);
-    qemu_co_mutex_init(&s->lock);
+    qemu_co_rwlock_init(&s->lock);
 
     /* Disable migration when VMDK images are used */
     error_set(&s->migration_blocker,
@@ -917,6 +985,58 @@ static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data)
     return VMDK_OK;
 }
 
+/* Return the grain table at l2_offset, loading it into the cache if
+ * necessary.  Reads run in parallel, so the cache can change while the
+ * table is read from disk.  The returned table may be evicted as soon as
+ * the caller yields.  */
+static uint32_t *vmdk_get_l2_table(VmdkExtent *extent, uint32_t l2_offset)
+{
+    VmdkL2Cache *cache = extent->l2_cache;
+    VmdkL2CacheEntry *entry;
+    size_t table_size = extent->l2_size * sizeof(uint32_t);
+    uint32_t *table;
+
+    entry = g_hash_table_lookup(cache->tables, GUINT_TO_POINTER(l2_offset));
+    if (!entry) {
+        table = g_malloc(table_size);
+        if (bdrv_pread(extent->file, (int64_t)l2_offset * 512,
+                       table, table_size) != table_size) {
+            g_free(table);
+            return NULL;
+        }
+
+        /* Somebody else may have loaded the same table meanwhile */
+        entry = g_hash_table_lookup(cache->tables,
+                                    GUINT_TO_POINTER(l2_offset));
+        if (entry) {
+            g_free(table);
+        } else {
+            if (cache->nb_entries >= cache->max_entries) {
+                VmdkL2CacheEntry *victim;
+
+                victim = QTAILQ_LAST(&cache->lru, VmdkL2CacheLRU);
+                QTAILQ_REMOVE(&cache->lru, victim, next);
+                g_hash_table_remove(cache->tables,
+                                    GUINT_TO_POINTER(victim->l2_offset));
+                cache->nb_entries--;
+            }
+
+            entry = g_new(VmdkL2CacheEntry, 1);
+            entry->l2_offset = l2_offset;
+            entry->table = table;
+            g_hash_table_insert(cache->tables, GUINT_TO_POINTER(l2_offset),
+                                entry);
+            QTAILQ_INSERT_HEAD(&cache->lru, entry, next);
+            cache->nb_entries++;
+            return table;
+        }
+    }
+
+    QTAILQ_REMOVE(&cache->lru, entry, next);
+    QTAILQ_INSERT_HEAD(&cache->lru, entry, next);
+    return entry->table;
+}
+
 static int get_cluster_offset(BlockDriverState *bs,
                                     VmdkExtent *extent,
                                     VmdkMetaData *m_data,
@@ -925,8 +1045,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    uint32_t *l2_table;
     bool zeroed = false;
 
     if (m_data) {
@@ -946,40 +1065,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
-    if (bdrv_pread(
-                extent->file,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                extent->l2_size * sizeof(uint32_t)
-            ) != extent->l2_size * sizeof(uint32_t)) {
+    l2_table = vmdk_get_l2_table(extent, l2_offset);
+    if (!l2_table) {
         return VMDK_ERROR;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
@@ -1059,10 +1149,10 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
     if (!extent) {
         return 0;
     }
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_rdlock(&s->lock);
     ret = get_cluster_offset(bs, extent, NULL,
                             sector_num * 512, 0, &offset);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
 
     switch (ret) {
     case VMDK_ERROR:
@@ -1257,9 +1347,9 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_rdlock(&s->lock);
     ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     return ret;
 }
 
@@ -1383,9 +1473,9 @@ static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
     ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     return ret;
 }
 
@@ -1395,14 +1485,14 @@ static int coroutine_fn vmdk_co_write_zeroes(BlockDriverState *bs,
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
+    qemu_co_rwlock_wrlock(&s->lock);
     /* write zeroes could fail if sectors not aligned to cluster, test it with
      * dry_run == true before really updating image */
     ret = vmdk_write(bs, sector_num, NULL, nb_sectors, true, true);
     if (!ret) {
         ret = vmdk_write(bs, sector_num, NULL, nb_sectors, true, false);
     }
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_rwlock_unlock(&s->lock);
     return ret;
 }
 
@@ -1523,6 +1523,131 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     }
 }
 
+/* latency histograms and slow request log */
+/* An empty list yields no boundaries and disables the histogram */
+static int parse_histogram_boundaries(const char *name, intList *list,
+                                      uint64_t **boundaries,
+                                      int *nb_boundaries, Error **errp)
+{
+    uint64_t *b;
+    intList *l;
+    int n = 0;
+
+    for (l = list; l; l = l->next) {
+        n++;
+    }
+
+    b = n ? g_new(uint64_t, n) : NULL;
+    n = 0;
+    for (l = list; l; l = l->next) {
+        if (l->value <= 0 || (n > 0 && (uint64_t)l->value <= b[n - 1])) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                      "a strictly ascending list of positive integers");
+            g_free(b);
+            return -1;
+        }
+        b[n++] = l->value;
+    }
+
+    *boundaries = b;
+    *nb_boundaries = n;
+    return 0;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     intList *boundaries,
+                                     bool has_boundaries_read,
+                                     intList *boundaries_read,
+                                     bool has_boundaries_write,
+                                     intList *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     intList *boundaries_flush,
+                                     Error **errp)
+{
+    const char *names[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ]    = "boundaries-read",
+        [BDRV_ACCT_WRITE]   = "boundaries-write",
+        [BDRV_ACCT_FLUSH]   = "boundaries-flush",
+    };
+    intList *lists[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ]    = has_boundaries_read ? boundaries_read : NULL,
+        [BDRV_ACCT_WRITE]   = has_boundaries_write ? boundaries_write : NULL,
+        [BDRV_ACCT_FLUSH]   = has_boundaries_flush ? boundaries_flush : NULL,
+    };
+    bool has_list[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ]    = has_boundaries_read,
+        [BDRV_ACCT_WRITE]   = has_boundaries_write,
+        [BDRV_ACCT_FLUSH]   = has_boundaries_flush,
+    };
+    uint64_t *parsed[BDRV_MAX_IOTYPE] = { NULL };
+    int nb[BDRV_MAX_IOTYPE] = { 0 };
+    BlockDriverState *bs;
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    /* Validate everything before touching the histograms */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (!has_list[i] && has_boundaries) {
+            lists[i] = boundaries;
+            has_list[i] = true;
+            names[i] = "boundaries";
+        }
+        if (has_list[i]) {
+            if (parse_histogram_boundaries(names[i], lists[i], &parsed[i],
+                                           &nb[i], errp) < 0) {
+                goto out;
+            }
+        }
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, parsed[i], nb[i]);
+    }
+
+out:
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        g_free(parsed[i]);
+    }
+}
+
+#define SLOW_REQUEST_LOG_DEFAULT_SIZE   64
+#define SLOW_REQUEST_LOG_MAX_SIZE       4096
+
+void qmp_block_slow_request_log_set(const char *device, int64_t threshold_ns,
+                                    bool has_size, int64_t size,
+                                    Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_size) {
+        size = SLOW_REQUEST_LOG_DEFAULT_SIZE;
+    }
+    if (size < 1 || size > SLOW_REQUEST_LOG_MAX_SIZE) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "size",
+                  "a value between 1 and 4096");
+        return;
+    }
+    if (threshold_ns < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threshold-ns",
+                  "a non-negative value");
+        return;
+    }
+
+    bdrv_set_slow_request_log(bs, threshold_ns, size);
+}
+
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
@@ -1839,6 +1964,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_granularity, uint32_t granularity,
                       bool has_buf_size, int64_t buf_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1869,6 +1995,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -1879,6 +2008,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
+    if (max_in_flight < 0 || max_in_flight > INT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                  "a non-negative integer");
+        return;
+    }
+
     bs = bdrv_find(device);
     if (!bs) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, device);
@@ -1957,7 +2092,8 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
-    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+    mirror_start(bs, target_bs, speed, granularity, buf_size, max_in_flight,
+                 sync,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
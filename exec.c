@@ -992,6 +992,11 @@ static void *file_ram_alloc(RAMBlock *block,
         close(fd);
         return (NULL);
     }
+#ifdef MAP_POPULATE
+    if (flags & MAP_SHARED) {
+        block->flags |= RAM_SHARED_MASK;
+    }
+#endif
     block->fd = fd;
     return area;
 }
@@ -1324,6 +1329,25 @@ found:
     return block;
 }
 
+/* Returns the file descriptor backing the block that contains @addr, or -1
+ * if the block is not a shared mapping of a file.  Another process can map
+ * the descriptor to access guest RAM, as vhost-user backends do.
+ */
+int qemu_get_ram_fd(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->flags & RAM_SHARED_MASK ? block->fd : -1;
+}
+
+/* Returns the host address at which the block containing @addr starts. */
+void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->host;
+}
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
    With the exception of the softmmu code in this file, this should
    only be used for local memory (e.g. video ram) that the device owns,
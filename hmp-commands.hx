@@ -1638,6 +1638,10 @@ Show various information about the system state.
 show the version of QEMU
 @item info network
 show the various VLANs and the associated devices
+@item info netbatch
+show packet batching statistics of the net clients
+@item info netqueues
+show the packet queues of the net clients
 @item info chardev
 show the character devices
 @item info block
@@ -1648,6 +1652,8 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info iothreads
+show iothreads
 @item info history
 show the command line history
 @item info irq
@@ -282,6 +282,66 @@ void hmp_info_cpus(Monitor *mon, const QDict *qdict)
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
+{
+    IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
+    IOThreadInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: thread_id=%" PRId64,
+                       info->value->id, info->value->thread_id);
+        if (info->value->has_cpu_time_ns) {
+            monitor_printf(mon, " cpu_time_ns=%" PRId64,
+                           info->value->cpu_time_ns);
+        }
+        monitor_printf(mon, " polls=%" PRId64 " progress=%" PRId64 "\n",
+                       info->value->poll_count, info->value->poll_progress);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
+void hmp_info_netbatch(Monitor *mon, const QDict *qdict)
+{
+    NetBatchStatsList *stats_list = qmp_query_net_batch_stats(false, NULL,
+                                                              NULL);
+    NetBatchStatsList *stats;
+    intList *bin;
+
+    for (stats = stats_list; stats; stats = stats->next) {
+        if (!stats->value->batches) {
+            continue;
+        }
+        monitor_printf(mon, "%s: batches=%" PRId64 " packets=%" PRId64
+                       " histogram=", stats->value->name,
+                       stats->value->batches, stats->value->packets);
+        for (bin = stats->value->histogram; bin; bin = bin->next) {
+            monitor_printf(mon, "%" PRId64 "%s", bin->value,
+                           bin->next ? "," : "\n");
+        }
+    }
+
+    qapi_free_NetBatchStatsList(stats_list);
+}
+
+void hmp_info_netqueues(Monitor *mon, const QDict *qdict)
+{
+    NetQueueInfoList *info_list = qmp_query_net_queues(false, NULL, NULL);
+    NetQueueInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: depth=%" PRId64 "%s count=%" PRId64
+                       " max_count=%" PRId64 " drops=%" PRId64
+                       " buffer_size=%" PRId64 "\n",
+                       info->value->name, info->value->depth,
+                       info->value->lockless ? " (lockless)" : "",
+                       info->value->count, info->value->max_count,
+                       info->value->drops, info->value->buffer_size);
+    }
+
+    qapi_free_NetQueueInfoList(info_list);
+}
+
 void hmp_info_block(Monitor *mon, const QDict *qdict)
 {
     BlockInfoList *block_list, *info;
@@ -665,6 +725,17 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
                            list->value->len,
                            list->value->speed);
         }
+        if (list->value->has_throughput) {
+            monitor_printf(mon, "    Throughput %" PRId64 " bytes/s",
+                           list->value->throughput);
+            if (list->value->has_eta) {
+                monitor_printf(mon, ", converging in %" PRId64 " s",
+                               list->value->eta);
+            } else {
+                monitor_printf(mon, ", not converging");
+            }
+            monitor_printf(mon, "\n");
+        }
         list = list->next;
     }
 }
@@ -923,7 +994,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, &errp);
+                     false, 0, false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -1,5 +1,5 @@
 /*
- * Dedicated thread for virtio-blk I/O processing
+ * virtio-blk I/O processing in an IOThread
  *
  * Copyright 2012 IBM, Corp.
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
@@ -23,6 +23,8 @@
 #include "virtio-blk.h"
 #include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
+#include "qom/object.h"
+#include "sysemu/iothread.h"
 
 enum {
     SEG_MAX = 126,                  /* maximum number of I/O segments */
@@ -40,15 +42,28 @@ typedef struct {
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
 } VirtIOBlockRequest;
 
+/* Request submitted through the block layer.  These are used when the image
+ * is not a raw file opened with aio=native, for example qcow2.  The
+ * BlockDriverState is moved into the IOThread's AioContext while dataplane
+ * is running, so requests are submitted and completed in the IOThread.
+ */
+typedef struct VirtIOBlockBdrvRequest {
+    VirtIOBlockDataPlane *s;
+    uint32_t type;                  /* VIRTIO_BLK_T_IN/OUT/FLUSH */
+    QEMUIOVector qiov;              /* guest data buffers */
+    QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
+    unsigned int head;              /* vring descriptor index */
+    BlockAcctCookie acct;
+} VirtIOBlockBdrvRequest;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
     bool stopping;
-    QEMUBH *start_bh;
-    QemuThread thread;
 
     VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+    int fd;                         /* image file descriptor, or -1 when
+                                       requests go through the block layer */
 
     VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
@@ -59,6 +74,8 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
+    IOThread *iothread;
+    bool private_iothread;          /* created for this device only */
     AioContext *ctx;
     EventNotifier io_notifier;      /* Linux AIO completion */
     EventNotifier host_notifier;    /* doorbell */
@@ -151,6 +168,84 @@ static void do_get_id_cmd(VirtIOBlockDataPlane *s,
     complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
+static void complete_bdrv_request(void *opaque, int ret)
+{
+    VirtIOBlockBdrvRequest *req = opaque;
+    VirtIOBlockDataPlane *s = req->s;
+    struct virtio_blk_inhdr hdr;
+    int len;
+
+    bdrv_acct_done(s->blk->conf.bs, &req->acct);
+
+    if (likely(ret >= 0)) {
+        hdr.status = VIRTIO_BLK_S_OK;
+        len = req->type == VIRTIO_BLK_T_IN ? req->qiov.size : 0;
+    } else {
+        hdr.status = VIRTIO_BLK_S_IOERR;
+        len = 0;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+
+    qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+    qemu_iovec_destroy(req->inhdr);
+    g_slice_free(QEMUIOVector, req->inhdr);
+
+    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    notify_guest(s);
+    s->num_reqs--;
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockBdrvRequest, req);
+}
+
+static void submit_bdrv_request(VirtIOBlockDataPlane *s, uint32_t type,
+                                struct iovec *iov, unsigned int iov_cnt,
+                                int64_t sector_num, unsigned int head,
+                                QEMUIOVector *inhdr)
+{
+    BlockDriverState *bs = s->blk->conf.bs;
+    VirtIOBlockBdrvRequest *req = g_slice_new0(VirtIOBlockBdrvRequest);
+    int nb_sectors;
+
+    req->s = s;
+    req->type = type;
+    req->head = head;
+    req->inhdr = inhdr;
+
+    /* The iovecs array is reused for the next request, take a copy */
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0, iov_size(iov, iov_cnt));
+    nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    s->num_reqs++;
+
+    switch (type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        if (req->qiov.size % BDRV_SECTOR_SIZE) {
+            bdrv_acct_start(bs, &req->acct, 0, BDRV_ACCT_READ);
+            complete_bdrv_request(req, -EINVAL);
+            break;
+        }
+        if (type == VIRTIO_BLK_T_IN) {
+            bdrv_acct_start(bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
+            bdrv_aio_readv(bs, sector_num, &req->qiov, nb_sectors,
+                           complete_bdrv_request, req);
+        } else {
+            bdrv_acct_start(bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
+            bdrv_aio_writev(bs, sector_num, &req->qiov, nb_sectors,
+                            complete_bdrv_request, req);
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        bdrv_acct_start(bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+        bdrv_aio_flush(bs, complete_bdrv_request, req);
+        break;
+    default:
+        abort();
+    }
+}
+
 static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
@@ -161,6 +256,13 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
     struct iovec *bounce_iov = NULL;
     QEMUIOVector *read_qiov = NULL;
 
+    if (s->fd < 0) {
+        submit_bdrv_request(s, read ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT,
+                            iov, iov_cnt, offset / BDRV_SECTOR_SIZE,
+                            head, inhdr);
+        return 0;
+    }
+
     qemu_iovec_init_external(&qiov, iov, iov_cnt);
     if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
         void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
@@ -193,11 +295,10 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
     return 0;
 }
 
-static int process_request(IOQueue *ioq, struct iovec iov[],
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -242,6 +343,11 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
+        if (s->fd < 0) {
+            submit_bdrv_request(s, VIRTIO_BLK_T_FLUSH, NULL, 0, 0, head, inhdr);
+            return 0;
+        }
+
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
         if (qemu_fdatasync(s->fd) < 0) {
             complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
@@ -306,11 +412,17 @@ static void handle_notify(EventNotifier *e)
             trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
                                                         head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
                 vring_set_broken(&s->vring);
                 break;
             }
-            iov += out_num + in_num;
+
+            /* Linux AIO needs the iovecs until io_submit(), the block layer
+             * path copies them into its own request.
+             */
+            if (s->fd >= 0) {
+                iov += out_num + in_num;
+            }
         }
 
         if (likely(head == -EAGAIN)) { /* vring emptied */
@@ -329,6 +441,10 @@ static void handle_notify(EventNotifier *e)
         }
     }
 
+    if (s->fd < 0) {
+        return;
+    }
+
     num_queued = ioq_num_queued(&s->ioqueue);
     if (num_queued > 0) {
         s->num_reqs += num_queued;
@@ -355,36 +471,15 @@ static void handle_io(EventNotifier *e)
      * so check again.  There should now be enough resources to process more
      * requests.
      */
-    if (unlikely(vring_more_avail(&s->vring))) {
+    if (unlikely(!s->stopping && vring_more_avail(&s->vring))) {
         handle_notify(&s->host_notifier);
     }
 }
 
-static void *data_plane_thread(void *opaque)
-{
-    VirtIOBlockDataPlane *s = opaque;
-
-    while (!s->stopping || s->num_reqs > 0) {
-        aio_poll(s->ctx, true);
-    }
-    return NULL;
-}
-
-static void start_data_plane_bh(void *opaque)
-{
-    VirtIOBlockDataPlane *s = opaque;
-
-    qemu_bh_delete(s->start_bh);
-    s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
-}
-
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   VirtIOBlockDataPlane **dataplane)
 {
     VirtIOBlockDataPlane *s;
-    int fd;
 
     *dataplane = NULL;
 
@@ -411,18 +506,27 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
-        error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
-        return false;
-    }
-
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
-    s->fd = fd;
     s->blk = blk;
 
+    /* Raw images opened with aio=native are accessed directly with Linux AIO
+     * from the IOThread, everything else goes through the block layer.
+     */
+    s->fd = raw_get_aio_fd(blk->conf.bs);
+    if (s->fd < 0) {
+        s->fd = -1;
+    }
+
+    if (blk->iothread) {
+        s->iothread = blk->iothread;
+        object_ref(OBJECT(s->iothread));
+    } else {
+        /* Create per-device IOThread if none specified */
+        s->iothread = IOTHREAD(object_new(TYPE_IOTHREAD));
+        s->private_iothread = true;
+    }
+
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
 
@@ -438,6 +542,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     virtio_blk_data_plane_stop(s);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    object_unref(OBJECT(s->iothread));
     g_free(s);
 }
 
@@ -464,7 +569,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         return;
     }
 
-    s->ctx = aio_context_new();
+    s->ctx = iothread_get_aio_context(s->iothread);
 
     /* Set up guest notifier (irq) */
     if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
@@ -480,15 +585,23 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         exit(1);
     }
     s->host_notifier = *virtio_queue_get_host_notifier(vq);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    /* Block layer requests are submitted and completed in the IOThread */
+    bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
+
+    /* The IOThread may be running on behalf of other devices */
+    aio_context_acquire(s->ctx);
+
+    if (s->fd >= 0) {
+        /* Set up ioqueue */
+        ioq_init(&s->ioqueue, s->fd, REQ_MAX);
+        for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+            ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+        }
+        s->io_notifier = *ioq_get_notifier(&s->ioqueue);
+        aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
 
     s->starting = false;
     s->started = true;
@@ -497,9 +610,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     /* Kick right away to begin processing requests already in vring */
     event_notifier_set(virtio_queue_get_host_notifier(vq));
 
-    /* Spawn thread in BH so it inherits iothread cpusets */
-    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
-    qemu_bh_schedule(s->start_bh);
+    aio_context_release(s->ctx);
 }
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
@@ -512,22 +623,30 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
-        qemu_bh_delete(s->start_bh);
-        s->start_bh = NULL;
-    } else {
-        aio_notify(s->ctx);
-        qemu_thread_join(&s->thread);
+    /* Take the AioContext away from the IOThread, other devices sharing it
+     * stall until we are done here.
+     */
+    aio_context_acquire(s->ctx);
+
+    /* Stop processing new requests */
+    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+
+    /* Complete pending requests */
+    while (s->num_reqs > 0) {
+        aio_poll(s->ctx, true);
     }
 
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
-    ioq_cleanup(&s->ioqueue);
+    if (s->fd >= 0) {
+        aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
+        ioq_cleanup(&s->ioqueue);
+    }
 
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
-    k->set_host_notifier(qbus->parent, 0, false);
+    /* Hand the BlockDriverState back to the main loop */
+    bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
 
-    aio_context_unref(s->ctx);
+    aio_context_release(s->ctx);
+
+    k->set_host_notifier(qbus->parent, 0, false);
 
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, 1, false);
@@ -18,6 +18,7 @@
 #include "net/hub.h"
 #include "qapi/visitor.h"
 #include "sysemu/char.h"
+#include "sysemu/iothread.h"
 
 static void get_pointer(Object *obj, Visitor *v, Property *prop,
                         const char *(*print)(void *ptr),
@@ -115,6 +116,57 @@ PropertyInfo qdev_prop_drive = {
     .release = release_drive,
 };
 
+/* --- iothread --- */
+
+static int parse_iothread(DeviceState *dev, const char *str, void **ptr)
+{
+    IOThread *iothread;
+
+    iothread = iothread_find(str);
+    if (!iothread) {
+        return -ENOENT;
+    }
+    object_ref(OBJECT(iothread));
+    *ptr = iothread;
+    return 0;
+}
+
+static void release_iothread(Object *obj, const char *name, void *opaque)
+{
+    DeviceState *dev = DEVICE(obj);
+    Property *prop = opaque;
+    IOThread **ptr = qdev_get_prop_ptr(dev, prop);
+
+    if (*ptr) {
+        object_unref(OBJECT(*ptr));
+    }
+}
+
+static void get_iothread(Object *obj, Visitor *v, void *opaque,
+                         const char *name, Error **errp)
+{
+    DeviceState *dev = DEVICE(obj);
+    IOThread **ptr = qdev_get_prop_ptr(dev, opaque);
+    char *p;
+
+    p = *ptr ? iothread_get_id(*ptr) : g_strdup("");
+    visit_type_str(v, &p, name, errp);
+    g_free(p);
+}
+
+static void set_iothread(Object *obj, Visitor *v, void *opaque,
+                         const char *name, Error **errp)
+{
+    set_pointer(obj, v, opaque, parse_iothread, name, errp);
+}
+
+PropertyInfo qdev_prop_iothread = {
+    .name  = "iothread",
+    .get   = get_iothread,
+    .set   = set_iothread,
+    .release = release_iothread,
+};
+
 /* --- character device --- */
 
 static int parse_chr(DeviceState *dev, const char *str, void **ptr)
@@ -512,6 +512,7 @@ static void ahci_reset_port(AHCIState *s, int port)
             bdrv_aio_cancel(ncq_tfs->aiocb);
             ncq_tfs->aiocb = NULL;
         }
+        bdrv_acct_cancel(ide_state->bs, &ncq_tfs->acct);
 
         /* Maybe we just finished the request thanks to bdrv_aio_cancel() */
         if (!ncq_tfs->used) {
@@ -1989,6 +1989,7 @@ static void ide_reset(IDEState *s)
 
     if (s->pio_aiocb) {
         bdrv_aio_cancel(s->pio_aiocb);
+        bdrv_acct_cancel(s->bs, &s->acct);
         s->pio_aiocb = NULL;
     }
 
@@ -2041,6 +2042,8 @@ static void ide_reset(IDEState *s)
 
 void ide_bus_reset(IDEBus *bus)
 {
+    int i;
+
     bus->unit = 0;
     bus->cmd = 0;
     ide_reset(&bus->ifs[0]);
@@ -2055,6 +2058,11 @@ void ide_bus_reset(IDEBus *bus)
         bdrv_aio_cancel(bus->dma->aiocb);
         bus->dma->aiocb = NULL;
     }
+    for (i = 0; i < 2; i++) {
+        if (bus->ifs[i].bs) {
+            bdrv_acct_cancel(bus->ifs[i].bs, &bus->ifs[i].acct);
+        }
+    }
 
     /* reset dma provider too */
     bus->dma->ops->reset(bus->dma);
@@ -56,6 +56,7 @@
 #include "sysemu/dma.h"
 #include "qemu/timer.h"
 #include "net/net.h"
+#include "net/checksum.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "qemu/iov.h"
@@ -1922,32 +1923,10 @@ typedef struct ip_pseudo_header
 #define TCP_FLAG_FIN  0x01
 #define TCP_FLAG_PUSH 0x08
 
-/* produces ones' complement sum of data */
-static uint16_t ones_complement_sum(uint8_t *data, size_t len)
-{
-    uint32_t result = 0;
-
-    for (; len > 1; data+=2, len-=2)
-    {
-        result += *(uint16_t*)data;
-    }
-
-    /* add the remainder byte */
-    if (len)
-    {
-        uint8_t odd[2] = {*data, 0};
-        result += *(uint16_t*)odd;
-    }
-
-    while (result>>16)
-        result = (result & 0xffff) + (result >> 16);
-
-    return result;
-}
-
+/* returns the checksum in network byte order, ready to be stored */
 static uint16_t ip_checksum(void *data, size_t len)
 {
-    return ~ones_complement_sum((uint8_t*)data, len);
+    return cpu_to_be16(net_raw_checksum(data, len));
 }
 
 static int rtl8139_cplus_transmit_one(RTL8139State *s)
@@ -105,14 +105,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     NetClientState *nc = qemu_get_queue(n->nic);
     int queues = n->multiqueue ? n->max_queues : 1;
 
-    if (!nc->peer) {
-        return;
-    }
-    if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return;
     }
 
@@ -122,7 +115,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(nc->peer), vdev)) {
+        if (!vhost_net_query(get_vhost_net(nc->peer), vdev)) {
             return;
         }
         n->vhost_started = 1;
@@ -437,13 +430,10 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+    if (!get_vhost_net(nc->peer)) {
         return features;
     }
-    if (!tap_get_vhost_net(nc->peer)) {
-        return features;
-    }
-    return vhost_net_get_features(tap_get_vhost_net(nc->peer), features);
+    return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -507,13 +497,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+        if (!get_vhost_net(nc->peer)) {
             continue;
         }
-        if (!tap_get_vhost_net(nc->peer)) {
-            continue;
-        }
-        vhost_net_ack_features(tap_get_vhost_net(nc->peer), features);
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
 }
 
@@ -850,14 +837,20 @@ static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        uint8_t *buf, size_t size)
+static bool is_broken_dhclient_packet(struct virtio_net_hdr *hdr,
+                                      uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        uint8_t *buf, size_t size)
+{
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
@@ -1027,11 +1020,114 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (nc->receive_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
 
+/* Zero-copy receive: the backend reads the next packet, header included,
+ * straight into the buffers of one rx element.  This requires the header
+ * the backend produces to be the one the guest expects.
+ */
+static int virtio_net_rx_buffers_get(NetClientState *nc, struct iovec *iov,
+                                     int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elem = &q->rx_elem;
+
+    if (!n->has_vnet_hdr || n->host_hdr_len != n->guest_hdr_len ||
+        q->rx_elem_busy || !virtio_net_can_receive(nc)) {
+        return 0;
+    }
+
+    if (!virtio_net_has_buffers(q, n->guest_hdr_len) ||
+        !virtqueue_pop(q->rx_vq, elem)) {
+        return 0;
+    }
+
+    if (elem->in_num < 1 || elem->in_num > iovcnt ||
+        iov_size(elem->in_sg, elem->in_num) < n->guest_hdr_len) {
+        /* Let virtio_net_receive() deal with it */
+        virtqueue_unpop(q->rx_vq, elem);
+        return 0;
+    }
+
+    q->rx_elem_busy = true;
+    memcpy(iov, elem->in_sg, elem->in_num * sizeof(*iov));
+    return elem->in_num;
+}
+
+static ssize_t virtio_net_rx_buffers_put(NetClientState *nc, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elem = &q->rx_elem;
+    uint8_t head[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 36] = { 0 };
+    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)head;
+
+    assert(q->rx_elem_busy);
+    q->rx_elem_busy = false;
+
+    if (size < n->host_hdr_len) {
+        virtqueue_unpop(q->rx_vq, elem);
+        return 0;
+    }
+
+    /* The filter and the dhclient check only look at the first bytes */
+    iov_to_buf(elem->in_sg, elem->in_num, 0, head, sizeof(head));
+    if (!receive_filter(n, head, size)) {
+        virtqueue_unpop(q->rx_vq, elem);
+        return size;
+    }
+
+    if (is_broken_dhclient_packet(hdr, head + n->host_hdr_len,
+                                  size - n->host_hdr_len)) {
+        uint8_t *buf = g_malloc(size);
+
+        iov_to_buf(elem->in_sg, elem->in_num, 0, buf, size);
+        work_around_broken_dhclient((struct virtio_net_hdr *)buf,
+                                    buf + n->host_hdr_len,
+                                    size - n->host_hdr_len);
+        iov_from_buf(elem->in_sg, elem->in_num, 0, buf, size);
+        g_free(buf);
+    }
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        stw_p(&num_buffers, 1);
+        iov_from_buf(elem->in_sg, elem->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    virtqueue_fill(q->rx_vq, elem, size, 0);
+    virtqueue_flush(q->rx_vq, 1);
+    if (nc->receive_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+
+    return size;
+}
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1055,7 +1151,9 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement elem;
+    NetClientState *nc;
     int32_t num_packets = 0;
+    bool busy = false;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -1068,6 +1166,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    nc = qemu_get_subqueue(n->nic, queue_index);
+    qemu_net_batch_begin(nc);
     while (virtqueue_pop(q->tx_vq, &elem)) {
         ssize_t ret, len;
         unsigned int out_num = elem.out_num;
@@ -1098,25 +1198,31 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                      virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
-            return -EBUSY;
+            busy = true;
+            break;
         }
 
         len += ret;
 
         virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
-    return num_packets;
+    qemu_net_batch_end(nc);
+
+    /* One notification for everything completed in this flush */
+    if (num_packets) {
+        virtio_notify(vdev, q->tx_vq);
+    }
+    return busy ? -EBUSY : num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
@@ -1430,6 +1536,9 @@ static NetClientInfo net_virtio_info = {
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .receive_batch_end = virtio_net_receive_batch_end,
+    .rx_buffers_get = virtio_net_rx_buffers_get,
+    .rx_buffers_put = virtio_net_rx_buffers_put,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -1437,7 +1546,7 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
+    return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
@@ -1446,7 +1555,7 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
+    vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
 
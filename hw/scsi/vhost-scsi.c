@@ -32,7 +32,8 @@ static int vhost_scsi_set_endpoint(VHostSCSI *s)
 
     memset(&backend, 0, sizeof(backend));
     pstrcpy(backend.vhost_wwpn, sizeof(backend.vhost_wwpn), vs->conf.wwpn);
-    ret = ioctl(s->dev.control, VHOST_SCSI_SET_ENDPOINT, &backend);
+    ret = s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_SET_ENDPOINT,
+                                       &backend);
     if (ret < 0) {
         return -errno;
     }
@@ -46,7 +47,8 @@ static void vhost_scsi_clear_endpoint(VHostSCSI *s)
 
     memset(&backend, 0, sizeof(backend));
     pstrcpy(backend.vhost_wwpn, sizeof(backend.vhost_wwpn), vs->conf.wwpn);
-    ioctl(s->dev.control, VHOST_SCSI_CLEAR_ENDPOINT, &backend);
+    s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_CLEAR_ENDPOINT,
+                                 &backend);
 }
 
 static int vhost_scsi_start(VHostSCSI *s)
@@ -61,7 +63,8 @@ static int vhost_scsi_start(VHostSCSI *s)
         return -ENOSYS;
     }
 
-    ret = ioctl(s->dev.control, VHOST_SCSI_GET_ABI_VERSION, &abi_version);
+    ret = s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_GET_ABI_VERSION,
+                                       &abi_version);
     if (ret < 0) {
         return -errno;
     }
@@ -214,6 +217,13 @@ static int vhost_scsi_init(VirtIODevice *vdev)
             error_report("vhost-scsi: unable to parse vhostfd\n");
             return -EINVAL;
         }
+    } else {
+        vhostfd = open("/dev/vhost-scsi", O_RDWR);
+        if (vhostfd < 0) {
+            error_report("vhost-scsi: open vhost char device failed: %s\n",
+                         strerror(errno));
+            return -errno;
+        }
     }
 
     ret = virtio_scsi_common_init(vs);
@@ -225,7 +235,8 @@ static int vhost_scsi_init(VirtIODevice *vdev)
     s->dev.vqs = g_new(struct vhost_virtqueue, s->dev.nvqs);
     s->dev.vq_index = 0;
 
-    ret = vhost_dev_init(&s->dev, vhostfd, "/dev/vhost-scsi", true);
+    ret = vhost_dev_init(&s->dev, (void *)(uintptr_t)vhostfd,
+                         VHOST_BACKEND_TYPE_KERNEL, true);
     if (ret < 0) {
         error_report("vhost-scsi: vhost initialization failed: %s\n",
                 strerror(-ret));
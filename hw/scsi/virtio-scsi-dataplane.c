@@ -0,0 +1,370 @@
+/*
+ * Virtio SCSI dataplane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/* All command virtqueues are served by one IOThread, either the one given
+ * with the x-iothread property or one created for the device.  The IOThread
+ * takes kicks through ioeventfd, pops requests from the vring, executes them
+ * and pushes completed requests, notifying the guest through irqfd, without
+ * the global mutex.
+ *
+ * The SCSI layer state of the bus and the BlockDriverStates of its disks
+ * belong to the IOThread's AioContext while dataplane runs.  The main loop
+ * must acquire the AioContext before touching them, for example in the
+ * control virtqueue handler.  The event virtqueue stays in the main loop.
+ */
+
+#include "trace.h"
+#include "qemu/error-report.h"
+#include "qom/object.h"
+#include "hw/virtio/virtio-scsi.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/scsi/scsi.h"
+#include "block/block.h"
+#include "sysemu/iothread.h"
+
+typedef struct VirtIOSCSIVring {
+    VirtIOSCSIDataPlane *d;
+    unsigned int n;                 /* virtqueue index */
+    Vring vring;
+    EventNotifier host_notifier;    /* doorbell, assigned by value */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Requests popped from the vring that were not pushed back yet, only
+     * accessed from the IOThread or with the AioContext acquired.
+     */
+    unsigned int num_reqs;
+} VirtIOSCSIVring;
+
+struct VirtIOSCSIDataPlane {
+    VirtIOSCSI *s;
+    bool started;
+    bool stopping;
+
+    IOThread *iothread;
+    AioContext *ctx;
+
+    unsigned int num_vrings;
+    VirtIOSCSIVring *vrings;        /* one per command virtqueue */
+};
+
+/* Called by the IOThread when the guest kicks a command virtqueue */
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOSCSIVring *r = container_of(e, VirtIOSCSIVring, host_notifier);
+    VirtIOSCSIDataPlane *d = r->d;
+    VirtIOSCSI *s = d->s;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueue *vq = VIRTIO_SCSI_COMMON(s)->cmd_vqs[r->n - 2];
+    VirtIOSCSIReq *req;
+    int head;
+
+    event_notifier_test_and_clear(e);
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &r->vring);
+
+        for (;;) {
+            req = g_malloc(sizeof(*req));
+            head = vring_pop_elem(vdev, &r->vring, &req->elem);
+            if (head < 0) {
+                g_free(req);
+                break;
+            }
+
+            trace_virtio_scsi_data_plane_pop(d, r->n, head);
+            req->vring = r;
+            r->num_reqs++;
+
+            virtio_scsi_parse_req(s, vq, req);
+            virtio_scsi_handle_cmd_req(s, req);
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(vdev, &r->vring)) {
+                break;
+            }
+        } else { /* fatal error, the vring is now broken */
+            break;
+        }
+    }
+}
+
+/* Called by virtio_scsi_complete_req() for requests that were popped by
+ * dataplane, in the IOThread or with the AioContext acquired.  The SCSI
+ * layer is done with @req.
+ */
+void virtio_scsi_data_plane_complete_req(VirtIOSCSIReq *req)
+{
+    VirtIOSCSIVring *r = req->vring;
+    VirtIODevice *vdev = VIRTIO_DEVICE(r->d->s);
+
+    trace_virtio_scsi_data_plane_push(r->d, r->n, req->elem.index, req->len);
+    vring_push(&r->vring, req->elem.index, req->len);
+    r->num_reqs--;
+    g_free(req);
+
+    if (vring_should_notify(vdev, &r->vring)) {
+        event_notifier_set(r->guest_notifier);
+    }
+}
+
+/* Block jobs run in the main loop and cannot share a disk with dataplane */
+static bool dev_in_use(SCSIDevice *dev)
+{
+    return dev->conf.bs && bdrv_in_use(dev->conf.bs);
+}
+
+/* Hands the disk of @dev over to the IOThread */
+static void attach_dev(VirtIOSCSIDataPlane *d, SCSIDevice *dev)
+{
+    BlockDriverState *bs = dev->conf.bs;
+
+    if (bs) {
+        bdrv_set_in_use(bs, 1);
+        bdrv_set_aio_context(bs, d->ctx);
+        dev->dataplane_attached = true;
+    }
+}
+
+/* Hands the disk of @dev back to the main loop */
+static void detach_dev(VirtIOSCSIDataPlane *d, SCSIDevice *dev)
+{
+    BlockDriverState *bs = dev->conf.bs;
+
+    /* Disks hotplugged while in use were never attached.  An empty drive
+     * stays in the main loop's AioContext, but it was marked in use.
+     */
+    if (dev->dataplane_attached) {
+        bdrv_set_aio_context(bs, qemu_get_aio_context());
+        bdrv_set_in_use(bs, 0);
+        dev->dataplane_attached = false;
+    }
+}
+
+void virtio_scsi_data_plane_hotplug(VirtIOSCSIDataPlane *d, SCSIDevice *dev)
+{
+    if (!d->started) {
+        return;
+    }
+
+    if (dev_in_use(dev)) {
+        /* Fall back to the main loop until the block job is done */
+        virtio_scsi_data_plane_stop(d);
+        return;
+    }
+
+    attach_dev(d, dev);
+}
+
+void virtio_scsi_data_plane_hot_unplug(VirtIOSCSIDataPlane *d,
+                                       SCSIDevice *dev)
+{
+    if (!d->started) {
+        return;
+    }
+
+    aio_context_acquire(d->ctx);
+    detach_dev(d, dev);
+    aio_context_release(d->ctx);
+}
+
+void virtio_scsi_data_plane_acquire(VirtIOSCSIDataPlane *d)
+{
+    if (d->started) {
+        aio_context_acquire(d->ctx);
+    }
+}
+
+void virtio_scsi_data_plane_release(VirtIOSCSIDataPlane *d)
+{
+    if (d->started) {
+        aio_context_release(d->ctx);
+    }
+}
+
+bool virtio_scsi_data_plane_create(VirtIOSCSI *s,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    VirtIOSCSIDataPlane *d;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!vs->conf.data_plane) {
+        return true;
+    }
+
+    d = g_new0(VirtIOSCSIDataPlane, 1);
+    d->s = s;
+
+    if (vs->conf.iothread) {
+        d->iothread = vs->conf.iothread;
+        object_ref(OBJECT(d->iothread));
+    } else {
+        /* Create per-device IOThread if none specified */
+        d->iothread = IOTHREAD(object_new(TYPE_IOTHREAD));
+    }
+
+    d->num_vrings = vs->conf.num_queues;
+    d->vrings = g_new0(VirtIOSCSIVring, d->num_vrings);
+    for (i = 0; i < d->num_vrings; i++) {
+        VirtIOSCSIVring *r = &d->vrings[i];
+
+        r->d = d;
+        r->n = i + 2;               /* after the control and event queues */
+    }
+
+    *dataplane = d;
+    return true;
+}
+
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *d)
+{
+    if (!d) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(d);
+    object_unref(OBJECT(d->iothread));
+    g_free(d->vrings);
+    g_free(d);
+}
+
+bool virtio_scsi_data_plane_started(VirtIOSCSIDataPlane *d)
+{
+    return d->started;
+}
+
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *d)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(d->s);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(d->s);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    BusChild *kid;
+    unsigned int i;
+
+    if (d->started || d->stopping) {
+        return;
+    }
+
+    QTAILQ_FOREACH(kid, &d->s->bus.qbus.children, sibling) {
+        if (dev_in_use(DO_UPCAST(SCSIDevice, qdev, kid->child))) {
+            return;
+        }
+    }
+
+    for (i = 0; i < d->num_vrings; i++) {
+        if (!vring_setup(&d->vrings[i].vring, vdev, d->vrings[i].n)) {
+            while (i-- > 0) {
+                vring_teardown(&d->vrings[i].vring, vdev, d->vrings[i].n);
+            }
+            return;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2,
+                               true) != 0) {
+        fprintf(stderr, "virtio-scsi failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    /* SCSI requests are executed in the IOThread */
+    d->ctx = iothread_get_aio_context(d->iothread);
+    QTAILQ_FOREACH(kid, &d->s->bus.qbus.children, sibling) {
+        attach_dev(d, DO_UPCAST(SCSIDevice, qdev, kid->child));
+    }
+
+    /* The IOThread may be running on behalf of other devices */
+    aio_context_acquire(d->ctx);
+
+    for (i = 0; i < d->num_vrings; i++) {
+        VirtIOSCSIVring *r = &d->vrings[i];
+        VirtQueue *vq = virtio_get_queue(vdev, r->n);
+
+        r->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, r->n, true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+        r->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(d->ctx, &r->host_notifier, handle_notify);
+    }
+
+    d->started = true;
+    trace_virtio_scsi_data_plane_start(d);
+
+    /* Kick right away to begin processing requests already in the vrings */
+    for (i = 0; i < d->num_vrings; i++) {
+        event_notifier_set(&d->vrings[i].host_notifier);
+    }
+
+    aio_context_release(d->ctx);
+}
+
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *d)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(d->s);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(d->s);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    BusChild *kid;
+    unsigned int i;
+
+    if (!d->started || d->stopping) {
+        return;
+    }
+    d->stopping = true;
+    trace_virtio_scsi_data_plane_stop(d);
+
+    /* Take the AioContext away from the IOThread, other devices sharing it
+     * stall until we are done here.
+     */
+    aio_context_acquire(d->ctx);
+
+    /* Stop processing new requests */
+    for (i = 0; i < d->num_vrings; i++) {
+        aio_set_event_notifier(d->ctx, &d->vrings[i].host_notifier, NULL);
+    }
+
+    /* Complete pending requests */
+    for (i = 0; i < d->num_vrings; i++) {
+        while (d->vrings[i].num_reqs > 0) {
+            aio_poll(d->ctx, true);
+        }
+    }
+
+    /* Hand the disks back to the main loop */
+    QTAILQ_FOREACH(kid, &d->s->bus.qbus.children, sibling) {
+        detach_dev(d, DO_UPCAST(SCSIDevice, qdev, kid->child));
+    }
+
+    aio_context_release(d->ctx);
+
+    for (i = 0; i < d->num_vrings; i++) {
+        VirtIOSCSIVring *r = &d->vrings[i];
+
+        k->set_host_notifier(qbus->parent, r->n, false);
+        vring_teardown(&r->vring, vdev, r->n);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, false);
+
+    d->started = false;
+    d->stopping = false;
+}
@@ -18,27 +18,9 @@
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
-
-typedef struct VirtIOSCSIReq {
-    VirtIOSCSI *dev;
-    VirtQueue *vq;
-    VirtQueueElement elem;
-    QEMUSGList qsgl;
-    SCSIRequest *sreq;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdReq      *cmd;
-        VirtIOSCSICtrlTMFReq  *tmf;
-        VirtIOSCSICtrlANReq   *an;
-    } req;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdResp     *cmd;
-        VirtIOSCSICtrlTMFResp *tmf;
-        VirtIOSCSICtrlANResp  *an;
-        VirtIOSCSIEvent       *event;
-    } resp;
-} VirtIOSCSIReq;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "migration/migration.h"
+#endif
 
 static inline int virtio_scsi_get_lun(uint8_t *lun)
 {
@@ -61,12 +43,24 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+
+    req->len = req->qsgl.size + req->elem.in_sg[0].iov_len;
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (req->vring) {
+        /* Push to the vring the request was popped from */
+        virtio_scsi_data_plane_complete_req(req);
+        return;
+    }
+#endif
+
+    virtqueue_push(vq, &req->elem, req->len);
+    s->vq_inflight--;
     g_free(req);
     virtio_notify(vdev, vq);
 }
@@ -88,13 +82,18 @@ static void qemu_sgl_init_external(VirtIOSCSIReq *req, struct iovec *sg,
     }
 }
 
-static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
-                                  VirtIOSCSIReq *req)
+/* Fills in everything but the element and, for requests popped by dataplane,
+ * req->vring.  Dataplane calls this from its IOThread.
+ */
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req)
 {
     assert(req->elem.in_num);
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
+    if (!req->vring) {
+        s->vq_inflight++;
+    }
     if (req->elem.out_num) {
         req->req.buf = req->elem.out_sg[0].iov_base;
     }
@@ -115,6 +114,7 @@ static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
     req = g_malloc(sizeof(*req));
+    req->vring = NULL;
     if (!virtqueue_pop(vq, &req->elem)) {
         g_free(req);
         return NULL;
@@ -144,6 +144,7 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     uint32_t n;
 
     req = g_malloc(sizeof(*req));
+    req->vring = NULL;
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
     qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
@@ -285,7 +286,18 @@ static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
                 in_size < sizeof(VirtIOSCSICtrlTMFResp)) {
                 virtio_scsi_bad_req();
             }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+            /* The SCSI requests may be owned by the dataplane IOThread */
+            if (s->dataplane) {
+                virtio_scsi_data_plane_acquire(s->dataplane);
+                virtio_scsi_do_tmf(s, req);
+                virtio_scsi_data_plane_release(s->dataplane);
+            } else {
+                virtio_scsi_do_tmf(s, req);
+            }
+#else
             virtio_scsi_do_tmf(s, req);
+#endif
 
         } else if (req->req.tmf->type == VIRTIO_SCSI_T_AN_QUERY ||
                    req->req.tmf->type == VIRTIO_SCSI_T_AN_SUBSCRIBE) {
@@ -347,61 +359,82 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    /* use non-QOM casts in the data path */
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSICommon *vs = &s->parent_obj;
-
-    VirtIOSCSIReq *req;
+    SCSIDevice *d;
+    int out_size, in_size;
     int n;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+            return;
         }
+    }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
+    }
+}
+
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* use non-QOM casts in the data path */
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Hand the command queues over to dataplane once the requests popped
+     * here, or loaded by migration, have completed.
+     */
+    if (s->dataplane && s->vq_inflight == 0) {
+        virtio_scsi_data_plane_start(s->dataplane);
+        if (virtio_scsi_data_plane_started(s->dataplane)) {
+            /* Without KVM the ioeventfd is not wired up and guest kicks
+             * still end up here, pass them on to the IOThread.
+             */
+            event_notifier_set(virtio_queue_get_host_notifier(vq));
+            return;
         }
     }
+#endif
+
+    while ((req = virtio_scsi_pop_req(s, vq))) {
+        virtio_scsi_handle_cmd_req(s, req);
+    }
 }
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
@@ -449,6 +482,12 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(vdev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     s->resetting++;
     qbus_reset_all(&s->bus.qbus);
     s->resetting--;
@@ -458,6 +497,18 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     s->events_dropped = false;
 }
 
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSI *s = VIRTIO_SCSI(vdev);
+
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+}
+
 /* The device does not have anything to save beyond the virtio data.
  * Request data is saved with callbacks from SCSI devices.
  */
@@ -483,7 +534,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                                    uint32_t event, uint32_t reason)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
-    VirtIOSCSIReq *req = virtio_scsi_pop_req(s, vs->event_vq);
+    VirtIOSCSIReq *req;
     VirtIOSCSIEvent *evt;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     int in_size;
@@ -492,6 +543,8 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         return;
     }
 
+    req = virtio_scsi_pop_req(s, vs->event_vq);
+
     if (!req) {
         s->events_dropped = true;
         return;
@@ -556,6 +609,12 @@ static void virtio_scsi_hotplug(SCSIBus *bus, SCSIDevice *dev)
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_hotplug(s->dataplane, dev);
+    }
+#endif
+
     if ((vdev->guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_RESCAN);
@@ -571,6 +630,12 @@ static void virtio_scsi_hot_unplug(SCSIBus *bus, SCSIDevice *dev)
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_REMOVED);
     }
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_hot_unplug(s->dataplane, dev);
+    }
+#endif
 }
 
 static struct SCSIBusInfo virtio_scsi_scsi_info = {
@@ -613,6 +678,33 @@ int virtio_scsi_common_init(VirtIOSCSICommon *s)
     return 0;
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+/* Disable dataplane during live migration, in-flight requests are saved
+ * through the VirtQueue.
+ */
+static void virtio_scsi_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIOSCSI *s = container_of(notifier, VirtIOSCSI,
+                                 migration_state_notifier);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        if (!s->dataplane) {
+            return;
+        }
+        virtio_scsi_data_plane_destroy(s->dataplane);
+        s->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (s->dataplane) {
+            return;
+        }
+        bdrv_drain_all(); /* complete in-flight non-dataplane requests */
+        virtio_scsi_data_plane_create(s, &s->dataplane);
+    }
+}
+#endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
+
 static int virtio_scsi_device_init(VirtIODevice *vdev)
 {
     DeviceState *qdev = DEVICE(vdev);
@@ -638,6 +730,15 @@ static int virtio_scsi_device_init(VirtIODevice *vdev)
         }
     }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_scsi_data_plane_create(s, &s->dataplane)) {
+        virtio_scsi_common_exit(vs);
+        return -1;
+    }
+    s->migration_state_notifier.notify = virtio_scsi_migration_state_changed;
+    add_migration_state_change_notifier(&s->migration_state_notifier);
+#endif
+
     register_savevm(qdev, "virtio-scsi", virtio_scsi_id++, 1,
                     virtio_scsi_save, virtio_scsi_load, s);
 
@@ -658,6 +759,11 @@ static int virtio_scsi_device_exit(DeviceState *qdev)
     VirtIOSCSI *s = VIRTIO_SCSI(qdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(qdev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    remove_migration_state_change_notifier(&s->migration_state_notifier);
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(qdev, "virtio-scsi", s);
     return virtio_scsi_common_exit(vs);
 }
@@ -687,6 +793,7 @@ static void virtio_scsi_class_init(ObjectClass *klass, void *data)
     vdc->set_config = virtio_scsi_set_config;
     vdc->get_features = virtio_scsi_get_features;
     vdc->reset = virtio_scsi_reset;
+    vdc->set_status = virtio_scsi_set_status;
 }
 
 static const TypeInfo virtio_scsi_common_info = {
@@ -113,6 +113,7 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(Vring *vring,
                         struct iovec iov[], struct iovec *iov_end,
+                        hwaddr addr[],
                         unsigned int *out_num, unsigned int *in_num,
                         struct vring_desc *indirect)
 {
@@ -186,6 +187,9 @@ static int get_indirect(Vring *vring,
         }
         iov->iov_len = desc.len;
         iov++;
+        if (addr) {
+            addr[*out_num + *in_num] = desc.addr;
+        }
 
         /* If this is an input descriptor, increment that count. */
         if (desc.flags & VRING_DESC_F_WRITE) {
@@ -217,9 +221,10 @@ static int get_indirect(Vring *vring,
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              struct iovec iov[], struct iovec *iov_end,
-              unsigned int *out_num, unsigned int *in_num)
+static int vring_pop_internal(VirtIODevice *vdev, Vring *vring,
+                              struct iovec iov[], struct iovec *iov_end,
+                              hwaddr addr[],
+                              unsigned int *out_num, unsigned int *in_num)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
@@ -287,7 +292,8 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            int ret = get_indirect(vring, iov, iov_end, out_num, in_num, &desc);
+            int ret = get_indirect(vring, iov, iov_end, addr,
+                                   out_num, in_num, &desc);
             if (ret < 0) {
                 return ret;
             }
@@ -313,6 +319,9 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         }
         iov->iov_len  = desc.len;
         iov++;
+        if (addr) {
+            addr[*out_num + *in_num] = desc.addr;
+        }
 
         if (desc.flags & VRING_DESC_F_WRITE) {
             /* If this is an input descriptor,
@@ -336,6 +345,41 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
     return head;
 }
 
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], struct iovec *iov_end,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    return vring_pop_internal(vdev, vring, iov, iov_end, NULL,
+                              out_num, in_num);
+}
+
+/* Like vring_pop(), but fills in a VirtQueueElement including the guest
+ * physical address of each buffer, for devices that pass QEMUSGLists on
+ * to other layers.  The element can be returned with vring_push().
+ */
+int vring_pop_elem(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem)
+{
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    unsigned int out_num, in_num;
+    int head;
+
+    head = vring_pop_internal(vdev, vring, iov, iov + VIRTQUEUE_MAX_SIZE, addr,
+                              &out_num, &in_num);
+    if (head < 0) {
+        return head;
+    }
+
+    elem->index = head;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    memcpy(elem->out_sg, iov, out_num * sizeof(iov[0]));
+    memcpy(elem->out_addr, addr, out_num * sizeof(addr[0]));
+    memcpy(elem->in_sg, iov + out_num, in_num * sizeof(iov[0]));
+    memcpy(elem->in_addr, addr + out_num, in_num * sizeof(addr[0]));
+    return head;
+}
+
 /* After we've used one of their buffers, we tell them about it.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
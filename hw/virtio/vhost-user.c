@@ -0,0 +1,350 @@
+/*
+ * vhost-user
+ *
+ * Forwards vhost requests to a backend process over a UNIX socket.  Guest
+ * RAM and the kick/call eventfds are passed to the backend as file
+ * descriptors, so that it can run the virtqueues without QEMU's help.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-backend.h"
+#include "hw/virtio/vhost-user.h"
+#include "exec/cpu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vhost.h>
+
+static const unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = 0; idx < VHOST_USER_MAX; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_fd(struct vhost_dev *dev)
+{
+    return (uintptr_t) dev->opaque;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    int fd = vhost_user_fd(dev);
+    uint8_t *p = (uint8_t *) msg;
+    size_t size = VHOST_USER_HDR_SIZE;
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < size) {
+        r = read(fd, p + done, size - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            error_report("vhost-user: failed to read message header");
+            return -1;
+        }
+        done += r;
+
+        if (done == VHOST_USER_HDR_SIZE) {
+            if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+                error_report("vhost-user: unexpected reply flags 0x%x",
+                             msg->flags);
+                return -1;
+            }
+            if (msg->size > sizeof(msg->payload)) {
+                error_report("vhost-user: reply payload of %u bytes is too "
+                             "large", msg->size);
+                return -1;
+            }
+            size += msg->size;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    int fd = vhost_user_fd(dev);
+    size_t fd_size = fd_num * sizeof(int);
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE + msg->size,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    assert(fd_num <= VHOST_MEMORY_MAX_NREGIONS);
+
+    if (fd_num) {
+        memset(control, 0, sizeof(control));
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_size);
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_size);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_size);
+    }
+
+    do {
+        r = sendmsg(fd, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        error_report("vhost-user: failed to send request %u: %s",
+                     msg->request, strerror(errno));
+        return -1;
+    }
+    if (r != iov.iov_len) {
+        error_report("vhost-user: short write sending request %u",
+                     msg->request);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Fills in the memory table, passing one descriptor per region.  Regions
+ * that are not backed by a shared file mapping (small ROMs, for example)
+ * cannot be reached by the backend and are left out.
+ */
+static int vhost_user_set_mem_table(struct vhost_dev *dev,
+                                    struct vhost_memory *mem,
+                                    VhostUserMsg *msg, int *fds)
+{
+    int i, fd_num = 0;
+
+    for (i = 0; i < mem->nregions; i++) {
+        struct vhost_memory_region *reg = mem->regions + i;
+        VhostUserMemoryRegion *ureg;
+        ram_addr_t ram_addr;
+        int fd;
+
+        if (!qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                     &ram_addr)) {
+            continue;
+        }
+        fd = qemu_get_ram_fd(ram_addr);
+        if (fd < 0) {
+            continue;
+        }
+        if (fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user: too many memory regions");
+            errno = E2BIG;
+            return -1;
+        }
+
+        ureg = &msg->payload.memory.regions[fd_num];
+        ureg->guest_phys_addr = reg->guest_phys_addr;
+        ureg->memory_size = reg->memory_size;
+        ureg->userspace_addr = reg->userspace_addr;
+        ureg->mmap_offset = reg->userspace_addr -
+            (uintptr_t)qemu_get_ram_block_host_ptr(ram_addr);
+        fds[fd_num++] = fd;
+    }
+
+    if (mem->nregions && !fd_num) {
+        error_report("vhost-user requires shared guest memory, "
+                     "use -mem-path with -mem-prealloc");
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg->payload.memory.nregions = fd_num;
+    msg->size = offsetof(VhostUserMemory, regions) +
+                fd_num * sizeof(VhostUserMemoryRegion);
+    return fd_num;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file;
+    int need_reply = 0;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    size_t fd_num = 0;
+    int r;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    if (msg_request == VHOST_USER_NONE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        need_reply = 1;
+        break;
+
+    case VHOST_SET_FEATURES:
+    case VHOST_SET_LOG_BASE:
+        msg.payload.u64 = *((__u64 *) arg);
+        msg.size = sizeof(msg.payload.u64);
+        break;
+
+    case VHOST_SET_OWNER:
+    case VHOST_RESET_OWNER:
+        break;
+
+    case VHOST_SET_MEM_TABLE:
+        r = vhost_user_set_mem_table(dev, arg, &msg, fds);
+        if (r < 0) {
+            return -1;
+        }
+        fd_num = r;
+        break;
+
+    case VHOST_SET_LOG_FD:
+        fds[fd_num++] = *((int *) arg);
+        break;
+
+    case VHOST_SET_VRING_NUM:
+    case VHOST_SET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.payload.state);
+        break;
+
+    case VHOST_GET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.payload.state);
+        need_reply = 1;
+        break;
+
+    case VHOST_SET_VRING_ADDR:
+        memcpy(&msg.payload.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(msg.payload.addr);
+        break;
+
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+    case VHOST_SET_VRING_ERR:
+        file = arg;
+        msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        if (vhost_user_read(dev, &msg) < 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        if (msg_request != msg.request) {
+            error_report("vhost-user: received reply %u, expected %u",
+                         msg.request, msg_request);
+            errno = EPROTO;
+            return -1;
+        }
+
+        switch (msg_request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.payload.u64)) {
+                error_report("vhost-user: received bad reply size");
+                errno = EPROTO;
+                return -1;
+            }
+            *((__u64 *) arg) = msg.payload.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(msg.payload.state)) {
+                error_report("vhost-user: received bad reply size");
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(arg, &msg.payload.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = opaque;
+
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = (void *)(uintptr_t)-1;
+
+    return 0;
+}
+
+const VhostOps vhost_user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+};
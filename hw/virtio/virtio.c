@@ -14,10 +14,12 @@
 #include <inttypes.h>
 
 #include "trace.h"
+#include "exec/address-spaces.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -63,9 +65,33 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* A contiguous range of guest RAM and its host mapping */
+typedef struct VRingMemCache
+{
+    unsigned int gen;
+    hwaddr addr;
+    hwaddr len;
+    uint8_t *host;
+    MemoryRegion *mr;
+    bool writable;
+} VRingMemCache;
+
 struct VirtQueue
 {
     VRing vring;
+
+    /* Host mappings of the rings, valid while ring_gen == vring_map_gen.
+     * A NULL pointer means that the ring must be accessed through the
+     * memory API, for example because it is not in RAM.
+     */
+    unsigned int ring_gen;
+    VRingDesc *desc_host;
+    VRingAvail *avail_host;
+    VRingUsed *used_host;
+
+    /* Guest RAM range that the last descriptor buffer was mapped from */
+    VRingMemCache buf_cache;
+
     hwaddr pa;
     uint16_t last_avail_idx;
     /* Last used index value we have signalled on */
@@ -88,49 +114,193 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
-/* virt queue functions */
-static void virtqueue_init(VirtQueue *vq)
+/*
+ * Host mappings of guest RAM are cached per virtqueue and revalidated
+ * whenever the memory map changes, which bumps vring_map_gen.  The used ring
+ * is only written through its mapping while dirty logging is off, because
+ * those writes bypass the dirty bitmap.
+ */
+static unsigned int vring_map_gen = 1;
+static bool vring_map_dirty_log;
+
+static void vring_map_invalidate(MemoryListener *listener)
 {
-    hwaddr pa = vq->pa;
+    vring_map_gen++;
+    if (vring_map_gen == 0) {
+        vring_map_gen++;
+    }
+}
 
-    vq->vring.desc = pa;
-    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
-    vq->vring.used = vring_align(vq->vring.avail +
-                                 offsetof(VRingAvail, ring[vq->vring.num]),
-                                 vq->vring.align);
+static void vring_map_log_global_start(MemoryListener *listener)
+{
+    vring_map_dirty_log = true;
+    vring_map_invalidate(listener);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static void vring_map_log_global_stop(MemoryListener *listener)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    vring_map_dirty_log = false;
+    vring_map_invalidate(listener);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static MemoryListener vring_map_listener = {
+    .commit = vring_map_invalidate,
+    .log_global_start = vring_map_log_global_start,
+    .log_global_stop = vring_map_log_global_stop,
+    .priority = 10,
+};
+
+static bool vring_map_listener_registered;
+
+/* Returns a host pointer for [addr, addr + size) if that range is contiguous
+ * guest RAM, NULL otherwise.
+ */
+static void *vring_map_ram(hwaddr addr, hwaddr size, bool is_write)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    MemoryRegion *mr;
+    hwaddr xlat, len = size;
+
+    mr = address_space_translate(&address_space_memory, addr, &xlat, &len,
+                                 is_write);
+    if (len < size || !memory_region_is_ram(mr) ||
+        memory_region_is_logging(mr) || (is_write && mr->readonly)) {
+        return NULL;
+    }
+    return (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static void virtqueue_map_rings(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    unsigned int num = vq->vring.num;
+
+    vq->ring_gen = vring_map_gen;
+    vq->desc_host = NULL;
+    vq->avail_host = NULL;
+    vq->used_host = NULL;
+
+    if (!vq->vring.desc || xen_enabled()) {
+        return;
+    }
+
+    /* The avail and used rings are followed by the used_event and
+     * avail_event fields respectively.
+     */
+    vq->desc_host = vring_map_ram(vq->vring.desc, num * sizeof(VRingDesc),
+                                  false);
+    vq->avail_host = vring_map_ram(vq->vring.avail,
+                                   offsetof(VRingAvail, ring[num]) +
+                                   sizeof(uint16_t), false);
+    if (!vring_map_dirty_log) {
+        vq->used_host = vring_map_ram(vq->vring.used,
+                                      offsetof(VRingUsed, ring[num]) +
+                                      sizeof(uint16_t), true);
+    }
+
+    trace_virtqueue_map_rings(vq, vq->desc_host, vq->avail_host,
+                              vq->used_host);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline void virtqueue_check_rings(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    if (unlikely(vq->ring_gen != vring_map_gen)) {
+        virtqueue_map_rings(vq);
+    }
+}
+
+/* Looks up a descriptor buffer or indirect table in the RAM range cached in
+ * vq->buf_cache, refilling the cache on a miss.  Returns NULL if the buffer
+ * is not in RAM, in which case the caller goes through the memory API.
+ */
+#define VRING_BUF_WINDOW    (2 * 1024 * 1024)
+
+static void *virtqueue_map_buf(VirtQueue *vq, hwaddr addr, hwaddr len,
+                               bool is_write)
+{
+    VRingMemCache *c = &vq->buf_cache;
+    MemoryRegion *mr;
+    hwaddr start, xlat, plen;
+    int try;
+
+    if (likely(c->gen == vring_map_gen && addr >= c->addr &&
+               len <= c->len && addr - c->addr <= c->len - len)) {
+        goto hit;
+    }
+
+    c->gen = 0;
+    if (xen_enabled() || (len && addr + len - 1 < addr)) {
+        return NULL;
+    }
+
+    /* Cache the RAM section around addr, starting at an aligned window so
+     * that buffers just below this one hit as well.
+     */
+    for (try = 0; try < 2; try++) {
+        start = try ? addr : addr & ~(hwaddr)(VRING_BUF_WINDOW - 1);
+        plen = HWADDR_MAX - start;
+        mr = address_space_translate(&address_space_memory, start, &xlat,
+                                     &plen, is_write);
+        if (memory_region_is_ram(mr) && plen >= addr - start + len) {
+            break;
+        }
+    }
+    if (try == 2) {
+        return NULL;
+    }
+
+    c->gen = vring_map_gen;
+    c->addr = start;
+    c->len = plen;
+    c->host = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+    c->mr = mr;
+    c->writable = !mr->readonly;
+
+hit:
+    if (is_write && !c->writable) {
+        return NULL;
+    }
+    return c->host + (addr - c->addr);
+}
+
+/* virt queue functions */
+static void virtqueue_init(VirtQueue *vq)
+{
+    hwaddr pa = vq->pa;
+
+    vq->vring.desc = pa;
+    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
+    vq->vring.used = vring_align(vq->vring.avail +
+                                 offsetof(VRingAvail, ring[vq->vring.num]),
+                                 vq->vring.align);
+    vq->ring_gen = 0;
+}
+
+/* Reads descriptor i of the table at desc_pa, which is mapped at table if
+ * that is not NULL.  Reading all fields at once also means that the guest
+ * cannot change them between our checks and their use.
+ */
+static inline void vring_desc_read(hwaddr desc_pa, VRingDesc *table, int i,
+                                   VRingDesc *desc)
+{
+    if (likely(table)) {
+        memcpy(desc, &table[i], sizeof(*desc));
+    } else {
+        cpu_physical_memory_read(desc_pa + sizeof(VRingDesc) * i, desc,
+                                 sizeof(*desc));
+    }
+    desc->addr = ldq_p(&desc->addr);
+    desc->len = ldl_p(&desc->len);
+    desc->flags = lduw_p(&desc->flags);
+    desc->next = lduw_p(&desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->avail_host)) {
+        return lduw_p(&vq->avail_host->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -138,6 +308,11 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->avail_host)) {
+        return lduw_p(&vq->avail_host->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -145,6 +320,11 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->avail_host)) {
+        return lduw_p(&vq->avail_host->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
@@ -154,23 +334,33 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
-static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
+/* Writes a used ring entry with a single store */
+static inline void vring_used_write(VirtQueue *vq, int i, uint32_t id,
+                                    uint32_t len)
 {
+    VRingUsedElem elem;
     hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
-}
 
-static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
-{
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    stl_p(&elem.id, id);
+    stl_p(&elem.len, len);
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        memcpy(&vq->used_host->ring[i], &elem, sizeof(elem));
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
+    cpu_physical_memory_write(pa, &elem, sizeof(elem));
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        return lduw_p(&vq->used_host->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
@@ -178,6 +368,12 @@ static uint16_t vring_used_idx(VirtQueue *vq)
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        stw_p(&vq->used_host->idx, val);
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     stw_phys(pa, val);
 }
@@ -185,6 +381,12 @@ static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        stw_p(&vq->used_host->flags, lduw_p(&vq->used_host->flags) | mask);
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
     stw_phys(pa, lduw_phys(pa) | mask);
 }
@@ -192,6 +394,12 @@ static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     hwaddr pa;
+
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        stw_p(&vq->used_host->flags, lduw_p(&vq->used_host->flags) & ~mask);
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
     stw_phys(pa, lduw_phys(pa) & ~mask);
 }
@@ -202,6 +410,11 @@ static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
     if (!vq->notification) {
         return;
     }
+    virtqueue_check_rings(vq);
+    if (likely(vq->used_host)) {
+        stw_p(&vq->used_host->ring[vq->vring.num], val);
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
     stw_phys(pa, val);
 }
@@ -232,14 +445,11 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(const VirtQueueElement *elem, unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -255,12 +465,31 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Gives back @elem, which must be the element most recently popped from @vq,
+ * without using it.  The next virtqueue_pop() returns the same buffers.
+ */
+void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    trace_virtqueue_unpop(vq, elem);
+
+    virtqueue_unmap_sg(elem, 0);
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
-    vring_used_ring_len(vq, idx, len);
+    vring_used_write(vq, idx, elem->index, len);
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
@@ -320,19 +549,16 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -354,6 +580,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
+        VRingDesc desc, *table;
         hwaddr desc_pa;
         int i;
 
@@ -361,9 +588,12 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        virtqueue_check_rings(vq);
+        table = vq->desc_host;
+        vring_desc_read(desc_pa, table, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -376,9 +606,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            table = virtqueue_map_buf(vq, desc_pa, desc.len, false);
             num_bufs = i = 0;
+            vring_desc_read(desc_pa, table, i, &desc);
         }
 
         do {
@@ -388,15 +620,20 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(desc_pa, table, i, &desc);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -437,10 +674,32 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
+/* Like virtqueue_map_sg(), but tries the RAM range cached in the virtqueue
+ * first.  The mappings are still released with cpu_physical_memory_unmap(),
+ * which marks written memory dirty and drops the region reference taken here.
+ */
+static void virtqueue_map_desc(VirtQueue *vq, struct iovec *sg, hwaddr *addr,
+                               size_t num_sg, bool is_write)
+{
+    unsigned int i;
+    void *host;
+
+    for (i = 0; i < num_sg; i++) {
+        host = virtqueue_map_buf(vq, addr[i], sg[i].iov_len, is_write);
+        if (likely(host)) {
+            memory_region_ref(vq->buf_cache.mr);
+            sg[i].iov_base = host;
+        } else {
+            virtqueue_map_sg(&sg[i], &addr[i], 1, is_write);
+        }
+    }
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
+    VRingDesc desc, *table;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -455,50 +714,60 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    virtqueue_check_rings(vq);
+    table = vq->desc_host;
+    vring_desc_read(desc_pa, table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        table = virtqueue_map_buf(vq, desc_pa, desc.len, false);
         i = 0;
+        vring_desc_read(desc_pa, table, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(desc_pa, table, i, &desc);
+        }
+    } while (i != max);
 
     /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    virtqueue_map_desc(vq, elem->in_sg, elem->in_addr, elem->in_num, true);
+    virtqueue_map_desc(vq, elem->out_sg, elem->out_addr, elem->out_num, false);
 
     elem->index = head;
 
@@ -558,6 +827,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        vdev->vq[i].ring_gen = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
@@ -765,6 +1035,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    vdev->vq[n].ring_gen = 0;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1010,6 +1281,11 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+
+    if (!vring_map_listener_registered) {
+        memory_listener_register(&vring_map_listener, &address_space_memory);
+        vring_map_listener_registered = true;
+    }
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -40,6 +40,7 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -52,6 +53,7 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 
 typedef struct BdrvTrackedRequest {
@@ -130,6 +132,19 @@ struct BlockDriver {
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
 
+    /*
+     * Copy data between two nodes without a bounce buffer. _from is called
+     * on the driver of src and _to on the driver of dst, see
+     * bdrv_co_copy_range_from() and bdrv_co_copy_range_to(). Drivers return
+     * -ENOTSUP if they can't offload the copy.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *src,
+        int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *src,
+        int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors);
+
     /*
      * Invalidate any cached meta-data.
      */
@@ -168,6 +183,9 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* Fill in the driver-specific optional fields of @stats */
+    void (*bdrv_query_stats)(const BlockDriverState *bs,
+                             BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -217,9 +235,65 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /* Remove fd handlers, timers, and other event loop callbacks so the event
+     * loop is no longer in use.  Called with no in-flight requests and in
+     * depth-first traversal order with parents before child nodes.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+
+    /* Add fd handlers, timers, and other event loop callbacks so I/O requests
+     * can be processed again.  Called with no in-flight requests and in
+     * depth-first traversal order with child nodes before parent nodes.
+     */
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
+typedef struct BdrvAioNotifier {
+    void (*attached_aio_context)(AioContext *new_context, void *opaque);
+    void (*detach_aio_context)(void *opaque);
+
+    void *opaque;
+
+    QLIST_ENTRY(BdrvAioNotifier) list;
+} BdrvAioNotifier;
+
+/* Latency histogram of one request type, see block-latency-histogram-set */
+typedef struct BlockAcctHistogram {
+    int nb_boundaries;
+    uint64_t *boundaries;       /* in nanoseconds, strictly ascending */
+    uint64_t *bins;             /* nb_boundaries + 1 counters */
+} BlockAcctHistogram;
+
+/* Queue depth bins: 1, 2-3, 4-7, ..., 64-127, 128 and more */
+#define BDRV_QUEUE_DEPTH_BINS 8
+
+typedef struct BlockSlowRequestEntry {
+    enum BlockAcctType type;
+    int64_t bytes;
+    int64_t start_time_ns;
+    int64_t latency_ns;
+} BlockSlowRequestEntry;
+
+typedef struct BlockLatencyStats {
+    BlockAcctHistogram histogram[BDRV_MAX_IOTYPE];
+
+    /* Requests between bdrv_acct_start() and bdrv_acct_done() */
+    unsigned int in_flight;
+    unsigned int max_in_flight;
+    uint64_t queue_depth_bins[BDRV_QUEUE_DEPTH_BINS];
+
+    /* Ring buffer of the last requests slower than slow_threshold_ns */
+    int64_t slow_threshold_ns;
+    BlockSlowRequestEntry *slow;
+    unsigned int slow_size;
+    unsigned int slow_count;
+    unsigned int slow_next;
+    uint64_t nr_slow;
+} BlockLatencyStats;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -272,6 +346,7 @@ struct BlockDriverState {
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyStats latency_stats;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -302,6 +377,13 @@ struct BlockDriverState {
     BlockJob *job;
 
     QDict *options;
+
+    /* event loop used for fd handlers, timers, and BHs */
+    AioContext *aio_context;
+
+    /* users that follow the BDS into a new AioContext, see
+     * bdrv_add_aio_context_notifier() */
+    QLIST_HEAD(, BdrvAioNotifier) aio_notifiers;
 };
 
 int get_tmp_filename(char *filename, int size);
@@ -320,11 +402,25 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
 /**
- * bdrv_get_aio_context:
+ * bdrv_detach_aio_context:
+ *
+ * May be called from .bdrv_detach_aio_context() to detach children from the
+ * current #AioContext.  This is only needed by block drivers that manage their
+ * own children.  Both ->file and ->backing_hd are automatically handled and
+ * block drivers should not call this function on them explicitly.
+ */
+void bdrv_detach_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_attach_aio_context:
  *
- * Returns: the currently bound #AioContext
+ * May be called from .bdrv_attach_aio_context() to attach children to the new
+ * #AioContext.  This is only needed by block drivers that manage their own
+ * children.  Both ->file and ->backing_hd are automatically handled and block
+ * drivers should not call this function on them explicitly.
  */
-AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+void bdrv_attach_aio_context(BlockDriverState *bs,
+                             AioContext *new_context);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -380,6 +476,8 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
+ * @max_in_flight: The maximum number of concurrent requests, or 0 for
+ * the default.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -394,6 +492,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
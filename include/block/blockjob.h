@@ -45,6 +45,12 @@ typedef struct BlockJobType {
     /** Optional callback for job types that need to forward I/O status reset */
     void (*iostatus_reset)(BlockJob *job);
 
+    /**
+     * Optional callback for job types that publish additional statistics
+     * through the query-block-jobs QMP API.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
+
     /**
      * Optional callback for job types whose completion must be triggered
      * manually.
@@ -44,6 +44,7 @@ struct nbd_reply {
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_READ_SPARSE (1 << 15)     /* Send READ_SPARSE (QEMU extension) */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -53,9 +54,24 @@ enum {
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+
+    /* QEMU extension, see docs/specs/nbd-read-sparse.txt.  Like
+     * NBD_CMD_READ, but the payload of a successful reply is a sequence of
+     * chunks covering the requested range.  Each chunk starts with an
+     * 8-byte header:
+     *    [0 .. 3]    type    (NBD_SPARSE_DATA or NBD_SPARSE_ZERO)
+     *    [4 .. 7]    length  (in bytes)
+     * NBD_SPARSE_DATA chunks are followed by length bytes of data,
+     * NBD_SPARSE_ZERO chunks have no payload and read as zeroes.
+     */
+    NBD_CMD_READ_SPARSE = 0x8000
 };
 
+#define NBD_SPARSE_CHUNK_SIZE   8
+#define NBD_SPARSE_DATA         0
+#define NBD_SPARSE_ZERO         1
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -95,6 +95,7 @@ struct SCSIDevice
     int blocksize;
     int type;
     uint64_t max_lba;
+    bool dataplane_attached;    /* disk handed to a dataplane IOThread */
 };
 
 extern const VMStateDescription vmstate_scsi_device;
@@ -57,6 +57,7 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring,
               struct iovec iov[], struct iovec *iov_end,
               unsigned int *out_num, unsigned int *in_num);
+int vring_pop_elem(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem);
 void vring_push(Vring *vring, unsigned int head, int len);
 
 #endif /* VRING_H */
@@ -147,6 +147,9 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    bool rx_notify_pending;     /* notification deferred to end of batch */
+    bool rx_elem_busy;          /* rx_elem lent to the backend */
+    VirtQueueElement rx_elem;
     struct {
         VirtQueueElement elem;
         ssize_t len;
@@ -17,6 +17,8 @@
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
 #include "hw/scsi/scsi.h"
+#include "sysemu/dma.h"
+#include "qemu/queue.h"
 
 #define TYPE_VIRTIO_SCSI_COMMON "virtio-scsi-common"
 #define VIRTIO_SCSI_COMMON(obj) \
@@ -153,6 +155,8 @@ struct VirtIOSCSIConf {
     uint32_t cmd_per_lun;
     char *vhostfd;
     char *wwpn;
+    uint32_t data_plane;
+    IOThread *iothread;
 };
 
 typedef struct VirtIOSCSICommon {
@@ -166,18 +170,63 @@ typedef struct VirtIOSCSICommon {
     VirtQueue **cmd_vqs;
 } VirtIOSCSICommon;
 
+struct VirtIOSCSIDataPlane;
+struct VirtIOSCSIVring;
+
 typedef struct {
     VirtIOSCSICommon parent_obj;
 
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+
+    /* Requests popped from a VirtQueue that have not been completed yet.
+     * Dataplane only starts once these are gone, so that the used rings
+     * are owned by one side at a time.
+     */
+    unsigned int vq_inflight;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIOSCSIDataPlane *dataplane;
+#endif
 } VirtIOSCSI;
 
+typedef struct VirtIOSCSIReq {
+    VirtIOSCSI *dev;
+    VirtQueue *vq;
+    struct VirtIOSCSIVring *vring;  /* NULL unless popped by dataplane */
+    unsigned int len;               /* bytes written, for the used ring */
+    VirtQueueElement elem;
+    QEMUSGList qsgl;
+    SCSIRequest *sreq;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdReq      *cmd;
+        VirtIOSCSICtrlTMFReq  *tmf;
+        VirtIOSCSICtrlANReq   *an;
+    } req;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdResp     *cmd;
+        VirtIOSCSICtrlTMFResp *tmf;
+        VirtIOSCSICtrlANResp  *an;
+        VirtIOSCSIEvent       *event;
+    } resp;
+} VirtIOSCSIReq;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
+    DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1),       \
+    DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF),\
+    DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128),   \
+    DEFINE_PROP_BIT("x-data-plane", _state, _conf_field.data_plane, 0, false), \
+    DEFINE_PROP_IOTHREAD("x-iothread", _state, _conf_field.iothread)
+#else
 #define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
     DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1),       \
     DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF),\
     DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128)
+#endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
 
 #define DEFINE_VIRTIO_SCSI_FEATURES(_state, _feature_field)                    \
     DEFINE_VIRTIO_COMMON_FEATURES(_state, _feature_field),                     \
@@ -189,4 +238,24 @@ typedef struct {
 int virtio_scsi_common_init(VirtIOSCSICommon *vs);
 int virtio_scsi_common_exit(VirtIOSCSICommon *vs);
 
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+
+bool virtio_scsi_data_plane_create(VirtIOSCSI *s,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *d);
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *d);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *d);
+bool virtio_scsi_data_plane_started(VirtIOSCSIDataPlane *d);
+void virtio_scsi_data_plane_complete_req(VirtIOSCSIReq *req);
+void virtio_scsi_data_plane_hotplug(VirtIOSCSIDataPlane *d, SCSIDevice *dev);
+void virtio_scsi_data_plane_hot_unplug(VirtIOSCSIDataPlane *d,
+                                       SCSIDevice *dev);
+void virtio_scsi_data_plane_acquire(VirtIOSCSIDataPlane *d);
+void virtio_scsi_data_plane_release(VirtIOSCSIDataPlane *d);
+#endif
+
 #endif /* _QEMU_VIRTIO_SCSI_H */
@@ -19,6 +19,7 @@
 #define QEMU_NET_CHECKSUM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
 uint16_t net_checksum_finish(uint32_t sum);
@@ -26,6 +27,9 @@ uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length);
 
+bool test_net_checksum_next_accel(void);
+const char *net_checksum_accel_name(void);
+
 static inline uint32_t
 net_checksum_add(int len, uint8_t *buf)
 {
@@ -31,13 +31,15 @@ typedef struct NICConf {
     NICPeers peers;
     int32_t bootindex;
     int32_t queues;
+    uint32_t queue_depth;       /* packets queued towards the NIC, 0: default */
 } NICConf;
 
 #define DEFINE_NIC_PROPERTIES(_state, _conf)                            \
     DEFINE_PROP_MACADDR("mac",   _state, _conf.macaddr),                \
     DEFINE_PROP_VLAN("vlan",     _state, _conf.peers),                   \
     DEFINE_PROP_NETDEV("netdev", _state, _conf.peers),                   \
-    DEFINE_PROP_INT32("bootindex", _state, _conf.bootindex, -1)
+    DEFINE_PROP_INT32("bootindex", _state, _conf.bootindex, -1),        \
+    DEFINE_PROP_UINT32("queue-depth", _state, _conf.queue_depth, 0)
 
 
 /* Net clients */
@@ -50,6 +52,9 @@ typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
 typedef RxFilterInfo *(QueryRxFilter)(NetClientState *);
+typedef void (NetReceiveBatchEnd)(NetClientState *);
+typedef int (NetRxBuffersGet)(NetClientState *, struct iovec *, int);
+typedef ssize_t (NetRxBuffersPut)(NetClientState *, size_t);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -62,8 +67,20 @@ typedef struct NetClientInfo {
     LinkStatusChanged *link_status_changed;
     QueryRxFilter *query_rx_filter;
     NetPoll *poll;
+    NetReceiveBatchEnd *receive_batch_end;
+    NetRxBuffersGet *rx_buffers_get;
+    NetRxBuffersPut *rx_buffers_put;
 } NetClientInfo;
 
+/* Packets per batch, in power-of-two bins: 1, 2-3, ..., 128 and more */
+#define NET_BATCH_BINS 8
+
+typedef struct NetBatchHistogram {
+    uint64_t batches;
+    uint64_t packets;
+    uint64_t bins[NET_BATCH_BINS];
+} NetBatchHistogram;
+
 struct NetClientState {
     NetClientInfo *info;
     int link_down;
@@ -77,6 +94,9 @@ struct NetClientState {
     NetClientDestructor *destructor;
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
+    unsigned int receive_batch;         /* nesting level of open batches */
+    unsigned int receive_batch_len;     /* packets delivered in this batch */
+    NetBatchHistogram receive_batch_hist;
 };
 
 typedef struct NICState {
@@ -114,9 +134,15 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
+void qemu_send_packet_shared(NetClientState *nc, const uint8_t *buf, int size,
+                             NetPacketBuf **shared);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_net_batch_begin(NetClientState *nc);
+void qemu_net_batch_end(NetClientState *nc);
+int qemu_net_rx_buffers_get(NetClientState *nc, struct iovec *iov, int iovcnt);
+void qemu_net_rx_buffers_put(NetClientState *nc, size_t size);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
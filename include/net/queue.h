@@ -25,18 +25,34 @@
 #define QEMU_NET_QUEUE_H
 
 #include "qemu-common.h"
+#include "qapi-types.h"
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
 
+/* A reference-counted packet that can sit on several queues at once */
+typedef struct NetPacketBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[];
+} NetPacketBuf;
+
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
+                                      unsigned flags,
+                                      const uint8_t *data,
+                                      size_t size,
+                                      void *opaque);
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
-NetQueue *qemu_new_net_queue(void *opaque);
+NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
+void qemu_net_queue_set_depth(NetQueue *queue, uint32_t depth);
+void qemu_net_queue_enable_lockless(NetQueue *queue);
 
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
@@ -52,7 +68,20 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *data,
+                                  size_t size,
+                                  NetPacketBuf **shared);
+
+NetPacketBuf *qemu_net_packet_buf_new(size_t size);
+void qemu_net_packet_buf_ref(NetPacketBuf *buf);
+void qemu_net_packet_buf_unref(NetPacketBuf *buf);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+bool qemu_net_queue_empty(NetQueue *queue);
+void qemu_net_queue_query(NetQueue *queue, NetQueueInfo *info);
 
 #endif /* QEMU_NET_QUEUE_H */
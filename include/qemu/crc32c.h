@@ -32,4 +32,7 @@
 
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 
+bool test_crc32c_next_accel(void);
+const char *crc32c_accel_name(void);
+
 #endif
@@ -9,6 +9,7 @@ typedef struct QEMUFile QEMUFile;
 typedef struct QEMUBH QEMUBH;
 
 typedef struct AioContext AioContext;
+typedef struct IOThread IOThread;
 
 struct Monitor;
 typedef struct Monitor Monitor;
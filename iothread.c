@@ -0,0 +1,217 @@
+/*
+ * Event loop thread
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
+
+#define IOTHREADS_PATH "/objects"
+
+struct IOThread {
+    Object parent;
+    QemuThread thread;
+    AioContext *ctx;
+    bool started;
+    bool stopping;
+    int thread_id;
+
+    QemuMutex init_done_lock;
+    QemuCond init_done_cond;    /* is thread initialization done? */
+    Notifier machine_init_done;
+
+    /* Statistics, updated by the thread and read without locking */
+    uint64_t poll_count;        /* number of aio_poll() calls */
+    uint64_t poll_progress;     /* aio_poll() calls that dispatched work */
+};
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = qemu_get_thread_id();
+    qemu_cond_signal(&iothread->init_done_cond);
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    while (!atomic_read(&iothread->stopping)) {
+        aio_context_acquire(iothread->ctx);
+        for (;;) {
+            bool progress;
+
+            if (atomic_read(&iothread->stopping)) {
+                break;
+            }
+            progress = aio_poll(iothread->ctx, true);
+            atomic_set(&iothread->poll_count, iothread->poll_count + 1);
+            if (!progress) {
+                /* Woken by aio_notify(), possibly because another thread
+                 * wants the AioContext.  Let it have a go.
+                 */
+                break;
+            }
+            atomic_set(&iothread->poll_progress, iothread->poll_progress + 1);
+        }
+        aio_context_release(iothread->ctx);
+    }
+    return NULL;
+}
+
+/* The thread is started lazily, either when a device first asks for the
+ * AioContext or once the machine is initialized.  -object is processed
+ * before the process daemonizes, and threads do not survive fork().
+ */
+static void iothread_start(IOThread *iothread)
+{
+    if (iothread->started) {
+        return;
+    }
+    iothread->started = true;
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+
+    /* Wait for initialization to complete */
+    while (iothread->thread_id == -1) {
+        qemu_cond_wait(&iothread->init_done_cond,
+                       &iothread->init_done_lock);
+    }
+    qemu_mutex_unlock(&iothread->init_done_lock);
+}
+
+static void iothread_machine_init_done(Notifier *notifier, void *data)
+{
+    IOThread *iothread = container_of(notifier, IOThread, machine_init_done);
+
+    iothread_start(iothread);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->thread_id = -1;
+    iothread->ctx = aio_context_new();
+    qemu_mutex_init(&iothread->init_done_lock);
+    qemu_cond_init(&iothread->init_done_cond);
+
+    iothread->machine_init_done.notify = iothread_machine_init_done;
+    qemu_add_machine_init_done_notifier(&iothread->machine_init_done);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    notifier_remove(&iothread->machine_init_done);
+    if (iothread->started) {
+        atomic_set(&iothread->stopping, true);
+        aio_notify(iothread->ctx);
+        qemu_thread_join(&iothread->thread);
+    }
+    qemu_cond_destroy(&iothread->init_done_cond);
+    qemu_mutex_destroy(&iothread->init_done_lock);
+    aio_context_unref(iothread->ctx);
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_resolve_path_component(container, id);
+    if (!child) {
+        return NULL;
+    }
+    return (IOThread *)object_dynamic_cast(child, TYPE_IOTHREAD);
+}
+
+char *iothread_get_id(IOThread *iothread)
+{
+    char *path = object_get_canonical_path(OBJECT(iothread));
+    char *id = g_strdup(path + strlen(IOTHREADS_PATH "/"));
+
+    g_free(path);
+    return id;
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    iothread_start(iothread);
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    info = g_new0(IOThreadInfo, 1);
+    info->id = iothread_get_id(iothread);
+    info->thread_id = iothread->thread_id;
+    info->poll_count = atomic_read(&iothread->poll_count);
+    info->poll_progress = atomic_read(&iothread->poll_progress);
+
+#ifdef _POSIX_THREAD_CPUTIME
+    if (iothread->started) {
+        clockid_t cid;
+        struct timespec ts;
+
+        if (pthread_getcpuclockid(iothread->thread.thread, &cid) == 0 &&
+            clock_gettime(cid, &ts) == 0) {
+            info->has_cpu_time_ns = true;
+            info->cpu_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+    }
+#endif
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
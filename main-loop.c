@@ -465,7 +465,8 @@ int main_loop_wait(int nonblocking)
     /* poll any events */
     g_array_set_size(gpollfds, 0); /* reset for new iteration */
     /* XXX: separate device handlers from system ones */
-#ifdef CONFIG_SLIRP
+#if defined(CONFIG_SLIRP) && defined(_WIN32)
+    /* Elsewhere slirp polls its sockets from a thread of its own */
     slirp_pollfds_fill(gpollfds, &timeout);
 #endif
     qemu_iohandler_fill(gpollfds);
@@ -482,7 +483,7 @@ int main_loop_wait(int nonblocking)
 
     ret = os_host_main_loop_wait(timeout_ns);
     qemu_iohandler_poll(gpollfds, ret);
-#ifdef CONFIG_SLIRP
+#if defined(CONFIG_SLIRP) && defined(_WIN32)
     slirp_pollfds_poll(gpollfds, (ret < 0));
 #endif
 
@@ -17,6 +17,7 @@
 #include "exec/address-spaces.h"
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
+#include "qemu/event_notifier.h"
 #include "qom/object.h"
 #include "trace.h"
 #include <assert.h>
@@ -968,6 +969,35 @@ static bool memory_region_dispatch_read(MemoryRegion *mr,
     return false;
 }
 
+/* Signals the ioeventfd matching a write, if any.  Accelerators such as
+ * KVM consume these writes before they reach QEMU; with the others, the
+ * notifier has to be signalled here so that handlers such as a vhost
+ * backend still see the kick.
+ */
+static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
+                                                  hwaddr addr,
+                                                  uint64_t data,
+                                                  unsigned size)
+{
+    MemoryRegionIoeventfd ioeventfd = {
+        .addr = addrrange_make(int128_make64(addr), int128_make64(size)),
+        .data = data,
+    };
+    unsigned i;
+
+    for (i = 0; i < mr->ioeventfd_nb; i++) {
+        ioeventfd.match_data = mr->ioeventfds[i].match_data;
+        ioeventfd.e = mr->ioeventfds[i].e;
+
+        if (memory_region_ioeventfd_equal(ioeventfd, mr->ioeventfds[i])) {
+            event_notifier_set(ioeventfd.e);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static bool memory_region_dispatch_write(MemoryRegion *mr,
                                          hwaddr addr,
                                          uint64_t data,
@@ -980,6 +1010,11 @@ static bool memory_region_dispatch_write(MemoryRegion *mr,
 
     adjust_endianness(mr, &data, size);
 
+    if (mr->ioeventfd_nb &&
+        memory_region_dispatch_write_eventfds(mr, addr, data, size)) {
+        return false;
+    }
+
     if (mr->ops->write) {
         access_with_adjusted_size(addr, &data, size,
                                   mr->ops->impl.min_access_size,
@@ -2650,6 +2650,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the network state",
         .mhandler.cmd = do_info_network,
     },
+    {
+        .name       = "netbatch",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show packet batching statistics of the net clients",
+        .mhandler.cmd = hmp_info_netbatch,
+    },
+    {
+        .name       = "netqueues",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the packet queues of the net clients",
+        .mhandler.cmd = hmp_info_netqueues,
+    },
     {
         .name       = "chardev",
         .args_type  = "",
@@ -2693,6 +2707,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show infos for each CPU",
         .mhandler.cmd = hmp_info_cpus,
     },
+    {
+        .name       = "iothreads",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show iothreads",
+        .mhandler.cmd = hmp_info_iothreads,
+    },
     {
         .name       = "history",
         .args_type  = "",
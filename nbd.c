@@ -100,6 +100,11 @@ struct NBDExport {
     uint32_t nbdflags;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
+
+    /* Clients are served in the AioContext of the block device and follow
+     * it when it moves.  NULL while the device is between two contexts.
+     */
+    AioContext *ctx;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -116,6 +121,8 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    bool can_read;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -350,8 +357,10 @@ static int nbd_receive_options(NBDClient *client)
         goto fail;
     }
 
+    aio_context_acquire(client->exp->ctx);
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
+    aio_context_release(client->exp->ctx);
 
     TRACE("Option negotiation succeeded.");
     rc = 0;
@@ -365,7 +374,8 @@ static int nbd_send_negotiate(NBDClient *client)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_SEND_READ_SPARSE);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -769,11 +779,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -782,6 +789,14 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+}
+
+static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    ssize_t ret;
+
+    nbd_encode_reply(buf, reply);
 
     TRACE("Sending response to client");
 
@@ -797,7 +812,11 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+#define MAX_NBD_REQUESTS 128
+
+static void nbd_set_handlers(NBDClient *client);
+static void nbd_unset_handlers(NBDClient *client);
+static void nbd_update_can_read(NBDClient *client);
 
 void nbd_client_get(NBDClient *client)
 {
@@ -812,7 +831,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
-        qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
+        nbd_unset_handlers(client);
         close(client->sock);
         client->sock = -1;
         if (client->exp) {
@@ -848,6 +867,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 
     assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
     client->nb_requests++;
+    nbd_update_can_read(client);
 
     req = g_slice_new0(NBDRequest);
     nbd_client_get(client);
@@ -864,12 +884,43 @@ static void nbd_request_put(NBDRequest *req)
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
-        qemu_notify_event();
-    }
+    client->nb_requests--;
+    nbd_update_can_read(client);
     nbd_client_put(client);
 }
 
+static void bs_aio_attached(AioContext *ctx, void *opaque)
+{
+    NBDExport *exp = opaque;
+    NBDClient *client;
+
+    TRACE("Export %s: Attaching clients to AIO context %p", exp->name, ctx);
+
+    exp->ctx = ctx;
+
+    /* Coroutines waiting for the socket are entered again by the handlers
+     * in the new context.
+     */
+    QTAILQ_FOREACH(client, &exp->clients, next) {
+        nbd_set_handlers(client);
+    }
+}
+
+static void bs_aio_detach(void *opaque)
+{
+    NBDExport *exp = opaque;
+    NBDClient *client;
+
+    TRACE("Export %s: Detaching clients from AIO context %p",
+          exp->name, exp->ctx);
+
+    QTAILQ_FOREACH(client, &exp->clients, next) {
+        nbd_unset_handlers(client);
+    }
+
+    exp->ctx = NULL;
+}
+
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *))
@@ -882,7 +933,12 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->nbdflags = nbdflags;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
+    exp->ctx = bdrv_get_aio_context(bs);
     bdrv_ref(bs);
+
+    aio_context_acquire(exp->ctx);
+    bdrv_add_aio_context_notifier(bs, bs_aio_attached, bs_aio_detach, exp);
+    aio_context_release(exp->ctx);
     return exp;
 }
 
@@ -922,6 +978,16 @@ void nbd_export_set_name(NBDExport *exp, const char *name)
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
+    AioContext *ctx;
+
+    if (!exp->bs) {
+        /* Already closed, no clients and no name left */
+        return;
+    }
+
+    /* The clients may be running in another thread */
+    ctx = bdrv_get_aio_context(exp->bs);
+    aio_context_acquire(ctx);
 
     nbd_export_get(exp);
     QTAILQ_FOREACH_SAFE(client, &exp->clients, next, next) {
@@ -930,9 +996,13 @@ void nbd_export_close(NBDExport *exp)
     nbd_export_set_name(exp, NULL);
     nbd_export_put(exp);
     if (exp->bs) {
+        bdrv_remove_aio_context_notifier(exp->bs, bs_aio_attached,
+                                         bs_aio_detach, exp);
         bdrv_unref(exp->bs);
         exp->bs = NULL;
     }
+
+    aio_context_release(ctx);
 }
 
 void nbd_export_get(NBDExport *exp)
@@ -973,10 +1043,6 @@ void nbd_export_close_all(void)
     }
 }
 
-static int nbd_can_read(void *opaque);
-static void nbd_read(void *opaque);
-static void nbd_restart_write(void *opaque);
-
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -985,27 +1051,166 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     ssize_t rc, ret;
 
     qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
 
     if (!len) {
         rc = nbd_send_reply(csock, reply);
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
+        /* Send header and payload with a single sendmsg, straight from
+         * the buffer the block layer read into.  */
+        uint8_t buf[NBD_REPLY_SIZE];
+        struct iovec iov[2] = {
+            { .iov_base = buf,       .iov_len = sizeof(buf) },
+            { .iov_base = req->data, .iov_len = len },
+        };
+
+        TRACE("Sending response to client");
+        nbd_encode_reply(buf, reply);
+        ret = qemu_co_sendv(csock, iov, 2, 0, sizeof(buf) + len);
+        rc = (ret == sizeof(buf) + len) ? 0 : -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+typedef struct NBDSparseExtent {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t length;
+} NBDSparseExtent;
+
+/* Read the range of a READ_SPARSE request into req->data, skipping the
+ * parts that the block layer reports as zero.  Returns the number of
+ * extents stored in *extents, or a negative errno value.
+ */
+static int nbd_co_read_sparse(NBDRequest *req, struct nbd_request *request,
+                              NBDSparseExtent **extents)
+{
+    NBDExport *exp = req->client->exp;
+    NBDSparseExtent *e = NULL;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint32_t offset = 0;
+    int nb_extents = 0;
+    int64_t ret;
+    int type, n;
+
+    while (nb_sectors > 0) {
+        ret = bdrv_get_block_status(exp->bs, sector_num, nb_sectors, &n);
+        if (ret < 0 || n <= 0) {
+            /* Just read everything that is left */
+            ret = 0;
+            n = nb_sectors;
+        }
+
+        if (ret & BDRV_BLOCK_ZERO) {
+            type = NBD_SPARSE_ZERO;
+        } else {
+            type = NBD_SPARSE_DATA;
+            ret = bdrv_read(exp->bs, sector_num, req->data + offset, n);
+            if (ret < 0) {
+                g_free(e);
+                return ret;
+            }
+        }
+
+        if (nb_extents > 0 && e[nb_extents - 1].type == type) {
+            e[nb_extents - 1].length += n * 512;
+        } else {
+            e = g_renew(NBDSparseExtent, e, nb_extents + 1);
+            e[nb_extents].type = type;
+            e[nb_extents].offset = offset;
+            e[nb_extents].length = n * 512;
+            nb_extents++;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * 512;
+    }
+
+    *extents = e;
+    return nb_extents;
+}
+
+/* Maximum number of extents that go into a single sendmsg */
+#define NBD_SPARSE_EXTENTS_PER_SEND ((IOV_MAX - 1) / 2)
+
+static ssize_t nbd_co_send_sparse_reply(NBDRequest *req,
+                                        struct nbd_reply *reply,
+                                        NBDSparseExtent *extents,
+                                        int nb_extents)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t reply_buf[NBD_REPLY_SIZE];
+    uint8_t *chunk_buf;
+    struct iovec *iov;
+    size_t bytes;
+    ssize_t rc, ret;
+    int i, niov;
+
+    /* Chunk headers and data are sent with one sendmsg per batch of
+     * extents, pointing straight into req->data.  */
+    chunk_buf = g_malloc(nb_extents * NBD_SPARSE_CHUNK_SIZE);
+    iov = g_new(struct iovec, 1 + 2 * MIN(nb_extents,
+                                          NBD_SPARSE_EXTENTS_PER_SEND));
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    nbd_encode_reply(reply_buf, reply);
+    iov[0].iov_base = reply_buf;
+    iov[0].iov_len = sizeof(reply_buf);
+    niov = 1;
+    bytes = sizeof(reply_buf);
+
+    rc = 0;
+    for (i = 0; i < nb_extents; i++) {
+        uint8_t *buf = chunk_buf + i * NBD_SPARSE_CHUNK_SIZE;
+
+        cpu_to_be32w((uint32_t*)buf, extents[i].type);
+        cpu_to_be32w((uint32_t*)(buf + 4), extents[i].length);
+        iov[niov].iov_base = buf;
+        iov[niov].iov_len = NBD_SPARSE_CHUNK_SIZE;
+        niov++;
+        bytes += NBD_SPARSE_CHUNK_SIZE;
+
+        if (extents[i].type == NBD_SPARSE_DATA) {
+            iov[niov].iov_base = req->data + extents[i].offset;
+            iov[niov].iov_len = extents[i].length;
+            niov++;
+            bytes += extents[i].length;
+        }
+
+        if (i == nb_extents - 1 || niov >= IOV_MAX - 2) {
+            ret = qemu_co_sendv(csock, iov, niov, 0, bytes);
+            if (ret != bytes) {
                 rc = -EIO;
+                break;
             }
+            niov = 0;
+            bytes = 0;
+        }
+    }
+    if (nb_extents == 0) {
+        ret = qemu_co_sendv(csock, iov, niov, 0, bytes);
+        if (ret != bytes) {
+            rc = -EIO;
         }
-        socket_set_cork(csock, 0);
     }
 
     client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    nbd_set_handlers(client);
     qemu_co_mutex_unlock(&client->send_lock);
+
+    g_free(iov);
+    g_free(chunk_buf);
     return rc;
 }
 
@@ -1017,6 +1222,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
+    nbd_update_can_read(client);
+
     rc = nbd_receive_request(csock, request);
     if (rc < 0) {
         if (rc != -EAGAIN) {
@@ -1042,7 +1249,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     TRACE("Decoding type");
 
     command = request->type & NBD_CMD_MASK_COMMAND;
-    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+    if (command == NBD_CMD_READ || command == NBD_CMD_READ_SPARSE ||
+        command == NBD_CMD_WRITE) {
         req->data = qemu_blockalign(client->exp->bs, request->len);
     }
     if (command == NBD_CMD_WRITE) {
@@ -1058,6 +1266,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
 out:
     client->recv_coroutine = NULL;
+    nbd_update_can_read(client);
+
     return rc;
 }
 
@@ -1126,6 +1336,44 @@ static void nbd_trip(void *opaque)
         if (nbd_co_send_reply(req, &reply, request.len) < 0)
             goto out;
         break;
+    case NBD_CMD_READ_SPARSE: {
+        NBDSparseExtent *extents;
+        int nb_extents;
+
+        TRACE("Request type is READ_SPARSE");
+
+        /* The chunks describe whole sectors */
+        if (((request.from + exp->dev_offset) | request.len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            LOG("unaligned READ_SPARSE request");
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+
+        if (request.type & NBD_CMD_FLAG_FUA) {
+            ret = bdrv_co_flush(exp->bs);
+            if (ret < 0) {
+                LOG("flush failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
+        }
+
+        nb_extents = nbd_co_read_sparse(req, &request, &extents);
+        if (nb_extents < 0) {
+            LOG("reading from file failed");
+            reply.error = -nb_extents;
+            goto error_reply;
+        }
+
+        TRACE("Read %u byte(s) in %d extent(s)", request.len, nb_extents);
+        ret = nbd_co_send_sparse_reply(req, &reply, extents, nb_extents);
+        g_free(extents);
+        if (ret < 0) {
+            goto out;
+        }
+        break;
+    }
     case NBD_CMD_WRITE:
         TRACE("Request type is WRITE");
 
@@ -1189,7 +1437,7 @@ static void nbd_trip(void *opaque)
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
@@ -1208,13 +1456,6 @@ out:
     nbd_client_close(client);
 }
 
-static int nbd_can_read(void *opaque)
-{
-    NBDClient *client = opaque;
-
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
-}
-
 static void nbd_read(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1237,6 +1478,8 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
                           void (*close)(NBDClient *))
 {
     NBDClient *client;
+    AioContext *ctx;
+
     client = g_malloc0(sizeof(NBDClient));
     client->refcount = 1;
     client->exp = exp;
@@ -1247,11 +1490,51 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
     }
     client->close = close;
     qemu_co_mutex_init(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    client->can_read = true;
 
+    /* Without @exp, the new-style handshake has looked up the export that
+     * the client asked for and added the client to it.  The export may be
+     * served by another thread.
+     */
+    assert(client->exp);
+    ctx = client->exp->ctx;
+    aio_context_acquire(ctx);
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
         nbd_export_get(exp);
     }
+    nbd_set_handlers(client);
+    aio_context_release(ctx);
     return client;
 }
+
+static void nbd_set_handlers(NBDClient *client)
+{
+    if (client->exp && client->exp->ctx) {
+        aio_set_fd_handler(client->exp->ctx, client->sock,
+                           client->can_read ? nbd_read : NULL,
+                           client->send_coroutine ? nbd_restart_write : NULL,
+                           client);
+    }
+}
+
+static void nbd_unset_handlers(NBDClient *client)
+{
+    if (client->exp && client->exp->ctx) {
+        aio_set_fd_handler(client->exp->ctx, client->sock, NULL, NULL, NULL);
+    }
+}
+
+static void nbd_update_can_read(NBDClient *client)
+{
+    bool can_read = client->recv_coroutine ||
+                    client->nb_requests < MAX_NBD_REQUESTS;
+
+    if (can_read != client->can_read) {
+        client->can_read = can_read;
+        nbd_set_handlers(client);
+
+        /* There is no need to invoke aio_notify(), since aio_set_fd_handler()
+         * in nbd_set_handlers() will have taken care of that */
+    }
+}
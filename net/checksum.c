@@ -21,17 +21,188 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The one's complement sum does not depend on the byte order (RFC 1071),
+ * so the kernels below add up the buffer in host-endian words, as wide as
+ * they can, and the result is folded and byte-swapped only at the end.
+ * Each kernel returns an unfolded sum of host-endian words.
+ */
+static uint64_t checksum_add_generic(const uint8_t *buf, int len)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+    uint32_t w;
+
+    for (; len >= 4; len -= 4, buf += 4) {
+        memcpy(&w, buf, 4);
+        sum += w;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, buf, len);
+        sum += w;
+    }
+    return sum;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static uint64_t checksum_add_sse2(const uint8_t *buf, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, acc32, v;
+    uint64_t lanes[2];
+    int i, n;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+    while (len >= 16) {
+        /* 32-bit lanes grow by at most 2 * 0xffff per iteration */
+        n = MIN(len / 16, 16384);
+        acc32 = zero;
+        for (i = 0; i < n; i++, buf += 16) {
+            v = _mm_loadu_si128((const __m128i *) buf);
+            acc32 = _mm_add_epi32(acc32, _mm_unpacklo_epi16(v, zero));
+            acc32 = _mm_add_epi32(acc32, _mm_unpackhi_epi16(v, zero));
         }
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(acc32, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(acc32, zero));
+        len -= n * 16;
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + checksum_add_generic(buf, len);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static uint64_t checksum_add_avx2(const uint8_t *buf, int len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero, acc32, v;
+    uint64_t lanes[4];
+    int i, n;
+
+    while (len >= 32) {
+        n = MIN(len / 32, 16384);
+        acc32 = zero;
+        for (i = 0; i < n; i++, buf += 32) {
+            v = _mm256_loadu_si256((const __m256i *) buf);
+            acc32 = _mm256_add_epi32(acc32, _mm256_unpacklo_epi16(v, zero));
+            acc32 = _mm256_add_epi32(acc32, _mm256_unpackhi_epi16(v, zero));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(acc32, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(acc32, zero));
+        len -= n * 32;
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           checksum_add_generic(buf, len);
+}
+
+#pragma GCC pop_options
+#endif
+
+typedef struct ChecksumAccel {
+    const char *name;
+    bool avx2;
+    uint64_t (*add)(const uint8_t *buf, int len);
+} ChecksumAccel;
+
+/* Sorted from fastest to slowest; the generic variant always comes last */
+static const ChecksumAccel accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", true, checksum_add_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", false, checksum_add_sse2 },
+#endif
+    { "generic", false, checksum_add_generic },
+};
+
+static bool host_avx2;
+static const ChecksumAccel *accel = &accels[ARRAY_SIZE(accels) - 1];
+
+static void select_accel(const ChecksumAccel *first)
+{
+    const ChecksumAccel *a;
+
+    for (a = first; a < &accels[ARRAY_SIZE(accels)]; a++) {
+        if (!a->avx2 || host_avx2) {
+            accel = a;
+            return;
+        }
+    }
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    unsigned int max, a, b, c, d, bv;
+
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+        /* AVX2 is only usable if the OS saves the YMM registers */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            host_avx2 = (bv & 0x06) == 0x06 && (b & bit_AVX2);
+        }
+    }
+#endif
+
+    select_accel(&accels[0]);
+}
+
+/*
+ * Switches to the next slower checksum kernel, for the unit tests.  Returns
+ * false and goes back to the fastest one after the generic kernel has been
+ * used.
+ */
+bool test_net_checksum_next_accel(void)
+{
+    if (accel == &accels[ARRAY_SIZE(accels) - 1]) {
+        select_accel(&accels[0]);
+        return false;
+    }
+    select_accel(accel + 1);
+    return true;
+}
+
+const char *net_checksum_accel_name(void)
+{
+    return accel->name;
+}
+
+static inline uint16_t checksum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint16_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    sum = be16_to_cpu(checksum_fold(accel->add(buf, len)));
+
+    /* Starting at an odd offset swaps the roles of high and low bytes */
+    if (seq & 1) {
+        sum = bswap16(sum);
     }
     return sum;
 }
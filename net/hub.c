@@ -14,16 +14,28 @@
 
 #include "monitor/monitor.h"
 #include "net/net.h"
+#include "net/eth.h"
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * Like a learning switch, the hub remembers which port each source MAC
+ * address was last seen on and sends unicast frames for a known address to
+ * that port only.  Ports connected to a dump client still see everything.
+ * A packet that goes to a single port is passed on as it is; one that goes
+ * to several ports is linearized once and queued by reference rather than
+ * copied for each of them.
  */
 
+#define NET_HUB_MAC_TABLE_SIZE  256     /* a power of two */
+#define NET_HUB_MAC_AGEING_MS   300000
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -33,51 +45,168 @@ typedef struct NetHubPort {
     int id;
 } NetHubPort;
 
+/* Collisions simply replace the older entry, whose frames are flooded */
+typedef struct NetHubMacEntry {
+    uint8_t mac[ETH_ALEN];
+    NetHubPort *port;           /* NULL if unused */
+    int64_t expires;
+} NetHubMacEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry macs[NET_HUB_MAC_TABLE_SIZE];
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
 {
-    NetHubPort *port;
+    /* The vendor part is mostly the same, so hash the low bytes */
+    unsigned int h = (mac[3] << 16 | mac[4] << 8 | mac[5]) * 0x9e3779b1u;
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
+    return &hub->macs[h >> 24 & (NET_HUB_MAC_TABLE_SIZE - 1)];
+}
+
+static void net_hub_learn(NetHub *hub, NetHubPort *port, const uint8_t *mac,
+                          int64_t now)
+{
+    NetHubMacEntry *e;
+
+    if (mac[0] & 1) {
+        return;                 /* not a unicast address */
+    }
+    e = net_hub_mac_entry(hub, mac);
+    memcpy(e->mac, mac, ETH_ALEN);
+    e->port = port;
+    e->expires = now + NET_HUB_MAC_AGEING_MS;
+}
+
+/* Returns the port that owns unicast address @mac, or NULL to flood */
+static NetHubPort *net_hub_lookup(NetHub *hub, const uint8_t *mac,
+                                  int64_t now)
+{
+    NetHubMacEntry *e;
+
+    if (mac[0] & 1) {
+        return NULL;
+    }
+    e = net_hub_mac_entry(hub, mac);
+    if (!e->port || e->expires <= now || memcmp(e->mac, mac, ETH_ALEN)) {
+        return NULL;
+    }
+    return e->port;
+}
+
+static void net_hub_forget_port(NetHub *hub, NetHubPort *port)
+{
+    int i;
+
+    for (i = 0; i < NET_HUB_MAC_TABLE_SIZE; i++) {
+        if (hub->macs[i].port == port) {
+            hub->macs[i].port = NULL;
         }
+    }
+}
+
+static bool net_hub_port_is_promisc(NetHubPort *port)
+{
+    return port->nc.peer &&
+           port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP;
+}
 
-        qemu_send_packet(&port->nc, buf, len);
+/* Learns the source address of a frame and returns the port that owns its
+ * destination address, or NULL if the frame is to be flooded.  */
+static NetHubPort *net_hub_route(NetHub *hub, NetHubPort *source_port,
+                                 const struct iovec *iov, int iovcnt)
+{
+    struct eth_header eh;
+    int64_t now;
+
+    if (iov_to_buf(iov, iovcnt, 0, &eh, sizeof(eh)) < sizeof(eh)) {
+        return NULL;
     }
-    return len;
+
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    net_hub_learn(hub, source_port, eh.h_source, now);
+    return net_hub_lookup(hub, eh.h_dest, now);
+}
+
+static bool net_hub_port_wants(NetHubPort *port, NetHubPort *source_port,
+                               NetHubPort *dest)
+{
+    if (port == source_port) {
+        return false;
+    }
+    return !dest || port == dest || net_hub_port_is_promisc(port);
 }
 
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
     ssize_t len = iov_size(iov, iovcnt);
+    NetHubPort *port, *dest, *last = NULL;
+    NetPacketBuf *shared = NULL;
+    int nb_ports = 0;
+    uint8_t *buf;
 
+    dest = net_hub_route(hub, source_port, iov, iovcnt);
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
+        if (net_hub_port_wants(port, source_port, dest)) {
+            last = port;
+            nb_ports++;
+        }
+    }
+
+    if (nb_ports == 0) {
+        return len;
+    }
+    if (nb_ports == 1) {
+        qemu_sendv_packet(&last->nc, iov, iovcnt);
+        return len;
+    }
+
+    /* Fanning out: linearize once and queue the frame by reference */
+    if (iovcnt == 1) {
+        buf = iov[0].iov_base;
+    } else {
+        buf = g_malloc(len);
+        iov_to_buf(iov, iovcnt, 0, buf, len);
+    }
+
+    QLIST_FOREACH(port, &hub->ports, next) {
+        if (net_hub_port_wants(port, source_port, dest)) {
+            qemu_send_packet_shared(&port->nc, buf, len, &shared);
         }
+    }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+    if (shared) {
+        qemu_net_packet_buf_unref(shared);
+    }
+    if (iovcnt != 1) {
+        g_free(buf);
     }
     return len;
 }
 
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
@@ -126,6 +255,7 @@ static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
+    net_hub_forget_port(port->hub, port);
     QLIST_REMOVE(port, next);
 }
 
@@ -322,6 +452,7 @@ void net_hub_check_clients(void)
             case NET_CLIENT_OPTIONS_KIND_TAP:
             case NET_CLIENT_OPTIONS_KIND_SOCKET:
             case NET_CLIENT_OPTIONS_KIND_VDE:
+            case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
                 has_host_dev = 1;
                 break;
             default:
@@ -37,6 +37,7 @@
 #include "hw/qdev.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "qemu/host-utils.h"
 #include "qapi-visit.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/dealloc-visitor.h"
@@ -207,7 +208,7 @@ static void qemu_net_client_setup(NetClientState *nc,
     }
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
-    nc->incoming_queue = qemu_new_net_queue(nc);
+    nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet, nc);
     nc->destructor = destructor;
 }
 
@@ -249,6 +250,10 @@ NICState *qemu_new_nic(NetClientInfo *info,
         qemu_net_client_setup(&nic->ncs[i], info, peers[i], model, name,
                               NULL);
         nic->ncs[i].queue_index = i;
+        if (conf->queue_depth) {
+            qemu_net_queue_set_depth(nic->ncs[i].incoming_queue,
+                                     conf->queue_depth);
+        }
     }
 
     return nic;
@@ -420,7 +425,9 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
-    };
+    } else if (nc->receive_batch) {
+        nc->receive_batch_len++;
+    }
 
     return ret;
 }
@@ -481,11 +488,105 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Packets sent by @nc between qemu_net_batch_begin() and qemu_net_batch_end()
+ * form a batch.  The peer learns about the end of the batch through its
+ * receive_batch_end callback, so that it can defer work such as guest
+ * notifications until then.  Batches may nest.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer) {
+        return;
+    }
+    if (peer->receive_batch++ == 0) {
+        peer->receive_batch_len = 0;
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+    NetBatchHistogram *hist;
+    unsigned int len;
+
+    if (!peer) {
+        return;
+    }
+    assert(peer->receive_batch > 0);
+    if (--peer->receive_batch) {
+        return;
+    }
+
+    len = peer->receive_batch_len;
+    if (len) {
+        hist = &peer->receive_batch_hist;
+        hist->batches++;
+        hist->packets += len;
+        hist->bins[MIN(NET_BATCH_BINS - 1, 31 - clz32(len))]++;
+    }
+
+    if (peer->info->receive_batch_end) {
+        peer->info->receive_batch_end(peer);
+    }
+}
+
+/* Zero-copy receive: instead of reading a packet into a buffer of its own
+ * and sending it, a backend can ask for the buffers that the peer would
+ * store the next packet in, read the packet straight into them and then
+ * hand it over with qemu_net_rx_buffers_put().  A size of zero gives the
+ * buffers back without delivering anything, for example because the packet
+ * did not fit.
+ *
+ * Returns the number of elements filled in @iov, or 0 if the packet must
+ * go through the normal send path.
+ */
+int qemu_net_rx_buffers_get(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (nc->link_down || !peer || peer->link_down ||
+        !peer->info->rx_buffers_get || !qemu_can_send_packet(nc)) {
+        return 0;
+    }
+
+    /* Queued packets go first */
+    if (!qemu_net_queue_empty(peer->incoming_queue)) {
+        return 0;
+    }
+
+    return peer->info->rx_buffers_get(peer, iov, iovcnt);
+}
+
+void qemu_net_rx_buffers_put(NetClientState *nc, size_t size)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer->info->rx_buffers_put(peer, size) > 0 && peer->receive_batch) {
+        peer->receive_batch_len++;
+    }
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
 }
 
+/* For senders that pass the same packet to several clients: if the peer
+ * has to queue it, it keeps a reference to *@shared instead of a copy.
+ */
+void qemu_send_packet_shared(NetClientState *nc, const uint8_t *buf, int size,
+                             NetPacketBuf **shared)
+{
+    if (nc->link_down || !nc->peer) {
+        return;
+    }
+
+    qemu_net_queue_send_shared(nc->peer->incoming_queue, nc,
+                               QEMU_NET_PACKET_FLAG_NONE, buf, size, shared);
+}
+
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_RAW,
@@ -528,6 +629,8 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (nc->receive_batch) {
+        nc->receive_batch_len++;
     }
 
     return ret;
@@ -726,6 +829,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_VHOST_NET_USER
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -756,6 +862,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_VHOST_NET_USER
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -1010,6 +1119,77 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+NetBatchStatsList *qmp_query_net_batch_stats(bool has_name, const char *name,
+                                             Error **errp)
+{
+    NetClientState *nc;
+    NetBatchStatsList *head = NULL, **prev = &head;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetBatchHistogram *hist = &nc->receive_batch_hist;
+        NetBatchStatsList *entry;
+        NetBatchStats *info;
+        int i;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        info->batches = hist->batches;
+        info->packets = hist->packets;
+        for (i = NET_BATCH_BINS - 1; i >= 0; i--) {
+            intList *bin = g_malloc0(sizeof(*bin));
+            bin->value = hist->bins[i];
+            bin->next = info->histogram;
+            info->histogram = bin;
+        }
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *prev = entry;
+        prev = &entry->next;
+    }
+
+    if (head == NULL && has_name) {
+        error_setg(errp, "invalid net client name: %s", name);
+    }
+
+    return head;
+}
+
+NetQueueInfoList *qmp_query_net_queues(bool has_name, const char *name,
+                                       Error **errp)
+{
+    NetClientState *nc;
+    NetQueueInfoList *head = NULL, **prev = &head;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetQueueInfoList *entry;
+        NetQueueInfo *info;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        qemu_net_queue_query(nc->incoming_queue, info);
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *prev = entry;
+        prev = &entry->next;
+    }
+
+    if (head == NULL && has_name) {
+        error_setg(errp, "invalid net client name: %s", name);
+    }
+
+    return head;
+}
+
 void do_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -23,6 +23,9 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -37,38 +40,70 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Queued packets are kept in a ring of slots.  The slots and their data
+ * buffers are reused, so once the ring has grown to the size a workload
+ * needs, queueing a packet does not allocate memory.  Only up to
+ * NET_QUEUE_RETAIN_BYTES of buffers are kept around, though; beyond that a
+ * slot gives its buffer back once the packet is delivered, so that a burst
+ * of large packets does not pin memory for good.  The ring grows up to
+ * the configured depth, and beyond it only for packets with a sent
+ * callback, whose senders stop after the first queued packet anyway.
+ *
+ * A packet that goes to several queues, as in a hub, can be queued by
+ * reference with qemu_net_queue_send_shared().  The first queue that has
+ * to hold on to it copies it into a NetPacketBuf, and the others share
+ * that copy.
+ *
+ * In lock-free mode the ring is allocated to its full depth up front and
+ * never grows.  Exactly one thread may then send to the queue without
+ * holding the global mutex.  Packets are only appended on that side, and a
+ * bottom half delivers them from the main loop.
  */
 
+#define NET_QUEUE_DEFAULT_DEPTH 10000
+#define NET_QUEUE_MIN_SLOTS     16
+#define NET_QUEUE_RETAIN_BYTES  (256 * 1024)
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
-    NetClientState *sender;
+    NetClientState *sender;     /* NULL once purged */
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    size_t capacity;
+    uint8_t *data;              /* kept when the slot is reused */
+    NetPacketBuf *shared;       /* if set, used instead of data */
 };
 
 struct NetQueue {
+    NetQueueDeliverFunc *deliver;
     void *opaque;
     uint32_t nq_maxlen;
-    uint32_t nq_count;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    NetPacket *slots;
+    uint32_t nslots;            /* zero or a power of two */
+    uint32_t head;              /* next slot to fill, written by producer */
+    uint32_t tail;              /* next slot to deliver, written by consumer */
+    size_t retained;            /* bytes in slot buffers, written by both */
+
+    /* Statistics, written by the producer */
+    uint32_t max_count;
+    uint64_t drops;
+
+    QEMUBH *bh;                 /* lock-free mode only */
 
     unsigned delivering : 1;
 };
 
-NetQueue *qemu_new_net_queue(void *opaque)
+NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
 
     queue = g_malloc0(sizeof(NetQueue));
 
+    queue->deliver = deliver;
     queue->opaque = opaque;
-    queue->nq_maxlen = 10000;
-    queue->nq_count = 0;
-
-    QTAILQ_INIT(&queue->packets);
+    queue->nq_maxlen = NET_QUEUE_DEFAULT_DEPTH;
 
     queue->delivering = 0;
 
@@ -77,16 +112,152 @@ NetQueue *qemu_new_net_queue(void *opaque)
 
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    uint32_t i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    if (queue->bh) {
+        qemu_bh_delete(queue->bh);
     }
-
+    for (i = 0; i < queue->nslots; i++) {
+        if (queue->slots[i].shared) {
+            qemu_net_packet_buf_unref(queue->slots[i].shared);
+        }
+        g_free(queue->slots[i].data);
+    }
+    g_free(queue->slots);
     g_free(queue);
 }
 
+NetPacketBuf *qemu_net_packet_buf_new(size_t size)
+{
+    NetPacketBuf *buf = g_malloc(sizeof(*buf) + size);
+
+    buf->refcnt = 1;
+    buf->size = size;
+    return buf;
+}
+
+void qemu_net_packet_buf_ref(NetPacketBuf *buf)
+{
+    atomic_inc(&buf->refcnt);
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (atomic_fetch_dec(&buf->refcnt) == 1) {
+        g_free(buf);
+    }
+}
+
+void qemu_net_queue_set_depth(NetQueue *queue, uint32_t depth)
+{
+    assert(!queue->bh);
+    assert(depth > 0);
+
+    queue->nq_maxlen = depth;
+}
+
+static void qemu_net_queue_bh(void *opaque)
+{
+    NetQueue *queue = opaque;
+
+    qemu_net_queue_flush(queue);
+}
+
+/* Must be called while the queue is empty and before the producer thread
+ * starts sending.  sent callbacks are not supported in this mode.
+ */
+void qemu_net_queue_enable_lockless(NetQueue *queue)
+{
+    uint32_t nslots = NET_QUEUE_MIN_SLOTS;
+    uint32_t i;
+
+    while (nslots < queue->nq_maxlen) {
+        nslots *= 2;
+    }
+
+    assert(!queue->bh);
+    assert(queue->head == queue->tail);
+
+    for (i = 0; i < queue->nslots; i++) {
+        g_free(queue->slots[i].data);
+    }
+    g_free(queue->slots);
+
+    queue->slots = g_new0(NetPacket, nslots);
+    queue->nslots = nslots;
+    queue->head = queue->tail = 0;
+    queue->retained = 0;
+    queue->bh = qemu_bh_new(qemu_net_queue_bh, queue);
+}
+
+static void qemu_net_queue_grow(NetQueue *queue)
+{
+    uint32_t nslots = MAX(NET_QUEUE_MIN_SLOTS, queue->nslots * 2);
+    NetPacket *slots = g_new0(NetPacket, nslots);
+    uint32_t i;
+
+    /* The ring is full, so this copies every slot, oldest first */
+    for (i = 0; i < queue->nslots; i++) {
+        slots[i] = queue->slots[(queue->tail + i) & (queue->nslots - 1)];
+    }
+
+    g_free(queue->slots);
+    queue->slots = slots;
+    queue->head = queue->nslots;
+    queue->tail = 0;
+    queue->nslots = nslots;
+}
+
+/* Returns a free slot with room for @size bytes, or NULL if the packet
+ * must be dropped.
+ */
+static NetPacket *qemu_net_queue_reserve(NetQueue *queue, size_t size,
+                                         NetPacketSent *sent_cb)
+{
+    uint32_t count = queue->head - atomic_read(&queue->tail);
+    NetPacket *packet;
+
+    if (count >= queue->nq_maxlen && !sent_cb) {
+        atomic_set(&queue->drops, queue->drops + 1);
+        return NULL; /* drop if queue full and no callback */
+    }
+    if (count == queue->nslots) {
+        assert(!queue->bh);
+        qemu_net_queue_grow(queue);
+    }
+
+    /* Don't overwrite the slot before the consumer is done with it */
+    smp_mb();
+
+    packet = &queue->slots[queue->head & (queue->nslots - 1)];
+    packet->shared = NULL;
+    if (packet->capacity < size) {
+        atomic_add(&queue->retained, size - packet->capacity);
+        g_free(packet->data);
+        packet->data = g_malloc(size);
+        packet->capacity = size;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_commit(NetQueue *queue)
+{
+    uint32_t count;
+
+    /* Make the packet visible before the new head */
+    smp_wmb();
+    atomic_set(&queue->head, queue->head + 1);
+
+    count = queue->head - atomic_read(&queue->tail);
+    if (count > queue->max_count) {
+        atomic_set(&queue->max_count, count);
+    }
+
+    if (queue->bh) {
+        qemu_bh_schedule(queue->bh);
+    }
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -96,18 +267,45 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+    packet = qemu_net_queue_reserve(queue, size, sent_cb);
+    if (!packet) {
+        return;
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_commit(queue);
+}
+
+/* Queues a reference to *@shared, creating it from @buf if necessary */
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const uint8_t *buf,
+                                         size_t size,
+                                         NetPacketBuf **shared)
+{
+    NetPacket *packet;
+
+    packet = qemu_net_queue_reserve(queue, 0, NULL);
+    if (!packet) {
+        return;
+    }
+    if (!*shared) {
+        *shared = qemu_net_packet_buf_new(size);
+        memcpy((*shared)->data, buf, size);
+    }
+    qemu_net_packet_buf_ref(*shared);
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = size;
+    packet->sent_cb = NULL;
+    packet->shared = *shared;
+
+    qemu_net_queue_commit(queue);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -121,14 +319,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     size_t max_len = 0;
     int i;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_reserve(queue, max_len, sent_cb);
+    if (!packet) {
+        return;
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +339,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_commit(queue);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -154,7 +351,7 @@ static ssize_t qemu_net_queue_deliver(NetQueue *queue,
     ssize_t ret = -1;
 
     queue->delivering = 1;
-    ret = qemu_deliver_packet(sender, flags, data, size, queue->opaque);
+    ret = queue->deliver(sender, flags, data, size, queue->opaque);
     queue->delivering = 0;
 
     return ret;
@@ -168,6 +365,17 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
 {
     ssize_t ret = -1;
 
+    if (queue->deliver != qemu_deliver_packet) {
+        /* Other delivery handlers only take linear buffers */
+        size_t size = iov_size(iov, iovcnt);
+        uint8_t *buf = g_malloc(size);
+
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+        ret = qemu_net_queue_deliver(queue, sender, flags, buf, size);
+        g_free(buf);
+        return ret;
+    }
+
     queue->delivering = 1;
     ret = qemu_deliver_packet_iov(sender, flags, iov, iovcnt, queue->opaque);
     queue->delivering = 0;
@@ -184,6 +392,13 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
 {
     ssize_t ret;
 
+    if (queue->bh) {
+        /* Lock-free mode, called by the producer thread */
+        assert(!sent_cb);
+        qemu_net_queue_append(queue, sender, flags, data, size, NULL);
+        return size;
+    }
+
     if (queue->delivering || !qemu_can_send_packet(sender)) {
         qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
         return 0;
@@ -209,6 +424,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 {
     ssize_t ret;
 
+    if (queue->bh) {
+        /* Lock-free mode, called by the producer thread */
+        assert(!sent_cb);
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL);
+        return iov_size(iov, iovcnt);
+    }
+
     if (queue->delivering || !qemu_can_send_packet(sender)) {
         qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
         return 0;
@@ -225,45 +447,126 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Like qemu_net_queue_send() without a sent callback, except that a packet
+ * which has to be queued is held by reference.  *@shared must be NULL or a
+ * NetPacketBuf holding @data; the caller drops its reference once done.
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *data,
+                                  size_t size,
+                                  NetPacketBuf **shared)
+{
+    ssize_t ret;
+
+    if (queue->bh) {
+        qemu_net_queue_append_shared(queue, sender, flags, data, size, shared);
+        return size;
+    }
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_shared(queue, sender, flags, data, size, shared);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
+    if (ret == 0) {
+        qemu_net_queue_append_shared(queue, sender, flags, data, size, shared);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    uint32_t head = atomic_read(&queue->head);
+    uint32_t i;
+
+    smp_rmb();
+    for (i = queue->tail; i != head; i++) {
+        NetPacket *packet = &queue->slots[i & (queue->nslots - 1)];
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            g_free(packet);
+            packet->sender = NULL;
         }
     }
 }
 
+/* True if no packets are waiting or being delivered */
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return !queue->delivering &&
+           queue->tail == atomic_read(&queue->head);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
+    while (queue->tail != atomic_read(&queue->head)) {
         NetPacket *packet;
-        int ret;
-
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+        NetClientState *sender;
+        NetPacketSent *sent_cb;
+        NetPacketBuf *shared;
+        int ret = 0;
+
+        smp_rmb();
+        packet = &queue->slots[queue->tail & (queue->nslots - 1)];
+        sender = packet->sender;
+        sent_cb = packet->sent_cb;
+        shared = packet->shared;
+
+        /* The slot must not hold the reference while the packet is being
+         * delivered: a packet sent from the delivery handler may grow the
+         * ring, which copies the slot and frees the old array.
+         */
+        packet->shared = NULL;
+
+        if (sender) {
+            ret = qemu_net_queue_deliver(queue,
+                                         sender,
+                                         packet->flags,
+                                         shared ? shared->data : packet->data,
+                                         packet->size);
+            /* The ring may have grown meanwhile */
+            packet = &queue->slots[queue->tail & (queue->nslots - 1)];
+            if (ret == 0) {
+                packet->shared = shared;
+                return false;
+            }
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        if (packet->capacity &&
+            atomic_read(&queue->retained) > NET_QUEUE_RETAIN_BYTES) {
+            atomic_sub(&queue->retained, packet->capacity);
+            g_free(packet->data);
+            packet->data = NULL;
+            packet->capacity = 0;
         }
 
-        g_free(packet);
+        /* Release the slot before the callback, which may send again */
+        smp_mb();
+        atomic_set(&queue->tail, queue->tail + 1);
+
+        if (shared) {
+            qemu_net_packet_buf_unref(shared);
+        }
+
+        if (sender && sent_cb) {
+            sent_cb(sender, ret);
+        }
     }
     return true;
 }
+
+void qemu_net_queue_query(NetQueue *queue, NetQueueInfo *info)
+{
+    info->depth = queue->nq_maxlen;
+    info->lockless = queue->bh != NULL;
+    info->count = atomic_read(&queue->head) - queue->tail;
+    info->max_count = atomic_read(&queue->max_count);
+    info->drops = atomic_read(&queue->drops);
+    info->buffer_size = atomic_read(&queue->retained);
+}
@@ -30,6 +30,7 @@
 #include <sys/wait.h>
 #endif
 #include "net/net.h"
+#include "net/queue.h"
 #include "clients.h"
 #include "hub.h"
 #include "monitor/monitor.h"
@@ -62,6 +63,9 @@ static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 #define SLIRP_CFG_HOSTFWD 1
 #define SLIRP_CFG_LEGACY  2
 
+/* Packets from the slirp thread waiting for the main loop */
+#define SLIRP_OUT_QUEUE_DEPTH 1024
+
 struct slirp_config_str {
     struct slirp_config_str *next;
     int flags;
@@ -73,6 +77,7 @@ typedef struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
     Slirp *slirp;
+    NetQueue *out_queue;
 #ifndef _WIN32
     char smb_dir[128];
 #endif
@@ -99,11 +104,23 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
+/* Called with the slirp lock held, usually from the slirp thread.  The lock
+ * serializes the producers of the lock-free out_queue.
+ */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
     SlirpState *s = opaque;
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    qemu_net_queue_send(s->out_queue, &s->nc, QEMU_NET_PACKET_FLAG_NONE,
+                        pkt, pkt_len, NULL);
+}
+
+static ssize_t net_slirp_deliver(NetClientState *sender, unsigned flags,
+                                 const uint8_t *data, size_t size,
+                                 void *opaque)
+{
+    qemu_send_packet(sender, data, size);
+    return size;
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
@@ -120,6 +137,7 @@ static void net_slirp_cleanup(NetClientState *nc)
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
     slirp_cleanup(s->slirp);
+    qemu_del_net_queue(s->out_queue);
     slirp_smb_cleanup(s);
     QTAILQ_REMOVE(&slirp_stacks, s, entry);
 }
@@ -242,6 +260,10 @@ static int net_slirp_init(NetClientState *peer, const char *model,
 
     s = DO_UPCAST(SlirpState, nc, nc);
 
+    s->out_queue = qemu_new_net_queue(net_slirp_deliver, s);
+    qemu_net_queue_set_depth(s->out_queue, SLIRP_OUT_QUEUE_DEPTH);
+    qemu_net_queue_enable_lockless(s->out_queue);
+
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
                           tftp_export, bootfile, dhcp, dns, dnssearch, s);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
@@ -39,11 +39,18 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Maximum number of packets read from the tap device per batch */
+#define TAP_BATCH_MAX 32
+
+/* Maximum number of peer buffers a packet is read into without copying */
+#define TAP_DIRECT_IOV_MAX 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -185,29 +192,96 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
-static void tap_send(void *opaque)
+/* Reads one packet, straight into the peer's receive buffers when possible,
+ * which is only the case when the peer wants the vnet header as the tap
+ * device produces it.  Packets that don't fit there are copied out into
+ * s->buf.
+ *
+ * Returns 1 if the packet went directly to the peer, 0 if it was stored
+ * in @pkt, or -1 if there was nothing to read.
+ */
+static int tap_read_one(TAPState *s, struct iovec *pkt)
 {
-    TAPState *s = opaque;
+    struct iovec iov[TAP_DIRECT_IOV_MAX + 1];
+    size_t guest_len = 0;
+    uint8_t *buf = s->buf;
+    int iovcnt = 0;
     int size;
 
-    do {
-        uint8_t *buf = s->buf;
+    if (s->using_vnet_hdr) {
+        iovcnt = qemu_net_rx_buffers_get(&s->nc, iov, TAP_DIRECT_IOV_MAX);
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+    if (iovcnt > 0) {
+        int cnt = iovcnt;
+
+        /* Catch what does not fit in the guest buffers */
+        guest_len = iov_size(iov, iovcnt);
+        if (guest_len < NET_BUFSIZE) {
+            iov[cnt].iov_base = buf + guest_len;
+            iov[cnt].iov_len = NET_BUFSIZE - guest_len;
+            cnt++;
+        }
+
+        size = readv(s->fd, iov, cnt);
         if (size <= 0) {
-            break;
+            qemu_net_rx_buffers_put(&s->nc, 0);
+            return -1;
+        }
+        if (size <= guest_len) {
+            qemu_net_rx_buffers_put(&s->nc, size);
+            return 1;
+        }
+
+        iov_to_buf(iov, iovcnt, 0, buf, guest_len);
+        qemu_net_rx_buffers_put(&s->nc, 0);
+    } else {
+        size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+        if (size <= 0) {
+            return -1;
         }
 
         if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
             buf  += s->host_vnet_hdr_len;
             size -= s->host_vnet_hdr_len;
         }
+    }
+
+    pkt->iov_base = buf;
+    pkt->iov_len = size;
+    return 0;
+}
+
+/* Reads up to TAP_BATCH_MAX packets per batch, so that the peer only has
+ * to do per-wakeup work such as injecting an interrupt once.  Each packet
+ * is handed over before the next one is read, and reading stops as soon as
+ * the peer cannot take more, rather than pulling packets off the tap device
+ * only to queue them.
+ */
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    struct iovec pkt;
+    int i;
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
+    do {
+        qemu_net_batch_begin(&s->nc);
+        for (i = 0; i < TAP_BATCH_MAX && qemu_can_send_packet(&s->nc); i++) {
+            int ret = tap_read_one(s, &pkt);
+
+            if (ret < 0) {
+                break;
+            }
+            if (ret == 0 &&
+                qemu_send_packet_async(&s->nc, pkt.iov_base, pkt.iov_len,
+                                       tap_send_completed) == 0) {
+                /* The peer queued the packet, wait until it is delivered */
+                tap_read_poll(s, false);
+                break;
+            }
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+        qemu_net_batch_end(&s->nc);
+    } while (i == TAP_BATCH_MAX);
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -622,6 +696,11 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
         int vhostfd;
+        VhostNetOptions options;
+
+        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        options.net_backend = &s->nc;
+        options.force = tap->has_vhostforce && tap->vhostforce;
 
         if (tap->has_vhostfd || tap->has_vhostfds) {
             vhostfd = monitor_handle_fd_param(cur_mon, vhostfdname);
@@ -629,11 +708,16 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                 return -1;
             }
         } else {
-            vhostfd = -1;
+            vhostfd = open("/dev/vhost-net", O_RDWR);
+            if (vhostfd < 0) {
+                error_report("tap: open vhost char device failed: %s",
+                             strerror(errno));
+                return -1;
+            }
         }
+        options.opaque = (void *)(uintptr_t)vhostfd;
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
+        s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
             return -1;
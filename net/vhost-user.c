@@ -0,0 +1,119 @@
+/*
+ * vhost-user network backend
+ *
+ * The virtio-net rings are run by an external process that connects to
+ * QEMU's guest memory and eventfds through the vhost-user protocol; QEMU
+ * itself never sees the packets.  See docs/specs/vhost-user.txt.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "clients.h"
+#include "net/vhost_net.h"
+#include "net/vhost-user.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/sockets.h"
+#include "sysemu/sysemu.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    int fd;
+    VHostNetState *vhost_net;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+/* Packets only reach us if the guest transmits before the backend has
+ * taken over the rings; there is nowhere to send them.
+ */
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->fd >= 0) {
+        closesocket(s->fd);
+        s->fd = -1;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    VhostNetOptions options;
+    NetClientState *nc;
+    VhostUserState *s;
+    Error *local_err = NULL;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    if (peer) {
+        error_report("vhost-user cannot be used with QEMU vlans, "
+                     "use -netdev");
+        return -1;
+    }
+
+    /* The backend maps guest RAM itself, see file_ram_alloc() */
+    if (!mem_path || !mem_prealloc) {
+        error_report("vhost-user requires guest memory shared with the "
+                     "backend, use -mem-path with -mem-prealloc");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path, &local_err);
+    if (fd < 0) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+
+    s = DO_UPCAST(VhostUserState, nc, nc);
+    s->fd = fd;
+
+    /* There is no userspace datapath to fall back to */
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.net_backend = nc;
+    options.opaque = (void *)(uintptr_t)fd;
+    options.force = true;
+
+    s->vhost_net = vhost_net_init(&options);
+    if (!s->vhost_net) {
+        error_report("vhost-user backend at %s could not be initialized",
+                     vhost_user->path);
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    return 0;
+}
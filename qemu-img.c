@@ -122,7 +122,17 @@ static void help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (default 75000)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-k' use kernel AIO implementation (on Linux only, requires '-t none')\n"
+           "  '-m' percentage of read requests, the rest are writes (default 100)\n"
+           "  '-o' offset at which sequential runs start and wrap around (default 0)\n"
+           "  '-r' use random instead of sequential offsets\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-S' distance between sequential requests (default: request size)\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -734,6 +744,10 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
+/* Number of sectors scanned at once while looking for the end of a run of
+ * zero or identical sectors */
+#define SCAN_CHUNK_SECTORS 128
+
 /*
  * Returns true iff the first sector pointed to by 'buf' contains at least
  * a non-NUL byte.
@@ -744,16 +758,28 @@ static int img_commit(int argc, char **argv)
 static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 {
     bool is_zero;
-    int i;
+    int i, chunk;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
-    for(i = 1; i < n; i++) {
-        buf += 512;
-        if (is_zero != buffer_is_zero(buf, 512)) {
+    i = 1;
+    if (is_zero) {
+        /* Long runs of zeroes are common; skip them a chunk at a time so that
+         * buffer_is_zero() can use its vectorized path. */
+        while (i < n) {
+            chunk = MIN(n - i, SCAN_CHUNK_SECTORS);
+            if (!buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                chunk * BDRV_SECTOR_SIZE)) {
+                break;
+            }
+            i += chunk;
+        }
+    }
+    for (; i < n; i++) {
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE, 512)) {
             break;
         }
     }
@@ -803,6 +829,113 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+typedef struct MapEntry {
+    int flags;
+    int depth;
+    int64_t start;
+    int64_t length;
+    int64_t offset;
+    BlockDriverState *bs;
+} MapEntry;
+
+/*
+ * Block status of the last range queried in one file of a backing chain.
+ * Walking the chain for every extent would query the upper layers over
+ * and over for the same large unallocated range; keeping the last answer
+ * for each layer lets get_block_status() only ask the layer that actually
+ * changes state.
+ */
+typedef struct BlockStatusCacheEntry {
+    BlockDriverState *bs;
+    int64_t start;
+    int64_t end;
+    int64_t ret;
+} BlockStatusCacheEntry;
+
+typedef struct BlockStatusCache {
+    int nb_layers;
+    BlockStatusCacheEntry *layers;
+} BlockStatusCache;
+
+static void block_status_cache_free(BlockStatusCache *cache)
+{
+    g_free(cache->layers);
+    cache->layers = NULL;
+    cache->nb_layers = 0;
+}
+
+static int64_t get_layer_status(BlockStatusCache *cache, int depth,
+                                BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors, int *pnum)
+{
+    BlockStatusCacheEntry *c;
+    int64_t ret;
+
+    if (depth >= cache->nb_layers) {
+        cache->layers = g_renew(BlockStatusCacheEntry, cache->layers,
+                                depth + 1);
+        memset(&cache->layers[cache->nb_layers], 0,
+               (depth + 1 - cache->nb_layers) * sizeof(*cache->layers));
+        cache->nb_layers = depth + 1;
+    }
+    c = &cache->layers[depth];
+
+    if (c->bs != bs || sector_num < c->start || sector_num >= c->end) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        c->bs = bs;
+        c->start = sector_num;
+        c->end = sector_num + *pnum;
+        c->ret = ret;
+        return ret;
+    }
+
+    ret = c->ret;
+    if (ret & BDRV_BLOCK_OFFSET_VALID) {
+        ret += (sector_num - c->start) << BDRV_SECTOR_BITS;
+    }
+    *pnum = MIN(nb_sectors, c->end - sector_num);
+    return ret;
+}
+
+static int get_block_status(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors, MapEntry *e,
+                            BlockStatusCache *cache)
+{
+    int64_t ret;
+    int depth;
+
+    depth = 0;
+    for (;;) {
+        ret = get_layer_status(cache, depth, bs, sector_num, nb_sectors,
+                               &nb_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        assert(nb_sectors);
+        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
+            break;
+        }
+        bs = bs->backing_hd;
+        if (bs == NULL) {
+            ret = 0;
+            break;
+        }
+
+        depth++;
+    }
+
+    e->start = sector_num * BDRV_SECTOR_SIZE;
+    e->length = nb_sectors * BDRV_SECTOR_SIZE;
+    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
+    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
+    e->depth = depth;
+    e->bs = bs;
+    return 0;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -813,7 +946,7 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
 static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     int *pnum)
 {
-    int res, i;
+    int res, i, chunk;
 
     if (n <= 0) {
         *pnum = 0;
@@ -821,11 +954,23 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     }
 
     res = !!memcmp(buf1, buf2, 512);
-    for(i = 1; i < n; i++) {
-        buf1 += 512;
-        buf2 += 512;
-
-        if (!!memcmp(buf1, buf2, 512) != res) {
+    i = 1;
+    if (!res) {
+        /* Identical data is the common case; compare whole chunks with a
+         * single memcmp() and only go sector by sector in the chunk that
+         * contains the first difference. */
+        while (i < n) {
+            chunk = MIN(n - i, SCAN_CHUNK_SECTORS);
+            if (memcmp(buf1 + i * BDRV_SECTOR_SIZE, buf2 + i * BDRV_SECTOR_SIZE,
+                       chunk * BDRV_SECTOR_SIZE)) {
+                break;
+            }
+            i += chunk;
+        }
+    }
+    for (; i < n; i++) {
+        if (!!memcmp(buf1 + i * BDRV_SECTOR_SIZE, buf2 + i * BDRV_SECTOR_SIZE,
+                     512) != res) {
             break;
         }
     }
@@ -836,50 +981,255 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Number of read requests per image that img_compare keeps in flight */
+#define COMPARE_IN_FLIGHT 8
+
 static int64_t sectors_to_bytes(int64_t sectors)
 {
     return sectors << BDRV_SECTOR_BITS;
 }
 
-static int64_t sectors_to_process(int64_t total, int64_t from)
-{
-    return MIN(total - from, IO_BUF_SIZE >> BDRV_SECTOR_BITS);
-}
+typedef struct CompareImage {
+    BlockDriverState *bs;
+    const char *filename;
+    int64_t total_sectors;
+    BlockStatusCache cache;
+
+    /* Block status of [status_start, status_end) */
+    int64_t status_start;
+    int64_t status_end;
+    bool zero;          /* reads as zeroes */
+    bool allocated;     /* allocated in the chain, only used in strict mode */
+} CompareImage;
+
+typedef struct CompareRead {
+    CompareImage *img;  /* NULL if this side is known to read as zeroes */
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool pending;
+    int ret;
+} CompareRead;
+
+typedef struct CompareRequest {
+    int64_t sector_num;
+    int nb_sectors;
+    CompareRead rd[2];
+} CompareRequest;
+
+typedef struct CompareState {
+    CompareImage img[2];
+    CompareRequest reqs[COMPARE_IN_FLIGHT];
+    bool strict;
+    bool quiet;
+    uint64_t progress_base;
+} CompareState;
 
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Returns 0 in case sectors are filled with 0, 1 if sectors contain non-zero
- * data and negative value on error.
- *
- * @param bs:  Driver used for accessing file
- * @param sect_num: Number of first sector to check
- * @param sect_count: Number of sectors to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * Makes sure that the cached block status of img covers sector_num.  Sectors
+ * past the end of the image read as zeroes, up to 'end'.
  */
-static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
-                               int sect_count, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int compare_get_status(CompareState *s, CompareImage *img,
+                              int64_t sector_num, int64_t end)
 {
-    int pnum, ret = 0;
-    ret = bdrv_read(bs, sect_num, buffer, sect_count);
+    MapEntry e;
+    int64_t n;
+    int pnum, ret;
+
+    if (sector_num >= img->status_start && sector_num < img->status_end) {
+        return 0;
+    }
+
+    if (sector_num >= img->total_sectors) {
+        img->status_start = sector_num;
+        img->status_end = end;
+        img->zero = true;
+        img->allocated = false;
+        return 0;
+    }
+
+    n = MIN(img->total_sectors, end) - sector_num;
+    n = MIN(n, 1 << (30 - BDRV_SECTOR_BITS));
+    ret = get_block_status(img->bs, sector_num, n, &e, &img->cache);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     sectors_to_bytes(sect_num), filename, strerror(-ret));
         return ret;
     }
-    ret = is_allocated_sectors(buffer, sect_count, &pnum);
-    if (ret || pnum != sect_count) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                sectors_to_bytes(ret ? sect_num : sect_num + pnum));
+    n = e.length >> BDRV_SECTOR_BITS;
+
+    if (s->strict) {
+        ret = bdrv_is_allocated_above(img->bs, NULL, sector_num, n, &pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        img->allocated = ret;
+        n = MIN(n, pnum);
+    }
+
+    img->status_start = sector_num;
+    img->status_end = sector_num + n;
+    img->zero = (e.flags & BDRV_BLOCK_ZERO) || !(e.flags & BDRV_BLOCK_DATA);
+    return 0;
+}
+
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareRead *rd = opaque;
+
+    rd->ret = ret;
+    rd->pending = false;
+}
+
+static void compare_read(CompareRead *rd, CompareImage *img,
+                         int64_t sector_num, int nb_sectors)
+{
+    BlockDriverAIOCB *acb;
+
+    rd->img = img;
+    rd->ret = 0;
+    if (!img) {
+        return;
+    }
+
+    rd->iov.iov_base = rd->buf;
+    rd->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&rd->qiov, &rd->iov, 1);
+
+    rd->pending = true;
+    acb = bdrv_aio_readv(img->bs, sector_num, &rd->qiov, nb_sectors,
+                         compare_read_cb, rd);
+    if (!acb) {
+        rd->pending = false;
+        rd->ret = -EIO;
+    }
+}
+
+static void compare_wait(CompareRequest *req)
+{
+    while (req->rd[0].pending || req->rd[1].pending) {
+        qemu_aio_wait();
+    }
+}
+
+/*
+ * Checks the data of a completed request.  If only one side was read, the
+ * other one is known to be zero and the data read must be all zeroes.
+ */
+static int compare_check_request(CompareState *s, CompareRequest *req)
+{
+    CompareRead *rd;
+    int i, pnum, ret;
+
+    for (i = 0; i < 2; i++) {
+        rd = &req->rd[i];
+        if (rd->ret < 0) {
+            error_report("Error while reading offset %" PRId64 " of %s: %s",
+                         sectors_to_bytes(req->sector_num), rd->img->filename,
+                         strerror(-rd->ret));
+            return 4;
+        }
+    }
+
+    if (req->rd[0].img && req->rd[1].img) {
+        ret = compare_sectors(req->rd[0].buf, req->rd[1].buf,
+                              req->nb_sectors, &pnum);
+    } else {
+        rd = &req->rd[req->rd[0].img ? 0 : 1];
+        ret = is_allocated_sectors(rd->buf, req->nb_sectors, &pnum);
+    }
+    if (ret || pnum != req->nb_sectors) {
+        qprintf(s->quiet, "Content mismatch at offset %" PRId64 "!\n",
+                sectors_to_bytes(ret ? req->sector_num
+                                     : req->sector_num + pnum));
         return 1;
     }
 
+    qemu_progress_print(((float) req->nb_sectors / s->progress_base) * 100,
+                        100);
     return 0;
 }
 
+/*
+ * Compares [start, end) of both images.  Ranges that read as zeroes on both
+ * sides are skipped using the block status alone; everything else is read
+ * with up to COMPARE_IN_FLIGHT requests in flight and checked in order, so
+ * that the first difference is the one reported.
+ *
+ * Returns 0 if the range is identical, otherwise the img_compare exit code.
+ */
+static int compare_range(CompareState *s, int64_t start, int64_t end)
+{
+    CompareImage *img1 = &s->img[0], *img2 = &s->img[1];
+    CompareRequest *req;
+    int64_t sector_num = start;
+    int64_t n;
+    int head = 0, queued = 0;
+    int i, ret = 0;
+
+    for (;;) {
+        while (queued < COMPARE_IN_FLIGHT && sector_num < end) {
+            for (i = 0; i < 2; i++) {
+                ret = compare_get_status(s, &s->img[i], sector_num, end);
+                if (ret < 0) {
+                    break;
+                }
+            }
+            if (ret < 0 || (s->strict && img1->allocated != img2->allocated)) {
+                /* Requests before this point may still find a difference */
+                if (queued > 0) {
+                    break;
+                }
+                if (ret < 0) {
+                    error_report("Sector allocation test failed for %s",
+                                 s->img[i].filename);
+                    ret = 3;
+                } else {
+                    qprintf(s->quiet, "Strict mode: Offset %" PRId64
+                            " allocation mismatch!\n",
+                            sectors_to_bytes(sector_num));
+                    ret = 1;
+                }
+                goto out;
+            }
+
+            n = MIN(img1->status_end, img2->status_end);
+            n = MIN(n, end) - sector_num;
+            if (img1->zero && img2->zero) {
+                sector_num += n;
+                qemu_progress_print(((float) n / s->progress_base) * 100, 100);
+                continue;
+            }
+
+            n = MIN(n, IO_BUF_SIZE >> BDRV_SECTOR_BITS);
+            req = &s->reqs[(head + queued) % COMPARE_IN_FLIGHT];
+            req->sector_num = sector_num;
+            req->nb_sectors = n;
+            compare_read(&req->rd[0], img1->zero ? NULL : img1, sector_num, n);
+            compare_read(&req->rd[1], img2->zero ? NULL : img2, sector_num, n);
+            sector_num += n;
+            queued++;
+        }
+
+        if (queued == 0) {
+            break;
+        }
+
+        req = &s->reqs[head];
+        compare_wait(req);
+        ret = compare_check_request(s, req);
+        if (ret) {
+            goto out;
+        }
+        head = (head + 1) % COMPARE_IN_FLIGHT;
+        queued--;
+    }
+
+out:
+    for (i = 0; i < COMPARE_IN_FLIGHT; i++) {
+        compare_wait(&s->reqs[i]);
+    }
+    return ret;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -893,16 +1243,12 @@ static int img_compare(int argc, char **argv)
     BlockDriverState *bs1, *bs2;
     int64_t total_sectors1, total_sectors2;
     uint8_t *buf1 = NULL, *buf2 = NULL;
-    int pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int64_t total_sectors;
-    int64_t sector_num = 0;
-    int64_t nb_sectors;
-    int c, pnum;
+    int c, i;
     uint64_t bs_sectors;
-    uint64_t progress_base;
+    CompareState s = {};
 
     for (;;) {
         c = getopt(argc, argv, "hpf:F:sq");
@@ -961,14 +1307,11 @@ static int img_compare(int argc, char **argv)
         goto out2;
     }
 
-    buf1 = qemu_blockalign(bs1, IO_BUF_SIZE);
-    buf2 = qemu_blockalign(bs2, IO_BUF_SIZE);
     bdrv_get_geometry(bs1, &bs_sectors);
     total_sectors1 = bs_sectors;
     bdrv_get_geometry(bs2, &bs_sectors);
     total_sectors2 = bs_sectors;
     total_sectors = MIN(total_sectors1, total_sectors2);
-    progress_base = MAX(total_sectors1, total_sectors2);
 
     qemu_progress_print(0, 100);
 
@@ -978,130 +1321,39 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    for (;;) {
-        nb_sectors = sectors_to_process(total_sectors, sector_num);
-        if (nb_sectors <= 0) {
-            break;
-        }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        nb_sectors = MIN(pnum1, pnum2);
+    buf1 = qemu_blockalign(bs1, COMPARE_IN_FLIGHT * IO_BUF_SIZE);
+    buf2 = qemu_blockalign(bs2, COMPARE_IN_FLIGHT * IO_BUF_SIZE);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    ret = 1;
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    goto out;
-                }
-            }
-        } else {
-            if (strict) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " allocation mismatch!\n",
-                        sectors_to_bytes(sector_num));
-                goto out;
-            }
+    s.img[0] = (CompareImage) {
+        .bs             = bs1,
+        .filename       = filename1,
+        .total_sectors  = total_sectors1,
+    };
+    s.img[1] = (CompareImage) {
+        .bs             = bs2,
+        .filename       = filename2,
+        .total_sectors  = total_sectors2,
+    };
+    s.strict = strict;
+    s.quiet = quiet;
+    s.progress_base = MAX(total_sectors1, total_sectors2);
+    for (i = 0; i < COMPARE_IN_FLIGHT; i++) {
+        s.reqs[i].rd[0].buf = buf1 + i * IO_BUF_SIZE;
+        s.reqs[i].rd[1].buf = buf2 + i * IO_BUF_SIZE;
+    }
 
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(bs2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                if (ret < 0) {
-                    ret = 4;
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                }
-                goto out;
-            }
-        }
-        sector_num += nb_sectors;
-        qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
+    ret = compare_range(&s, 0, total_sectors);
+    if (ret) {
+        goto out;
     }
 
     if (total_sectors1 != total_sectors2) {
-        BlockDriverState *bs_over;
-        int64_t total_sectors_over;
-        const char *filename_over;
-
+        /* The shorter image reads as zeroes past its end */
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_sectors1 > total_sectors2) {
-            total_sectors_over = total_sectors1;
-            bs_over = bs1;
-            filename_over = filename1;
-        } else {
-            total_sectors_over = total_sectors2;
-            bs_over = bs2;
-            filename_over = filename2;
-        }
-
-        for (;;) {
-            nb_sectors = sectors_to_process(total_sectors_over, sector_num);
-            if (nb_sectors <= 0) {
-                break;
-            }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
-
-            }
-            nb_sectors = pnum;
-            if (ret) {
-                ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    if (ret < 0) {
-                        ret = 4;
-                        error_report("Error while reading offset %" PRId64
-                                     " of %s: %s", sectors_to_bytes(sector_num),
-                                     filename_over, strerror(-ret));
-                    }
-                    goto out;
-                }
-            }
-            sector_num += nb_sectors;
-            qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
+        ret = compare_range(&s, total_sectors,
+                            MAX(total_sectors1, total_sectors2));
+        if (ret) {
+            goto out;
         }
     }
 
@@ -1109,6 +1361,8 @@ static int img_compare(int argc, char **argv)
     ret = 0;
 
 out:
+    block_status_cache_free(&s.img[0].cache);
+    block_status_cache_free(&s.img[1].cache);
     bdrv_unref(bs2);
     qemu_vfree(buf1);
     qemu_vfree(buf2);
@@ -1466,6 +1720,7 @@ static int img_convert(int argc, char **argv)
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
         int has_zero_init = bdrv_has_zero_init(out_bs);
+        bool copy_offload = true;
 
         sector_num = 0; // total number of sectors converted so far
         nb_sectors = total_sectors - sector_num;
@@ -1523,6 +1778,40 @@ static int img_convert(int argc, char **argv)
                 n1 = n;
             }
 
+            /* Let the host copy the data without reading it into our buffer
+             * if both images support it. Holes in the input stay holes in
+             * the output. */
+            if (copy_offload && has_zero_init) {
+                ret = bdrv_get_block_status(bs[bs_i], sector_num - bs_offset,
+                                            n, &n1);
+                if (ret < 0) {
+                    error_report("error while reading metadata for sector "
+                                 "%" PRId64 ": %s",
+                                 sector_num - bs_offset, strerror(-ret));
+                    goto out;
+                }
+                if (ret & BDRV_BLOCK_ZERO) {
+                    sector_num += n1;
+                    qemu_progress_print(local_progress, 100);
+                    continue;
+                }
+                n = n1;
+            }
+            if (copy_offload) {
+                ret = bdrv_copy_range(bs[bs_i], sector_num - bs_offset,
+                                      out_bs, sector_num, n);
+                if (ret == 0) {
+                    sector_num += n;
+                    qemu_progress_print(local_progress, 100);
+                    continue;
+                } else if (ret != -ENOTSUP) {
+                    error_report("error while copying sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    goto out;
+                }
+                copy_offload = false;
+            }
+
             ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
             if (ret < 0) {
                 error_report("error while reading sector %" PRId64 ": %s",
@@ -1799,15 +2088,6 @@ static int img_info(int argc, char **argv)
 }
 
 
-typedef struct MapEntry {
-    int flags;
-    int depth;
-    int64_t start;
-    int64_t length;
-    int64_t offset;
-    BlockDriverState *bs;
-} MapEntry;
-
 static void dump_map_entry(OutputFormat output_format, MapEntry *e,
                            MapEntry *next)
 {
@@ -1850,45 +2130,6 @@ static void dump_map_entry(OutputFormat output_format, MapEntry *e,
     }
 }
 
-static int get_block_status(BlockDriverState *bs, int64_t sector_num,
-                            int nb_sectors, MapEntry *e)
-{
-    int64_t ret;
-    int depth;
-
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
-
-    depth = 0;
-    for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
-        if (ret < 0) {
-            return ret;
-        }
-        assert(nb_sectors);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
-        }
-        bs = bs->backing_hd;
-        if (bs == NULL) {
-            ret = 0;
-            break;
-        }
-
-        depth++;
-    }
-
-    e->start = sector_num * BDRV_SECTOR_SIZE;
-    e->length = nb_sectors * BDRV_SECTOR_SIZE;
-    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
-    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
-    e->depth = depth;
-    e->bs = bs;
-    return 0;
-}
-
 static int img_map(int argc, char **argv)
 {
     int c;
@@ -1897,6 +2138,7 @@ static int img_map(int argc, char **argv)
     const char *filename, *fmt, *output;
     int64_t length;
     MapEntry curr = { .length = 0 }, next;
+    BlockStatusCache cache = {};
     int ret = 0;
 
     fmt = NULL;
@@ -1961,7 +2203,7 @@ static int img_map(int argc, char **argv)
         /* Probe up to 1 GiB at a time.  */
         nsectors_left = DIV_ROUND_UP(length, BDRV_SECTOR_SIZE) - sector_num;
         n = MIN(1 << (30 - BDRV_SECTOR_BITS), nsectors_left);
-        ret = get_block_status(bs, sector_num, n, &next);
+        ret = get_block_status(bs, sector_num, n, &next, &cache);
 
         if (ret < 0) {
             error_report("Could not read file metadata: %s", strerror(-ret));
@@ -1985,6 +2227,7 @@ static int img_map(int argc, char **argv)
     dump_map_entry(output_format, &curr, NULL);
 
 out:
+    block_status_cache_free(&cache);
     bdrv_unref(bs);
     return ret < 0;
 }
@@ -2613,6 +2856,345 @@ out:
     return 0;
 }
 
+typedef struct BenchData {
+    BlockDriverState *bs;
+    uint64_t image_size;
+    int bufsize;
+    int step;
+    int nrreq;
+    int n;
+    int in_flight;
+    int read_mix;
+    bool random;
+    GRand *rand;
+    uint64_t start_offset;
+    uint64_t offset;
+    int64_t *latency;
+    int nr_done;
+    int ret;
+} BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start_ns;
+} BenchRequest;
+
+static void bench_cb(void *opaque, int ret);
+
+static int bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    BlockDriverAIOCB *acb;
+    uint64_t offset;
+    bool write;
+
+    if (b->random) {
+        /* Whole buffers between the start offset and the end of the image */
+        offset = b->start_offset +
+            (uint64_t) g_rand_double_range(b->rand, 0,
+                (b->image_size - b->start_offset) / b->bufsize) * b->bufsize;
+    } else {
+        offset = b->offset;
+        b->offset += b->step;
+        if (b->offset + b->bufsize > b->image_size) {
+            b->offset = b->start_offset;
+        }
+    }
+
+    if (b->read_mix == 100) {
+        write = false;
+    } else if (b->read_mix == 0) {
+        write = true;
+    } else {
+        write = g_rand_int_range(b->rand, 0, 100) >= b->read_mix;
+    }
+
+    b->n--;
+    b->in_flight++;
+    req->start_ns = get_clock();
+
+    if (write) {
+        acb = bdrv_aio_writev(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                              b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    } else {
+        acb = bdrv_aio_readv(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                             b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    }
+    if (!acb) {
+        b->in_flight--;
+        return -EIO;
+    }
+    return 0;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    b->in_flight--;
+    if (ret < 0) {
+        if (b->ret == 0) {
+            b->ret = ret;
+        }
+        return;
+    }
+    b->latency[b->nr_done++] = get_clock() - req->start_ns;
+
+    if (b->n > 0 && b->ret == 0) {
+        ret = bench_submit(req);
+        if (ret < 0) {
+            b->ret = ret;
+        }
+    }
+}
+
+static int bench_compare_latency(const void *a, const void *b)
+{
+    int64_t la = *(const int64_t *) a;
+    int64_t lb = *(const int64_t *) b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static double bench_percentile(const int64_t *latency, int nr, double p)
+{
+    int i = (int) (p * nr / 100);
+
+    return latency[MIN(i, nr - 1)] / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, i;
+    const char *fmt = NULL, *filename, *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    int flags = 0;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    size_t step = 0;
+    int read_mix = 100;
+    bool random = false;
+    BlockDriverState *bs = NULL;
+    BenchRequest *reqs = NULL;
+    uint8_t *buf = NULL;
+    int64_t image_size, start, elapsed, sum;
+    BenchData data = {};
+    char *end;
+
+    for (;;) {
+        c = getopt(argc, argv, "hc:d:f:km:o:qrs:S:t:");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 0);
+            if (*end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth <= 0 || depth > 4096) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'k':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'm':
+            read_mix = strtol(optarg, &end, 0);
+            if (*end || read_mix < 0 || read_mix > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            break;
+        case 'o':
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+        {
+            int64_t sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            step = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help();
+    }
+    filename = argv[argc - 1];
+
+    if (step == 0) {
+        step = bufsize;
+    }
+    if ((bufsize | step | offset) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Buffer size, step size and offset must be multiples "
+                     "of 512");
+        return 1;
+    }
+
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+    if ((flags & BDRV_O_NATIVE_AIO) && !(flags & BDRV_O_NOCACHE)) {
+        error_report("Kernel AIO (-k) requires cache mode 'none' (-t none)");
+        return 1;
+    }
+    if (read_mix < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags, true, quiet);
+    if (!bs) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = bdrv_getlength(bs);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = image_size;
+        goto out;
+    }
+    if (image_size < offset + bufsize) {
+        error_report("Image is too small for the requested offset and "
+                     "buffer size");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .bs         = bs,
+        .image_size = image_size,
+        .bufsize    = bufsize,
+        .step       = step,
+        .nrreq      = depth,
+        .n          = count,
+        .read_mix   = read_mix,
+        .random     = random,
+        .rand       = g_rand_new_with_seed(0x42),
+        .start_offset = offset,
+        .offset     = offset,
+        .latency    = g_new(int64_t, count),
+    };
+
+    qprintf(quiet, "Sending %d requests, %zu bytes each, %d in parallel "
+            "(starting at offset %" PRId64 ", %s, %d%% reads)\n",
+            count, bufsize, depth, offset,
+            random ? "random" : "sequential", read_mix);
+
+    buf = qemu_blockalign(bs, (size_t) depth * bufsize);
+    memset(buf, 0xa5, (size_t) depth * bufsize);
+
+    reqs = g_new0(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = &data;
+        reqs[i].iov.iov_base = buf + i * bufsize;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    start = get_clock();
+    for (i = 0; i < depth && data.n > 0 && data.ret == 0; i++) {
+        ret = bench_submit(&reqs[i]);
+        if (ret < 0) {
+            data.ret = ret;
+        }
+    }
+    while (data.in_flight > 0) {
+        qemu_aio_wait();
+    }
+    elapsed = get_clock() - start;
+
+    ret = data.ret;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        goto out;
+    }
+
+    qsort(data.latency, data.nr_done, sizeof(data.latency[0]),
+          bench_compare_latency);
+    sum = 0;
+    for (i = 0; i < data.nr_done; i++) {
+        sum += data.latency[i];
+    }
+
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", elapsed / 1e9);
+    qprintf(quiet, "IOPS: %.0f, bandwidth: %.2f MB/s\n",
+            data.nr_done * 1e9 / elapsed,
+            (double) data.nr_done * bufsize * 1e9 / elapsed / (1 << 20));
+    qprintf(quiet, "Latency (us): min %.1f, avg %.1f, 50%% %.1f, "
+            "90%% %.1f, 99%% %.1f, 99.9%% %.1f, max %.1f\n",
+            data.latency[0] / 1000.0,
+            (double) sum / data.nr_done / 1000.0,
+            bench_percentile(data.latency, data.nr_done, 50),
+            bench_percentile(data.latency, data.nr_done, 90),
+            bench_percentile(data.latency, data.nr_done, 99),
+            bench_percentile(data.latency, data.nr_done, 99.9),
+            data.latency[data.nr_done - 1] / 1000.0);
+
+out:
+    g_free(reqs);
+    qemu_vfree(buf);
+    g_free(data.latency);
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    if (bs) {
+        bdrv_unref(bs);
+    }
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
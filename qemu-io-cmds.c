@@ -1329,6 +1329,7 @@ out:
 }
 
 struct aio_ctx {
+    BlockDriverState *bs;
     QEMUIOVector qiov;
     int64_t offset;
     char *buf;
@@ -1338,6 +1339,7 @@ struct aio_ctx {
     int Pflag;
     int pattern;
     struct timeval t1;
+    BlockAcctCookie acct;
 };
 
 static void aio_write_done(void *opaque, int ret)
@@ -1346,7 +1348,7 @@ static void aio_write_done(void *opaque, int ret)
     struct timeval t2;
 
     gettimeofday(&t2, NULL);
-
+    bdrv_acct_done(ctx->bs, &ctx->acct);
 
     if (ret < 0) {
         printf("aio_write failed: %s\n", strerror(-ret));
@@ -1373,6 +1375,7 @@ static void aio_read_done(void *opaque, int ret)
     struct timeval t2;
 
     gettimeofday(&t2, NULL);
+    bdrv_acct_done(ctx->bs, &ctx->acct);
 
     if (ret < 0) {
         printf("readv failed: %s\n", strerror(-ret));
@@ -1445,6 +1448,8 @@ static int aio_read_f(BlockDriverState *bs, int argc, char **argv)
     int nr_iov, c;
     struct aio_ctx *ctx = g_new0(struct aio_ctx, 1);
 
+    ctx->bs = bs;
+
     while ((c = getopt(argc, argv, "CP:qv")) != EOF) {
         switch (c) {
         case 'C':
@@ -1498,6 +1503,7 @@ static int aio_read_f(BlockDriverState *bs, int argc, char **argv)
     }
 
     gettimeofday(&ctx->t1, NULL);
+    bdrv_acct_start(bs, &ctx->acct, ctx->qiov.size, BDRV_ACCT_READ);
     bdrv_aio_readv(bs, ctx->offset >> 9, &ctx->qiov,
                    ctx->qiov.size >> 9, aio_read_done, ctx);
     return 0;
@@ -1541,6 +1547,8 @@ static int aio_write_f(BlockDriverState *bs, int argc, char **argv)
     int pattern = 0xcd;
     struct aio_ctx *ctx = g_new0(struct aio_ctx, 1);
 
+    ctx->bs = bs;
+
     while ((c = getopt(argc, argv, "CqP:")) != EOF) {
         switch (c) {
         case 'C':
@@ -1590,6 +1598,7 @@ static int aio_write_f(BlockDriverState *bs, int argc, char **argv)
     }
 
     gettimeofday(&ctx->t1, NULL);
+    bdrv_acct_start(bs, &ctx->acct, ctx->qiov.size, BDRV_ACCT_WRITE);
     bdrv_aio_writev(bs, ctx->offset >> 9, &ctx->qiov,
                     ctx->qiov.size >> 9, aio_write_done, ctx);
     return 0;
@@ -20,6 +20,8 @@
 #include "block/block.h"
 #include "block/nbd.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -38,6 +40,7 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_IOTHREAD 4
 
 static NBDExport *exp;
 static int verbose;
@@ -48,6 +51,13 @@ static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
 static int nb_fds;
 
+/* With --iothread the export is served by a thread of its own, and the
+ * main loop only accepts new connections.
+ */
+static AioContext *iothread_ctx;
+static QemuThread iothread;
+static bool iothread_stopping;
+
 static void usage(const char *name)
 {
     (printf) (
@@ -65,6 +75,7 @@ static void usage(const char *name)
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
+"      --iothread       serve clients from a separate I/O thread\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET  offset into the image\n"
@@ -266,21 +277,38 @@ out:
     return (void *) EXIT_FAILURE;
 }
 
+static void *nbd_iothread_run(void *opaque)
+{
+    while (!iothread_stopping) {
+        aio_context_acquire(iothread_ctx);
+        while (!iothread_stopping && aio_poll(iothread_ctx, true)) {
+            /* Keep going until aio_notify(), possibly because the main
+             * loop wants the AioContext.
+             */
+        }
+        aio_context_release(iothread_ctx);
+    }
+    return NULL;
+}
+
 static int nbd_can_accept(void *opaque)
 {
-    return nb_fds < shared;
+    return atomic_read(&nb_fds) < shared;
 }
 
+/* The export and its clients are closed in the AioContext of the export,
+ * which may belong to the I/O thread.
+ */
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
     state = TERMINATED;
+    qemu_notify_event();
 }
 
 static void nbd_client_closed(NBDClient *client)
 {
-    nb_fds--;
-    if (nb_fds == 0 && !persistent && state == RUNNING) {
+    if (atomic_fetch_dec(&nb_fds) == 1 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
     qemu_notify_event();
@@ -299,8 +327,16 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
-        nb_fds++;
+    if (fd < 0) {
+        return;
+    }
+
+    /* Count the client first, it may be closed by the I/O thread as soon
+     * as it is registered.
+     */
+    atomic_inc(&nb_fds);
+    if (!nbd_client_new(exp, fd, nbd_client_closed)) {
+        atomic_dec(&nb_fds);
     }
 }
 
@@ -338,6 +374,7 @@ int main(int argc, char **argv)
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
+        { "iothread", 0, NULL, QEMU_NBD_OPT_IOTHREAD },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -350,6 +387,7 @@ int main(int argc, char **argv)
     int fd;
     bool seen_cache = false;
     bool seen_discard = false;
+    bool use_iothread = false;
 #ifdef CONFIG_LINUX_AIO
     bool seen_aio = false;
 #endif
@@ -406,6 +444,9 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid discard mode `%s'", optarg);
             }
             break;
+        case QEMU_NBD_OPT_IOTHREAD:
+            use_iothread = true;
+            break;
         case 'b':
             bindto = optarg;
             break;
@@ -591,6 +632,13 @@ int main(int argc, char **argv)
         }
     }
 
+    if (use_iothread) {
+        iothread_ctx = aio_context_new();
+        qemu_thread_create(&iothread, nbd_iothread_run, NULL,
+                           QEMU_THREAD_JOINABLE);
+        bdrv_set_aio_context(bs, iothread_ctx);
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
 
     if (sockpath) {
@@ -629,13 +677,25 @@ int main(int argc, char **argv)
     do {
         main_loop_wait(false);
         if (state == TERMINATE) {
+            AioContext *ctx = bdrv_get_aio_context(bs);
+
             state = TERMINATING;
+            aio_context_acquire(ctx);
             nbd_export_close(exp);
             nbd_export_put(exp);
+            aio_context_release(ctx);
             exp = NULL;
         }
     } while (state != TERMINATED);
 
+    if (use_iothread) {
+        iothread_stopping = true;
+        aio_notify(iothread_ctx);
+        qemu_thread_join(&iothread);
+        bdrv_set_aio_context(bs, qemu_get_aio_context());
+        aio_context_unref(iothread_ctx);
+    }
+
     bdrv_close(bs);
     if (sockpath) {
         unlink(sockpath);
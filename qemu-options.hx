@@ -235,7 +235,8 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  The memory is then mapped shared,
+so that vhost-user backends can access it.
 ETEXI
 #endif
 
@@ -1408,6 +1409,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                on host and listening for incoming connections on 'socketpath'.\n"
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
+#endif
+#ifdef CONFIG_VHOST_NET_USER
+    "-netdev vhost-user,id=str,path=socketpath\n"
+    "                hand the virtio-net datapath to a vhost-user backend process\n"
+    "                listening on the UNIX socket 'socketpath'\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1424,6 +1430,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "vde|"
 #endif
     "socket|"
+#ifdef CONFIG_VHOST_NET_USER
+    "vhost-user|"
+#endif
     "hubport],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
@@ -1754,6 +1763,27 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
+The hub learns the MAC addresses seen on each port and forwards unicast frames
+for a known address only to the port it was last seen on.  Broadcast, multicast
+and unknown unicast frames go to all ports, and @option{-net dump} always sees
+all traffic.
+
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}
+
+Hand the datapath of a virtio-net device to a vhost-user backend process
+listening on the UNIX socket @var{socketpath}.  The backend accesses guest
+memory and the virtqueues directly, so guest RAM must be shared with it:
+use @option{-mem-path} together with @option{-mem-prealloc}.  The protocol
+is described in @file{docs/specs/vhost-user.txt}.  Migration is not
+supported.
+
+Example:
+@example
+qemu -m 512 -mem-path /dev/hugepages -mem-prealloc \
+     -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+     -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -2117,6 +2147,34 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+The number of requests that are kept in flight on each connection can be
+set with the @option{queue-depth} option (default 64).  The @option{connections}
+option opens several connections to the same export and spreads the
+requests across them (default 1).  The server must accept that many clients;
+@command{qemu-nbd} serves only one unless it is started with @option{-e}:
+@example
+qemu-nbd -p 30000 -e 4 disk.img
+qemu-system-i386 --drive file.driver=nbd,file.host=192.0.2.1,file.port=30000,file.connections=4
+@end example
+If the server refuses an additional connection, QEMU carries on with the
+connections that were established.  A server that leaves the additional
+connections pending, as @command{qemu-nbd} does, makes QEMU wait for them.
+
+@item rcache
+The rcache filter keeps data that was read from the image in memory, and
+reads ahead when the guest reads sequentially.  It is useful on top of
+network protocols that do not benefit from the host page cache.  Writes
+are passed through and invalidate the cached data.
+
+Syntax for the rcache filter
+``rcache:<image>''
+
+The cache size (default 32M) and the read-ahead size (default 256k) are
+set with the @option{size} and @option{readahead} options:
+@example
+qemu-system-i386 --drive file=rcache:nbd:192.0.2.1:30000,file.size=128M,file.readahead=1M
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
@@ -1171,7 +1171,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1198,6 +1198,8 @@ Arguments:
 - "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
 - "buf_size": maximum amount of data in flight from source to target, in bytes
   (json-int, default 10M)
+- "max-in-flight": maximum number of concurrent requests issued by the job
+  (json-int, default 16)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
   allocated in the topmost image, or "none" to only replicate new I/O
@@ -1212,6 +1214,10 @@ between 4096 and 65536, if the image format defines one.  If the format
 does not define a cluster size, the default value of the granularity
 is 65536.
 
+Adjacent dirty chunks are copied with a single request of up to
+buf-size / max-in-flight bytes.  Ranges that read as zero in the source
+are not copied; the job zeroes them in the target instead.
+
 
 Example:
 
@@ -1522,6 +1528,74 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Enable, reconfigure or disable the latency histograms of a block drive.  The
+counters of all histograms are reset.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries in nano-seconds for all request types without
+                their own list (json-array of json-int, optional)
+- "boundaries-read": bin boundaries for reads (json-array of json-int,
+                     optional)
+- "boundaries-write": bin boundaries for writes (json-array of json-int,
+                      optional)
+- "boundaries-flush": bin boundaries for cache flushes (json-array of
+                      json-int, optional)
+
+The histogram of a request type is disabled if no list applies to it or if
+that list is empty.  Boundaries must be positive and strictly ascending.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ 100000, 1000000, 10000000 ],
+                    "boundaries-flush": [ 1000000, 100000000 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-slow-request-log-set",
+        .args_type  = "device:B,threshold-ns:l,size:l?",
+        .mhandler.cmd_new = qmp_marshal_input_block_slow_request_log_set,
+    },
+
+SQMP
+block-slow-request-log-set
+--------------------------
+
+Configure the slow request log of a block drive.  The log keeps the most
+recent requests whose latency reached the threshold; reconfiguring it drops
+all logged requests.  See query-block-slow-requests.
+
+Arguments:
+
+- "device": device name (json-string)
+- "threshold-ns": latency in nano-seconds from which a request is logged, 0
+                  disables the log (json-int)
+- "size": number of requests to keep, 1 to 4096, default 64 (json-int,
+          optional)
+
+Example:
+
+-> { "execute": "block-slow-request-log-set",
+     "arguments": { "device": "virtio0", "threshold-ns": 100000000 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2023,6 +2097,27 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "cache_hits": reads served from the read cache of an rcache filter
+                    (json-int, optional)
+    - "cache_misses": reads that missed the read cache of an rcache filter
+                      (json-int, optional)
+    - "cache_prefetched_bytes": bytes read ahead by an rcache filter
+                                (json-int, optional)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms enabled with
+      block-latency-histogram-set (json-object, optional), each containing:
+        - "boundaries": bin boundaries in nano-seconds (json-array of
+                        json-int)
+        - "bins": completed requests per bin, one more than there are
+                  boundaries (json-array of json-int)
+    - "queue_depth": queue depth of a device (json-object, optional),
+                     containing:
+        - "current": requests currently in flight (json-int)
+        - "max": largest number of requests in flight (json-int)
+        - "histogram": queue depth at each request submission in the bins
+                       1, 2-3, 4-7, ..., 64-127, 128+ (json-array of json-int)
+    - "slow_requests": number of requests logged by the slow request log,
+                       if enabled (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2113,6 +2208,46 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
     },
 
+SQMP
+query-block-slow-requests
+-------------------------
+
+Dump the slow request log of a block device, oldest request first.
+
+Arguments:
+
+- "device": device name (json-string)
+- "clear": empty the log after dumping it (json-bool, optional)
+
+Each request is a json-object containing:
+
+- "type": request type, one of "read", "write" or "flush" (json-string)
+- "bytes": request size in bytes (json-int)
+- "start-time-ns": submission time on the host monotonic clock in
+                   nano-seconds (json-int)
+- "latency-ns": time it took to complete the request in nano-seconds
+                (json-int)
+
+Example:
+
+-> { "execute": "query-block-slow-requests",
+     "arguments": { "device": "virtio0" } }
+<- { "return": [
+        { "type": "write", "bytes": 65536, "start-time-ns": 1823360123456,
+          "latency-ns": 250311887 },
+        { "type": "flush", "bytes": 0, "start-time-ns": 1823612003451,
+          "latency-ns": 480023112 }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-block-slow-requests",
+        .args_type  = "device:B,clear:b?",
+        .mhandler.cmd_new = qmp_marshal_input_query_block_slow_requests,
+    },
+
 SQMP
 query-cpus
 ----------
@@ -2161,6 +2296,54 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-iothreads
+---------------
+
+Returns a list of information about each iothread.
+
+Note this list excludes the QEMU main loop thread, which is not declared
+using the -object iothread command-line option.  It is always the main thread
+of the process.
+
+Return a json-array. Each iothread is represented by a json-object, which contains:
+
+- "id": name of iothread (json-str)
+- "thread-id": ID of the underlying host thread, -1 if not started (json-int)
+- "cpu-time-ns": CPU time consumed by the thread in nanoseconds (json-int, optional)
+- "poll-count": number of event loop iterations (json-int)
+- "poll-progress": number of iterations that dispatched work (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- {
+      "return":[
+         {
+            "id":"iothread0",
+            "thread-id":3134,
+            "cpu-time-ns":48210512,
+            "poll-count":10452,
+            "poll-progress":10417
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135,
+            "cpu-time-ns":1035871,
+            "poll-count":212,
+            "poll-progress":198
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
 SQMP
 query-pci
 ---------
@@ -3239,4 +3422,86 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-net-batch-stats",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_batch_stats,
+    },
+
+SQMP
+query-net-batch-stats
+---------------------
+
+Show statistics about the batches of packets that net clients received
+from their peer, for all net clients or for the given one.  Tap backends
+deliver the packets read in one wakeup as a batch, and NICs batch the
+packets they transmit in one go.
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "batches": number of batches received (json-int)
+- "packets": number of packets received in batches (json-int)
+- "histogram": a json-array of 8 json-ints, the number of batches whose
+  size falls in the power-of-two bins 1, 2-3, 4-7, 8-15, 16-31, 32-63,
+  64-127, 128 and more
+
+Example:
+
+-> { "execute": "query-net-batch-stats", "arguments": { "name": "net0" } }
+<- { "return": [
+        {
+            "name": "net0",
+            "batches": 1200,
+            "packets": 9650,
+            "histogram": [ 310, 220, 290, 180, 120, 80, 0, 0 ]
+        }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-net-queues",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_queues,
+    },
+
+SQMP
+query-net-queues
+----------------
+
+Show the state of the queue of packets waiting to be delivered to each net
+client, or to the given one.
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "depth": maximum number of packets queued before packets are dropped
+  (json-int)
+- "lockless": true if a thread other than the main loop fills the queue
+  (json-bool)
+- "count": number of packets currently queued (json-int)
+- "max-count": largest number of packets queued at the same time (json-int)
+- "drops": number of packets dropped because the queue was full (json-int)
+- "buffer-size": bytes of memory held by the queue for packet data (json-int)
+
+Example:
+
+-> { "execute": "query-net-queues", "arguments": { "name": "net0" } }
+<- { "return": [
+        {
+            "name": "net0",
+            "depth": 10000,
+            "lockless": false,
+            "count": 0,
+            "max-count": 31,
+            "drops": 0,
+            "buffer-size": 47058
+        }
+      ]
+   }
+
 EQMP
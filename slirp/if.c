@@ -112,6 +112,7 @@ if_output(struct socket *so, struct mbuf *ifm)
 diddit:
 	if (so) {
 		/* Update *_queued */
+		slirp_poll_dirty(so);
 		so->so_queued++;
 		so->so_nqueued++;
 		/*
@@ -229,6 +230,9 @@ void if_start(Slirp *slirp)
             /* If there's no more queued, reset nqueued */
             ifm->ifq_so->so_nqueued = 0;
         }
+        if (ifm->ifq_so) {
+            slirp_poll_dirty(ifm->ifq_so);
+        }
 
         m_free(ifm);
     }
@@ -95,6 +95,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     addr.sin_addr = so->so_faddr;
 
     insque(so, &so->slirp->icmp);
+    slirp_poll_dirty(so);
 
     if (sendto(so->s, m->m_data + hlen, m->m_len - hlen, 0,
                (struct sockaddr *)&addr, sizeof(addr)) == -1) {
@@ -17,7 +17,11 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/*
+ * Number of mbufs kept on the free list once allocated.  A TCP window
+ * worth of segments in flight should not have to go through malloc().
+ */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
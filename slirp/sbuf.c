@@ -19,7 +19,9 @@ sbfree(struct sbuf *sb)
 void
 sbdrop(struct sbuf *sb, int num)
 {
+#ifdef _WIN32
     int limit = sb->sb_datalen / 2;
+#endif
 
 	/*
 	 * We can only drop how much we have
@@ -32,9 +34,14 @@ sbdrop(struct sbuf *sb, int num)
 	if(sb->sb_rptr >= sb->sb_data + sb->sb_datalen)
 		sb->sb_rptr -= sb->sb_datalen;
 
+#ifdef _WIN32
+    /* The main loop polls slirp here, let it read from the socket again.
+     * Elsewhere tcp_input() has already marked the socket dirty.
+     */
     if (sb->sb_cc < limit && sb->sb_cc + num >= limit) {
         qemu_notify_event();
     }
+#endif
 }
 
 void
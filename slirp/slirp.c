@@ -23,6 +23,8 @@
  */
 #include "qemu-common.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
 #include "sysemu/char.h"
 #include "slirp.h"
 #include "hw/hw.h"
@@ -47,6 +49,31 @@ static QTAILQ_HEAD(slirp_instances, Slirp) slirp_instances =
 static struct in_addr dns_addr;
 static u_int dns_addr_time;
 
+static QemuMutex slirp_mutex;
+
+#ifndef _WIN32
+/* On POSIX hosts the sockets are polled by a thread of its own rather than
+ * by the main loop.
+ */
+static QemuThread slirp_thread;
+static EventNotifier slirp_notifier;
+
+/* The thread keeps its poll set from one iteration to the next.  Entry 0
+ * is the notifier; every other entry belongs to the socket in the same slot
+ * of slirp_poll_sockets, whose pollfds_idx points back to it.  Sockets that
+ * may need a different entry are on their instance's poll_dirty list until
+ * the thread updates the set.  Only the thread changes the set, since
+ * g_poll() uses it without the lock held; a socket that is freed meanwhile
+ * leaves a NULL slot behind and makes the set stale.
+ */
+static GArray *slirp_pollfds;
+static GPtrArray *slirp_poll_sockets;
+static bool slirp_poll_stale;
+
+static void slirp_thread_start(void);
+static bool slirp_poll_changed(void);
+#endif
+
 #define TIMEOUT_FAST 2  /* milliseconds */
 #define TIMEOUT_SLOW 499  /* milliseconds */
 /* for the aging of certain requests like DNS */
@@ -194,6 +221,60 @@ static void slirp_init_once(void)
 
     loopback_addr.s_addr = htonl(INADDR_LOOPBACK);
     loopback_mask = htonl(IN_CLASSA_NET);
+
+    qemu_mutex_init(&slirp_mutex);
+#ifndef _WIN32
+    slirp_thread_start();
+#endif
+}
+
+void slirp_lock(void)
+{
+    qemu_mutex_lock(&slirp_mutex);
+}
+
+/* If what the caller did changed the set of sockets to poll or the
+ * timeout, let the slirp thread have another look.
+ */
+void slirp_unlock(void)
+{
+#ifndef _WIN32
+    bool changed = slirp_poll_changed();
+
+    qemu_mutex_unlock(&slirp_mutex);
+    if (changed) {
+        event_notifier_set(&slirp_notifier);
+    }
+#else
+    qemu_mutex_unlock(&slirp_mutex);
+#endif
+}
+
+/* Something happened to @so that may change the events it is polled for,
+ * or whether it needs a timer.
+ */
+void slirp_poll_dirty(struct socket *so)
+{
+    if (!so->so_poll_dirty) {
+        so->so_poll_dirty = true;
+        QTAILQ_INSERT_TAIL(&so->slirp->poll_dirty, so, so_dirty_entry);
+    }
+}
+
+/* Called when @so is freed */
+void slirp_poll_remove(struct socket *so)
+{
+    if (so->so_poll_dirty) {
+        so->so_poll_dirty = false;
+        QTAILQ_REMOVE(&so->slirp->poll_dirty, so, so_dirty_entry);
+    }
+#ifndef _WIN32
+    if (so->pollfds_idx > 0) {
+        /* Its descriptor is closed, but may still be polled */
+        g_ptr_array_index(slirp_poll_sockets, so->pollfds_idx) = NULL;
+        slirp_poll_stale = true;
+    }
+#endif
 }
 
 static void slirp_state_save(QEMUFile *f, void *opaque);
@@ -235,23 +316,28 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
     }
 
     slirp->opaque = opaque;
+    QTAILQ_INIT(&slirp->poll_dirty);
 
     register_savevm(NULL, "slirp", 0, 3,
                     slirp_state_save, slirp_state_load, slirp);
 
+    slirp_lock();
     QTAILQ_INSERT_TAIL(&slirp_instances, slirp, entry);
+    slirp_unlock();
 
     return slirp;
 }
 
 void slirp_cleanup(Slirp *slirp)
 {
+    slirp_lock();
     QTAILQ_REMOVE(&slirp_instances, slirp, entry);
 
-    unregister_savevm(NULL, "slirp", slirp);
-
     ip_cleanup(slirp);
     m_cleanup(slirp);
+    slirp_unlock();
+
+    unregister_savevm(NULL, "slirp", slirp);
 
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
@@ -288,7 +374,266 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
-void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
+/* so_type is only set for ICMP sockets */
+static int slirp_socket_proto(struct socket *so)
+{
+    if (so->so_type == IPPROTO_ICMP) {
+        return IPPROTO_ICMP;
+    }
+    return so->so_tcpcb ? IPPROTO_TCP : IPPROTO_UDP;
+}
+
+/* The events @so is polled for */
+static int slirp_socket_poll_events(struct socket *so)
+{
+    int events = 0;
+
+    switch (slirp_socket_proto(so)) {
+    case IPPROTO_TCP:
+        /*
+         * NOFDREF can include still connecting to local-host,
+         * newly socreated() sockets etc. Don't want to select these.
+         */
+        if (so->so_state & SS_NOFDREF || so->s == -1) {
+            return 0;
+        }
+
+        /*
+         * Set for reading sockets which are accepting
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            return G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+
+        /*
+         * Set for writing sockets which are connecting
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            return G_IO_OUT | G_IO_ERR;
+        }
+
+        /*
+         * Set for writing if we are connected, can send more, and
+         * we have something to send
+         */
+        if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+            events |= G_IO_OUT | G_IO_ERR;
+        }
+
+        /*
+         * Set for reading (and urgent data) if we are connected, can
+         * receive more, and we have room for it XXX /2 ?
+         */
+        if (CONN_CANFRCV(so) &&
+            (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+            events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+        }
+        return events;
+
+    case IPPROTO_UDP:
+        /*
+         * When UDP packets are received from over the
+         * link, they're sendto()'d straight away, so
+         * no need for setting for writing
+         * Limit the number of packets queued by this session
+         * to 4.  Note that even though we try and limit this
+         * to 4 packets, the session could have more queued
+         * if the packets needed to be fragmented
+         * (XXX <= 4 ?)
+         */
+        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+            return G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+        return 0;
+
+    case IPPROTO_ICMP:
+        if (so->so_state & SS_ISFCONNECTED) {
+            return G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Handles the events poll() returned for TCP socket @so
+ */
+static void slirp_tcp_dispatch(struct socket *so, int revents)
+{
+    int ret;
+
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for G_IO_IN below if this succeeds
+     */
+    if (revents & G_IO_PRI) {
+        sorecvoob(so);
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+            (revents & (G_IO_OUT | G_IO_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+            /*
+             * Continue tcp_input
+             */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+        }
+        /*
+         * XXXXX If we wrote something (a lot), there
+         * could be a need for a window update.
+         * In the worst case, the remote will send
+         * a window probe to get things going again
+         */
+    }
+
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
+            }
+
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
+            }
+
+        }
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+    } /* SS_ISFCONNECTING */
+#endif
+}
+
+/*
+ * Incoming UDP data isn't buffered, it is sent straight away.
+ */
+static void slirp_udp_dispatch(struct socket *so, int revents)
+{
+    if (so->s != -1 && (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        sorecvfrom(so);
+    }
+}
+
+/*
+ * Check incoming ICMP relies.
+ */
+static void slirp_icmp_dispatch(struct socket *so, int revents)
+{
+    if (so->s != -1 && (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        icmp_receive(so);
+    }
+}
+
+/*
+ * See if anything has timed out
+ */
+static void slirp_run_timers(Slirp *slirp)
+{
+    if (slirp->time_fasttimo &&
+        ((curtime - slirp->time_fasttimo) >= TIMEOUT_FAST)) {
+        tcp_fasttimo(slirp);
+        slirp->time_fasttimo = 0;
+    }
+    if (slirp->do_slowtimo &&
+        ((curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
+        ip_slowtimo(slirp);
+        tcp_slowtimo(slirp);
+        slirp->last_slowtimo = curtime;
+    }
+}
+
+#ifdef _WIN32
+/* On Windows the main loop polls the sockets, and the poll set is built
+ * from scratch for every iteration.
+ */
+static void slirp_pollfds_add(GArray *pollfds, struct socket *so)
+{
+    so->so_poll_events = slirp_socket_poll_events(so);
+    if (so->so_poll_events) {
+        GPollFD pfd = {
+            .fd = so->s,
+            .events = so->so_poll_events,
+        };
+        so->pollfds_idx = pollfds->len;
+        g_array_append_val(pollfds, pfd);
+    }
+}
+
+static void slirp_pollfds_fill_locked(GArray *pollfds, uint32_t *timeout)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
@@ -302,6 +647,12 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
      */
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        /* Every socket is looked at below */
+        while ((so = QTAILQ_FIRST(&slirp->poll_dirty)) != NULL) {
+            QTAILQ_REMOVE(&slirp->poll_dirty, so, so_dirty_entry);
+            so->so_poll_dirty = false;
+        }
+
         /*
          * *_slowtimo needs calling if there are IP fragments
          * in the fragment queue, or there are TCP connections active
@@ -311,8 +662,6 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 
         for (so = slirp->tcb.so_next; so != &slirp->tcb;
                 so = so_next) {
-            int events = 0;
-
             so_next = so->so_next;
 
             so->pollfds_idx = -1;
@@ -325,65 +674,7 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
                 slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
             }
 
-            /*
-             * NOFDREF can include still connecting to local-host,
-             * newly socreated() sockets etc. Don't want to select these.
-             */
-            if (so->so_state & SS_NOFDREF || so->s == -1) {
-                continue;
-            }
-
-            /*
-             * Set for reading sockets which are accepting
-             */
-            if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
-            }
-
-            /*
-             * Set for writing sockets which are connecting
-             */
-            if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
-            }
-
-            /*
-             * Set for writing if we are connected, can send more, and
-             * we have something to send
-             */
-            if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-                events |= G_IO_OUT | G_IO_ERR;
-            }
-
-            /*
-             * Set for reading (and urgent data) if we are connected, can
-             * receive more, and we have room for it XXX /2 ?
-             */
-            if (CONN_CANFRCV(so) &&
-                (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-                events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
-            }
-
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_pollfds_add(pollfds, so);
         }
 
         /*
@@ -407,24 +698,7 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
                 }
             }
 
-            /*
-             * When UDP packets are received from over the
-             * link, they're sendto()'d straight away, so
-             * no need for setting for writing
-             * Limit the number of packets queued by this session
-             * to 4.  Note that even though we try and limit this
-             * to 4 packets, the session could have more queued
-             * if the packets needed to be fragmented
-             * (XXX <= 4 ?)
-             */
-            if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_pollfds_add(pollfds, so);
         }
 
         /*
@@ -448,24 +722,24 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
                 }
             }
 
-            if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+            slirp_pollfds_add(pollfds, so);
         }
     }
     slirp_update_timeout(timeout);
 }
 
-void slirp_pollfds_poll(GArray *pollfds, int select_error)
+static int slirp_pollfds_revents(GArray *pollfds, struct socket *so)
+{
+    if (so->pollfds_idx == -1) {
+        return 0;
+    }
+    return g_array_index(pollfds, GPollFD, so->pollfds_idx).revents;
+}
+
+static void slirp_pollfds_poll_locked(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
     struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
@@ -474,203 +748,301 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-        /*
-         * See if anything has timed out
-         */
-        if (slirp->time_fasttimo &&
-            ((curtime - slirp->time_fasttimo) >= TIMEOUT_FAST)) {
-            tcp_fasttimo(slirp);
-            slirp->time_fasttimo = 0;
-        }
-        if (slirp->do_slowtimo &&
-            ((curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
-            ip_slowtimo(slirp);
-            tcp_slowtimo(slirp);
-            slirp->last_slowtimo = curtime;
-        }
+        slirp_run_timers(slirp);
 
         /*
          * Check sockets
          */
         if (!select_error) {
-            /*
-             * Check TCP sockets
-             */
             for (so = slirp->tcb.so_next; so != &slirp->tcb;
                     so = so_next) {
-                int revents;
+                so_next = so->so_next;
+                slirp_tcp_dispatch(so, slirp_pollfds_revents(pollfds, so));
+            }
 
+            for (so = slirp->udb.so_next; so != &slirp->udb;
+                    so = so_next) {
                 so_next = so->so_next;
+                slirp_udp_dispatch(so, slirp_pollfds_revents(pollfds, so));
+            }
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
+            for (so = slirp->icmp.so_next; so != &slirp->icmp;
+                    so = so_next) {
+                so_next = so->so_next;
+                slirp_icmp_dispatch(so, slirp_pollfds_revents(pollfds, so));
+            }
+        }
 
-                if (so->so_state & SS_NOFDREF || so->s == -1) {
-                    continue;
-                }
+        if_start(slirp);
+    }
+}
 
-                /*
-                 * Check for URG data
-                 * This will soread as well, so no need to
-                 * test for G_IO_IN below if this succeeds
-                 */
-                if (revents & G_IO_PRI) {
-                    sorecvoob(so);
-                }
-                /*
-                 * Check sockets for reading
-                 */
-                else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
-                    /*
-                     * Check for incoming connections
-                     */
-                    if (so->so_state & SS_FACCEPTCONN) {
-                        tcp_connect(so);
-                        continue;
-                    } /* else */
-                    ret = soread(so);
-
-                    /* Output it if we read something */
-                    if (ret > 0) {
-                        tcp_output(sototcpcb(so));
-                    }
-                }
+void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
+{
+    qemu_mutex_lock(&slirp_mutex);
+    slirp_pollfds_fill_locked(pollfds, timeout);
+    qemu_mutex_unlock(&slirp_mutex);
+}
 
-                /*
-                 * Check sockets for writing
-                 */
-                if (!(so->so_state & SS_NOFDREF) &&
-                        (revents & (G_IO_OUT | G_IO_ERR))) {
-                    /*
-                     * Check for non-blocking, still-connecting sockets
-                     */
-                    if (so->so_state & SS_ISFCONNECTING) {
-                        /* Connected */
-                        so->so_state &= ~SS_ISFCONNECTING;
-
-                        ret = send(so->s, (const void *) &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXXXX Must fix, zero bytes is a NOP */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        }
-                        /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                        /*
-                         * Continue tcp_input
-                         */
-                        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                        /* continue; */
-                    } else {
-                        ret = sowrite(so);
-                    }
-                    /*
-                     * XXXXX If we wrote something (a lot), there
-                     * could be a need for a window update.
-                     * In the worst case, the remote will send
-                     * a window probe to get things going again
-                     */
-                }
+void slirp_pollfds_poll(GArray *pollfds, int select_error)
+{
+    qemu_mutex_lock(&slirp_mutex);
+    slirp_pollfds_poll_locked(pollfds, select_error);
+    qemu_mutex_unlock(&slirp_mutex);
+}
+#else
+/* True if the poll set entry of @so, or the timers, must be updated */
+static bool slirp_poll_needs_update(Slirp *slirp, struct socket *so)
+{
+    if (slirp_socket_poll_events(so) != so->so_poll_events) {
+        return true;
+    }
+    if (!slirp->time_fasttimo && so->so_tcpcb &&
+        (so->so_tcpcb->t_flags & TF_DELACK)) {
+        return true;
+    }
+    return !slirp->do_slowtimo && (so->so_expire || so->so_tcpcb);
+}
 
-                /*
-                 * Probe a still-connecting, non-blocking socket
-                 * to check if it's still alive
-                 */
-#ifdef PROBE_CONN
-                if (so->so_state & SS_ISFCONNECTING) {
-                    ret = qemu_recv(so->s, &ret, 0, 0);
-
-                    if (ret < 0) {
-                        /* XXX */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue; /* Still connecting, continue */
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-
-                        /* tcp_input will take care of it */
-                    } else {
-                        ret = send(so->s, &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXX */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        } else {
-                            so->so_state &= ~SS_ISFCONNECTING;
-                        }
-
-                    }
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-                } /* SS_ISFCONNECTING */
-#endif
+/* True if the slirp thread has to update its poll set or recompute its
+ * timeout because of changes made since it last did so.  Only sockets that
+ * were marked dirty are looked at, so this is cheap enough to be done for
+ * every packet the guest sends.  Sockets that need no update are taken off
+ * the dirty list; the others are left for the thread.
+ */
+static bool slirp_poll_changed(void)
+{
+    Slirp *slirp;
+    struct socket *so, *so_next;
+    bool changed = slirp_poll_stale;
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        QTAILQ_FOREACH_SAFE(so, &slirp->poll_dirty, so_dirty_entry, so_next) {
+            if (slirp_poll_needs_update(slirp, so)) {
+                changed = true;
+            } else {
+                QTAILQ_REMOVE(&slirp->poll_dirty, so, so_dirty_entry);
+                so->so_poll_dirty = false;
             }
+        }
+        if (!slirp->do_slowtimo &&
+            &slirp->ipq.ip_link != slirp->ipq.ip_link.next) {
+            changed = true;
+        }
+    }
+    return changed;
+}
 
-            /*
-             * Now UDP sockets.
-             * Incoming packets are sent straight away, they're not buffered.
-             * Incoming UDP data isn't buffered either.
-             */
-            for (so = slirp->udb.so_next; so != &slirp->udb;
-                    so = so_next) {
-                int revents;
+static void slirp_poll_drop(guint idx)
+{
+    struct socket *so;
 
-                so_next = so->so_next;
+    g_array_remove_index_fast(slirp_pollfds, idx);
+    g_ptr_array_remove_index_fast(slirp_poll_sockets, idx);
+    if (idx < slirp_poll_sockets->len) {
+        /* The last entry moved here */
+        so = g_ptr_array_index(slirp_poll_sockets, idx);
+        if (so) {
+            so->pollfds_idx = idx;
+        }
+    }
+}
 
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
+static void slirp_poll_update_socket(Slirp *slirp, struct socket *so)
+{
+    so->so_poll_events = slirp_socket_poll_events(so);
+
+    if (so->pollfds_idx > 0) {
+        if (so->so_poll_events) {
+            GPollFD *pfd = &g_array_index(slirp_pollfds, GPollFD,
+                                          so->pollfds_idx);
+            pfd->fd = so->s;
+            pfd->events = so->so_poll_events;
+        } else {
+            slirp_poll_drop(so->pollfds_idx);
+            so->pollfds_idx = -1;
+        }
+    } else if (so->so_poll_events) {
+        GPollFD pfd = {
+            .fd = so->s,
+            .events = so->so_poll_events,
+        };
+        so->pollfds_idx = slirp_pollfds->len;
+        g_array_append_val(slirp_pollfds, pfd);
+        g_ptr_array_add(slirp_poll_sockets, so);
+    }
 
-                if (so->s != -1 &&
-                    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    sorecvfrom(so);
-                }
+    /*
+     * See if we need a tcp_fasttimo
+     */
+    if (slirp->time_fasttimo == 0 && so->so_tcpcb &&
+        (so->so_tcpcb->t_flags & TF_DELACK)) {
+        slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
+    }
+}
+
+/* Brings the poll set up to date with the sockets on the dirty lists and
+ * computes the poll timeout.
+ */
+static void slirp_poll_update(uint32_t *timeout)
+{
+    Slirp *slirp;
+    struct socket *so;
+    guint i;
+
+    if (slirp_poll_stale) {
+        /* Entry 0 is the notifier */
+        for (i = slirp_pollfds->len - 1; i > 0; i--) {
+            if (!g_ptr_array_index(slirp_poll_sockets, i)) {
+                slirp_poll_drop(i);
             }
+        }
+        slirp_poll_stale = false;
+    }
 
-            /*
-             * Check incoming ICMP relies.
-             */
-            for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                    so = so_next) {
-                    int revents;
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        while ((so = QTAILQ_FIRST(&slirp->poll_dirty)) != NULL) {
+            QTAILQ_REMOVE(&slirp->poll_dirty, so, so_dirty_entry);
+            so->so_poll_dirty = false;
+            slirp_poll_update_socket(slirp, so);
+        }
 
-                    so_next = so->so_next;
+        /*
+         * *_slowtimo needs calling if there are IP fragments
+         * in the fragment queue, TCP connections active, or UDP and
+         * ICMP sockets that may time out
+         */
+        slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
+                (&slirp->ipq.ip_link != slirp->ipq.ip_link.next) ||
+                (slirp->udb.so_next != &slirp->udb) ||
+                (slirp->icmp.so_next != &slirp->icmp));
+    }
+    slirp_update_timeout(timeout);
+}
+
+/* Runs every 500 ms: expires idle UDP and ICMP sockets, and has every TCP
+ * socket looked at again since the TCP timers may have changed its state.
+ */
+static void slirp_poll_slowtimo(Slirp *slirp)
+{
+    struct socket *so, *so_next;
 
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
+    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so->so_next) {
+        slirp_poll_dirty(so);
+    }
+    for (so = slirp->udb.so_next; so != &slirp->udb; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            udp_detach(so);
+        }
+    }
+    for (so = slirp->icmp.so_next; so != &slirp->icmp; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            icmp_detach(so);
+        }
+    }
+}
 
-                    if (so->s != -1 &&
-                        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    icmp_receive(so);
-                }
-            }
+/* Handles the sockets poll() reported events for.  Only the entries of
+ * the poll set are looked at, not every socket.
+ */
+static void slirp_poll_dispatch(int select_error)
+{
+    Slirp *slirp;
+    guint i, len = slirp_pollfds->len;
+
+    curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        u_int last_slowtimo = slirp->last_slowtimo;
+
+        slirp_run_timers(slirp);
+        if (slirp->last_slowtimo != last_slowtimo) {
+            slirp_poll_slowtimo(slirp);
+        }
+    }
+
+    /* Freed sockets leave a NULL slot, and new ones are only added to the
+     * poll set by the next slirp_poll_update().
+     */
+    for (i = 1; i < len && !select_error; i++) {
+        GPollFD *pfd = &g_array_index(slirp_pollfds, GPollFD, i);
+        struct socket *so = g_ptr_array_index(slirp_poll_sockets, i);
+
+        if (!so || !pfd->revents) {
+            continue;
+        }
+
+        switch (slirp_socket_proto(so)) {
+        case IPPROTO_TCP:
+            slirp_tcp_dispatch(so, pfd->revents);
+            break;
+        case IPPROTO_UDP:
+            slirp_udp_dispatch(so, pfd->revents);
+            break;
+        case IPPROTO_ICMP:
+            slirp_icmp_dispatch(so, pfd->revents);
+            break;
         }
 
+        /* Unless it was freed, its events may have changed */
+        if (g_ptr_array_index(slirp_poll_sockets, i) == so) {
+            slirp_poll_dirty(so);
+        }
+    }
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
         if_start(slirp);
     }
 }
 
+static void *slirp_thread_fn(void *opaque)
+{
+    for (;;) {
+        uint32_t timeout = UINT32_MAX;
+        int ret;
+
+        qemu_mutex_lock(&slirp_mutex);
+        slirp_poll_update(&timeout);
+        qemu_mutex_unlock(&slirp_mutex);
+
+        ret = g_poll((GPollFD *)slirp_pollfds->data, slirp_pollfds->len,
+                     timeout == UINT32_MAX ? -1 : (int)timeout);
+
+        if (g_array_index(slirp_pollfds, GPollFD, 0).revents) {
+            event_notifier_test_and_clear(&slirp_notifier);
+        }
+
+        qemu_mutex_lock(&slirp_mutex);
+        slirp_poll_dispatch(ret < 0);
+        qemu_mutex_unlock(&slirp_mutex);
+    }
+    return NULL;
+}
+
+static void slirp_thread_start(void)
+{
+    GPollFD notify_pfd = {
+        .events = G_IO_IN,
+    };
+
+    if (event_notifier_init(&slirp_notifier, false) < 0) {
+        fprintf(stderr, "slirp: failed to create event notifier\n");
+        abort();
+    }
+
+    notify_pfd.fd = event_notifier_get_fd(&slirp_notifier);
+    slirp_pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    slirp_poll_sockets = g_ptr_array_new();
+    g_array_append_val(slirp_pollfds, notify_pfd);
+    g_ptr_array_add(slirp_poll_sockets, NULL);
+
+    qemu_thread_create(&slirp_thread, slirp_thread_fn, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+#endif
+
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 {
     struct arphdr *ah = (struct arphdr *)(pkt + ETH_HLEN);
@@ -730,7 +1102,7 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+static void slirp_input_locked(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 {
     struct mbuf *m;
     int proto;
@@ -764,6 +1136,13 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp_lock();
+    slirp_input_locked(slirp, pkt, pkt_len);
+    slirp_unlock();
+}
+
 /* Output the IP packet to the ethernet device. Returns 0 if the packet must be
  * re-queued.
  */
@@ -836,7 +1215,9 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
     struct sockaddr_in addr;
     int port = htons(host_port);
     socklen_t addr_len;
+    int ret = -1;
 
+    slirp_lock();
     for (so = head->so_next; so != head; so = so->so_next) {
         addr_len = sizeof(addr);
         if ((so->so_state & SS_HOSTFWD) &&
@@ -845,34 +1226,42 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             addr.sin_port == port) {
             close(so->s);
             sofree(so);
-            return 0;
+            ret = 0;
+            break;
         }
     }
+    slirp_unlock();
 
-    return -1;
+    return ret;
 }
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
                       int host_port, struct in_addr guest_addr, int guest_port)
 {
+    int ret = 0;
+
     if (!guest_addr.s_addr) {
         guest_addr = slirp->vdhcp_startaddr;
     }
+    slirp_lock();
     if (is_udp) {
         if (!udp_listen(slirp, host_addr.s_addr, htons(host_port),
                         guest_addr.s_addr, htons(guest_port), SS_HOSTFWD))
-            return -1;
+            ret = -1;
     } else {
         if (!tcp_listen(slirp, host_addr.s_addr, htons(host_port),
                         guest_addr.s_addr, htons(guest_port), SS_HOSTFWD))
-            return -1;
+            ret = -1;
     }
-    return 0;
+    slirp_unlock();
+    return ret;
 }
 
 int slirp_add_exec(Slirp *slirp, int do_pty, const void *args,
                    struct in_addr *guest_addr, int guest_port)
 {
+    int ret;
+
     if (!guest_addr->s_addr) {
         guest_addr->s_addr = slirp->vnetwork_addr.s_addr |
             (htonl(0x0204) & ~slirp->vnetwork_mask.s_addr);
@@ -883,8 +1272,11 @@ int slirp_add_exec(Slirp *slirp, int do_pty, const void *args,
         guest_addr->s_addr == slirp->vnameserver_addr.s_addr) {
         return -1;
     }
-    return add_exec(&slirp->exec_list, do_pty, (char *)args, *guest_addr,
-                    htons(guest_port));
+    slirp_lock();
+    ret = add_exec(&slirp->exec_list, do_pty, (char *)args, *guest_addr,
+                   htons(guest_port));
+    slirp_unlock();
+    return ret;
 }
 
 ssize_t slirp_send(struct socket *so, const void *buf, size_t len, int flags)
@@ -916,33 +1308,36 @@ size_t slirp_socket_can_recv(Slirp *slirp, struct in_addr guest_addr,
 {
     struct iovec iov[2];
     struct socket *so;
+    size_t ret = 0;
 
+    qemu_mutex_lock(&slirp_mutex);
     so = slirp_find_ctl_socket(slirp, guest_addr, guest_port);
 
-    if (!so || so->so_state & SS_NOFDREF) {
-        return 0;
+    if (so && !(so->so_state & SS_NOFDREF) && CONN_CANFRCV(so) &&
+        so->so_snd.sb_cc < (so->so_snd.sb_datalen/2)) {
+        ret = sopreprbuf(so, iov, NULL);
     }
+    qemu_mutex_unlock(&slirp_mutex);
 
-    if (!CONN_CANFRCV(so) || so->so_snd.sb_cc >= (so->so_snd.sb_datalen/2)) {
-        return 0;
-    }
-
-    return sopreprbuf(so, iov, NULL);
+    return ret;
 }
 
 void slirp_socket_recv(Slirp *slirp, struct in_addr guest_addr, int guest_port,
                        const uint8_t *buf, int size)
 {
     int ret;
-    struct socket *so = slirp_find_ctl_socket(slirp, guest_addr, guest_port);
-
-    if (!so)
-        return;
+    struct socket *so;
 
-    ret = soreadbuf(so, (const char *)buf, size);
+    slirp_lock();
+    so = slirp_find_ctl_socket(slirp, guest_addr, guest_port);
+    if (so) {
+        slirp_poll_dirty(so);
+        ret = soreadbuf(so, (const char *)buf, size);
 
-    if (ret > 0)
-        tcp_output(sototcpcb(so));
+        if (ret > 0)
+            tcp_output(sototcpcb(so));
+    }
+    slirp_unlock();
 }
 
 static void slirp_tcp_save(QEMUFile *f, struct tcpcb *tp)
@@ -1036,6 +1431,7 @@ static void slirp_state_save(QEMUFile *f, void *opaque)
     Slirp *slirp = opaque;
     struct ex_list *ex_ptr;
 
+    qemu_mutex_lock(&slirp_mutex);
     for (ex_ptr = slirp->exec_list; ex_ptr; ex_ptr = ex_ptr->ex_next)
         if (ex_ptr->ex_pty == 3) {
             struct socket *so;
@@ -1052,6 +1448,7 @@ static void slirp_state_save(QEMUFile *f, void *opaque)
     qemu_put_be16(f, slirp->ip_id);
 
     slirp_bootp_save(f, slirp);
+    qemu_mutex_unlock(&slirp_mutex);
 }
 
 static void slirp_tcp_load(QEMUFile *f, struct tcpcb *tp)
@@ -1135,6 +1532,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr.s_addr = qemu_get_be32(f);
     so->so_fport = qemu_get_be16(f);
     so->so_lport = qemu_get_be16(f);
+    sohash_insert(&so->slirp->tcb_hash, so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -1158,7 +1556,7 @@ static void slirp_bootp_load(QEMUFile *f, Slirp *slirp)
     }
 }
 
-static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
+static int slirp_state_load_locked(QEMUFile *f, void *opaque, int version_id)
 {
     Slirp *slirp = opaque;
     struct ex_list *ex_ptr;
@@ -1202,3 +1600,13 @@ static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
 
     return 0;
 }
+
+static int slirp_state_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret;
+
+    slirp_lock();
+    ret = slirp_state_load_locked(f, opaque, version_id);
+    slirp_unlock();
+    return ret;
+}
@@ -242,18 +242,23 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
+    struct sohash tcb_hash;
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
+    struct sohash udb_hash;
     struct socket *udp_last_so;
 
     /* icmp states */
     struct socket icmp;
     struct socket *icmp_last_so;
 
+    /* sockets whose poll events may have changed */
+    QTAILQ_HEAD(, socket) poll_dirty;
+
     /* tftp states */
     char *tftp_prefix;
     struct tftp_session tftp_sessions[TFTP_SESSIONS_MAX];
@@ -269,6 +274,15 @@ extern Slirp *slirp_instance;
 #define NULL (void *)0
 #endif
 
+/* All slirp state is protected by one lock.  The QEMU side takes it when it
+ * calls into slirp; slirp_output() is called with it held.
+ */
+void slirp_lock(void);
+void slirp_unlock(void);
+
+void slirp_poll_dirty(struct socket *so);
+void slirp_poll_remove(struct socket *so);
+
 #ifndef FULL_BOLT
 void if_start(Slirp *);
 #else
@@ -15,24 +15,123 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+#define SOHASH_MIN_BITS 6
+#define SOHASH_MAX_BITS 20
+
+void sohash_init(struct sohash *h, bool match_foreign)
+{
+    h->bits = SOHASH_MIN_BITS;
+    h->count = 0;
+    h->buckets = calloc(1u << h->bits, sizeof(*h->buckets));
+    h->match_foreign = match_foreign;
+}
+
+void sohash_cleanup(struct sohash *h)
+{
+    free(h->buckets);
+    h->buckets = NULL;
+}
+
+static uint32_t sohash_key(struct sohash *h, struct in_addr laddr,
+                           u_int lport, struct in_addr faddr, u_int fport)
+{
+    uint32_t key = laddr.s_addr ^ (lport << 16);
+
+    if (h->match_foreign) {
+        key ^= faddr.s_addr ^ fport;
+    }
+    /* Fibonacci hashing, buckets are picked from the top bits */
+    return key * 0x9e3779b1;
+}
+
+static struct socket **sohash_bucket(struct sohash *h, uint32_t key)
+{
+    return &h->buckets[key >> (32 - h->bits)];
+}
+
+static void sohash_link(struct sohash *h, struct socket *so)
+{
+    struct socket **b = sohash_bucket(h, so->so_hkey);
+
+    so->so_hnext = *b;
+    *b = so;
+}
+
+/* Double the table once it holds as many sockets as buckets */
+static void sohash_grow(struct sohash *h)
+{
+    struct socket **old = h->buckets;
+    unsigned int i, old_size = 1u << h->bits;
+    struct socket *so, *next;
+
+    h->buckets = calloc(old_size * 2, sizeof(*h->buckets));
+    if (!h->buckets) {
+        h->buckets = old;       /* keep using the smaller table */
+        return;
+    }
+    h->bits++;
+
+    for (i = 0; i < old_size; i++) {
+        for (so = old[i]; so; so = next) {
+            next = so->so_hnext;
+            sohash_link(h, so);
+        }
+    }
+    free(old);
+}
+
+/*
+ * Hash a socket under its current addresses.  Must be called again
+ * whenever they change, or lookups will not find the socket.
+ */
+void sohash_insert(struct sohash *h, struct socket *so)
+{
+    sohash_remove(so);
+
+    if (h->count >= (1u << h->bits) && h->bits < SOHASH_MAX_BITS) {
+        sohash_grow(h);
+    }
+    so->so_hkey = sohash_key(h, so->so_laddr, so->so_lport,
+                             so->so_faddr, so->so_fport);
+    sohash_link(h, so);
+    so->so_hash = h;
+    h->count++;
+}
+
+void sohash_remove(struct socket *so)
+{
+    struct sohash *h = so->so_hash;
+    struct socket **p;
+
+    if (!h) {
+        return;
+    }
+    for (p = sohash_bucket(h, so->so_hkey); *p != so; p = &(*p)->so_hnext) {
+        assert(*p);
+    }
+    *p = so->so_hnext;
+    so->so_hnext = NULL;
+    so->so_hash = NULL;
+    h->count--;
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(struct sohash *h, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	so = *sohash_bucket(h, sohash_key(h, laddr, lport, faddr, fport));
+	for (; so; so = so->so_hnext) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
-		    so->so_faddr.s_addr == faddr.s_addr &&
-		    so->so_fport == fport)
+		    (!h->match_foreign ||
+		     (so->so_faddr.s_addr == faddr.s_addr &&
+		      so->so_fport == fport)))
 		   break;
 	}
 
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
-
 }
 
 /*
@@ -76,6 +175,8 @@ sofree(struct socket *so)
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
+  sohash_remove(so);
+  slirp_poll_remove(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -164,7 +265,8 @@ soread(struct socket *so)
 	sopreprbuf(so, iov, &n);
 
 #ifdef HAVE_READV
-	nn = readv(so->s, (struct iovec *)iov, n);
+	/* Both parts of a wrapped-around buffer in one go */
+	nn = readv(so->s, iov, n);
 	DEBUG_MISC((dfd, " ... read nn = %d bytes\n", nn));
 #else
 	nn = qemu_recv(so->s, iov[0].iov_base, iov[0].iov_len,0);
@@ -386,13 +488,26 @@ sowrite(struct socket *so)
 	}
 	/* Check if there's urgent data to send, and if so, send it */
 
+	if (so->s == -1) {
+		/* guestfwd to a chardev, which takes the whole buffer */
+		nn = slirp_send(so, iov[0].iov_base, iov[0].iov_len, 0);
+		if (n == 2 && nn == iov[0].iov_len) {
+			nn += slirp_send(so, iov[1].iov_base, iov[1].iov_len, 0);
+		}
+	} else {
 #ifdef HAVE_READV
-	nn = writev(so->s, (const struct iovec *)iov, n);
-
-	DEBUG_MISC((dfd, "  ... wrote nn = %d bytes\n", nn));
+		nn = writev(so->s, iov, n);
 #else
-	nn = slirp_send(so, iov[0].iov_base, iov[0].iov_len,0);
+		nn = slirp_send(so, iov[0].iov_base, iov[0].iov_len, 0);
+		if (n == 2 && nn == iov[0].iov_len) {
+			int ret = slirp_send(so, iov[1].iov_base, iov[1].iov_len, 0);
+			if (ret > 0)
+				nn += ret;
+		}
 #endif
+	}
+	DEBUG_MISC((dfd, "  ... wrote nn = %d bytes\n", nn));
+
 	/* This should never happen, but people tell me it does *shrug* */
 	if (nn < 0 && (errno == EAGAIN || errno == EINTR))
 		return 0;
@@ -405,16 +520,6 @@ sowrite(struct socket *so)
 		return -1;
 	}
 
-#ifndef HAVE_READV
-	if (n == 2 && nn == iov[0].iov_len) {
-            int ret;
-            ret = slirp_send(so, iov[1].iov_base, iov[1].iov_len,0);
-            if (ret > 0)
-                nn += ret;
-        }
-        DEBUG_MISC((dfd, "  ... wrote nn = %d bytes\n", nn));
-#endif
-
 	/* Update sbuf */
 	sb->sb_cc -= nn;
 	sb->sb_rptr += nn;
@@ -610,6 +715,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 		return NULL;
 	}
 	insque(so, &slirp->tcb);
+	slirp_poll_dirty(so);
 
 	/*
 	 * SS_FACCEPTONCE sockets must time out.
@@ -652,6 +758,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash_insert(&slirp->tcb_hash, so);
 
 	so->s = s;
 	return so;
@@ -11,6 +11,17 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/*
+ * Hash table for looking up sockets by address.  TCP sockets are keyed on
+ * the full 4-tuple, UDP sockets only on the local (guest) address and port.
+ */
+struct sohash {
+  struct socket **buckets;
+  unsigned int bits;		/* log2 of the number of buckets */
+  unsigned int count;		/* number of hashed sockets */
+  bool match_foreign;		/* compare foreign address and port too */
+};
+
 /*
  * Our socket structure
  */
@@ -18,9 +29,16 @@
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
 
+  struct socket *so_hnext;         /* Next socket in the hash bucket */
+  struct sohash *so_hash;          /* Table we are hashed in, if any */
+  uint32_t so_hkey;                /* Hash of the addresses when hashed */
+
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int so_poll_events;              /* Events in the poll set, or 0 */
+  bool so_poll_dirty;              /* On slirp->poll_dirty */
+  QTAILQ_ENTRY(socket) so_dirty_entry;
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -76,7 +94,11 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+void sohash_init(struct sohash *, bool);
+void sohash_cleanup(struct sohash *);
+void sohash_insert(struct sohash *, struct socket *);
+void sohash_remove(struct socket *);
+struct socket * solookup(struct sohash *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
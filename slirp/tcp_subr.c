@@ -53,6 +53,7 @@ tcp_init(Slirp *slirp)
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
     slirp->tcp_last_so = &slirp->tcb;
+    sohash_init(&slirp->tcb_hash, true);
 }
 
 void tcp_cleanup(Slirp *slirp)
@@ -60,6 +61,7 @@ void tcp_cleanup(Slirp *slirp)
     while (slirp->tcb.so_next != &slirp->tcb) {
         tcp_close(sototcpcb(slirp->tcb.so_next));
     }
+    sohash_cleanup(&slirp->tcb_hash);
 }
 
 /*
@@ -440,6 +442,7 @@ void tcp_connect(struct socket *inso)
         (loopback_addr.s_addr & loopback_mask)) {
         so->so_faddr = slirp->vhost_addr;
     }
+    sohash_insert(&slirp->tcb_hash, so);
 
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
@@ -476,6 +479,7 @@ tcp_attach(struct socket *so)
 	   return -1;
 
 	insque(so, &so->slirp->tcb);
+	slirp_poll_dirty(so);
 
 	return 0;
 }
@@ -592,19 +596,13 @@ tcp_emu(struct socket *so, struct mbuf *m)
 					HTONS(n1);
 					HTONS(n2);
 					/* n2 is the one on our host */
-					for (tmpso = slirp->tcb.so_next;
-					     tmpso != &slirp->tcb;
-					     tmpso = tmpso->so_next) {
-						if (tmpso->so_laddr.s_addr == so->so_laddr.s_addr &&
-						    tmpso->so_lport == n2 &&
-						    tmpso->so_faddr.s_addr == so->so_faddr.s_addr &&
-						    tmpso->so_fport == n1) {
-							if (getsockname(tmpso->s,
-								(struct sockaddr *)&addr, &addrlen) == 0)
-							   n2 = ntohs(addr.sin_port);
-							break;
-						}
-					}
+					tmpso = solookup(&slirp->tcb_hash,
+							 so->so_laddr, n2,
+							 so->so_faddr, n1);
+					if (tmpso &&
+					    getsockname(tmpso->s,
+						(struct sockaddr *)&addr, &addrlen) == 0)
+					   n2 = ntohs(addr.sin_port);
 				}
                                 so_rcv->sb_cc = snprintf(so_rcv->sb_data,
                                                          so_rcv->sb_datalen,
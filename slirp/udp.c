@@ -48,6 +48,7 @@ udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
     slirp->udp_last_so = &slirp->udb;
+    sohash_init(&slirp->udb_hash, false);
 }
 
 void udp_cleanup(Slirp *slirp)
@@ -55,6 +56,7 @@ void udp_cleanup(Slirp *slirp)
     while (slirp->udb.so_next != &slirp->udb) {
         udp_detach(slirp->udb.so_next);
     }
+    sohash_cleanup(&slirp->udb_hash);
 }
 
 /* m->m_data  points at ip packet header
@@ -154,19 +156,9 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = slirp->udp_last_so;
 	if (so->so_lport != uh->uh_sport ||
 	    so->so_laddr.s_addr != ip->ip_src.s_addr) {
-		struct socket *tmp;
-
-		for (tmp = slirp->udb.so_next; tmp != &slirp->udb;
-		     tmp = tmp->so_next) {
-			if (tmp->so_lport == uh->uh_sport &&
-			    tmp->so_laddr.s_addr == ip->ip_src.s_addr) {
-				so = tmp;
-				break;
-			}
-		}
-		if (tmp == &slirp->udb) {
-		  so = NULL;
-		} else {
+		so = solookup(&slirp->udb_hash, ip->ip_src, uh->uh_sport,
+			      ip->ip_dst, uh->uh_dport);
+		if (so) {
 		  slirp->udp_last_so = so;
 		}
 	}
@@ -192,6 +184,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	   */
 	  so->so_laddr = ip->ip_src;
 	  so->so_lport = uh->uh_sport;
+	  sohash_insert(&slirp->udb_hash, so);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -204,6 +197,7 @@ udp_input(register struct mbuf *m, int iphlen)
 
         so->so_faddr = ip->ip_dst; /* XXX */
         so->so_fport = uh->uh_dport; /* XXX */
+        slirp_poll_dirty(so);
 
 	iphlen += sizeof(struct udphdr);
 	m->m_len -= iphlen;
@@ -315,6 +309,7 @@ udp_attach(struct socket *so)
   if((so->s = qemu_socket(AF_INET,SOCK_DGRAM,0)) != -1) {
     so->so_expire = curtime + SO_EXPIRE;
     insque(so, &so->slirp->udb);
+    slirp_poll_dirty(so);
   }
   return(so->s);
 }
@@ -363,6 +358,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	so->s = qemu_socket(AF_INET,SOCK_DGRAM,0);
 	so->so_expire = curtime + SO_EXPIRE;
 	insque(so, &slirp->udb);
+	slirp_poll_dirty(so);
 
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = haddr;
@@ -384,6 +380,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	}
 	so->so_lport = lport;
 	so->so_laddr.s_addr = laddr;
+	sohash_insert(&slirp->udb_hash, so);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
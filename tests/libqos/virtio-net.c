@@ -0,0 +1,268 @@
+/*
+ * libqos virtio-net-pci driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/virtio-net.h"
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define VIRTIO_PCI_VENDOR_ID        0x1af4
+#define VIRTIO_NET_DEVICE_ID        0x1000
+
+/* Legacy virtio PCI I/O space layout, without MSI-X */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+#define VIRTIO_PCI_CONFIG           20
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_DESC_SIZE             16
+#define VRING_ALIGN                 4096
+
+#define TX_BUF_LEN                  2048
+#define CTRL_BUF_LEN                64
+
+/* How long to wait for the device to consume a buffer we gave it */
+#define COMPLETION_TIMEOUT_MS       5000
+
+static void *io_addr(QVirtioNet *n, int offset)
+{
+    return (void *)((uintptr_t)n->io + offset);
+}
+
+static void desc_write(QVirtioNetQueue *vq, unsigned int i, uint64_t addr,
+                       uint32_t len, uint16_t flags, uint16_t next)
+{
+    uint64_t desc = vq->desc + i * VRING_DESC_SIZE;
+
+    writeq(desc, addr);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+    writew(desc + 14, next);
+}
+
+static void queue_init(QVirtioNet *n, QVirtioNetQueue *vq, unsigned int index,
+                       size_t buf_len)
+{
+    uint64_t ring;
+
+    vq->index = index;
+    qpci_io_writew(n->dev, io_addr(n, VIRTIO_PCI_QUEUE_SEL), index);
+    vq->num = qpci_io_readw(n->dev, io_addr(n, VIRTIO_PCI_QUEUE_NUM));
+    g_assert_cmpint(vq->num, >, 0);
+
+    /* Descriptors, avail ring, then used ring page aligned */
+    ring = guest_alloc(n->alloc, 2 * VRING_ALIGN +
+                       vq->num * (VRING_DESC_SIZE + 2 + 8));
+    vq->desc = ring;
+    vq->avail = vq->desc + vq->num * VRING_DESC_SIZE;
+    vq->used = QEMU_ALIGN_UP(vq->avail + 4 + 2 * vq->num + 2, VRING_ALIGN);
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used, 0);
+    writew(vq->used + 2, 0);
+
+    vq->buf_len = buf_len;
+    vq->bufs = guest_alloc(n->alloc, vq->num * buf_len);
+
+    qpci_io_writel(n->dev, io_addr(n, VIRTIO_PCI_QUEUE_PFN),
+                   vq->desc / VRING_ALIGN);
+}
+
+static uint64_t queue_buf(QVirtioNetQueue *vq, unsigned int head)
+{
+    return vq->bufs + head * vq->buf_len;
+}
+
+static void queue_kick(QVirtioNet *n, QVirtioNetQueue *vq, uint16_t head)
+{
+    writew(vq->avail + 4 + 2 * (vq->avail_idx % vq->num), head);
+    vq->avail_idx++;
+    writew(vq->avail + 2, vq->avail_idx);
+    qpci_io_writew(n->dev, io_addr(n, VIRTIO_PCI_QUEUE_NOTIFY), vq->index);
+}
+
+/* Returns the used ring entry at @vq->used_idx, or false on timeout */
+static bool queue_wait_used(QVirtioNetQueue *vq, int timeout_ms,
+                            uint32_t *id, uint32_t *len)
+{
+    gint64 end = g_get_monotonic_time() + timeout_ms * 1000LL;
+    uint64_t elem;
+
+    while (readw(vq->used + 2) == vq->used_idx) {
+        if (g_get_monotonic_time() >= end) {
+            return false;
+        }
+        g_usleep(100);
+    }
+
+    elem = vq->used + 4 + 8 * (vq->used_idx % vq->num);
+    *id = readl(elem);
+    *len = readl(elem + 4);
+    vq->used_idx++;
+    return true;
+}
+
+QVirtioNet *qvirtio_net_init(QPCIBus *bus, QGuestAllocator *alloc, int devfn,
+                             uint32_t features, size_t rx_buf_len)
+{
+    QVirtioNet *n = g_new0(QVirtioNet, 1);
+    uint32_t host_features;
+    int i;
+
+    n->alloc = alloc;
+    n->dev = qpci_device_find(bus, devfn);
+    g_assert(n->dev != NULL);
+    g_assert_cmphex(qpci_config_readw(n->dev, PCI_VENDOR_ID), ==,
+                    VIRTIO_PCI_VENDOR_ID);
+    g_assert_cmphex(qpci_config_readw(n->dev, PCI_DEVICE_ID), ==,
+                    VIRTIO_NET_DEVICE_ID);
+
+    n->io = qpci_iomap(n->dev, 0);
+    qpci_device_enable(n->dev);
+
+    qpci_io_writeb(n->dev, io_addr(n, VIRTIO_PCI_STATUS), 0);
+    qpci_io_writeb(n->dev, io_addr(n, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    host_features = qpci_io_readl(n->dev,
+                                  io_addr(n, VIRTIO_PCI_HOST_FEATURES));
+    g_assert_cmphex(host_features & features, ==, features);
+    n->features = features;
+    qpci_io_writel(n->dev, io_addr(n, VIRTIO_PCI_GUEST_FEATURES), features);
+    n->hdr_len = features & (1u << QVIRTIO_NET_F_MRG_RXBUF) ? 12 : 10;
+
+    for (i = 0; i < 6; i++) {
+        n->mac[i] = qpci_io_readb(n->dev, io_addr(n, VIRTIO_PCI_CONFIG + i));
+    }
+
+    g_assert_cmpint(rx_buf_len, >, n->hdr_len);
+    queue_init(n, &n->rx, 0, rx_buf_len);
+    queue_init(n, &n->tx, 1, TX_BUF_LEN);
+    if (features & (1u << QVIRTIO_NET_F_CTRL_VQ)) {
+        queue_init(n, &n->ctrl, 2, CTRL_BUF_LEN);
+    }
+
+    qpci_io_writeb(n->dev, io_addr(n, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_DRIVER_OK);
+    return n;
+}
+
+void qvirtio_net_free(QVirtioNet *n)
+{
+    g_free(n->dev);
+    g_free(n);
+}
+
+void qvirtio_net_post_rx(QVirtioNet *n, unsigned int count)
+{
+    QVirtioNetQueue *vq = &n->rx;
+
+    while (count--) {
+        uint16_t head = vq->avail_idx % vq->num;
+
+        /* The device completes receive buffers in order */
+        g_assert_cmpint((uint16_t)(vq->avail_idx - vq->used_idx), <, vq->num);
+        desc_write(vq, head, queue_buf(vq, head), vq->buf_len,
+                   VRING_DESC_F_WRITE, 0);
+        queue_kick(n, vq, head);
+    }
+}
+
+void qvirtio_net_send(QVirtioNet *n, const void *frame, size_t len)
+{
+    QVirtioNetQueue *vq = &n->tx;
+    uint16_t head = vq->avail_idx % vq->num;
+    uint64_t buf = queue_buf(vq, head);
+    uint8_t hdr[12] = { 0 };
+    uint32_t id, used_len;
+
+    g_assert_cmpint(n->hdr_len + len, <=, vq->buf_len);
+    memwrite(buf, hdr, n->hdr_len);
+    memwrite(buf + n->hdr_len, frame, len);
+    desc_write(vq, head, buf, n->hdr_len + len, 0, 0);
+    queue_kick(n, vq, head);
+
+    g_assert(queue_wait_used(vq, COMPLETION_TIMEOUT_MS, &id, &used_len));
+    g_assert_cmpint(id, ==, head);
+}
+
+ssize_t qvirtio_net_recv(QVirtioNet *n, void *frame, size_t size,
+                         int timeout_ms)
+{
+    QVirtioNetQueue *vq = &n->rx;
+    uint8_t *p = frame;
+    size_t total = 0, hdr_len = n->hdr_len;
+    uint32_t id, len;
+    unsigned int i, num_buffers = 1;
+
+    for (i = 0; i < num_buffers; i++) {
+        if (!queue_wait_used(vq, i ? COMPLETION_TIMEOUT_MS : timeout_ms,
+                             &id, &len)) {
+            g_assert_cmpint(i, ==, 0);
+            return -1;
+        }
+        g_assert_cmpint(id, <, vq->num);
+        g_assert_cmpint(len, <=, vq->buf_len);
+
+        if (i == 0) {
+            n->rx_head = id;
+            if (n->features & (1u << QVIRTIO_NET_F_MRG_RXBUF)) {
+                num_buffers = readw(queue_buf(vq, id) + 10);
+                g_assert_cmpint(num_buffers, >=, 1);
+            }
+            n->rx_num_buffers = num_buffers;
+        } else {
+            hdr_len = 0;
+        }
+
+        g_assert_cmpint(len, >=, hdr_len);
+        g_assert_cmpint(total + len - hdr_len, <=, size);
+        memread(queue_buf(vq, id) + hdr_len, p + total, len - hdr_len);
+        total += len - hdr_len;
+    }
+
+    return total;
+}
+
+uint8_t qvirtio_net_ctrl(QVirtioNet *n, uint8_t class, uint8_t cmd,
+                         const void *data, size_t len)
+{
+    QVirtioNetQueue *vq = &n->ctrl;
+    uint64_t buf = queue_buf(vq, 0);
+    uint8_t hdr[2] = { class, cmd };
+    uint32_t id, used_len;
+
+    /* One command at a time, always in descriptors 0 to 2 */
+    g_assert_cmpint(vq->num, >=, 3);
+    g_assert_cmpint(len, <=, CTRL_BUF_LEN - 3);
+    memwrite(buf, hdr, 2);
+    memwrite(buf + 2, data, len);
+    writeb(buf + 2 + len, 0xff);
+
+    desc_write(vq, 0, buf, 2, VRING_DESC_F_NEXT, 1);
+    desc_write(vq, 1, buf + 2, len, VRING_DESC_F_NEXT, 2);
+    desc_write(vq, 2, buf + 2 + len, 1, VRING_DESC_F_WRITE, 0);
+    queue_kick(n, vq, 0);
+
+    g_assert(queue_wait_used(vq, COMPLETION_TIMEOUT_MS, &id, &used_len));
+    g_assert_cmpint(id, ==, 0);
+    return readb(buf + 2 + len);
+}
@@ -0,0 +1,126 @@
+/*
+ * libqos virtio-net-pci driver
+ *
+ * A minimal legacy virtio-net driver that lets qtest cases send and receive
+ * Ethernet frames and issue control queue commands.  Only what the tests
+ * need is implemented: no interrupts, no multiqueue, no offloads.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_NET_H
+#define LIBQOS_VIRTIO_NET_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+
+#define QVIRTIO_NET_F_MRG_RXBUF     15
+#define QVIRTIO_NET_F_CTRL_VQ       17
+#define QVIRTIO_NET_F_CTRL_RX       18
+
+#define QVIRTIO_NET_CTRL_RX         0
+#define QVIRTIO_NET_CTRL_RX_PROMISC 0
+
+#define QVIRTIO_NET_OK              0
+
+typedef struct QVirtioNetQueue {
+    unsigned int index;
+    unsigned int num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint64_t bufs;          /* one buffer of buf_len bytes per descriptor */
+    size_t buf_len;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+} QVirtioNetQueue;
+
+typedef struct QVirtioNet {
+    QPCIDevice *dev;
+    void *io;
+    QGuestAllocator *alloc;
+    uint32_t features;
+    size_t hdr_len;
+    uint8_t mac[6];
+    QVirtioNetQueue rx;
+    QVirtioNetQueue tx;
+    QVirtioNetQueue ctrl;
+    uint16_t rx_head;           /* first descriptor of the last frame */
+    uint16_t rx_num_buffers;    /* descriptors used by the last frame */
+} QVirtioNet;
+
+/**
+ * qvirtio_net_init:
+ * @bus: PCI bus the device is on.
+ * @alloc: allocator for guest memory.
+ * @devfn: PCI device and function number of the device.
+ * @features: QVIRTIO_NET_F_* feature bits to negotiate.
+ * @rx_buf_len: size of each receive buffer, header included.
+ *
+ * Resets the device and sets up its queues.  No receive buffers are made
+ * available yet, see qvirtio_net_post_rx().
+ *
+ * Returns: The driver state, to be freed with qvirtio_net_free().
+ */
+QVirtioNet *qvirtio_net_init(QPCIBus *bus, QGuestAllocator *alloc, int devfn,
+                             uint32_t features, size_t rx_buf_len);
+
+void qvirtio_net_free(QVirtioNet *n);
+
+/**
+ * qvirtio_net_post_rx:
+ * @n: driver state.
+ * @count: number of receive buffers to make available.
+ *
+ * Buffers are made available in descriptor order, and the device uses them
+ * in that order.
+ */
+void qvirtio_net_post_rx(QVirtioNet *n, unsigned int count);
+
+/**
+ * qvirtio_net_send:
+ * @n: driver state.
+ * @frame: Ethernet frame to send.
+ * @len: length of @frame.
+ *
+ * Sends @frame with an all-zero virtio-net header and waits until the
+ * device has consumed it.
+ */
+void qvirtio_net_send(QVirtioNet *n, const void *frame, size_t len);
+
+/**
+ * qvirtio_net_recv:
+ * @n: driver state.
+ * @frame: buffer for the received frame, without virtio-net header.
+ * @size: size of @frame.
+ * @timeout_ms: how long to wait for a frame.
+ *
+ * Waits for the device to fill the next receive buffer, or buffers if
+ * mergeable receive buffers were negotiated.  The buffers are not made
+ * available again.
+ *
+ * Returns: The length of the frame, or -1 if none arrived in time.
+ */
+ssize_t qvirtio_net_recv(QVirtioNet *n, void *frame, size_t size,
+                         int timeout_ms);
+
+/**
+ * qvirtio_net_ctrl:
+ * @n: driver state.
+ * @class: command class.
+ * @cmd: command.
+ * @data: command data.
+ * @len: length of @data.
+ *
+ * Issues a command on the control queue and waits for its completion.
+ *
+ * Returns: The ack byte written by the device.
+ */
+uint8_t qvirtio_net_ctrl(QVirtioNet *n, uint8_t class, uint8_t cmd,
+                         const void *data, size_t len);
+
+#endif
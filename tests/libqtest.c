@@ -291,15 +291,18 @@ redo:
     return words;
 }
 
-void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+/* Reads one JSON object from the QMP socket.  Braces inside strings are
+ * not counted, so that replies carrying arbitrary text (such as the output
+ * of human-monitor-command) are read whole.
+ */
+static GString *qmp_read_object(QTestState *s)
 {
+    GString *obj = g_string_new("");
     bool has_reply = false;
+    bool in_string = false;
+    bool escape = false;
     int nesting = 0;
 
-    /* Send QMP request */
-    socket_sendf(s->qmp_fd, fmt, ap);
-
-    /* Receive reply */
     while (!has_reply || nesting > 0) {
         ssize_t len;
         char c;
@@ -314,16 +317,75 @@ void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
             exit(1);
         }
 
+        if (has_reply) {
+            g_string_append_c(obj, c);
+        }
+
+        if (in_string) {
+            if (escape) {
+                escape = false;
+            } else if (c == '\\') {
+                escape = true;
+            } else if (c == '"') {
+                in_string = false;
+            }
+            continue;
+        }
+
         switch (c) {
         case '{':
+            if (!has_reply) {
+                g_string_append_c(obj, c);
+            }
             nesting++;
             has_reply = true;
             break;
         case '}':
             nesting--;
             break;
+        case '"':
+            in_string = has_reply;
+            break;
         }
     }
+
+    return obj;
+}
+
+char *qtest_qmp_replyv(QTestState *s, const char *fmt, va_list ap)
+{
+    GString *reply;
+
+    /* Send QMP request */
+    socket_sendf(s->qmp_fd, fmt, ap);
+
+    /* Receive reply, skipping asynchronous events */
+    for (;;) {
+        reply = qmp_read_object(s);
+        if (!g_str_has_prefix(reply->str, "{\"timestamp\"")) {
+            break;
+        }
+        g_string_free(reply, true);
+    }
+
+    return g_string_free(reply, false);
+}
+
+char *qtest_qmp_reply(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    char *reply;
+
+    va_start(ap, fmt);
+    reply = qtest_qmp_replyv(s, fmt, ap);
+    va_end(ap);
+
+    return reply;
+}
+
+void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+{
+    g_free(qtest_qmp_replyv(s, fmt, ap));
 }
 
 void qtest_qmp(QTestState *s, const char *fmt, ...)
@@ -62,6 +62,30 @@ void qtest_qmp(QTestState *s, const char *fmt, ...);
  */
 void qtest_qmpv(QTestState *s, const char *fmt, va_list ap);
 
+/**
+ * qtest_qmp_reply:
+ * @s: #QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns its reply as a string.  Events
+ * that QEMU sends before the reply are skipped.
+ *
+ * Returns: The reply, to be freed with g_free().
+ */
+char *qtest_qmp_reply(QTestState *s, const char *fmt, ...);
+
+/**
+ * qtest_qmp_replyv:
+ * @s: #QTestState instance to operate on.
+ * @fmt: QMP message to send to QEMU
+ * @ap: QMP message arguments
+ *
+ * Sends a QMP message to QEMU and returns its reply as a string.
+ *
+ * Returns: The reply, to be freed with g_free().
+ */
+char *qtest_qmp_replyv(QTestState *s, const char *fmt, va_list ap);
+
 /**
  * qtest_get_irq:
  * @s: #QTestState instance to operate on.
@@ -345,6 +369,26 @@ static inline void qmp(const char *fmt, ...)
     va_end(ap);
 }
 
+/**
+ * qmp_reply:
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns its reply as a string.
+ *
+ * Returns: The reply, to be freed with g_free().
+ */
+static inline char *qmp_reply(const char *fmt, ...)
+{
+    va_list ap;
+    char *reply;
+
+    va_start(ap, fmt);
+    reply = qtest_qmp_replyv(global_qtest, fmt, ap);
+    va_end(ap);
+
+    return reply;
+}
+
 /**
  * get_irq:
  * @num: Interrupt to observe.
@@ -32,6 +32,7 @@ __all__ = ['imgfmt', 'imgproto', 'test_dir' 'qemu_img', 'qemu_io',
 # want to support the override options that ./check supports.
 qemu_img_args = os.environ.get('QEMU_IMG', 'qemu-img').strip().split(' ')
 qemu_io_args = os.environ.get('QEMU_IO', 'qemu-io').strip().split(' ')
+qemu_nbd_args = os.environ.get('QEMU_NBD', 'qemu-nbd').strip().split(' ')
 qemu_args = os.environ.get('QEMU', 'qemu').strip().split(' ')
 
 imgfmt = os.environ.get('IMGFMT', 'raw')
@@ -81,6 +82,7 @@ class VM(object):
                      '-qtest', 'stdio', '-machine', 'accel=qtest',
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
+        self._iolog = None
 
     # This can be used to add an unused monitor instance.
     def add_monitor_telnet(self, ip, port):
@@ -103,11 +105,21 @@ class VM(object):
         self._num_drives += 1
         return self
 
+    def add_incoming(self, addr):
+        '''Make the VM wait for an incoming migration from addr'''
+        self._args.append('-incoming')
+        self._args.append(addr)
+        return self
+
     def hmp_qemu_io(self, drive, cmd):
         '''Write to a given drive using an HMP command'''
         return self.qmp('human-monitor-command',
                         command_line='qemu-io %s "%s"' % (drive, cmd))
 
+    def get_log(self):
+        '''Return the output of the VM after it has been shut down'''
+        return self._iolog
+
     def add_fd(self, fd, fdset, opaque, opts=''):
         '''Pass a file descriptor to the VM'''
         options = ['fd=%d' % fd,
@@ -154,6 +166,7 @@ class VM(object):
             self._qmp.cmd('quit')
             self._popen.wait()
             os.remove(self._monitor_path)
+            self._iolog = open(self._qemu_log_path, 'r').read()
             os.remove(self._qemu_log_path)
             self._popen = None
 
@@ -0,0 +1,571 @@
+/*
+ * QTest testcase for the user mode network stack
+ *
+ * The test plays the guest through a virtio-net-pci device whose backend
+ * is -netdev user, and connects to host forwarding rules from the host
+ * side.  This checks that the slirp thread picks up sockets that are added
+ * at run time, that data flows both ways, and that segments from the guest
+ * find their socket with many connections open and after loadvm.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/virtio-net.h"
+
+#include "qemu-common.h"
+
+#define VIRTIO_NET_DEVFN        QPCI_DEVFN(4, 0)
+#define RX_BUFS                 64
+#define RX_BUF_LEN              2048
+#define TIMEOUT_MS              5000
+
+#define ETH_HLEN                14
+#define ETH_P_IP                0x0800
+#define ETH_P_ARP               0x0806
+#define IP_HLEN                 20
+#define TCP_HLEN                20
+
+#define TH_FIN                  0x01
+#define TH_SYN                  0x02
+#define TH_RST                  0x04
+#define TH_ACK                  0x10
+
+#define GUEST_ADDR              0x0a00020f      /* 10.0.2.15 */
+#define HOST_ADDR               0x0a000202      /* 10.0.2.2 */
+#define GUEST_PORT              22
+#define GUESTFWD_ADDR           0x0a000264      /* 10.0.2.100 */
+#define GUESTFWD_PORT           1234
+
+/* Enough connections for the socket hash table to grow */
+#define NUM_CONNS               200
+
+static const uint8_t slirp_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+
+typedef struct TestConn {
+    int fd;                 /* host end of the connection */
+    uint16_t lport;         /* guest port */
+    uint32_t faddr;         /* address and port slirp uses towards the guest */
+    uint16_t fport;
+    uint32_t snd_nxt;       /* guest sequence numbers */
+    uint32_t rcv_nxt;
+} TestConn;
+
+static QVirtioNet *net;
+
+static char *slirp_test_args(const char *netdev_opts)
+{
+    return g_strdup_printf("-netdev user,id=n0%s "
+                           "-device virtio-net-pci,netdev=n0,romfile=,"
+                           "addr=04.0", netdev_opts ?: "");
+}
+
+static void slirp_test_start(const char *netdev_opts)
+{
+    QPCIBus *bus;
+    char *args;
+
+    args = slirp_test_args(netdev_opts);
+    qtest_start(args);
+    g_free(args);
+    bus = qpci_init_pc();
+    net = qvirtio_net_init(bus, pc_alloc_init(), VIRTIO_NET_DEVFN, 0,
+                           RX_BUF_LEN);
+    qvirtio_net_post_rx(net, RX_BUFS);
+}
+
+static void slirp_test_end(void)
+{
+    qvirtio_net_free(net);
+    net = NULL;
+    qtest_end();
+}
+
+/* Runs a monitor command and checks that its output contains @expected */
+static void hmp(const char *expected, const char *fmt, ...)
+{
+    va_list ap;
+    char *cmd, *reply;
+
+    va_start(ap, fmt);
+    cmd = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    reply = qmp_reply("{ 'execute': 'human-monitor-command',"
+                      "  'arguments': { 'command-line': '%s' } }", cmd);
+    g_assert(strstr(reply, expected) != NULL);
+    g_free(reply);
+    g_free(cmd);
+}
+
+/* Returns a TCP port on 127.0.0.1 that nothing listens on */
+static int free_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd, ret;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+    ret = getsockname(fd, (struct sockaddr *)&addr, &len);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return ntohs(addr.sin_port);
+}
+
+static int host_connect(int port, int *err)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        *err = errno;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += lduw_be_p(p + i);
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void build_eth(uint8_t *frame, uint16_t type)
+{
+    memcpy(frame, slirp_mac, 6);
+    memcpy(frame + 6, net->mac, 6);
+    stw_be_p(frame + 12, type);
+}
+
+static void guest_send_arp_request(uint32_t target)
+{
+    uint8_t frame[60] = { 0 };
+    uint8_t *arp = frame + ETH_HLEN;
+
+    build_eth(frame, ETH_P_ARP);
+    memset(frame, 0xff, 6);
+    stw_be_p(arp, 1);                   /* Ethernet */
+    stw_be_p(arp + 2, ETH_P_IP);
+    arp[4] = 6;
+    arp[5] = 4;
+    stw_be_p(arp + 6, 1);               /* request */
+    memcpy(arp + 8, net->mac, 6);
+    stl_be_p(arp + 14, GUEST_ADDR);
+    stl_be_p(arp + 24, target);
+
+    qvirtio_net_send(net, frame, sizeof(frame));
+}
+
+static void guest_send_tcp(TestConn *c, uint8_t flags, const void *data,
+                           size_t len)
+{
+    uint8_t frame[ETH_HLEN + IP_HLEN + TCP_HLEN + 1024] = { 0 };
+    uint8_t *ip = frame + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    uint8_t pseudo[12];
+    uint32_t sum;
+
+    g_assert_cmpint(len, <=, 1024);
+    build_eth(frame, ETH_P_IP);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP_HLEN + TCP_HLEN + len);
+    ip[8] = 64;                         /* TTL */
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, GUEST_ADDR);
+    stl_be_p(ip + 16, c->faddr);
+    stw_be_p(ip + 10, csum_fold(csum_add(0, ip, IP_HLEN)));
+
+    stw_be_p(tcp, c->lport);
+    stw_be_p(tcp + 2, c->fport);
+    stl_be_p(tcp + 4, c->snd_nxt);
+    stl_be_p(tcp + 8, c->rcv_nxt);
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 65535);          /* window */
+    memcpy(tcp + TCP_HLEN, data, len);
+
+    stl_be_p(pseudo, GUEST_ADDR);
+    stl_be_p(pseudo + 4, c->faddr);
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_TCP;
+    stw_be_p(pseudo + 10, TCP_HLEN + len);
+    sum = csum_add(0, pseudo, sizeof(pseudo));
+    sum = csum_add(sum, tcp, TCP_HLEN + len);
+    stw_be_p(tcp + 16, csum_fold(sum));
+
+    c->snd_nxt += len + !!(flags & (TH_SYN | TH_FIN));
+    qvirtio_net_send(net, frame, ETH_HLEN + IP_HLEN + TCP_HLEN + len);
+}
+
+/* Receives frames until one is a TCP segment of @c, which is returned in
+ * @frame.  Until the port slirp uses is known, only SYNs are taken; with
+ * @data, only segments that carry data.  Other frames are skipped.
+ * Returns the offset of the TCP header, or -1 on timeout.
+ */
+static int guest_recv_tcp(TestConn *c, bool data, uint8_t *frame,
+                          size_t size, size_t *len)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_MS * 1000LL;
+
+    while (g_get_monotonic_time() < end) {
+        ssize_t ret;
+        uint8_t *ip = frame + ETH_HLEN;
+        uint8_t *tcp;
+        int ihl;
+
+        ret = qvirtio_net_recv(net, frame, size, TIMEOUT_MS);
+        if (ret < 0) {
+            return -1;
+        }
+        qvirtio_net_post_rx(net, 1);
+
+        if (ret < ETH_HLEN + IP_HLEN ||
+            lduw_be_p(frame + 12) != ETH_P_IP || ip[9] != IPPROTO_TCP ||
+            ldl_be_p(ip + 16) != GUEST_ADDR) {
+            continue;
+        }
+        ihl = (ip[0] & 0xf) * 4;
+        tcp = ip + ihl;
+        *len = MIN(ret, ETH_HLEN + lduw_be_p(ip + 2));
+
+        if (lduw_be_p(tcp + 2) != c->lport) {
+            continue;
+        }
+        if (c->fport ? lduw_be_p(tcp) != c->fport : !(tcp[13] & TH_SYN)) {
+            continue;
+        }
+        if (data && *len == ETH_HLEN + ihl + (tcp[12] >> 4) * 4) {
+            continue;
+        }
+        return ETH_HLEN + ihl;
+    }
+    return -1;
+}
+
+/* Connects to host port @port and plays the guest end of the handshake */
+static void conn_open(TestConn *c, int port)
+{
+    uint8_t frame[RX_BUF_LEN];
+    size_t len;
+    int off, err = 0;
+
+    memset(c, 0, sizeof(*c));
+    c->lport = GUEST_PORT;
+    c->fd = host_connect(port, &err);
+    g_assert_cmpint(c->fd, >=, 0);
+
+    /* The slirp thread must see the connection and open one to the guest */
+    off = guest_recv_tcp(c, false, frame, sizeof(frame), &len);
+    g_assert_cmpint(off, >=, 0);
+    g_assert_cmphex(frame[off + 13] & (TH_SYN | TH_ACK), ==, TH_SYN);
+
+    c->faddr = ldl_be_p(frame + ETH_HLEN + 12);
+    c->fport = lduw_be_p(frame + off);
+    c->rcv_nxt = ldl_be_p(frame + off + 4) + 1;
+    c->snd_nxt = g_random_int();
+    g_assert_cmphex(c->faddr, ==, HOST_ADDR);
+
+    guest_send_tcp(c, TH_SYN | TH_ACK, NULL, 0);
+}
+
+/* Connects from the guest to @faddr:@fport, where slirp has no host socket */
+static void conn_open_guest(TestConn *c, uint32_t faddr, uint16_t fport)
+{
+    uint8_t frame[RX_BUF_LEN];
+    size_t len;
+    int off;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->lport = 40000 + g_random_int_range(0, 10000);
+    c->faddr = faddr;
+    c->fport = fport;
+    c->snd_nxt = g_random_int();
+
+    guest_send_tcp(c, TH_SYN, NULL, 0);
+    off = guest_recv_tcp(c, false, frame, sizeof(frame), &len);
+    g_assert_cmpint(off, >=, 0);
+    g_assert_cmphex(frame[off + 13] & (TH_SYN | TH_ACK | TH_RST), ==,
+                    TH_SYN | TH_ACK);
+    g_assert_cmphex(ldl_be_p(frame + off + 8), ==, c->snd_nxt);
+
+    c->rcv_nxt = ldl_be_p(frame + off + 4) + 1;
+    guest_send_tcp(c, TH_ACK, NULL, 0);
+}
+
+/* Sends @msg from the host end of @c and checks that the guest gets it */
+static void conn_host_to_guest(TestConn *c, const char *msg)
+{
+    uint8_t frame[RX_BUF_LEN];
+    size_t len, hlen;
+    int off;
+
+    g_assert_cmpint(send(c->fd, msg, strlen(msg), 0), ==, strlen(msg));
+
+    off = guest_recv_tcp(c, true, frame, sizeof(frame), &len);
+    g_assert_cmpint(off, >=, 0);
+    hlen = (frame[off + 12] >> 4) * 4;
+
+    g_assert_cmpint(ldl_be_p(frame + off + 4), ==, c->rcv_nxt);
+    g_assert_cmpint(len - off - hlen, ==, strlen(msg));
+    g_assert(memcmp(frame + off + hlen, msg, strlen(msg)) == 0);
+    c->rcv_nxt += strlen(msg);
+}
+
+/* Sends @msg from the guest end of @c and checks that the host gets it */
+static void conn_guest_to_host(TestConn *c, const char *msg)
+{
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    char buf[256];
+    size_t got = 0;
+
+    guest_send_tcp(c, TH_ACK, msg, strlen(msg));
+
+    while (got < strlen(msg)) {
+        ssize_t ret;
+
+        g_assert_cmpint(poll(&pfd, 1, TIMEOUT_MS), ==, 1);
+        ret = recv(c->fd, buf + got, sizeof(buf) - got, 0);
+        g_assert_cmpint(ret, >, 0);
+        got += ret;
+    }
+    g_assert_cmpint(got, ==, strlen(msg));
+    g_assert(memcmp(buf, msg, got) == 0);
+}
+
+/* Sends @msg from the guest end of @c and waits for slirp to acknowledge
+ * it, which it does after a delay
+ */
+static void conn_guest_send_acked(TestConn *c, const char *msg)
+{
+    uint8_t frame[RX_BUF_LEN];
+    size_t len;
+    int off;
+
+    guest_send_tcp(c, TH_ACK, msg, strlen(msg));
+
+    do {
+        off = guest_recv_tcp(c, false, frame, sizeof(frame), &len);
+        g_assert_cmpint(off, >=, 0);
+        g_assert_cmphex(frame[off + 13] & TH_RST, ==, 0);
+    } while (ldl_be_p(frame + off + 8) != c->snd_nxt);
+}
+
+static void conn_close(TestConn *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void test_arp(void)
+{
+    uint8_t frame[RX_BUF_LEN];
+    uint8_t *arp = frame + ETH_HLEN;
+    ssize_t len;
+
+    slirp_test_start(NULL);
+
+    guest_send_arp_request(HOST_ADDR);
+    len = qvirtio_net_recv(net, frame, sizeof(frame), TIMEOUT_MS);
+    g_assert_cmpint(len, >=, ETH_HLEN + 28);
+    g_assert_cmphex(lduw_be_p(frame + 12), ==, ETH_P_ARP);
+    g_assert_cmpint(lduw_be_p(arp + 6), ==, 2);     /* reply */
+    g_assert(memcmp(arp + 8, slirp_mac, 6) == 0);
+    g_assert_cmphex(ldl_be_p(arp + 14), ==, HOST_ADDR);
+    g_assert(memcmp(arp + 18, net->mac, 6) == 0);
+
+    slirp_test_end();
+}
+
+/* A forwarding rule added while the slirp thread is idle in poll() */
+static void test_hostfwd_add(void)
+{
+    TestConn c;
+    int port = free_port();
+    int err = 0;
+
+    slirp_test_start(NULL);
+    guest_send_arp_request(HOST_ADDR);
+
+    /* Nothing listens yet */
+    g_assert_cmpint(host_connect(port, &err), ==, -1);
+    g_assert_cmpint(err, ==, ECONNREFUSED);
+
+    hmp("\"return\": \"\"", "hostfwd_add tcp:127.0.0.1:%d-:%d",
+        port, GUEST_PORT);
+    conn_open(&c, port);
+    conn_host_to_guest(&c, "hello guest");
+    conn_guest_to_host(&c, "hello host");
+    conn_host_to_guest(&c, "bye");
+    conn_close(&c);
+
+    hmp("removed", "hostfwd_remove tcp:127.0.0.1:%d", port);
+    g_assert_cmpint(host_connect(port, &err), ==, -1);
+    g_assert_cmpint(err, ==, ECONNREFUSED);
+
+    slirp_test_end();
+}
+
+/* Many connections through one forwarding rule.  Segments from the guest
+ * are matched to their socket through the hash table, which has to grow on
+ * the way, and the host sockets all have to be in the slirp thread's poll
+ * set.
+ */
+static void test_many_conns(void)
+{
+    TestConn *conns = g_new(TestConn, NUM_CONNS);
+    int port = free_port();
+    char msg[32];
+    int i, j;
+
+    slirp_test_start(NULL);
+    guest_send_arp_request(HOST_ADDR);
+    hmp("\"return\": \"\"", "hostfwd_add tcp:127.0.0.1:%d-:%d",
+        port, GUEST_PORT);
+
+    for (i = 0; i < NUM_CONNS; i++) {
+        conn_open(&conns[i], port);
+    }
+
+    /* Go through the connections in an order unrelated to their creation */
+    for (i = 0; i < NUM_CONNS; i++) {
+        j = (i * 7) % NUM_CONNS;
+        snprintf(msg, sizeof(msg), "to guest %d", j);
+        conn_host_to_guest(&conns[j], msg);
+    }
+    for (i = 0; i < NUM_CONNS; i++) {
+        j = NUM_CONNS - 1 - (i * 13) % NUM_CONNS;
+        snprintf(msg, sizeof(msg), "to host %d", j);
+        conn_guest_to_host(&conns[j], msg);
+    }
+
+    /* Closing every other one takes entries out of the middle of the
+     * poll set
+     */
+    for (i = 0; i < NUM_CONNS; i += 2) {
+        conn_close(&conns[i]);
+    }
+    for (i = 1; i < NUM_CONNS; i += 2) {
+        conn_host_to_guest(&conns[i], "still there");
+        conn_guest_to_host(&conns[i], "yes");
+        conn_close(&conns[i]);
+    }
+
+    slirp_test_end();
+    g_free(conns);
+}
+
+static void wait_for_status(const char *cmd, const char *done)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_MS * 1000LL;
+    char *reply;
+
+    for (;;) {
+        reply = qmp_reply("{ 'execute': '%s' }", cmd);
+        g_assert(strstr(reply, "failed") == NULL);
+        if (strstr(reply, done)) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < end);
+        g_free(reply);
+        g_usleep(10 * 1000);
+    }
+    g_free(reply);
+}
+
+/* Connections to a guestfwd chardev are the only ones that are migrated.
+ * After loadvm, segments from the guest must find the loaded socket in the
+ * hash table.
+ */
+static void test_guestfwd_migrate(void)
+{
+    char *file = g_strdup_printf("/tmp/slirp-test-%d.mig", getpid());
+    char *opts, *args, *incoming;
+    TestConn c;
+
+    opts = g_strdup_printf(",guestfwd=tcp:10.0.2.100:%d-null", GUESTFWD_PORT);
+    slirp_test_start(opts);
+    guest_send_arp_request(HOST_ADDR);
+
+    conn_open_guest(&c, GUESTFWD_ADDR, GUESTFWD_PORT);
+    conn_guest_send_acked(&c, "before");
+
+    qmp("{ 'execute': 'migrate',"
+        "  'arguments': { 'uri': 'exec:cat > %s' } }", file);
+    wait_for_status("query-migrate", "\"status\": \"completed\"");
+    qtest_end();
+
+    /* The driver state carries over, as does guest memory */
+    args = slirp_test_args(opts);
+    incoming = g_strdup_printf("%s -incoming 'exec:cat %s'", args, file);
+    qtest_start(incoming);
+    wait_for_status("query-status", "\"status\": \"running\"");
+
+    /* slirp does not migrate its ARP table */
+    guest_send_arp_request(HOST_ADDR);
+    conn_guest_send_acked(&c, "after");
+
+    slirp_test_end();
+    unlink(file);
+    g_free(incoming);
+    g_free(args);
+    g_free(opts);
+    g_free(file);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/slirp/arp", test_arp);
+    qtest_add_func("/slirp/hostfwd-add", test_hostfwd_add);
+    qtest_add_func("/slirp/many-conns", test_many_conns);
+    qtest_add_func("/slirp/guestfwd-migrate", test_guestfwd_migrate);
+
+    return g_test_run();
+}
@@ -0,0 +1,115 @@
+/*
+ * Test and benchmark buffer_is_zero() and buffer_find_nonzero_offset()
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with "-m perf" to measure the throughput of every variant usable on
+ * the host.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+
+#define BUF_SIZE 8192
+#define MAX_ALIGN 128
+
+static char buffer[BUF_SIZE + 2 * MAX_ALIGN] __attribute__((aligned(MAX_ALIGN)));
+
+static void check_variant(void)
+{
+    size_t align, len, pos;
+
+    /* Cover every head and tail alignment for the short lengths */
+    for (align = 0; align < MAX_ALIGN; align++) {
+        char *buf = buffer + MAX_ALIGN + align;
+
+        for (len = 0; len < 2 * MAX_ALIGN; len++) {
+            memset(buffer, 0, sizeof(buffer));
+            g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+            g_assert(buffer_is_zero(buf, len));
+
+            /* Non-zero bytes just outside the buffer must not matter */
+            buf[-1] = 1;
+            buf[len] = 1;
+            g_assert(buffer_is_zero(buf, len));
+            buf[-1] = 0;
+            buf[len] = 0;
+
+            for (pos = 0; pos < len; pos++) {
+                buf[pos] = 1;
+                buf[pos + (len - pos) / 2] = 0x80;
+                g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, pos);
+                g_assert(!buffer_is_zero(buf, len));
+                memset(buf + pos, 0, len - pos);
+            }
+        }
+    }
+
+    /* And a few positions in a long buffer */
+    memset(buffer, 0, sizeof(buffer));
+    for (pos = 0; pos < BUF_SIZE; pos += 509) {
+        buffer[pos] = 0x42;
+        g_assert_cmpint(buffer_find_nonzero_offset(buffer, BUF_SIZE), ==, pos);
+        g_assert(!buffer_is_zero(buffer, BUF_SIZE));
+        buffer[pos] = 0;
+    }
+    g_assert(buffer_is_zero(buffer, BUF_SIZE));
+}
+
+static void test_variants(void)
+{
+    do {
+        g_test_message("checking %s\n", buffer_is_zero_accel_name());
+        check_variant();
+    } while (test_buffer_is_zero_next_accel());
+}
+
+/*
+ * Throughput benchmark
+ */
+
+static void perf_variant(size_t len)
+{
+    void *buf = qemu_memalign(64, len);
+    unsigned int i, max;
+    double duration;
+
+    memset(buf, 0, len);
+    max = (1ULL << 33) / len;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        g_assert(buffer_is_zero(buf, len));
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%-8s %8zu bytes: %.2f GB/s\n",
+                   buffer_is_zero_accel_name(), len,
+                   (double) max * len / duration / 1e9);
+    qemu_vfree(buf);
+}
+
+static void perf_variants(void)
+{
+    static const size_t sizes[] = { 512, 4096, 64 * 1024, 2 * 1024 * 1024 };
+    int i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            perf_variant(sizes[i]);
+        }
+    } while (test_buffer_is_zero_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bufferiszero/variants", test_variants);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/bufferiszero", perf_variants);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,170 @@
+/*
+ * Test and benchmark the CRC32C and Internet checksum kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with "-m perf" to measure the throughput of every variant usable on
+ * the host.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE (64 * 1024)
+
+static uint8_t buffer[BUF_SIZE + 64];
+
+static void fill_buffer(void)
+{
+    GRand *rand = g_rand_new_with_seed(0x42);
+    int i;
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = g_rand_int(rand);
+    }
+    g_rand_free(rand);
+}
+
+/* Bit-at-a-time reference implementations */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static uint16_t checksum_ref(const uint8_t *data, int len, int seq)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        sum += (i & 1) ? data[i - seq] : data[i - seq] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void test_crc32c(void)
+{
+    static const uint8_t check[] = "123456789";
+    size_t off, len;
+
+    fill_buffer();
+    do {
+        g_test_message("checking %s\n", crc32c_accel_name());
+        g_assert_cmphex(crc32c(0xffffffff, check, 9), ==, 0xe3069283);
+
+        for (off = 0; off < 16; off++) {
+            for (len = 0; len < 256; len++) {
+                g_assert_cmphex(crc32c(0xffffffff, buffer + off, len), ==,
+                                crc32c_ref(0xffffffff, buffer + off, len));
+            }
+            /* Long enough for the interleaved blocks, with a tail */
+            for (len = 3000; len < BUF_SIZE; len += 3001) {
+                g_assert_cmphex(crc32c(0x12345678, buffer + off, len), ==,
+                                crc32c_ref(0x12345678, buffer + off, len));
+            }
+        }
+    } while (test_crc32c_next_accel());
+}
+
+static void test_net_checksum(void)
+{
+    int off, len, seq;
+
+    fill_buffer();
+    do {
+        g_test_message("checking %s\n", net_checksum_accel_name());
+        for (off = 0; off < 40; off++) {
+            for (len = 0; len < 2000; len += (len < 256 ? 1 : 37)) {
+                for (seq = 0; seq < 2; seq++) {
+                    uint32_t sum = net_checksum_add_cont(len, buffer + off,
+                                                         seq);
+                    g_assert_cmphex(net_checksum_finish(sum), ==,
+                                    checksum_ref(buffer + off, len, seq));
+                }
+            }
+        }
+        g_assert_cmphex(net_checksum_finish(net_checksum_add(BUF_SIZE,
+                                                             buffer)), ==,
+                        checksum_ref(buffer, BUF_SIZE, 0));
+    } while (test_net_checksum_next_accel());
+}
+
+/*
+ * Throughput benchmark
+ */
+
+static void perf_report(const char *what, const char *name, size_t len,
+                        unsigned int count, double duration)
+{
+    g_test_message("%-8s %-8s %6zu bytes: %.2f GB/s\n", what, name, len,
+                   (double) count * len / duration / 1e9);
+}
+
+static void perf_crc32c(void)
+{
+    static const size_t sizes[] = { 512, 4096, BUF_SIZE };
+    unsigned int i, j, max;
+    double duration;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            max = (1U << 30) / sizes[i];
+            g_test_timer_start();
+            for (j = 0; j < max; j++) {
+                crc32c(0xffffffff, buffer, sizes[i]);
+            }
+            duration = g_test_timer_elapsed();
+            perf_report("crc32c", crc32c_accel_name(), sizes[i], max,
+                        duration);
+        }
+    } while (test_crc32c_next_accel());
+}
+
+static void perf_net_checksum(void)
+{
+    static const size_t sizes[] = { 64, 1500, BUF_SIZE };
+    unsigned int i, j, max;
+    double duration;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            max = (1U << 30) / sizes[i];
+            g_test_timer_start();
+            for (j = 0; j < max; j++) {
+                net_checksum_add(sizes[i], buffer);
+            }
+            duration = g_test_timer_elapsed();
+            perf_report("checksum", net_checksum_accel_name(), sizes[i], max,
+                        duration);
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/checksum/crc32c", test_crc32c);
+    g_test_add_func("/checksum/net", test_net_checksum);
+    if (g_test_perf()) {
+        fill_buffer();
+        g_test_add_func("/perf/crc32c", perf_crc32c);
+        g_test_add_func("/perf/net_checksum", perf_net_checksum);
+    }
+    return g_test_run();
+}
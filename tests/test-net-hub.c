@@ -0,0 +1,309 @@
+/*
+ * Hub net client tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
+#include "net/net.h"
+#include "net/queue.h"
+#include "net/eth.h"
+#include "net/hub.h"
+
+/* Must match NET_HUB_MAC_AGEING_MS in net/hub.c */
+#define AGEING_MS       300000
+
+#define NB_PORTS        4
+#define FRAME_SIZE      64
+
+static NetClientState *ports[NB_PORTS];
+static NetClientState peers[NB_PORTS];
+static int received[NB_PORTS];          /* frames passed on per port */
+static int nb_direct;                   /* frames passed on as they came */
+static int nb_shared;                   /* frames passed on by reference */
+static int nb_bufs;                     /* shared buffers still alive */
+static const struct iovec *last_iov;    /* iov of the last direct frame */
+static int64_t clock_ns;
+
+static NetClientInfo nic_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NetClientState),
+};
+
+static NetClientInfo dump_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_DUMP,
+    .size = sizeof(NetClientState),
+};
+
+static int port_index(NetClientState *nc)
+{
+    int i;
+
+    for (i = 0; i < NB_PORTS; i++) {
+        if (ports[i] == nc) {
+            return i;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* Stubs for net/net.c, net/queue.c and the clock */
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc = g_malloc0(info->size);
+
+    nc->info = info;
+    nc->model = g_strdup(model);
+    nc->name = g_strdup(name);
+    return nc;
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    received[port_index(nc)]++;
+    nb_direct++;
+    last_iov = iov;
+    return iov_size(iov, iovcnt);
+}
+
+void qemu_send_packet_shared(NetClientState *nc, const uint8_t *buf, int size,
+                             NetPacketBuf **shared)
+{
+    if (!*shared) {
+        *shared = g_malloc(sizeof(NetPacketBuf) + size);
+        (*shared)->refcnt = 1;
+        (*shared)->size = size;
+        memcpy((*shared)->data, buf, size);
+        nb_bufs++;
+    }
+    g_assert_cmpint((*shared)->size, ==, size);
+    g_assert(memcmp((*shared)->data, buf, size) == 0);
+
+    received[port_index(nc)]++;
+    nb_shared++;
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (--buf->refcnt == 0) {
+        g_free(buf);
+        nb_bufs--;
+    }
+}
+
+bool qemu_net_queue_flush(NetQueue *queue)
+{
+    return false;
+}
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+void print_net_client(Monitor *mon, NetClientState *nc)
+{
+}
+
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    return clock_ns;
+}
+
+/* Every test uses a hub of its own, so that no addresses are shared */
+static void setup_hub(int hub_id, int dump_port)
+{
+    int i;
+
+    for (i = 0; i < NB_PORTS; i++) {
+        ports[i] = net_hub_add_port(hub_id, NULL);
+        peers[i].info = (i == dump_port) ? &dump_info : &nic_info;
+        ports[i]->peer = &peers[i];
+    }
+    clock_ns = 0;
+}
+
+static void reset_counters(void)
+{
+    memset(received, 0, sizeof(received));
+    nb_direct = 0;
+    nb_shared = 0;
+    last_iov = NULL;
+}
+
+static void make_mac(uint8_t *mac, int host)
+{
+    static const uint8_t base[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0 };
+
+    memcpy(mac, base, ETH_ALEN);
+    mac[5] = host;
+}
+
+/* Sends a frame from host @src on port @port to host @dst, or to the
+ * broadcast address if @dst is negative.  The Ethernet header is split
+ * over several iovec elements.
+ */
+static void send_frame(int port, int src, int dst)
+{
+    uint8_t frame[FRAME_SIZE];
+    struct eth_header *eh = (struct eth_header *)frame;
+    struct iovec iov[3] = {
+        { .iov_base = frame, .iov_len = 3 },
+        { .iov_base = frame + 3, .iov_len = 6 },
+        { .iov_base = frame + 9, .iov_len = FRAME_SIZE - 9 },
+    };
+
+    memset(frame, port, sizeof(frame));
+    if (dst < 0) {
+        memset(eh->h_dest, 0xff, ETH_ALEN);
+    } else {
+        make_mac(eh->h_dest, dst);
+    }
+    make_mac(eh->h_source, src);
+    eh->h_proto = cpu_to_be16(ETH_P_IP);
+
+    reset_counters();
+    g_assert_cmpint(ports[port]->info->receive_iov(ports[port], iov, 3),
+                    ==, FRAME_SIZE);
+    g_assert_cmpint(nb_bufs, ==, 0);
+}
+
+static void assert_flooded(int src_port)
+{
+    int i;
+
+    for (i = 0; i < NB_PORTS; i++) {
+        g_assert_cmpint(received[i], ==, i == src_port ? 0 : 1);
+    }
+    g_assert_cmpint(nb_direct, ==, 0);
+    g_assert_cmpint(nb_shared, ==, NB_PORTS - 1);
+}
+
+static void assert_unicast(int dst_port)
+{
+    int i;
+
+    for (i = 0; i < NB_PORTS; i++) {
+        g_assert_cmpint(received[i], ==, i == dst_port ? 1 : 0);
+    }
+    g_assert_cmpint(nb_direct, ==, 1);
+    g_assert_cmpint(nb_shared, ==, 0);
+}
+
+static void test_flood(void)
+{
+    setup_hub(100, -1);
+
+    /* Unknown and broadcast destinations go everywhere but the source */
+    send_frame(0, 1, 2);
+    assert_flooded(0);
+    send_frame(1, 2, -1);
+    assert_flooded(1);
+}
+
+static void test_learning(void)
+{
+    setup_hub(101, -1);
+
+    send_frame(0, 1, 2);
+    assert_flooded(0);
+
+    /* Host 1 was seen on port 0; its iovec is passed on untouched */
+    send_frame(1, 2, 1);
+    assert_unicast(0);
+    g_assert(last_iov != NULL);
+
+    send_frame(0, 1, 2);
+    assert_unicast(1);
+
+    /* Hosts move between ports */
+    send_frame(3, 1, 2);
+    assert_unicast(1);
+    send_frame(1, 2, 1);
+    assert_unicast(3);
+
+    /* Broadcasts still flood */
+    send_frame(0, 1, -1);
+    assert_flooded(0);
+}
+
+static void test_ageing(void)
+{
+    setup_hub(102, -1);
+
+    send_frame(0, 1, 2);
+    clock_ns = (int64_t)(AGEING_MS - 1) * SCALE_MS;
+    send_frame(1, 2, 1);
+    assert_unicast(0);
+
+    /* Host 2 was seen later, so only host 1 has expired */
+    clock_ns = (int64_t)AGEING_MS * SCALE_MS;
+    send_frame(2, 3, 1);
+    assert_flooded(2);
+    send_frame(2, 3, 2);
+    assert_unicast(1);
+}
+
+static void test_port_removal(void)
+{
+    NetClientState *removed;
+
+    setup_hub(103, -1);
+
+    send_frame(1, 2, 1);
+    send_frame(0, 1, 2);
+    assert_unicast(1);
+
+    /* Addresses learnt on a removed port are forgotten */
+    removed = ports[1];
+    removed->info->cleanup(removed);
+    send_frame(0, 1, 2);
+    g_assert_cmpint(received[0], ==, 0);
+    g_assert_cmpint(received[2], ==, 1);
+    g_assert_cmpint(received[3], ==, 1);
+    g_assert_cmpint(nb_shared, ==, 2);
+
+    ports[1] = NULL;
+    g_free(removed->model);
+    g_free(removed->name);
+    g_free(removed);
+}
+
+static void test_dump(void)
+{
+    setup_hub(104, 3);
+
+    send_frame(1, 2, -1);
+    send_frame(0, 1, 2);
+
+    /* The port with the dump client sees unicast frames of other ports */
+    g_assert_cmpint(received[0], ==, 0);
+    g_assert_cmpint(received[1], ==, 1);
+    g_assert_cmpint(received[2], ==, 0);
+    g_assert_cmpint(received[3], ==, 1);
+    g_assert_cmpint(nb_shared, ==, 2);
+
+    /* ...but its own frames are still switched */
+    send_frame(3, 4, 2);
+    assert_unicast(1);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/hub/flood", test_flood);
+    g_test_add_func("/net/hub/learning", test_learning);
+    g_test_add_func("/net/hub/ageing", test_ageing);
+    g_test_add_func("/net/hub/port-removal", test_port_removal);
+    g_test_add_func("/net/hub/dump", test_dump);
+    return g_test_run();
+}
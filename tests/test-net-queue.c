@@ -0,0 +1,526 @@
+/*
+ * NetQueue tests
+ *
+ * Copyright (c) 2013 the QEMU project
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+/* Must match NET_QUEUE_RETAIN_BYTES in net/queue.c */
+#define RETAIN_BYTES (256 * 1024)
+
+/* Every packet starts with its sequence number, its sender's index and its
+ * size, and is filled with the low byte of the sequence number.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t sender;
+    uint32_t size;
+} PacketHeader;
+
+static NetClientState senders[2];
+
+static bool can_send;           /* result of qemu_can_send_packet() */
+static bool refuse;             /* the delivery handler returns zero */
+static uint32_t next_seq;       /* sequence number of the next packet */
+static uint32_t last_seq;       /* last sequence number delivered */
+static int delivered[2];        /* packets delivered per sender */
+static int sent_cbs;            /* sent callbacks invoked */
+static bool contiguous;         /* no packets were dropped or purged */
+
+/* Packets queued from the delivery handler, once */
+static NetQueue *reenter_queue;
+static int reenter_count;
+
+static size_t packet_size(uint32_t seq)
+{
+    return sizeof(PacketHeader) + 60 + seq % 1400;
+}
+
+static uint8_t *make_packet(int sender, uint32_t seq, size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    PacketHeader hdr = { .seq = seq, .sender = sender, .size = size };
+
+    memset(buf, seq & 0xff, size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    return buf;
+}
+
+static ssize_t send_packet(NetQueue *queue, int sender, size_t size,
+                           NetPacketSent *sent_cb)
+{
+    uint8_t *buf = make_packet(sender, next_seq++, size);
+    ssize_t ret;
+
+    ret = qemu_net_queue_send(queue, &senders[sender], 0, buf, size, sent_cb);
+    g_free(buf);
+    return ret;
+}
+
+static ssize_t send_packet_iov(NetQueue *queue, int sender, size_t size)
+{
+    uint8_t *buf = make_packet(sender, next_seq++, size);
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = size / 2 },
+        { .iov_base = buf + size / 2, .iov_len = size - size / 2 },
+    };
+    ssize_t ret;
+
+    ret = qemu_net_queue_send_iov(queue, &senders[sender], 0, iov, 2, NULL);
+    g_free(buf);
+    return ret;
+}
+
+static void check_packet(NetClientState *sender, const uint8_t *data,
+                         size_t size)
+{
+    PacketHeader hdr;
+    size_t i;
+
+    g_assert_cmpint(size, >=, sizeof(hdr));
+    memcpy(&hdr, data, sizeof(hdr));
+    g_assert(sender == &senders[hdr.sender]);
+    g_assert_cmpint(size, ==, hdr.size);
+    for (i = sizeof(hdr); i < size; i++) {
+        g_assert_cmpint(data[i], ==, hdr.seq & 0xff);
+    }
+
+    if (contiguous) {
+        g_assert_cmpint(hdr.seq, ==, last_seq + 1);
+    } else {
+        g_assert_cmpint(hdr.seq, >, last_seq);
+    }
+    last_seq = hdr.seq;
+    delivered[hdr.sender]++;
+}
+
+/* Stubs for net/net.c and the main loop */
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return can_send;
+}
+
+ssize_t qemu_deliver_packet(NetClientState *sender, unsigned flags,
+                            const uint8_t *data, size_t size, void *opaque)
+{
+    if (refuse) {
+        return 0;
+    }
+    check_packet(sender, data, size);
+
+    if (reenter_queue) {
+        NetQueue *queue = reenter_queue;
+        int i;
+
+        reenter_queue = NULL;
+        for (i = 0; i < reenter_count; i++) {
+            send_packet(queue, 0, packet_size(next_seq), NULL);
+        }
+    }
+    return size;
+}
+
+ssize_t qemu_deliver_packet_iov(NetClientState *sender, unsigned flags,
+                                const struct iovec *iov, int iovcnt,
+                                void *opaque)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t *buf = g_malloc(size);
+    ssize_t ret;
+
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+    ret = qemu_deliver_packet(sender, flags, buf, size, opaque);
+    g_free(buf);
+    return ret;
+}
+
+struct QEMUBH {
+    QEMUBHFunc *cb;
+    void *opaque;
+    int scheduled;
+};
+
+static QEMUBH *last_bh;
+
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    QEMUBH *bh = g_new0(QEMUBH, 1);
+
+    bh->cb = cb;
+    bh->opaque = opaque;
+    last_bh = bh;
+    return bh;
+}
+
+void qemu_bh_schedule(QEMUBH *bh)
+{
+    atomic_mb_set(&bh->scheduled, 1);
+}
+
+void qemu_bh_delete(QEMUBH *bh)
+{
+    g_free(bh);
+}
+
+static bool bh_poll(QEMUBH *bh)
+{
+    if (!atomic_xchg(&bh->scheduled, 0)) {
+        return false;
+    }
+    bh->cb(bh->opaque);
+    return true;
+}
+
+static void sent_cb(NetClientState *sender, ssize_t ret)
+{
+    g_assert_cmpint(ret, >, 0);
+    sent_cbs++;
+}
+
+static NetQueue *new_queue(void)
+{
+    can_send = true;
+    refuse = false;
+    next_seq = 1;
+    last_seq = 0;
+    delivered[0] = delivered[1] = 0;
+    sent_cbs = 0;
+    reenter_queue = NULL;
+    contiguous = true;
+
+    return qemu_new_net_queue(qemu_deliver_packet, NULL);
+}
+
+static void query(NetQueue *queue, NetQueueInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    qemu_net_queue_query(queue, info);
+}
+
+static void test_direct(void)
+{
+    NetQueue *queue = new_queue();
+    NetQueueInfo info;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        size_t size = packet_size(next_seq);
+
+        g_assert_cmpint(send_packet(queue, 0, size, NULL), ==, size);
+        size = packet_size(next_seq);
+        g_assert_cmpint(send_packet_iov(queue, 1, size), ==, size);
+    }
+    g_assert_cmpint(delivered[0], ==, 100);
+    g_assert_cmpint(delivered[1], ==, 100);
+    g_assert(qemu_net_queue_empty(queue));
+
+    /* Nothing was queued, so nothing was allocated */
+    query(queue, &info);
+    g_assert_cmpint(info.max_count, ==, 0);
+    g_assert_cmpint(info.buffer_size, ==, 0);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_wrap(void)
+{
+    NetQueue *queue = new_queue();
+    NetQueueInfo info;
+    int i, j;
+
+    /* Ten packets at a time go around the 16-slot ring many times over */
+    for (i = 0; i < 50; i++) {
+        can_send = false;
+        for (j = 0; j < 10; j++) {
+            g_assert_cmpint(send_packet(queue, 0, packet_size(next_seq),
+                                        NULL), ==, 0);
+        }
+        g_assert(!qemu_net_queue_empty(queue));
+
+        can_send = true;
+        g_assert(qemu_net_queue_flush(queue));
+        g_assert(qemu_net_queue_empty(queue));
+
+        /* The ring did not grow, and its buffers are reused */
+        query(queue, &info);
+        g_assert_cmpint(info.buffer_size, <=, 16 * packet_size(1399));
+    }
+
+    g_assert_cmpint(delivered[0], ==, 500);
+    query(queue, &info);
+    g_assert_cmpint(info.count, ==, 0);
+    g_assert_cmpint(info.max_count, ==, 10);
+    g_assert_cmpint(info.drops, ==, 0);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_grow(void)
+{
+    NetQueue *queue = new_queue();
+    NetQueueInfo info;
+    int i;
+
+    /* The ring starts with 16 slots and doubles as needed */
+    refuse = true;
+    g_assert_cmpint(send_packet(queue, 0, packet_size(next_seq), NULL), ==, 0);
+    can_send = false;
+    refuse = false;
+    for (i = 1; i < 100; i++) {
+        send_packet(queue, i & 1, packet_size(next_seq), sent_cb);
+    }
+    query(queue, &info);
+    g_assert_cmpint(info.count, ==, 100);
+
+    /* The first delivery queues more packets, which grows the ring while
+     * it is being flushed.
+     */
+    can_send = true;
+    reenter_queue = queue;
+    reenter_count = 200;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert(qemu_net_queue_empty(queue));
+
+    g_assert_cmpint(delivered[0] + delivered[1], ==, 300);
+    g_assert_cmpint(sent_cbs, ==, 99);
+    query(queue, &info);
+    g_assert_cmpint(info.max_count, ==, 300);
+    g_assert_cmpint(info.drops, ==, 0);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_shared(void)
+{
+    NetQueue *queues[2] = { new_queue(), new_queue() };
+    NetPacketBuf *shared = NULL;
+    size_t size = packet_size(1);
+    uint8_t *buf = make_packet(0, 1, size);
+    int i;
+
+    /* The first queue copies the packet, the second one takes a reference */
+    can_send = false;
+    for (i = 0; i < 2; i++) {
+        g_assert_cmpint(qemu_net_queue_send_shared(queues[i], &senders[0], 0,
+                                                   buf, size, &shared),
+                        ==, 0);
+    }
+    g_free(buf);
+    g_assert(shared);
+    g_assert_cmpint(shared->refcnt, ==, 3);
+
+    /* Delivering the shared packet grows the ring, so the slot holding it
+     * moves while it is being delivered.
+     */
+    can_send = true;
+    reenter_queue = queues[0];
+    reenter_count = 20;
+    next_seq = 2;
+    g_assert(qemu_net_queue_flush(queues[0]));
+    g_assert_cmpint(delivered[0], ==, 21);
+    g_assert_cmpint(shared->refcnt, ==, 2);
+
+    last_seq = 0;
+    g_assert(qemu_net_queue_flush(queues[1]));
+    g_assert_cmpint(delivered[0], ==, 22);
+    g_assert_cmpint(shared->refcnt, ==, 1);
+    qemu_net_packet_buf_unref(shared);
+
+    /* A packet that cannot be delivered keeps its reference */
+    shared = NULL;
+    last_seq = next_seq - 1;
+    size = packet_size(next_seq);
+    buf = make_packet(0, next_seq++, size);
+    can_send = false;
+    qemu_net_queue_send_shared(queues[1], &senders[0], 0, buf, size, &shared);
+    g_free(buf);
+    can_send = true;
+    refuse = true;
+    g_assert(!qemu_net_queue_flush(queues[1]));
+    g_assert_cmpint(shared->refcnt, ==, 2);
+    refuse = false;
+    g_assert(qemu_net_queue_flush(queues[1]));
+    g_assert_cmpint(shared->refcnt, ==, 1);
+    qemu_net_packet_buf_unref(shared);
+
+    qemu_del_net_queue(queues[0]);
+    qemu_del_net_queue(queues[1]);
+}
+
+static void test_purge(void)
+{
+    NetQueue *queue = new_queue();
+    int i;
+
+    can_send = false;
+    for (i = 0; i < 40; i++) {
+        send_packet(queue, i & 1, packet_size(next_seq), sent_cb);
+    }
+
+    /* Packets from the purged sender are skipped without a callback */
+    qemu_net_queue_purge(queue, &senders[0]);
+    can_send = true;
+    contiguous = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert(qemu_net_queue_empty(queue));
+    g_assert_cmpint(delivered[0], ==, 0);
+    g_assert_cmpint(delivered[1], ==, 20);
+    g_assert_cmpint(sent_cbs, ==, 20);
+
+    /* The purged slots are reused */
+    contiguous = true;
+    last_seq = next_seq - 1;
+    send_packet(queue, 0, packet_size(next_seq), NULL);
+    g_assert_cmpint(delivered[0], ==, 1);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_drops(void)
+{
+    NetQueue *queue = new_queue();
+    NetQueueInfo info;
+    int i;
+
+    qemu_net_queue_set_depth(queue, 8);
+
+    /* Without a sent callback, packets beyond the depth are dropped */
+    can_send = false;
+    for (i = 0; i < 20; i++) {
+        send_packet(queue, 0, packet_size(next_seq), NULL);
+    }
+    query(queue, &info);
+    g_assert_cmpint(info.depth, ==, 8);
+    g_assert_cmpint(info.count, ==, 8);
+    g_assert_cmpint(info.drops, ==, 12);
+
+    /* Packets with a sent callback are always queued */
+    for (i = 0; i < 4; i++) {
+        send_packet(queue, 0, packet_size(next_seq), sent_cb);
+    }
+    query(queue, &info);
+    g_assert_cmpint(info.count, ==, 12);
+    g_assert_cmpint(info.drops, ==, 12);
+
+    can_send = true;
+    contiguous = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(delivered[0], ==, 12);
+    g_assert_cmpint(sent_cbs, ==, 4);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_buffer_limit(void)
+{
+    NetQueue *queue = new_queue();
+    NetQueueInfo info;
+    int i;
+
+    /* A burst of large packets needs a lot of memory while it is queued */
+    can_send = false;
+    for (i = 0; i < 64; i++) {
+        send_packet(queue, 0, 65536, sent_cb);
+    }
+    query(queue, &info);
+    g_assert_cmpint(info.buffer_size, >=, 64 * 65536);
+
+    /* ...but not after it has been delivered */
+    can_send = true;
+    contiguous = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(delivered[0], ==, 64);
+    query(queue, &info);
+    g_assert_cmpint(info.buffer_size, <=, RETAIN_BYTES);
+
+    /* Small packets still reuse the buffers that are left */
+    for (i = 0; i < 10; i++) {
+        can_send = false;
+        send_packet(queue, 0, packet_size(next_seq), NULL);
+        can_send = true;
+        g_assert(qemu_net_queue_flush(queue));
+        query(queue, &info);
+        g_assert_cmpint(info.buffer_size, <=, RETAIN_BYTES);
+    }
+
+    qemu_del_net_queue(queue);
+}
+
+#define LOCKLESS_PACKETS 200000
+
+typedef struct {
+    NetQueue *queue;
+    bool done;
+} LocklessData;
+
+static void *lockless_producer(void *opaque)
+{
+    LocklessData *data = opaque;
+    uint32_t seq;
+
+    for (seq = 1; seq <= LOCKLESS_PACKETS; seq++) {
+        size_t size = packet_size(seq);
+        uint8_t *buf = make_packet(0, seq, size);
+
+        g_assert_cmpint(qemu_net_queue_send(data->queue, &senders[0], 0,
+                                            buf, size, NULL), ==, size);
+        g_free(buf);
+    }
+    atomic_mb_set(&data->done, true);
+    return NULL;
+}
+
+static void test_lockless(void)
+{
+    LocklessData data = { .queue = new_queue() };
+    NetQueueInfo info;
+    QemuThread thread;
+
+    qemu_net_queue_set_depth(data.queue, 64);
+    qemu_net_queue_enable_lockless(data.queue);
+    contiguous = false;
+
+    /* The producer never blocks; whatever does not fit is dropped */
+    qemu_thread_create(&thread, lockless_producer, &data,
+                       QEMU_THREAD_JOINABLE);
+    while (!atomic_mb_read(&data.done)) {
+        bh_poll(last_bh);
+    }
+    qemu_thread_join(&thread);
+    bh_poll(last_bh);
+
+    query(data.queue, &info);
+    g_assert(info.lockless);
+    g_assert_cmpint(info.count, ==, 0);
+    g_assert_cmpint(info.max_count, <=, 64);
+    g_assert_cmpint(delivered[0] + info.drops, ==, LOCKLESS_PACKETS);
+    g_assert(delivered[0] > 0);
+
+    qemu_del_net_queue(data.queue);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/direct", test_direct);
+    g_test_add_func("/net/queue/wrap", test_wrap);
+    g_test_add_func("/net/queue/grow", test_grow);
+    g_test_add_func("/net/queue/shared", test_shared);
+    g_test_add_func("/net/queue/purge", test_purge);
+    g_test_add_func("/net/queue/drops", test_drops);
+    g_test_add_func("/net/queue/buffer-limit", test_buffer_limit);
+    g_test_add_func("/net/queue/lockless", test_lockless);
+    return g_test_run();
+}
@@ -0,0 +1,611 @@
+/*
+ * vhost-user loopback backend
+ *
+ * A minimal vhost-user backend for virtio-net: every packet the guest
+ * transmits is copied into the next receive buffer, so that the vhost-user
+ * datapath can be exercised without a network.  It serves a single
+ * connection and exits when QEMU closes it.
+ *
+ * Usage: vhost-user-loopback <socket path>
+ *
+ * "ready" is printed on stdout once the socket is listening.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hw/virtio/vhost-user.h"
+
+#define RX_QUEUE                0
+#define TX_QUEUE                1
+#define NUM_QUEUES              2
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+
+/* virtio_net_hdr plus the largest frame we care to copy */
+#define MAX_PACKET_LEN          (10 + 65536)
+
+typedef struct VRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} VRingAvail;
+
+typedef struct VRingUsedElem {
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[];
+} VRingUsed;
+
+typedef struct MemRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    void *mmap_addr;
+    size_t mmap_size;
+    uint8_t *host;
+} MemRegion;
+
+typedef struct Queue {
+    unsigned int num;
+    VhostUserVringAddr addr;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    int kick_fd;
+    int call_fd;
+    bool enabled;
+} Queue;
+
+static MemRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+static unsigned int nregions;
+static Queue queues[NUM_QUEUES];
+static uint8_t packet[MAX_PACKET_LEN];
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "vhost-user-loopback: %s\n", msg);
+    exit(1);
+}
+
+static void *gpa_to_va(uint64_t addr, uint32_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < nregions; i++) {
+        MemRegion *r = &regions[i];
+
+        if (addr >= r->guest_phys_addr &&
+            addr - r->guest_phys_addr + len <= r->memory_size) {
+            return r->host + (addr - r->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+static void *uva_to_va(uint64_t addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nregions; i++) {
+        MemRegion *r = &regions[i];
+
+        if (addr >= r->userspace_addr &&
+            addr - r->userspace_addr < r->memory_size) {
+            return r->host + (addr - r->userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+static void unmap_regions(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < nregions; i++) {
+        munmap(regions[i].mmap_addr, regions[i].mmap_size);
+    }
+    nregions = 0;
+}
+
+/* Translates the ring addresses, which are given in QEMU's address space */
+static void queue_map(Queue *q)
+{
+    q->desc = uva_to_va(q->addr.desc_user_addr);
+    q->avail = uva_to_va(q->addr.avail_user_addr);
+    q->used = uva_to_va(q->addr.used_user_addr);
+}
+
+static void set_mem_table(VhostUserMemory *memory, int *fds, int nfds)
+{
+    unsigned int i;
+
+    if (memory->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        memory->nregions != (unsigned int)nfds) {
+        die("bad memory table");
+    }
+
+    unmap_regions();
+    for (i = 0; i < memory->nregions; i++) {
+        VhostUserMemoryRegion *ureg = &memory->regions[i];
+        MemRegion *r = &regions[i];
+
+        r->guest_phys_addr = ureg->guest_phys_addr;
+        r->memory_size = ureg->memory_size;
+        r->userspace_addr = ureg->userspace_addr;
+        r->mmap_size = ureg->memory_size + ureg->mmap_offset;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[i], 0);
+        close(fds[i]);
+        if (r->mmap_addr == MAP_FAILED) {
+            die("cannot map guest memory");
+        }
+        r->host = (uint8_t *)r->mmap_addr + ureg->mmap_offset;
+        nregions++;
+    }
+
+    for (i = 0; i < NUM_QUEUES; i++) {
+        if (queues[i].desc) {
+            queue_map(&queues[i]);
+        }
+    }
+}
+
+static void queue_push(Queue *q, uint16_t head, uint32_t len)
+{
+    VRingUsedElem *elem = &q->used->ring[q->used->idx % q->num];
+
+    elem->id = head;
+    elem->len = len;
+    __sync_synchronize();
+    q->used->idx++;
+}
+
+static void queue_notify(Queue *q)
+{
+    uint64_t value = 1;
+
+    if (q->call_fd >= 0 && write(q->call_fd, &value, sizeof(value)) < 0) {
+        die("cannot signal call eventfd");
+    }
+}
+
+static bool queue_empty(Queue *q)
+{
+    return q->last_avail_idx == q->avail->idx;
+}
+
+static uint16_t queue_pop(Queue *q)
+{
+    uint16_t head;
+
+    __sync_synchronize();
+    head = q->avail->ring[q->last_avail_idx % q->num];
+    q->last_avail_idx++;
+    if (head >= q->num) {
+        die("bad descriptor index");
+    }
+    return head;
+}
+
+/* Copies the device-readable buffers of a chain into packet[] */
+static size_t read_chain(Queue *q, uint16_t head)
+{
+    size_t len = 0;
+    unsigned int i = head, n;
+
+    for (n = 0; n < q->num; n++) {
+        VRingDesc *d = &q->desc[i];
+        void *buf = gpa_to_va(d->addr, d->len);
+
+        if (!buf) {
+            die("descriptor outside of guest memory");
+        }
+        if (!(d->flags & VRING_DESC_F_WRITE)) {
+            size_t copy = d->len;
+
+            if (copy > sizeof(packet) - len) {
+                copy = sizeof(packet) - len;
+            }
+            memcpy(packet + len, buf, copy);
+            len += copy;
+        }
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d->next;
+    }
+    return len;
+}
+
+/* Copies packet[] into the device-writable buffers of a chain */
+static size_t write_chain(Queue *q, uint16_t head, size_t len)
+{
+    size_t done = 0;
+    unsigned int i = head, n;
+
+    for (n = 0; n < q->num && done < len; n++) {
+        VRingDesc *d = &q->desc[i];
+        void *buf = gpa_to_va(d->addr, d->len);
+
+        if (!buf) {
+            die("descriptor outside of guest memory");
+        }
+        if (d->flags & VRING_DESC_F_WRITE) {
+            size_t copy = d->len;
+
+            if (copy > len - done) {
+                copy = len - done;
+            }
+            memcpy(buf, packet + done, copy);
+            done += copy;
+        }
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d->next;
+    }
+    return done;
+}
+
+/* Moves packets from the transmit queue to the receive queue.  Packets
+ * stay in the transmit queue while there are no receive buffers.
+ */
+static void loopback(void)
+{
+    Queue *tx = &queues[TX_QUEUE];
+    Queue *rx = &queues[RX_QUEUE];
+    bool progress = false;
+
+    if (!tx->enabled || !rx->enabled) {
+        return;
+    }
+
+    while (!queue_empty(tx) && !queue_empty(rx)) {
+        uint16_t tx_head = queue_pop(tx);
+        uint16_t rx_head = queue_pop(rx);
+        size_t len;
+
+        len = read_chain(tx, tx_head);
+        len = write_chain(rx, rx_head, len);
+        queue_push(tx, tx_head, 0);
+        queue_push(rx, rx_head, len);
+        progress = true;
+    }
+
+    if (progress) {
+        queue_notify(tx);
+        queue_notify(rx);
+    }
+}
+
+static void read_full(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t r = read(fd, buf, len);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            die("short read from socket");
+        }
+        buf = (uint8_t *)buf + r;
+        len -= r;
+    }
+}
+
+/* Returns false when the master has closed the connection */
+static bool read_msg(int sock, VhostUserMsg *msg, int *fds, int *nfds)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    do {
+        r = recvmsg(sock, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r == 0) {
+        return false;
+    }
+    if (r < 0) {
+        die("cannot read from socket");
+    }
+    if ((size_t)r < VHOST_USER_HDR_SIZE) {
+        read_full(sock, (uint8_t *)msg + r, VHOST_USER_HDR_SIZE - r);
+    }
+
+    *nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+            break;
+        }
+    }
+
+    if ((msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION) {
+        die("unsupported protocol version");
+    }
+    if (msg->size > sizeof(msg->payload)) {
+        die("message payload too large");
+    }
+    read_full(sock, &msg->payload, msg->size);
+    return true;
+}
+
+static void send_reply(int sock, VhostUserMsg *msg, uint32_t size)
+{
+    uint8_t *buf = (uint8_t *)msg;
+    size_t len;
+
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    msg->size = size;
+    len = VHOST_USER_HDR_SIZE + size;
+
+    while (len) {
+        ssize_t r = write(sock, buf, len);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            die("cannot write to socket");
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+static Queue *vring_file_queue(VhostUserMsg *msg, int *fds, int nfds, int *fd)
+{
+    unsigned int index = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+
+    if (index >= NUM_QUEUES) {
+        die("bad vring index");
+    }
+    *fd = -1;
+    if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+        if (nfds != 1) {
+            die("missing vring file descriptor");
+        }
+        *fd = fds[0];
+    }
+    return &queues[index];
+}
+
+static Queue *vring_state_queue(VhostUserMsg *msg)
+{
+    if (msg->payload.state.index >= NUM_QUEUES) {
+        die("bad vring index");
+    }
+    return &queues[msg->payload.state.index];
+}
+
+static void handle_msg(int sock, VhostUserMsg *msg, int *fds, int nfds)
+{
+    VhostUserVringAddr *addr;
+    Queue *q;
+    int fd;
+
+    switch (msg->request) {
+    case VHOST_USER_GET_FEATURES:
+        /* Plain split rings, no offloads and no dirty logging */
+        msg->payload.u64 = 0;
+        send_reply(sock, msg, sizeof(msg->payload.u64));
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_LOG_BASE:
+        break;
+
+    case VHOST_USER_SET_LOG_FD:
+        while (nfds) {
+            close(fds[--nfds]);
+        }
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        set_mem_table(&msg->payload.memory, fds, nfds);
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+        q = vring_state_queue(msg);
+        q->num = msg->payload.state.num;
+        break;
+
+    case VHOST_USER_SET_VRING_BASE:
+        q = vring_state_queue(msg);
+        q->last_avail_idx = msg->payload.state.num;
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        q = vring_state_queue(msg);
+        q->enabled = false;
+        if (q->kick_fd >= 0) {
+            close(q->kick_fd);
+            q->kick_fd = -1;
+        }
+        msg->payload.state.num = q->last_avail_idx;
+        send_reply(sock, msg, sizeof(msg->payload.state));
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        addr = &msg->payload.addr;
+        if (addr->index >= NUM_QUEUES) {
+            die("bad vring index");
+        }
+        q = &queues[addr->index];
+        q->addr = *addr;
+        queue_map(q);
+        if (!q->desc || !q->avail || !q->used) {
+            die("vring outside of guest memory");
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+        q = vring_file_queue(msg, fds, nfds, &fd);
+        if (q->kick_fd >= 0) {
+            close(q->kick_fd);
+        }
+        q->kick_fd = fd;
+        q->enabled = q->num && q->desc && q->avail && q->used;
+        break;
+
+    case VHOST_USER_SET_VRING_CALL:
+        q = vring_file_queue(msg, fds, nfds, &fd);
+        if (q->call_fd >= 0) {
+            close(q->call_fd);
+        }
+        q->call_fd = fd;
+        break;
+
+    case VHOST_USER_SET_VRING_ERR:
+        vring_file_queue(msg, fds, nfds, &fd);
+        if (fd >= 0) {
+            close(fd);
+        }
+        break;
+
+    default:
+        die("unknown request");
+    }
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        die("socket path too long");
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        die("cannot create socket");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 1) < 0) {
+        die("cannot listen on socket");
+    }
+    return sock;
+}
+
+int main(int argc, char **argv)
+{
+    VhostUserMsg msg;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int listen_sock, sock, nfds, i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <socket path>\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < NUM_QUEUES; i++) {
+        queues[i].kick_fd = -1;
+        queues[i].call_fd = -1;
+    }
+
+    listen_sock = listen_on(argv[1]);
+    printf("ready\n");
+    fflush(stdout);
+
+    do {
+        sock = accept(listen_sock, NULL, NULL);
+    } while (sock < 0 && errno == EINTR);
+    if (sock < 0) {
+        die("cannot accept connection");
+    }
+    close(listen_sock);
+    unlink(argv[1]);
+
+    for (;;) {
+        struct pollfd pfd[1 + NUM_QUEUES];
+        int npfd = 0;
+
+        pfd[npfd].fd = sock;
+        pfd[npfd++].events = POLLIN;
+        for (i = 0; i < NUM_QUEUES; i++) {
+            if (queues[i].kick_fd >= 0) {
+                pfd[npfd].fd = queues[i].kick_fd;
+                pfd[npfd++].events = POLLIN;
+            }
+        }
+
+        if (poll(pfd, npfd, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll failed");
+        }
+
+        for (i = 1; i < npfd; i++) {
+            uint64_t value;
+
+            if ((pfd[i].revents & POLLIN) &&
+                read(pfd[i].fd, &value, sizeof(value)) < 0 &&
+                errno != EAGAIN) {
+                die("cannot read kick eventfd");
+            }
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (!read_msg(sock, &msg, fds, &nfds)) {
+                break;
+            }
+            handle_msg(sock, &msg, fds, nfds);
+        }
+
+        loopback();
+    }
+
+    unmap_regions();
+    close(sock);
+    return 0;
+}
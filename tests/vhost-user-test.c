@@ -0,0 +1,287 @@
+/*
+ * vhost-user test cases
+ *
+ * Runs a virtio-net-pci device on a vhost-user netdev whose backend is
+ * tests/vhost-user-loopback, which sends every transmitted packet back to
+ * the guest.  Guest RAM lives in a temporary directory so that it can be
+ * shared with the backend.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define VIRTIO_NET_PCI_DEV      4
+#define VIRTIO_PCI_VENDOR_ID    0x1af4
+#define VIRTIO_NET_DEVICE_ID    0x1000
+
+/* Legacy virtio PCI I/O space layout */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+
+#define VRING_DESC_F_WRITE          2
+
+#define VRING_ALIGN                 4096
+#define RX_QUEUE                    0
+#define TX_QUEUE                    1
+
+/* virtio_net_hdr followed by a minimal Ethernet frame */
+#define PACKET_LEN                  (10 + 64)
+#define RX_BUF_LEN                  (10 + 1514)
+
+/* How long to wait for the backend, in milliseconds */
+#define TIMEOUT_MS                  5000
+
+#define LOOPBACK_BINARY             "tests/vhost-user-loopback"
+
+typedef struct VRingDescLE {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDescLE;
+
+typedef struct TestVirtQueue {
+    unsigned int num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint64_t buf;
+} TestVirtQueue;
+
+typedef struct TestDevice {
+    QPCIDevice *dev;
+    void *io;
+    TestVirtQueue rx;
+    TestVirtQueue tx;
+} TestDevice;
+
+static QPCIBus *pcibus;
+static QGuestAllocator *guest_malloc;
+
+static char *tmpdir;
+static char *socket_path;
+static GPid backend_pid;
+
+static void *io_addr(TestDevice *d, int offset)
+{
+    return (void *)((uintptr_t)d->io + offset);
+}
+
+/* Starts the loopback backend and waits until it is listening */
+static void backend_start(void)
+{
+    const char *binary = getenv("QTEST_VHOST_USER_BACKEND");
+    gchar *argv[3];
+    char ready[6];
+    int out;
+    FILE *f;
+
+    tmpdir = g_strdup_printf("%s/vhost-user-test-XXXXXX", g_get_tmp_dir());
+    g_assert(mkdtemp(tmpdir) != NULL);
+    socket_path = g_strdup_printf("%s/sock", tmpdir);
+
+    argv[0] = (gchar *)(binary ? binary : LOOPBACK_BINARY);
+    argv[1] = socket_path;
+    argv[2] = NULL;
+    g_assert(g_spawn_async_with_pipes(NULL, argv, NULL,
+                                      G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                      &backend_pid, NULL, &out, NULL, NULL));
+
+    f = fdopen(out, "r");
+    g_assert(f != NULL);
+    g_assert(fgets(ready, sizeof(ready), f) != NULL);
+    g_assert_cmpstr(ready, ==, "ready");
+    fclose(f);
+}
+
+/* The backend exits once QEMU has closed the connection */
+static void backend_stop(void)
+{
+    int status;
+
+    g_assert_cmpint(waitpid(backend_pid, &status, 0), ==, backend_pid);
+    g_spawn_close_pid(backend_pid);
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+
+    unlink(socket_path);
+    rmdir(tmpdir);
+    g_free(socket_path);
+    g_free(tmpdir);
+}
+
+static void test_start(void)
+{
+    char *args;
+
+    backend_start();
+    args = g_strdup_printf("-m 64 -mem-path %s -mem-prealloc "
+                           "-netdev vhost-user,id=net0,path=%s "
+                           "-device virtio-net-pci,netdev=net0,romfile=,"
+                           "addr=04.0", tmpdir, socket_path);
+    qtest_start(args);
+    g_free(args);
+
+    guest_malloc = pc_alloc_init();
+    pcibus = qpci_init_pc();
+}
+
+static void test_quit(TestDevice *d)
+{
+    g_free(d->dev);
+    qtest_end();
+    backend_stop();
+}
+
+static void init_virtqueue(TestDevice *d, TestVirtQueue *vq, int index,
+                           uint32_t buf_len, uint16_t flags)
+{
+    VRingDescLE desc = { };
+    uint64_t ring;
+
+    qpci_io_writew(d->dev, io_addr(d, VIRTIO_PCI_QUEUE_SEL), index);
+    vq->num = qpci_io_readw(d->dev, io_addr(d, VIRTIO_PCI_QUEUE_NUM));
+    g_assert_cmpint(vq->num, >, 0);
+
+    /* Legacy layout: descriptors, avail ring, then used ring page aligned */
+    ring = guest_alloc(guest_malloc, 3 * VRING_ALIGN +
+                       vq->num * (sizeof(VRingDescLE) + 2 + 8));
+    vq->desc = QEMU_ALIGN_UP(ring, VRING_ALIGN);
+    vq->avail = vq->desc + vq->num * sizeof(VRingDescLE);
+    vq->used = QEMU_ALIGN_UP(vq->avail + 4 + 2 * vq->num + 2, VRING_ALIGN);
+
+    /* A single descriptor, always reused as head 0 */
+    vq->buf = guest_alloc(guest_malloc, buf_len);
+    desc.addr = cpu_to_le64(vq->buf);
+    desc.len = cpu_to_le32(buf_len);
+    desc.flags = cpu_to_le16(flags);
+    memwrite(vq->desc, &desc, sizeof(desc));
+
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used, 0);
+    writew(vq->used + 2, 0);
+
+    qpci_io_writel(d->dev, io_addr(d, VIRTIO_PCI_QUEUE_PFN),
+                   vq->desc / VRING_ALIGN);
+}
+
+static void init_device(TestDevice *d)
+{
+    uint16_t vendor_id, device_id;
+
+    memset(d, 0, sizeof(*d));
+
+    d->dev = qpci_device_find(pcibus, QPCI_DEVFN(VIRTIO_NET_PCI_DEV, 0));
+    g_assert(d->dev != NULL);
+
+    vendor_id = qpci_config_readw(d->dev, PCI_VENDOR_ID);
+    device_id = qpci_config_readw(d->dev, PCI_DEVICE_ID);
+    g_assert_cmphex(vendor_id, ==, VIRTIO_PCI_VENDOR_ID);
+    g_assert_cmphex(device_id, ==, VIRTIO_NET_DEVICE_ID);
+
+    d->io = qpci_iomap(d->dev, 0);
+    qpci_device_enable(d->dev);
+
+    qpci_io_writeb(d->dev, io_addr(d, VIRTIO_PCI_STATUS), 0);
+    qpci_io_writeb(d->dev, io_addr(d, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    /* No offloads, no mergeable receive buffers: a 10-byte header */
+    qpci_io_writel(d->dev, io_addr(d, VIRTIO_PCI_GUEST_FEATURES), 0);
+
+    init_virtqueue(d, &d->rx, RX_QUEUE, RX_BUF_LEN, VRING_DESC_F_WRITE);
+    init_virtqueue(d, &d->tx, TX_QUEUE, PACKET_LEN, 0);
+
+    /* Starts the backend */
+    qpci_io_writeb(d->dev, io_addr(d, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_DRIVER_OK);
+}
+
+/* Makes head 0 available for the @count-th time and kicks the queue */
+static void submit(TestDevice *d, TestVirtQueue *vq, int index,
+                   uint16_t count)
+{
+    writew(vq->avail + 4 + 2 * ((count - 1) % vq->num), 0);
+    writew(vq->avail + 2, count);
+    qpci_io_writew(d->dev, io_addr(d, VIRTIO_PCI_QUEUE_NOTIFY), index);
+}
+
+static void wait_used(TestVirtQueue *vq, uint16_t count)
+{
+    int ms;
+
+    for (ms = 0; ms < TIMEOUT_MS; ms++) {
+        if (readw(vq->used + 2) == count) {
+            return;
+        }
+        g_usleep(1000);
+    }
+    g_assert_cmpint(readw(vq->used + 2), ==, count);
+}
+
+static void test_loopback(void)
+{
+    uint8_t tx_packet[PACKET_LEN], rx_packet[PACKET_LEN];
+    TestDevice d;
+    uint16_t i, slot;
+
+    test_start();
+    init_device(&d);
+
+    for (i = 1; i <= 3; i++) {
+        memset(tx_packet, 0, 10);
+        memset(tx_packet + 10, i, PACKET_LEN - 10);
+        memwrite(d.tx.buf, tx_packet, PACKET_LEN);
+
+        submit(&d, &d.rx, RX_QUEUE, i);
+        submit(&d, &d.tx, TX_QUEUE, i);
+        wait_used(&d.tx, i);
+        wait_used(&d.rx, i);
+
+        slot = (i - 1) % d.rx.num;
+        g_assert_cmpint(readl(d.rx.used + 4 + 8 * slot), ==, 0);
+        g_assert_cmpint(readl(d.rx.used + 4 + 8 * slot + 4), ==, PACKET_LEN);
+
+        memread(d.rx.buf, rx_packet, PACKET_LEN);
+        g_assert(memcmp(tx_packet, rx_packet, PACKET_LEN) == 0);
+    }
+
+    test_quit(&d);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/vhost-user/loopback", test_loopback);
+
+    return g_test_run();
+}
@@ -0,0 +1,456 @@
+/*
+ * QTest testcase for virtio-net with a tap backend
+ *
+ * The test opens a tap interface, hands it to QEMU with fd=, and injects
+ * frames through a packet socket bound to it.  Frames that fit in the guest
+ * buffer are read by the tap backend straight into it; larger ones spill
+ * into the copy path, and frames that the receive filter drops leave the
+ * buffer available to the guest.
+ *
+ * Creating the tap interface needs CAP_NET_ADMIN; without it these tests
+ * are skipped.  The batching tests pass one end of a datagram socket pair
+ * as the tap fd instead, which needs no privileges: it checks that the
+ * backend stops reading when the guest runs out of buffers, and that the
+ * batches show up in query-net-batch-stats and "info netbatch".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/virtio-net.h"
+#include "net/tap-linux.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qint.h"
+#include "qapi/qmp/qlist.h"
+
+#include "qemu-common.h"
+
+#define VIRTIO_NET_DEVFN        QPCI_DEVFN(4, 0)
+#define TIMEOUT_MS              5000
+
+#define ETH_HLEN                14
+/* IEEE 802 local experimental ethertype, nothing else on the link uses it */
+#define ETH_P_TEST              0x88b5
+
+/* Frames queued on the host side of the socket pair, and guest buffers */
+#define BATCH_FRAMES            10
+#define BATCH_RX_BUFS           4
+
+/* Receive buffer length that makes a full-sized frame spill */
+#define SMALL_BUF_LEN           512
+#define LARGE_FRAME_LEN         1400
+
+static const uint8_t host_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+static const uint8_t other_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+typedef struct TestTap {
+    int pkt_fd;             /* host end: packet socket or socket pair */
+    int ifindex;
+    QVirtioNet *net;
+} TestTap;
+
+/* Returns a tap fd with a vnet header, or -1 if the host does not allow it */
+static int tap_open(char *ifname)
+{
+    struct ifreq ifr;
+    int fd, sock, ret;
+    char *path;
+    FILE *f;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    pstrcpy(ifr.ifr_name, IFNAMSIZ, "qtap%d");
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+    pstrcpy(ifname, IFNAMSIZ, ifr.ifr_name);
+
+    /* Keep router solicitations and the like off the link, if we can */
+    path = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6", ifname);
+    f = fopen(path, "w");
+    if (f) {
+        fputs("1", f);
+        fclose(f);
+    }
+    g_free(path);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(sock, >=, 0);
+    ifr.ifr_flags = IFF_UP | IFF_NOARP;
+    ret = ioctl(sock, SIOCSIFFLAGS, &ifr);
+    close(sock);
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool tap_test_start(TestTap *t, uint32_t features, size_t rx_buf_len)
+{
+    char ifname[IFNAMSIZ];
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_TEST),
+    };
+    char *args;
+    int fd;
+
+    fd = tap_open(ifname);
+    if (fd < 0) {
+        g_test_message("Skipping test, cannot create a tap interface\n");
+        return false;
+    }
+
+    t->pkt_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_TEST));
+    if (t->pkt_fd < 0) {
+        g_test_message("Skipping test, cannot open a packet socket\n");
+        close(fd);
+        return false;
+    }
+    t->ifindex = if_nametoindex(ifname);
+    g_assert_cmpint(t->ifindex, >, 0);
+    addr.sll_ifindex = t->ifindex;
+    g_assert_cmpint(bind(t->pkt_fd, (struct sockaddr *)&addr,
+                         sizeof(addr)), ==, 0);
+
+    args = g_strdup_printf("-netdev tap,id=n0,fd=%d "
+                           "-device virtio-net-pci,netdev=n0,romfile=,"
+                           "addr=04.0", fd);
+    qtest_start(args);
+    g_free(args);
+
+    /* QEMU has its own copy now; the interface goes away with the last one */
+    close(fd);
+
+    t->net = qvirtio_net_init(qpci_init_pc(), pc_alloc_init(),
+                              VIRTIO_NET_DEVFN, features, rx_buf_len);
+    return true;
+}
+
+static void tap_test_end(TestTap *t)
+{
+    qvirtio_net_free(t->net);
+    qtest_end();
+    close(t->pkt_fd);
+}
+
+/* Builds a test frame whose payload is a pattern derived from @seed */
+static size_t build_frame(uint8_t *frame, const uint8_t *dst, size_t len,
+                          uint8_t seed)
+{
+    size_t i;
+
+    g_assert_cmpint(len, >, ETH_HLEN);
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, host_mac, 6);
+    frame[12] = ETH_P_TEST >> 8;
+    frame[13] = ETH_P_TEST & 0xff;
+    for (i = ETH_HLEN; i < len; i++) {
+        frame[i] = seed + i;
+    }
+    return len;
+}
+
+static void host_send(TestTap *t, const uint8_t *frame, size_t len)
+{
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = t->ifindex,
+        .sll_halen = 6,
+    };
+
+    memcpy(addr.sll_addr, frame, 6);
+    g_assert_cmpint(sendto(t->pkt_fd, frame, len, 0,
+                           (struct sockaddr *)&addr, sizeof(addr)), ==, len);
+}
+
+/* Waits for the next test frame, skipping whatever else the host sent */
+static size_t guest_recv(TestTap *t, uint8_t *frame, size_t size)
+{
+    ssize_t len;
+
+    do {
+        len = qvirtio_net_recv(t->net, frame, size, TIMEOUT_MS);
+        g_assert_cmpint(len, >=, ETH_HLEN);
+    } while (frame[12] != ETH_P_TEST >> 8 || frame[13] != (ETH_P_TEST & 0xff));
+
+    return len;
+}
+
+/* Frames that fit in one buffer complete it in order, with their contents */
+static void test_direct(void)
+{
+    uint8_t frame[256], buf[2048];
+    TestTap t;
+    size_t len;
+    int i;
+
+    if (!tap_test_start(&t, 0, 2048)) {
+        return;
+    }
+    qvirtio_net_post_rx(t.net, 8);
+
+    for (i = 0; i < 4; i++) {
+        len = build_frame(frame, t.net->mac, 60 + i * 40, i);
+        host_send(&t, frame, len);
+        g_assert_cmpint(guest_recv(&t, buf, sizeof(buf)), ==, len);
+        g_assert(memcmp(buf, frame, len) == 0);
+        g_assert_cmpint(t.net->rx_num_buffers, ==, 1);
+    }
+
+    tap_test_end(&t);
+}
+
+/* A frame larger than the first buffer goes through the copy path, which
+ * starts over in the same buffer and merges it with the following ones.
+ */
+static void test_spill(void)
+{
+    uint8_t frame[LARGE_FRAME_LEN], buf[2048];
+    TestTap t;
+    uint16_t head;
+    size_t len;
+
+    if (!tap_test_start(&t, 1u << QVIRTIO_NET_F_MRG_RXBUF, SMALL_BUF_LEN)) {
+        return;
+    }
+    qvirtio_net_post_rx(t.net, 16);
+
+    head = t.net->rx.used_idx % t.net->rx.num;
+    len = build_frame(frame, t.net->mac, LARGE_FRAME_LEN, 0x40);
+    host_send(&t, frame, len);
+    g_assert_cmpint(guest_recv(&t, buf, sizeof(buf)), ==, len);
+    g_assert(memcmp(buf, frame, len) == 0);
+    g_assert_cmpint(t.net->rx_head, ==, head);
+    g_assert_cmpint(t.net->rx_num_buffers, ==,
+                    DIV_ROUND_UP(t.net->hdr_len + len, SMALL_BUF_LEN));
+
+    /* The next small frame takes the next buffer, on the direct path */
+    head = t.net->rx.used_idx % t.net->rx.num;
+    len = build_frame(frame, t.net->mac, 100, 0x80);
+    host_send(&t, frame, len);
+    g_assert_cmpint(guest_recv(&t, buf, sizeof(buf)), ==, len);
+    g_assert(memcmp(buf, frame, len) == 0);
+    g_assert_cmpint(t.net->rx_head, ==, head);
+    g_assert_cmpint(t.net->rx_num_buffers, ==, 1);
+
+    tap_test_end(&t);
+}
+
+/* A frame the receive filter drops is read into the guest buffer, which is
+ * then given back to the queue without being used.
+ */
+static void test_unpop(void)
+{
+    uint8_t frame[256], buf[2048];
+    uint8_t promisc = 0;
+    TestTap t;
+    uint64_t first;
+    uint16_t head;
+    size_t len;
+
+    if (!tap_test_start(&t, (1u << QVIRTIO_NET_F_CTRL_VQ) |
+                            (1u << QVIRTIO_NET_F_CTRL_RX), 2048)) {
+        return;
+    }
+    g_assert_cmpint(qvirtio_net_ctrl(t.net, QVIRTIO_NET_CTRL_RX,
+                                     QVIRTIO_NET_CTRL_RX_PROMISC,
+                                     &promisc, 1), ==, QVIRTIO_NET_OK);
+    qvirtio_net_post_rx(t.net, 4);
+    head = t.net->rx.used_idx % t.net->rx.num;
+    first = t.net->rx.bufs + head * t.net->rx.buf_len;
+
+    len = build_frame(frame, other_mac, 120, 0x10);
+    host_send(&t, frame, len);
+    g_assert_cmpint(qvirtio_net_recv(t.net, buf, sizeof(buf), 500), ==, -1);
+
+    /* The frame was read in place, so it must be in the first buffer */
+    memread(first + t.net->hdr_len, buf, len);
+    g_assert(memcmp(buf, frame, len) == 0);
+
+    /* The buffer is still the next one the device uses */
+    len = build_frame(frame, t.net->mac, 80, 0x20);
+    host_send(&t, frame, len);
+    g_assert_cmpint(guest_recv(&t, buf, sizeof(buf)), ==, len);
+    g_assert(memcmp(buf, frame, len) == 0);
+    g_assert_cmpint(t.net->rx_head, ==, head);
+
+    tap_test_end(&t);
+}
+
+/* Starts QEMU with one end of a datagram socket pair as the tap fd.  Each
+ * datagram written to the other end, t->pkt_fd, is one frame.
+ */
+static void socket_test_start(TestTap *t)
+{
+    int sv[2];
+    char *args;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), ==, 0);
+
+    args = g_strdup_printf("-netdev tap,id=n0,fd=%d "
+                           "-device virtio-net-pci,netdev=n0,id=nic0,"
+                           "romfile=,addr=04.0", sv[1]);
+    qtest_start(args);
+    g_free(args);
+    close(sv[1]);
+
+    t->pkt_fd = sv[0];
+    t->net = qvirtio_net_init(qpci_init_pc(), pc_alloc_init(),
+                              VIRTIO_NET_DEVFN, 0, 2048);
+}
+
+/* Runs a QMP query for net client @name and returns its only result */
+static QDict *query_net_client(const char *cmd, const char *name)
+{
+    QDict *resp, *info;
+    QList *list;
+    char *reply;
+
+    reply = qmp_reply("{ 'execute': '%s', 'arguments': { 'name': '%s' } }",
+                      cmd, name);
+    resp = qobject_to_qdict(qobject_from_json(reply));
+    g_free(reply);
+    g_assert(resp != NULL);
+
+    list = qdict_get_qlist(resp, "return");
+    g_assert(list != NULL);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    info = qobject_to_qdict(qlist_peek(list));
+    QINCREF(info);
+    QDECREF(resp);
+
+    return info;
+}
+
+static void recv_batch_frame(TestTap *t, int i)
+{
+    uint8_t buf[2048];
+
+    g_assert_cmpint(guest_recv(t, buf, sizeof(buf)), ==, 60);
+    g_assert_cmpint(buf[ETH_HLEN], ==, (uint8_t)(i + ETH_HLEN));
+}
+
+/* When the guest runs out of buffers the backend must leave the remaining
+ * frames in the socket instead of reading and queueing them.
+ */
+static void test_batch_stop(void)
+{
+    uint8_t frame[60];
+    QDict *info;
+    TestTap t;
+    int i;
+
+    socket_test_start(&t);
+    qvirtio_net_post_rx(t.net, BATCH_RX_BUFS);
+
+    for (i = 0; i < BATCH_FRAMES; i++) {
+        build_frame(frame, t.net->mac, sizeof(frame), i);
+        g_assert_cmpint(send(t.pkt_fd, frame, sizeof(frame), 0), ==,
+                        sizeof(frame));
+    }
+    for (i = 0; i < BATCH_RX_BUFS; i++) {
+        recv_batch_frame(&t, i);
+    }
+
+    /* Give the backend time to read what it shouldn't */
+    g_usleep(100 * 1000);
+
+    /* At most the frame that found no buffer is queued */
+    info = query_net_client("query-net-queues", "nic0");
+    g_assert_cmpint(qdict_get_int(info, "count"), <=, 1);
+    g_assert_cmpint(qdict_get_int(info, "max-count"), <=, 1);
+    g_assert_cmpint(qdict_get_int(info, "drops"), ==, 0);
+    QDECREF(info);
+
+    /* The rest comes in order once there is room */
+    qvirtio_net_post_rx(t.net, BATCH_FRAMES - BATCH_RX_BUFS);
+    for (i = BATCH_RX_BUFS; i < BATCH_FRAMES; i++) {
+        recv_batch_frame(&t, i);
+    }
+
+    tap_test_end(&t);
+}
+
+static void test_batch_stats(void)
+{
+    uint8_t frame[60];
+    const QListEntry *entry;
+    int64_t batches, packets, sum = 0, bins = 0;
+    QDict *info;
+    TestTap t;
+    char *reply;
+    int i;
+
+    socket_test_start(&t);
+    qvirtio_net_post_rx(t.net, BATCH_FRAMES);
+
+    for (i = 0; i < BATCH_FRAMES; i++) {
+        build_frame(frame, t.net->mac, sizeof(frame), i);
+        g_assert_cmpint(send(t.pkt_fd, frame, sizeof(frame), 0), ==,
+                        sizeof(frame));
+    }
+    for (i = 0; i < BATCH_FRAMES; i++) {
+        recv_batch_frame(&t, i);
+    }
+
+    info = query_net_client("query-net-batch-stats", "nic0");
+    g_assert_cmpstr(qdict_get_str(info, "name"), ==, "nic0");
+    batches = qdict_get_int(info, "batches");
+    packets = qdict_get_int(info, "packets");
+    g_assert_cmpint(batches, >=, 1);
+    g_assert_cmpint(packets, >=, batches);
+    g_assert_cmpint(packets, <=, BATCH_FRAMES);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(info, "histogram"), entry) {
+        sum += qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+        bins++;
+    }
+    g_assert_cmpint(bins, ==, 8);
+    g_assert_cmpint(sum, ==, batches);
+    QDECREF(info);
+
+    reply = qmp_reply("{ 'execute': 'human-monitor-command',"
+                      "  'arguments': { 'command-line': 'info netbatch' } }");
+    g_assert(strstr(reply, "nic0: batches=") != NULL);
+    g_free(reply);
+
+    tap_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio-net/tap/rx-direct", test_direct);
+    qtest_add_func("/virtio-net/tap/rx-spill", test_spill);
+    qtest_add_func("/virtio-net/tap/rx-unpop", test_unpop);
+    qtest_add_func("/virtio-net/tap/batch-stop", test_batch_stop);
+    qtest_add_func("/virtio-net/tap/batch-stats", test_batch_stats);
+
+    return g_test_run();
+}
@@ -0,0 +1,316 @@
+/*
+ * Virtqueue test cases and micro-benchmark
+ *
+ * Drives the transmit queue of a virtio-net-pci device whose backend is a
+ * hub port without peers, so that the device does little more than move
+ * buffers through the virtqueue.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define VIRTIO_NET_PCI_DEV      4
+#define VIRTIO_PCI_VENDOR_ID    0x1af4
+#define VIRTIO_NET_DEVICE_ID    0x1000
+
+/* Legacy virtio PCI I/O space layout */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VRING_DESC_F_INDIRECT       4
+
+#define VRING_ALIGN                 4096
+#define TX_QUEUE                    1
+
+/* virtio_net_hdr followed by a minimal Ethernet frame */
+#define PACKET_LEN                  (10 + 64)
+
+/* How long to wait for the device to consume a batch */
+#define MAX_POLLS                   100000
+
+typedef struct VRingDescLE {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDescLE;
+
+typedef struct TestVirtQueue {
+    QPCIDevice *dev;
+    void *io;
+    uint32_t features;
+    unsigned int num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint64_t indirect;
+    uint16_t avail_idx;
+} TestVirtQueue;
+
+static QPCIBus *pcibus;
+static QGuestAllocator *guest_malloc;
+
+static void *io_addr(TestVirtQueue *vq, int offset)
+{
+    return (void *)((uintptr_t)vq->io + offset);
+}
+
+static void ring_test_start(void)
+{
+    qtest_start("-netdev hubport,id=hp0,hubid=0 "
+                "-device virtio-net-pci,netdev=hp0,romfile=,addr=04.0");
+    guest_malloc = pc_alloc_init();
+    pcibus = qpci_init_pc();
+}
+
+static void ring_test_quit(TestVirtQueue *vq)
+{
+    g_free(vq->dev);
+    qtest_end();
+}
+
+/* Fills every descriptor with the same read-only packet buffer.  With
+ * @indirect, each head descriptor points to a one-entry indirect table.
+ */
+static void setup_descriptors(TestVirtQueue *vq, bool indirect)
+{
+    VRingDescLE *table = g_new0(VRingDescLE, vq->num);
+    VRingDescLE *ind = g_new0(VRingDescLE, vq->num);
+    uint64_t packet;
+    unsigned int i;
+
+    packet = guest_alloc(guest_malloc, PACKET_LEN);
+    for (i = 0; i < PACKET_LEN; i++) {
+        writeb(packet + i, i < 10 ? 0 : i);
+    }
+
+    vq->indirect = guest_alloc(guest_malloc, vq->num * sizeof(VRingDescLE));
+    for (i = 0; i < vq->num; i++) {
+        ind[i].addr = cpu_to_le64(packet);
+        ind[i].len = cpu_to_le32(PACKET_LEN);
+
+        if (indirect) {
+            table[i].addr = cpu_to_le64(vq->indirect + i * sizeof(VRingDescLE));
+            table[i].len = cpu_to_le32(sizeof(VRingDescLE));
+            table[i].flags = cpu_to_le16(VRING_DESC_F_INDIRECT);
+        } else {
+            table[i] = ind[i];
+        }
+    }
+    memwrite(vq->indirect, ind, vq->num * sizeof(VRingDescLE));
+    memwrite(vq->desc, table, vq->num * sizeof(VRingDescLE));
+
+    g_free(table);
+    g_free(ind);
+}
+
+static void init_virtqueue(TestVirtQueue *vq, bool indirect)
+{
+    uint16_t vendor_id, device_id;
+    uint32_t host_features;
+    uint64_t ring;
+
+    memset(vq, 0, sizeof(*vq));
+
+    vq->dev = qpci_device_find(pcibus, QPCI_DEVFN(VIRTIO_NET_PCI_DEV, 0));
+    g_assert(vq->dev != NULL);
+
+    vendor_id = qpci_config_readw(vq->dev, PCI_VENDOR_ID);
+    device_id = qpci_config_readw(vq->dev, PCI_DEVICE_ID);
+    g_assert_cmphex(vendor_id, ==, VIRTIO_PCI_VENDOR_ID);
+    g_assert_cmphex(device_id, ==, VIRTIO_NET_DEVICE_ID);
+
+    vq->io = qpci_iomap(vq->dev, 0);
+    qpci_device_enable(vq->dev);
+
+    qpci_io_writeb(vq->dev, io_addr(vq, VIRTIO_PCI_STATUS), 0);
+    qpci_io_writeb(vq->dev, io_addr(vq, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    host_features = qpci_io_readl(vq->dev,
+                                  io_addr(vq, VIRTIO_PCI_HOST_FEATURES));
+    if (indirect) {
+        g_assert(host_features & (1u << VIRTIO_RING_F_INDIRECT_DESC));
+        vq->features |= 1u << VIRTIO_RING_F_INDIRECT_DESC;
+    }
+    qpci_io_writel(vq->dev, io_addr(vq, VIRTIO_PCI_GUEST_FEATURES),
+                   vq->features);
+
+    qpci_io_writew(vq->dev, io_addr(vq, VIRTIO_PCI_QUEUE_SEL), TX_QUEUE);
+    vq->num = qpci_io_readw(vq->dev, io_addr(vq, VIRTIO_PCI_QUEUE_NUM));
+    g_assert_cmpint(vq->num, >, 0);
+
+    /* Legacy layout: descriptors, avail ring, then used ring page aligned */
+    ring = guest_alloc(guest_malloc, 3 * VRING_ALIGN +
+                       vq->num * (sizeof(VRingDescLE) + 2 + 8));
+    vq->desc = QEMU_ALIGN_UP(ring, VRING_ALIGN);
+    vq->avail = vq->desc + vq->num * sizeof(VRingDescLE);
+    vq->used = QEMU_ALIGN_UP(vq->avail + 4 + 2 * vq->num + 2, VRING_ALIGN);
+
+    setup_descriptors(vq, indirect);
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used, 0);
+    writew(vq->used + 2, 0);
+
+    qpci_io_writel(vq->dev, io_addr(vq, VIRTIO_PCI_QUEUE_PFN),
+                   vq->desc / VRING_ALIGN);
+    qpci_io_writeb(vq->dev, io_addr(vq, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_DRIVER_OK);
+}
+
+/* Makes @count heads available, kicks the device and waits until it has
+ * returned them all.
+ */
+static void submit_batch(TestVirtQueue *vq, unsigned int count)
+{
+    uint16_t *ring = g_new(uint16_t, count);
+    unsigned int i, start, first;
+    uint16_t used_idx;
+    int polls;
+
+    g_assert_cmpint(count, <=, vq->num);
+
+    start = vq->avail_idx % vq->num;
+    for (i = 0; i < count; i++) {
+        ring[i] = cpu_to_le16((start + i) % vq->num);
+    }
+
+    /* The avail ring may wrap around */
+    first = MIN(count, vq->num - start);
+    memwrite(vq->avail + 4 + 2 * start, ring, 2 * first);
+    if (first < count) {
+        memwrite(vq->avail + 4, ring + first, 2 * (count - first));
+    }
+
+    vq->avail_idx += count;
+    writew(vq->avail + 2, vq->avail_idx);
+    qpci_io_writew(vq->dev, io_addr(vq, VIRTIO_PCI_QUEUE_NOTIFY), TX_QUEUE);
+
+    for (polls = 0; polls < MAX_POLLS; polls++) {
+        used_idx = readw(vq->used + 2);
+        if (used_idx == vq->avail_idx) {
+            break;
+        }
+    }
+    g_assert_cmpint(used_idx, ==, vq->avail_idx);
+
+    g_free(ring);
+}
+
+static void check_used_ring(TestVirtQueue *vq, unsigned int count)
+{
+    unsigned int i, idx;
+    uint16_t head;
+
+    for (i = 0; i < count; i++) {
+        head = (uint16_t)(vq->avail_idx - count + i);
+        idx = head % vq->num;
+        g_assert_cmpint(readl(vq->used + 4 + 8 * idx), ==, idx);
+        g_assert_cmpint(readl(vq->used + 4 + 8 * idx + 4), ==, 0);
+    }
+}
+
+static void test_tx(void)
+{
+    TestVirtQueue vq;
+
+    ring_test_start();
+    init_virtqueue(&vq, false);
+
+    /* A partial batch, then full batches that wrap around the rings */
+    submit_batch(&vq, 3);
+    check_used_ring(&vq, 3);
+    submit_batch(&vq, vq.num);
+    check_used_ring(&vq, vq.num);
+    submit_batch(&vq, vq.num);
+    check_used_ring(&vq, vq.num);
+
+    ring_test_quit(&vq);
+}
+
+static void test_tx_indirect(void)
+{
+    TestVirtQueue vq;
+
+    ring_test_start();
+    init_virtqueue(&vq, true);
+
+    submit_batch(&vq, vq.num / 2);
+    check_used_ring(&vq, vq.num / 2);
+    submit_batch(&vq, vq.num);
+    check_used_ring(&vq, vq.num);
+
+    ring_test_quit(&vq);
+}
+
+static void perf_tx(bool indirect)
+{
+    TestVirtQueue vq;
+    uint64_t packets = 0;
+    double duration;
+
+    ring_test_start();
+    init_virtqueue(&vq, indirect);
+
+    g_test_timer_start();
+    do {
+        submit_batch(&vq, vq.num);
+        packets += vq.num;
+        duration = g_test_timer_elapsed();
+    } while (duration < 2.0);
+
+    g_test_message("tx%s: %" PRIu64 " packets in %.2f s, %.0f packets/s",
+                   indirect ? " (indirect)" : "", packets, duration,
+                   packets / duration);
+
+    ring_test_quit(&vq);
+}
+
+static void perf_tx_direct(void)
+{
+    perf_tx(false);
+}
+
+static void perf_tx_indirect(void)
+{
+    perf_tx(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio/ring/tx", test_tx);
+    qtest_add_func("/virtio/ring/tx-indirect", test_tx_indirect);
+    if (g_test_perf()) {
+        qtest_add_func("/perf/virtio/ring/tx", perf_tx_direct);
+        qtest_add_func("/perf/virtio/ring/tx-indirect", perf_tx_indirect);
+    }
+
+    return g_test_run();
+}
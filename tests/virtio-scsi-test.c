@@ -0,0 +1,524 @@
+/*
+ * QTest testcase for virtio-scsi dataplane
+ *
+ * Runs virtio-scsi-pci with x-data-plane=on and a scsi-hd on a scratch
+ * image.  Commands go through the first command virtqueue, which the
+ * IOThread serves once the guest kicks it, and their data is checked
+ * against the image file.  The device is reset and set up again to stop
+ * and restart dataplane, and a logical unit reset is sent through the
+ * control virtqueue while dataplane is running.  An empty CD-ROM drive on
+ * the same bus must be released when dataplane stops.
+ *
+ * Without KVM the kicks are forwarded to the IOThread by the main loop,
+ * but the commands themselves still run in the IOThread.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qdict.h"
+
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define VIRTIO_SCSI_DEVFN           QPCI_DEVFN(4, 0)
+#define VIRTIO_PCI_VENDOR_ID        0x1af4
+#define VIRTIO_SCSI_DEVICE_ID       0x1004
+
+/* Legacy virtio PCI I/O space layout, without MSI-X */
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   1
+#define VIRTIO_STATUS_DRIVER        2
+#define VIRTIO_STATUS_DRIVER_OK     4
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_DESC_SIZE             16
+#define VRING_ALIGN                 4096
+
+#define CTRL_QUEUE                  0
+#define EVENT_QUEUE                 1
+#define CMD_QUEUE                   2
+
+/* virtio-scsi request layouts with the default CDB and sense sizes */
+#define CDB_SIZE                    32
+#define SENSE_SIZE                  96
+#define CMD_REQ_LEN                 (19 + CDB_SIZE)
+#define CMD_RESP_LEN                (12 + SENSE_SIZE)
+#define CMD_RESP_STATUS             10
+#define CMD_RESP_RESPONSE           11
+#define TMF_REQ_LEN                 24
+#define TMF_RESP_LEN                1
+
+#define VIRTIO_SCSI_S_OK            0
+#define VIRTIO_SCSI_T_TMF           0
+#define VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET 5
+
+#define SCSI_GOOD                   0x00
+#define SCSI_CHECK_CONDITION        0x02
+#define TEST_UNIT_READY             0x00
+#define READ_10                     0x28
+#define WRITE_10                    0x2a
+
+#define SECTOR_SIZE                 512
+#define IMAGE_SECTORS               2048
+#define MAX_SECTORS                 16
+
+/* How long to wait for the device to complete a request */
+#define TIMEOUT_MS                  5000
+
+typedef struct TestQueue {
+    unsigned int index;
+    unsigned int num;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+} TestQueue;
+
+typedef struct TestSCSI {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    void *io;
+    QGuestAllocator *alloc;
+    TestQueue ctrl;
+    TestQueue event;
+    TestQueue cmd;
+    uint64_t req;           /* request header, one request at a time */
+    uint64_t resp;          /* response header */
+    uint64_t data;          /* MAX_SECTORS of data */
+} TestSCSI;
+
+static char image_path[] = "/tmp/qtest-virtio-scsi.XXXXXX";
+
+static uint8_t pattern_byte(unsigned int sector, unsigned int i, uint8_t seed)
+{
+    return (sector * 7 + i + seed) & 0xff;
+}
+
+static void fill_pattern(uint8_t *buf, unsigned int sector, unsigned int n,
+                         uint8_t seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < n * SECTOR_SIZE; i++) {
+        buf[i] = pattern_byte(sector + i / SECTOR_SIZE, i % SECTOR_SIZE, seed);
+    }
+}
+
+static void create_image(void)
+{
+    uint8_t *buf = g_malloc(IMAGE_SECTORS * SECTOR_SIZE);
+    int fd;
+
+    fd = mkstemp(image_path);
+    g_assert(fd >= 0);
+    fill_pattern(buf, 0, IMAGE_SECTORS, 0);
+    g_assert_cmpint(write(fd, buf, IMAGE_SECTORS * SECTOR_SIZE), ==,
+                    IMAGE_SECTORS * SECTOR_SIZE);
+    close(fd);
+    g_free(buf);
+}
+
+static void *io_addr(TestSCSI *t, int offset)
+{
+    return (void *)((uintptr_t)t->io + offset);
+}
+
+static void desc_write(TestQueue *vq, unsigned int i, uint64_t addr,
+                       uint32_t len, uint16_t flags, uint16_t next)
+{
+    uint64_t desc = vq->desc + i * VRING_DESC_SIZE;
+
+    writeq(desc, addr);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+    writew(desc + 14, next);
+}
+
+static void queue_init(TestSCSI *t, TestQueue *vq, unsigned int index)
+{
+    uint64_t ring;
+
+    memset(vq, 0, sizeof(*vq));
+    vq->index = index;
+    qpci_io_writew(t->dev, io_addr(t, VIRTIO_PCI_QUEUE_SEL), index);
+    vq->num = qpci_io_readw(t->dev, io_addr(t, VIRTIO_PCI_QUEUE_NUM));
+    g_assert_cmpint(vq->num, >=, 4);
+
+    /* Descriptors, avail ring, then used ring page aligned */
+    ring = guest_alloc(t->alloc, 2 * VRING_ALIGN +
+                       vq->num * (VRING_DESC_SIZE + 2 + 8));
+    ring = QEMU_ALIGN_UP(ring, VRING_ALIGN);
+    vq->desc = ring;
+    vq->avail = vq->desc + vq->num * VRING_DESC_SIZE;
+    vq->used = QEMU_ALIGN_UP(vq->avail + 4 + 2 * vq->num + 2, VRING_ALIGN);
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used, 0);
+    writew(vq->used + 2, 0);
+
+    qpci_io_writel(t->dev, io_addr(t, VIRTIO_PCI_QUEUE_PFN),
+                   vq->desc / VRING_ALIGN);
+}
+
+/* Makes descriptor 0 available and waits for the device to use it */
+static void queue_run(TestSCSI *t, TestQueue *vq)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_MS * 1000LL;
+    uint64_t elem;
+
+    writew(vq->avail + 4 + 2 * (vq->avail_idx % vq->num), 0);
+    vq->avail_idx++;
+    writew(vq->avail + 2, vq->avail_idx);
+    qpci_io_writew(t->dev, io_addr(t, VIRTIO_PCI_QUEUE_NOTIFY), vq->index);
+
+    while (readw(vq->used + 2) == vq->used_idx) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(100);
+    }
+
+    elem = vq->used + 4 + 8 * (vq->used_idx % vq->num);
+    g_assert_cmpint(readl(elem), ==, 0);
+    vq->used_idx++;
+}
+
+/* Resets the device, which stops dataplane, and sets it up again */
+static void device_init(TestSCSI *t)
+{
+    qpci_io_writeb(t->dev, io_addr(t, VIRTIO_PCI_STATUS), 0);
+    qpci_io_writeb(t->dev, io_addr(t, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    qpci_io_writel(t->dev, io_addr(t, VIRTIO_PCI_GUEST_FEATURES), 0);
+
+    queue_init(t, &t->ctrl, CTRL_QUEUE);
+    queue_init(t, &t->event, EVENT_QUEUE);
+    queue_init(t, &t->cmd, CMD_QUEUE);
+
+    qpci_io_writeb(t->dev, io_addr(t, VIRTIO_PCI_STATUS),
+                   VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_DRIVER_OK);
+}
+
+static void scsi_test_start(TestSCSI *t, const char *extra_args,
+                            const char *extra_props)
+{
+    char *args;
+
+    args = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw %s "
+                           "-device virtio-scsi-pci,id=vs0,addr=04.0,"
+                           "x-data-plane=on%s "
+                           "-device scsi-hd,bus=vs0.0,drive=drv0,"
+                           "scsi-id=0,lun=0",
+                           image_path, extra_args, extra_props);
+    qtest_start(args);
+    g_free(args);
+
+    t->bus = qpci_init_pc();
+    t->alloc = pc_alloc_init();
+    t->dev = qpci_device_find(t->bus, VIRTIO_SCSI_DEVFN);
+    g_assert(t->dev != NULL);
+    g_assert_cmphex(qpci_config_readw(t->dev, PCI_VENDOR_ID), ==,
+                    VIRTIO_PCI_VENDOR_ID);
+    g_assert_cmphex(qpci_config_readw(t->dev, PCI_DEVICE_ID), ==,
+                    VIRTIO_SCSI_DEVICE_ID);
+    t->io = qpci_iomap(t->dev, 0);
+    qpci_device_enable(t->dev);
+
+    t->req = guest_alloc(t->alloc, CMD_REQ_LEN);
+    t->resp = guest_alloc(t->alloc, CMD_RESP_LEN);
+    t->data = guest_alloc(t->alloc, MAX_SECTORS * SECTOR_SIZE);
+
+    device_init(t);
+}
+
+static void scsi_test_end(TestSCSI *t)
+{
+    g_free(t->dev);
+    qtest_end();
+}
+
+/* Runs @cdb on LUN 0.  @data_len bytes of t->data are written to the disk
+ * with @write, read from it otherwise.  Returns the SCSI status.
+ */
+static uint8_t scsi_cmd(TestSCSI *t, const uint8_t *cdb, size_t cdb_len,
+                        size_t data_len, bool write)
+{
+    TestQueue *vq = &t->cmd;
+    uint8_t req[CMD_REQ_LEN] = { 1, 0, 0, 0 };
+    unsigned int n = 0;
+
+    memcpy(req + 19, cdb, cdb_len);
+    memwrite(t->req, req, sizeof(req));
+
+    desc_write(vq, n, t->req, sizeof(req), VRING_DESC_F_NEXT, n + 1);
+    n++;
+    if (write && data_len) {
+        desc_write(vq, n, t->data, data_len, VRING_DESC_F_NEXT, n + 1);
+        n++;
+    }
+    if (!write && data_len) {
+        desc_write(vq, n, t->resp, CMD_RESP_LEN,
+                   VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, n + 1);
+        n++;
+        desc_write(vq, n, t->data, data_len, VRING_DESC_F_WRITE, 0);
+    } else {
+        desc_write(vq, n, t->resp, CMD_RESP_LEN, VRING_DESC_F_WRITE, 0);
+    }
+    queue_run(t, vq);
+
+    g_assert_cmpint(readb(t->resp + CMD_RESP_RESPONSE), ==, VIRTIO_SCSI_S_OK);
+    return readb(t->resp + CMD_RESP_STATUS);
+}
+
+/* The first command after a reset reports a unit attention */
+static void clear_unit_attention(TestSCSI *t)
+{
+    const uint8_t cdb[6] = { TEST_UNIT_READY };
+    uint8_t status;
+
+    status = scsi_cmd(t, cdb, sizeof(cdb), 0, false);
+    if (status == SCSI_CHECK_CONDITION) {
+        status = scsi_cmd(t, cdb, sizeof(cdb), 0, false);
+    }
+    g_assert_cmphex(status, ==, SCSI_GOOD);
+}
+
+static void rw_cmd(TestSCSI *t, bool write, unsigned int sector,
+                   unsigned int n)
+{
+    uint8_t cdb[10] = {
+        write ? WRITE_10 : READ_10, 0,
+        sector >> 24, sector >> 16, sector >> 8, sector,
+        0, n >> 8, n, 0,
+    };
+
+    g_assert_cmpint(n, <=, MAX_SECTORS);
+    g_assert_cmphex(scsi_cmd(t, cdb, sizeof(cdb), n * SECTOR_SIZE, write),
+                    ==, SCSI_GOOD);
+}
+
+static void check_read(TestSCSI *t, unsigned int sector, unsigned int n,
+                       uint8_t seed)
+{
+    uint8_t expected[MAX_SECTORS * SECTOR_SIZE];
+    uint8_t buf[MAX_SECTORS * SECTOR_SIZE];
+
+    rw_cmd(t, false, sector, n);
+    fill_pattern(expected, sector, n, seed);
+    memread(t->data, buf, n * SECTOR_SIZE);
+    g_assert(memcmp(buf, expected, n * SECTOR_SIZE) == 0);
+}
+
+static void do_write(TestSCSI *t, unsigned int sector, unsigned int n,
+                     uint8_t seed)
+{
+    uint8_t buf[MAX_SECTORS * SECTOR_SIZE];
+
+    fill_pattern(buf, sector, n, seed);
+    memwrite(t->data, buf, n * SECTOR_SIZE);
+    rw_cmd(t, true, sector, n);
+}
+
+static void check_image(unsigned int sector, unsigned int n, uint8_t seed)
+{
+    uint8_t expected[MAX_SECTORS * SECTOR_SIZE];
+    uint8_t buf[MAX_SECTORS * SECTOR_SIZE];
+    FILE *f;
+
+    f = fopen(image_path, "rb");
+    g_assert(f != NULL);
+    g_assert_cmpint(fseek(f, sector * SECTOR_SIZE, SEEK_SET), ==, 0);
+    g_assert_cmpint(fread(buf, SECTOR_SIZE, n, f), ==, n);
+    fclose(f);
+
+    fill_pattern(expected, sector, n, seed);
+    g_assert(memcmp(buf, expected, n * SECTOR_SIZE) == 0);
+}
+
+/* Dataplane marks the disk in use while the IOThread owns it, so ejecting
+ * the disk fails.  Otherwise ejecting succeeds for a removable disk and
+ * fails for the hard disk, which is not removable.
+ */
+static bool drive_owned_by_dataplane(const char *drive)
+{
+    QDict *resp, *error;
+    const char *desc;
+    char *reply;
+    bool in_use = false;
+
+    reply = qmp_reply("{ 'execute': 'eject',"
+                      "  'arguments': { 'device': '%s' } }", drive);
+    resp = qobject_to_qdict(qobject_from_json(reply));
+    g_free(reply);
+    g_assert(resp != NULL);
+
+    error = qdict_get_qdict(resp, "error");
+    if (error) {
+        desc = qdict_get_str(error, "desc");
+        in_use = strstr(desc, "is in use") != NULL;
+        if (!in_use) {
+            g_assert(strstr(desc, "is not removable") != NULL);
+        }
+    }
+
+    QDECREF(resp);
+    return in_use;
+}
+
+static bool disk_owned_by_dataplane(void)
+{
+    return drive_owned_by_dataplane("drv0");
+}
+
+static void test_rw(void)
+{
+    TestSCSI t;
+    unsigned int i;
+
+    scsi_test_start(&t, "", "");
+
+    /* Dataplane starts with the first kick of a command queue */
+    g_assert(!disk_owned_by_dataplane());
+    clear_unit_attention(&t);
+    g_assert(disk_owned_by_dataplane());
+
+    for (i = 0; i < 4; i++) {
+        check_read(&t, i * MAX_SECTORS, MAX_SECTORS, 0);
+    }
+    do_write(&t, 100, 8, 0x5a);
+    check_read(&t, 100, 8, 0x5a);
+    check_read(&t, 108, 8, 0);
+
+    scsi_test_end(&t);
+    check_image(100, 8, 0x5a);
+    check_image(108, 8, 0);
+}
+
+static void test_iothread(void)
+{
+    TestSCSI t;
+
+    scsi_test_start(&t, "-object iothread,id=iothread0",
+                    ",x-iothread=iothread0");
+
+    clear_unit_attention(&t);
+    g_assert(disk_owned_by_dataplane());
+    do_write(&t, 300, MAX_SECTORS, 0x33);
+    check_read(&t, 300, MAX_SECTORS, 0x33);
+
+    scsi_test_end(&t);
+    check_image(300, MAX_SECTORS, 0x33);
+}
+
+static void test_stop_start(void)
+{
+    TestSCSI t;
+    unsigned int i;
+
+    scsi_test_start(&t, "", "");
+
+    for (i = 0; i < 3; i++) {
+        clear_unit_attention(&t);
+        g_assert(disk_owned_by_dataplane());
+        do_write(&t, 500 + i * MAX_SECTORS, MAX_SECTORS, 0x10 + i);
+        check_read(&t, 500 + i * MAX_SECTORS, MAX_SECTORS, 0x10 + i);
+
+        /* Resetting the device hands the disk back to the main loop */
+        qpci_io_writeb(t.dev, io_addr(&t, VIRTIO_PCI_STATUS), 0);
+        g_assert(!disk_owned_by_dataplane());
+        device_init(&t);
+    }
+
+    /* Writes made before each stop are still there after the restart */
+    clear_unit_attention(&t);
+    for (i = 0; i < 3; i++) {
+        check_read(&t, 500 + i * MAX_SECTORS, MAX_SECTORS, 0x10 + i);
+    }
+
+    scsi_test_end(&t);
+}
+
+static void test_lun_reset(void)
+{
+    uint8_t req[TMF_REQ_LEN] = { 0 };
+    TestSCSI t;
+
+    scsi_test_start(&t, "", "");
+    clear_unit_attention(&t);
+    check_read(&t, 0, 1, 0);
+
+    /* The control queue runs in the main loop, the disk is in the IOThread */
+    req[0] = VIRTIO_SCSI_T_TMF;
+    req[4] = VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET;
+    req[8] = 1;
+    memwrite(t.req, req, sizeof(req));
+    desc_write(&t.ctrl, 0, t.req, sizeof(req), VRING_DESC_F_NEXT, 1);
+    desc_write(&t.ctrl, 1, t.resp, TMF_RESP_LEN, VRING_DESC_F_WRITE, 0);
+    queue_run(&t, &t.ctrl);
+    g_assert_cmpint(readb(t.resp), ==, VIRTIO_SCSI_S_OK);
+
+    g_assert(disk_owned_by_dataplane());
+    clear_unit_attention(&t);
+    check_read(&t, 1, 1, 0);
+
+    scsi_test_end(&t);
+}
+
+/* An empty CD-ROM drive cannot move to the IOThread, but it is still
+ * marked in use while dataplane runs, and must be released afterwards.
+ */
+static void test_empty_cdrom(void)
+{
+    TestSCSI t;
+
+    /* The CD-ROM goes on the bus after the controller */
+    scsi_test_start(&t, "", " -drive id=cd0,if=none,media=cdrom"
+                    " -device scsi-cd,bus=vs0.0,drive=cd0,scsi-id=1,lun=0");
+
+    clear_unit_attention(&t);
+    g_assert(drive_owned_by_dataplane("cd0"));
+
+    qpci_io_writeb(t.dev, io_addr(&t, VIRTIO_PCI_STATUS), 0);
+    g_assert(!drive_owned_by_dataplane("cd0"));
+    g_assert(!disk_owned_by_dataplane());
+
+    scsi_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    create_image();
+
+    qtest_add_func("/virtio-scsi/dataplane/rw", test_rw);
+    qtest_add_func("/virtio-scsi/dataplane/iothread", test_iothread);
+    qtest_add_func("/virtio-scsi/dataplane/stop-start", test_stop_start);
+    qtest_add_func("/virtio-scsi/dataplane/lun-reset", test_lun_reset);
+    qtest_add_func("/virtio-scsi/dataplane/empty-cdrom", test_empty_cdrom);
+
+    ret = g_test_run();
+    unlink(image_path);
+    return ret;
+}
@@ -0,0 +1,334 @@
+/*
+ * Simple C functions to supplement the C library
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+
+/*
+ * Each variant returns an offset 'o' such that buf[0, o) is all zero.  If
+ * the whole buffer is zero, o == len; otherwise the first non-zero byte is
+ * within a few vectors after o and buffer_find_nonzero_offset() locates it
+ * exactly.
+ *
+ * The x86 variants only require len to be at least one vector.  Unaligned
+ * heads and tails are handled with an unaligned load that overlaps the
+ * aligned part of the buffer.
+ */
+
+#define VECTYPE_ALL_ZERO(v) ALL_EQ(v, (VECTYPE){0})
+
+static size_t find_nonzero_generic(const void *buf, size_t len)
+{
+    const unsigned char *start = buf;
+    const VECTYPE *p;
+    size_t i = 0;
+
+    /* Unaligned head */
+    while (i < len && ((uintptr_t) (start + i)) % sizeof(VECTYPE)) {
+        if (start[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* Unroll the loop to smooth out the effect of memory latency */
+    p = (const VECTYPE *) (start + i);
+    for (; i + 4 * sizeof(VECTYPE) <= len; i += 4 * sizeof(VECTYPE), p += 4) {
+        VECTYPE tmp = (p[0] | p[1]) | (p[2] | p[3]);
+        if (!VECTYPE_ALL_ZERO(tmp)) {
+            return i;
+        }
+    }
+
+    /* Tail */
+    for (; i < len; i++) {
+        if (start[i]) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#define SSE2_ALL_ZERO(v) \
+    (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xFFFF)
+
+static size_t find_nonzero_sse2(const void *buf, size_t len)
+{
+    const char *start = buf;
+    const char *end = start + len;
+    const __m128i *p = (const __m128i *) (((uintptr_t) start + 16) & -16);
+    const __m128i *e = (const __m128i *) ((uintptr_t) end & -16);
+    __m128i t;
+
+    t = _mm_loadu_si128((const __m128i *) start);
+    if (!SSE2_ALL_ZERO(t)) {
+        return 0;
+    }
+
+    for (; p + 4 <= e; p += 4) {
+        t = _mm_or_si128(_mm_or_si128(p[0], p[1]), _mm_or_si128(p[2], p[3]));
+        if (!SSE2_ALL_ZERO(t)) {
+            return (const char *) p - start;
+        }
+    }
+    for (; p < e; p++) {
+        if (!SSE2_ALL_ZERO(p[0])) {
+            return (const char *) p - start;
+        }
+    }
+
+    if ((const char *) p < end) {
+        t = _mm_loadu_si128((const __m128i *) (end - 16));
+        if (!SSE2_ALL_ZERO(t)) {
+            return (const char *) p - start;
+        }
+    }
+    return len;
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+#include "qemu/cpuid.h"
+#include <immintrin.h>
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static size_t find_nonzero_avx2(const void *buf, size_t len)
+{
+    const char *start = buf;
+    const char *end = start + len;
+    const __m256i *p = (const __m256i *) (((uintptr_t) start + 32) & -32);
+    const __m256i *e = (const __m256i *) ((uintptr_t) end & -32);
+    __m256i t;
+
+    t = _mm256_loadu_si256((const __m256i *) start);
+    if (!_mm256_testz_si256(t, t)) {
+        return 0;
+    }
+
+    for (; p + 4 <= e; p += 4) {
+        t = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                            _mm256_or_si256(p[2], p[3]));
+        if (!_mm256_testz_si256(t, t)) {
+            return (const char *) p - start;
+        }
+    }
+    for (; p < e; p++) {
+        if (!_mm256_testz_si256(p[0], p[0])) {
+            return (const char *) p - start;
+        }
+    }
+
+    if ((const char *) p < end) {
+        t = _mm256_loadu_si256((const __m256i *) (end - 32));
+        if (!_mm256_testz_si256(t, t)) {
+            return (const char *) p - start;
+        }
+    }
+    return len;
+}
+
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+#define AVX512_ALL_ZERO(v) (_mm512_test_epi64_mask(v, v) == 0)
+
+static size_t find_nonzero_avx512f(const void *buf, size_t len)
+{
+    const char *start = buf;
+    const char *end = start + len;
+    const __m512i *p = (const __m512i *) (((uintptr_t) start + 64) & -64);
+    const __m512i *e = (const __m512i *) ((uintptr_t) end & -64);
+    __m512i t;
+
+    t = _mm512_loadu_si512(start);
+    if (!AVX512_ALL_ZERO(t)) {
+        return 0;
+    }
+
+    for (; p + 4 <= e; p += 4) {
+        t = _mm512_or_si512(_mm512_or_si512(p[0], p[1]),
+                            _mm512_or_si512(p[2], p[3]));
+        if (!AVX512_ALL_ZERO(t)) {
+            return (const char *) p - start;
+        }
+    }
+    for (; p < e; p++) {
+        if (!AVX512_ALL_ZERO(p[0])) {
+            return (const char *) p - start;
+        }
+    }
+
+    if ((const char *) p < end) {
+        t = _mm512_loadu_si512(end - 64);
+        if (!AVX512_ALL_ZERO(t)) {
+            return (const char *) p - start;
+        }
+    }
+    return len;
+}
+
+#pragma GCC pop_options
+#endif
+
+#define ACCEL_SSE2      1
+#define ACCEL_AVX2      2
+#define ACCEL_AVX512F   4
+
+typedef struct BufferZeroAccel {
+    const char *name;
+    unsigned int required;      /* ACCEL_* bits the host must support */
+    size_t min_len;             /* shorter buffers use the generic code */
+    size_t (*find_nonzero)(const void *buf, size_t len);
+} BufferZeroAccel;
+
+/* Sorted from fastest to slowest; the generic variant always comes last */
+static const BufferZeroAccel accels[] = {
+#ifdef CONFIG_AVX512F_OPT
+    { "avx512f", ACCEL_AVX512F, 64, find_nonzero_avx512f },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", ACCEL_AVX2, 32, find_nonzero_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", ACCEL_SSE2, 16, find_nonzero_sse2 },
+#endif
+    { "generic", 0, 0, find_nonzero_generic },
+};
+
+static unsigned int host_accel;
+static const BufferZeroAccel *accel = &accels[ARRAY_SIZE(accels) - 1];
+
+static void select_accel(const BufferZeroAccel *first)
+{
+    const BufferZeroAccel *a;
+
+    for (a = first; a < &accels[ARRAY_SIZE(accels)]; a++) {
+        if ((a->required & host_accel) == a->required) {
+            accel = a;
+            return;
+        }
+    }
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+#ifdef __SSE2__
+    /* Already required by the compiler flags */
+    host_accel |= ACCEL_SSE2;
+#endif
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT)
+    {
+        unsigned int max, a, b, c, d, bv;
+
+        max = __get_cpuid_max(0, NULL);
+        if (max >= 1) {
+            __cpuid(1, a, b, c, d);
+            if (d & bit_SSE2) {
+                host_accel |= ACCEL_SSE2;
+            }
+
+            /* The registers must not only exist, the OS must also save and
+             * restore them: check XCR0 for the YMM and ZMM state. */
+            if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+                __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+                __cpuid_count(7, 0, a, b, c, d);
+                if ((bv & 0x06) == 0x06 && (b & bit_AVX2)) {
+                    host_accel |= ACCEL_AVX2;
+                }
+                if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                    host_accel |= ACCEL_AVX512F;
+                }
+            }
+        }
+    }
+#endif
+
+    select_accel(&accels[0]);
+}
+
+/*
+ * Switches to the next slower variant usable on this host, for the unit
+ * tests.  Returns false and goes back to the fastest one after the generic
+ * variant has been used.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (accel == &accels[ARRAY_SIZE(accels) - 1]) {
+        select_accel(&accels[0]);
+        return false;
+    }
+    select_accel(accel + 1);
+    return true;
+}
+
+const char *buffer_is_zero_accel_name(void)
+{
+    return accel->name;
+}
+
+static inline size_t find_nonzero(const void *buf, size_t len)
+{
+    if (len < accel->min_len) {
+        return find_nonzero_generic(buf, len);
+    }
+    return accel->find_nonzero(buf, len);
+}
+
+/*
+ * Searches for an area with non-zero content in a buffer
+ *
+ * Returns the offset of the first non-zero byte, or len if the buffer is
+ * all zero.  There are no alignment or length requirements.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t i;
+
+    i = find_nonzero(buf, len);
+    while (i < len && !p[i]) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * There are no alignment or length requirements.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return find_nonzero(buf, len) == len;
+}
@@ -104,12 +104,183 @@ static const uint32_t crc32c_table[256] = {
     0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *data,
+                               unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#if defined(CONFIG_SSE42_OPT) || defined(CONFIG_PCLMUL_OPT)
+#include "qemu/cpuid.h"
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+
+/* The crc32 instruction implements exactly the CRC-32C polynomial */
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    while (length && ((uintptr_t) data & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+#ifdef __x86_64__
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = _mm_crc32_u64(crc, *(const uint64_t *) data);
+    }
+#else
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t *) data);
+    }
+#endif
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#pragma GCC pop_options
+#endif
+
+#if defined(CONFIG_PCLMUL_OPT) && defined(__x86_64__)
+#pragma GCC push_options
+#pragma GCC target("sse4.2,pclmul")
+
+/*
+ * The crc32 instruction has a latency of three cycles but a throughput of
+ * one per cycle, so a single dependency chain only uses a third of it.
+ * Process three blocks in parallel and merge the partial CRCs afterwards:
+ *
+ *   crc(A B C) = shift(crc(A), |B| + |C|) ^ shift(crc(B), |C|) ^ crc(C)
+ *
+ * where crc(B) and crc(C) start from zero and shift(crc, n) appends n zero
+ * bytes.  shift() is a carry-less multiplication by x^(8n - 33) mod P,
+ * followed by a reduction with the crc32 instruction itself.
+ */
+#define CRC32C_BLOCK        1024
+#define CRC32C_K_BLOCK      0x170076faULL   /* x^(8 * 1024 - 33) mod P */
+#define CRC32C_K_2BLOCK     0xa51b6135ULL   /* x^(8 * 2048 - 33) mod P */
+
+static inline uint32_t crc32c_shift(uint32_t crc, uint64_t k)
+{
+    __m128i t = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                     _mm_cvtsi64_si128(k), 0x00);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+}
+
+static uint32_t crc32c_pclmul(uint32_t crc, const uint8_t *data,
+                              unsigned int length)
+{
+    const uint64_t *p;
+    uint64_t crc0, crc1, crc2;
+    int i;
+
+    while (length && ((uintptr_t) data & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    for (; length >= 3 * CRC32C_BLOCK; length -= 3 * CRC32C_BLOCK) {
+        p = (const uint64_t *) data;
+        crc0 = crc;
+        crc1 = 0;
+        crc2 = 0;
+        for (i = 0; i < CRC32C_BLOCK / 8; i++) {
+            crc0 = _mm_crc32_u64(crc0, p[i]);
+            crc1 = _mm_crc32_u64(crc1, p[i + CRC32C_BLOCK / 8]);
+            crc2 = _mm_crc32_u64(crc2, p[i + 2 * CRC32C_BLOCK / 8]);
+        }
+        crc = crc32c_shift(crc0, CRC32C_K_2BLOCK) ^
+              crc32c_shift(crc1, CRC32C_K_BLOCK) ^ crc2;
+        data += 3 * CRC32C_BLOCK;
+    }
+
+    return crc32c_sse42(crc, data, length);
+}
+
+#pragma GCC pop_options
+#endif
+
+#define ACCEL_SSE42     1
+#define ACCEL_PCLMUL    2
+
+typedef struct CRC32CAccel {
+    const char *name;
+    unsigned int required;      /* ACCEL_* bits the host must support */
+    uint32_t (*fn)(uint32_t crc, const uint8_t *data, unsigned int length);
+} CRC32CAccel;
+
+/* Sorted from fastest to slowest; the generic variant always comes last */
+static const CRC32CAccel accels[] = {
+#if defined(CONFIG_PCLMUL_OPT) && defined(__x86_64__)
+    { "pclmul", ACCEL_SSE42 | ACCEL_PCLMUL, crc32c_pclmul },
+#endif
+#if defined(CONFIG_SSE42_OPT) || defined(CONFIG_PCLMUL_OPT)
+    { "sse4.2", ACCEL_SSE42, crc32c_sse42 },
+#endif
+    { "generic", 0, crc32c_generic },
+};
+
+static unsigned int host_accel;
+static const CRC32CAccel *accel = &accels[ARRAY_SIZE(accels) - 1];
+
+static void select_accel(const CRC32CAccel *first)
+{
+    const CRC32CAccel *a;
+
+    for (a = first; a < &accels[ARRAY_SIZE(accels)]; a++) {
+        if ((a->required & host_accel) == a->required) {
+            accel = a;
+            return;
+        }
+    }
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+#if defined(CONFIG_SSE42_OPT) || defined(CONFIG_PCLMUL_OPT)
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_SSE4_2) {
+            host_accel |= ACCEL_SSE42;
+        }
+        if (c & bit_PCLMUL) {
+            host_accel |= ACCEL_PCLMUL;
+        }
+    }
+#endif
+
+    select_accel(&accels[0]);
+}
+
+/*
+ * Switches to the next slower variant usable on this host, for the unit
+ * tests.  Returns false and goes back to the fastest one after the generic
+ * variant has been used.
+ */
+bool test_crc32c_next_accel(void)
+{
+    if (accel == &accels[ARRAY_SIZE(accels) - 1]) {
+        select_accel(&accels[0]);
+        return false;
+    }
+    select_accel(accel + 1);
+    return true;
+}
+
+const char *crc32c_accel_name(void)
+{
+    return accel->name;
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return accel->fn(crc, data, length) ^ 0xffffffff;
 }
 